@@ -0,0 +1,122 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include "../src/runtime/noja.h"
+
+//
+// Measures the latency of [nj_dictionary_select] on
+// dicts holding from 10 thousand to 100 thousand keys.
+//
+// Usage: bench_dict [key count...]
+//
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void run(int count)
+{
+	string_builder_t output_builder;
+	string_builder_init(&output_builder);
+
+	nj_state_t state;
+
+	if(!nj_state_init(&state, &output_builder)) {
+
+		fprintf(stderr, "Failed to initialize the state\n");
+		exit(1);
+	}
+
+	char **keys   = malloc(sizeof(char*) * count);
+	char **misses = malloc(sizeof(char*) * count);
+
+	for(int i = 0; i < count; i++) {
+
+		char buffer[32];
+
+		snprintf(buffer, sizeof(buffer), "variable_%d", i);
+		keys[i] = strdup(buffer);
+
+		snprintf(buffer, sizeof(buffer), "missing_%d", i);
+		misses[i] = strdup(buffer);
+	}
+
+	nj_object_t *dict = nj_object_istanciate(&state, nj_get_dict_type_object(&state));
+
+	double t0 = now();
+
+	for(int i = 0; i < count; i++)
+		nj_dictionary_insert(&state, dict, keys[i], nj_get_null_object(&state));
+
+	double t1 = now();
+
+	int rounds = 1 + 2000000 / count;
+	int found = 0;
+
+	for(int r = 0; r < rounds; r++)
+		for(int i = 0; i < count; i++)
+			found += nj_dictionary_select(&state, dict, keys[i]) != 0;
+
+	double t2 = now();
+
+	for(int r = 0; r < rounds; r++)
+		for(int i = 0; i < count; i++)
+			found += nj_dictionary_select(&state, dict, misses[i]) != 0;
+
+	double t3 = now();
+
+	// Interned names, as used by the interpreter
+
+	nj_symbol_t **symbols = malloc(sizeof(nj_symbol_t*) * count);
+
+	for(int i = 0; i < count; i++)
+		symbols[i] = nj_symbol_intern(&state, keys[i], strlen(keys[i]));
+
+	double t4 = now();
+
+	for(int r = 0; r < rounds; r++)
+		for(int i = 0; i < count; i++)
+			found += nj_dictionary_select_symbol(&state, dict, symbols[i]) != 0;
+
+	double t5 = now();
+
+	printf("%7d keys: insert %8.1f ns/key, hit %8.1f ns/lookup, miss %8.1f ns/lookup, symbol hit %8.1f ns/lookup (%d)\n", count,
+		(t1 - t0) * 1e9 / count,
+		(t2 - t1) * 1e9 / ((double) rounds * count),
+		(t3 - t2) * 1e9 / ((double) rounds * count),
+		(t5 - t4) * 1e9 / ((double) rounds * count), found);
+
+	free(symbols);
+
+	for(int i = 0; i < count; i++) {
+		free(keys[i]);
+		free(misses[i]);
+	}
+
+	free(keys);
+	free(misses);
+
+	nj_state_deinit(&state);
+	string_builder_deinit(&output_builder);
+}
+
+int main(int argc, char **argv)
+{
+	if(argc > 1) {
+
+		for(int i = 1; i < argc; i++)
+			run(atoi(argv[i]));
+
+	} else {
+
+		run(10000);
+		run(30000);
+		run(100000);
+	}
+
+	return 0;
+}
@@ -0,0 +1,171 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include "../src/runtime/noja.h"
+
+//
+// Measures the execution loop on a few small programs:
+// recursive calls, integer loops, string building, the
+// churn of small arrays and dicts and builtin calls from a
+// module with enough globals to put its map in dictionary
+// mode.
+// The whole run (compilation included) is timed and the
+// best of [rounds] runs is reported, for the stack and the
+// register backend, at the default optimization level.
+//
+// When built with NJ_COUNT_DISPATCH, the number of
+// instructions each backend dispatched is also reported.
+//
+// The interpreter's own output is sent to /dev/null, the
+// results are printed on stderr.
+//
+// Usage: bench_execute [rounds]
+//
+
+typedef struct {
+	const char *name;
+	const char *source;
+} program_t;
+
+static const program_t programs[] = {
+	{
+		"fib",
+		"fib = function(n) {\n"
+		"	if n < 2 { return n; }\n"
+		"	return fib(n - 1) + fib(n - 2);\n"
+		"};\n"
+		"print(fib(25));\n"
+	},
+	{
+		"loops",
+		"i = 0;\n"
+		"s = 0;\n"
+		"while i < 1000 {\n"
+		"	j = 0;\n"
+		"	while j < 1000 {\n"
+		"		s = s + (i ^ j) % 7;\n"
+		"		j = j + 1;\n"
+		"	}\n"
+		"	i = i + 1;\n"
+		"}\n"
+		"print(s);\n"
+	},
+	{
+		"string",
+		"build = function(n) {\n"
+		"	s = \"\";\n"
+		"	i = 0;\n"
+		"	while i < n {\n"
+		"		s = s + \"x\";\n"
+		"		i = i + 1;\n"
+		"	}\n"
+		"	return s;\n"
+		"};\n"
+		"k = 0;\n"
+		"while k < 100 { build(2000); k = k + 1; }\n"
+	},
+	{
+		"alloc",
+		"i = 0;\n"
+		"n = 0;\n"
+		"while i < 1000000 {\n"
+		"	a = [i, i, i];\n"
+		"	d = {\"x\": i, \"y\": a};\n"
+		"	n = n + a.length() + d.length();\n"
+		"	i = i + 1;\n"
+		"}\n"
+		"print(n);\n"
+	},
+	{
+		"builtin",
+		"g0 = 0; g1 = 1; g2 = 2; g3 = 3; g4 = 4; g5 = 5; g6 = 6; g7 = 7;\n"
+		"g8 = 8; g9 = 9; g10 = 10; g11 = 11; g12 = 12; g13 = 13; g14 = 14; g15 = 15;\n"
+		"g16 = 16; g17 = 17; g18 = 18; g19 = 19; g20 = 20; g21 = 21; g22 = 22; g23 = 23;\n"
+		"g24 = 24; g25 = 25; g26 = 26; g27 = 27; g28 = 28; g29 = 29; g30 = 30; g31 = 31;\n"
+		"count = function(n) {\n"
+		"	i = 0;\n"
+		"	while i < n {\n"
+		"		type_of(i);\n"
+		"		typename_of(g31);\n"
+		"		i = i + 1;\n"
+		"	}\n"
+		"	return i;\n"
+		"};\n"
+		"i = 0;\n"
+		"while i < 500000 { type_of(i); i = i + 1; }\n"
+		"print(count(500000));\n"
+	},
+};
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv)
+{
+	int rounds = 5;
+
+	if(argc > 1)
+		rounds = atoi(argv[1]);
+
+	if(!freopen("/dev/null", "w", stdout)) {
+
+		fprintf(stderr, "Failed to redirect stdout\n");
+		return 1;
+	}
+
+	static const struct {
+		const char *name;
+		int backend;
+	} backends[] = {
+		{ "stack",    NJ_BACKEND_STACK },
+		{ "register", NJ_BACKEND_REGISTER },
+	};
+
+	for(size_t i = 0; i < sizeof(programs) / sizeof(programs[0]); i++) {
+
+		fprintf(stderr, "%-8s", programs[i].name);
+
+		for(size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+
+			double best = -1;
+
+			nj_run_options_t options;
+
+			for(int r = 0; r < rounds; r++) {
+
+				char *error = 0;
+
+				options = (nj_run_options_t) { .backend = backends[b].backend, .opt_level = NJ_OPT_DEFAULT };
+
+				double t0 = now();
+				int ok = nj_run_with_options(programs[i].name, programs[i].source, strlen(programs[i].source), &options, &error);
+				double t1 = now();
+
+				if(!ok) {
+
+					fprintf(stderr, "\n%s (%s): %s\n", programs[i].name, backends[b].name, error ? error : "failed");
+					free(error);
+					return 1;
+				}
+
+				if(best < 0 || t1 - t0 < best)
+					best = t1 - t0;
+			}
+
+			fprintf(stderr, " %s %8.2f ms", backends[b].name, best * 1e3);
+
+#ifdef NJ_COUNT_DISPATCH
+			fprintf(stderr, " (%llu dispatched)", (unsigned long long) options.dispatched);
+#endif
+		}
+
+		fprintf(stderr, "\n");
+	}
+
+	return 0;
+}
@@ -0,0 +1,126 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "../src/runtime/noja.h"
+#include "../src/runtime/bytecode.h"
+
+//
+// Runs the given scripts on the stack backend and reports
+// the pairs of consecutive opcodes they dispatched, most
+// frequent first. It's what tells which sequences are worth
+// a superinstruction in the peephole pass.
+//
+// Only counts when built with NJ_COUNT_PAIRS, which is what
+// the bench_pairs target does.
+//
+// The interpreter's own output is sent to /dev/null, the
+// results are printed on stderr.
+//
+// Usage: bench_pairs [--opt-level=N] [--top=N] file.noja...
+//
+
+typedef struct {
+	uint32_t first;
+	uint32_t second;
+	uint64_t count;
+} pair_t;
+
+static int compare_pairs(const void *a, const void *b)
+{
+	uint64_t x = ((const pair_t*) a)->count;
+	uint64_t y = ((const pair_t*) b)->count;
+
+	return (x < y) - (x > y);
+}
+
+int main(int argc, char **argv)
+{
+	int opt_level = NJ_OPT_DEFAULT;
+	int top = 30;
+
+	uint64_t *counts = calloc(OPCODE_COUNT * OPCODE_COUNT, sizeof(uint64_t));
+	pair_t *pairs = malloc(sizeof(pair_t) * OPCODE_COUNT * OPCODE_COUNT);
+
+	if(counts == 0 || pairs == 0) {
+
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	if(!freopen("/dev/null", "w", stdout)) {
+
+		fprintf(stderr, "Failed to redirect stdout\n");
+		return 1;
+	}
+
+	int scripts = 0;
+
+	for(int i = 1; i < argc; i++) {
+
+		if(!strncmp(argv[i], "--opt-level=", 12)) {
+			opt_level = atoi(argv[i] + 12);
+			continue;
+		}
+
+		if(!strncmp(argv[i], "--top=", 6)) {
+			top = atoi(argv[i] + 6);
+			continue;
+		}
+
+		char *error = 0;
+
+		nj_run_options_t options = {
+			.backend = NJ_BACKEND_STACK,
+			.opt_level = opt_level,
+			.opcode_pairs = counts,
+		};
+
+		if(!nj_run_file_with_options(argv[i], &options, &error)) {
+
+			fprintf(stderr, "%s: %s\n", argv[i], error ? error : "failed");
+			free(error);
+		}
+
+		scripts++;
+	}
+
+	if(scripts == 0) {
+
+		fprintf(stderr, "Usage: %s [--opt-level=N] [--top=N] file.noja...\n", argv[0]);
+		return 1;
+	}
+
+	uint64_t total = 0;
+	uint32_t used = 0;
+
+	for(uint32_t i = 0; i < OPCODE_COUNT; i++)
+		for(uint32_t j = 0; j < OPCODE_COUNT; j++) {
+
+			uint64_t count = counts[i * OPCODE_COUNT + j];
+
+			if(count == 0)
+				continue;
+
+			pairs[used++] = (pair_t) { i, j, count };
+			total += count;
+		}
+
+	if(total == 0) {
+
+		fprintf(stderr, "No pairs were counted (was it built with NJ_COUNT_PAIRS?)\n");
+		return 1;
+	}
+
+	qsort(pairs, used, sizeof(pair_t), compare_pairs);
+
+	fprintf(stderr, "%llu pairs dispatched\n", (unsigned long long) total);
+
+	for(uint32_t i = 0; i < used && (int) i < top; i++)
+		fprintf(stderr, "%12llu %6.2f%%  %s -> %s\n",
+			(unsigned long long) pairs[i].count, 100.0 * pairs[i].count / total,
+			nj_get_opcode_name(pairs[i].first), nj_get_opcode_name(pairs[i].second));
+
+	free(counts);
+	free(pairs);
+	return 0;
+}
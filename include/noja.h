@@ -14,9 +14,14 @@ int nj_run(const char *name, const char *text, int length, char **error_text);
 int nj_run_file(const char *path, char **error_text);
 
 // C to Noja types conversion functions
+//
+// Ints and floats may be immediates, stored inside the value
+// itself rather than on the heap. All values must still be
+// inspected through these functions.
 
 int nj_object_to_c_int(nj_state_t *state, nj_object_t *object, int64_t *value);
 int nj_object_to_c_float(nj_state_t *state, nj_object_t *object, double *value);
+int nj_object_to_c_bool(nj_state_t *state, nj_object_t *object, unsigned char *value);
 int nj_object_to_c_string(nj_state_t *state, nj_object_t *object, const char **value, int *length);
 
 nj_object_t *nj_object_from_c_int(nj_state_t *state, int64_t value);
@@ -72,7 +77,7 @@ int 		 nj_object_insert(nj_state_t *state, nj_object_t *collection, nj_object_t
 
 //
 
-nj_object_t *nj_object_type(nj_object_t *self);
+nj_object_t *nj_object_type(nj_state_t *state, nj_object_t *self);
 nj_object_t *nj_object_test(nj_state_t *state, nj_object_t *object);
 nj_object_t *nj_object_print(nj_object_t *state, nj_object_t *object, FILE *fp);
 nj_object_t *nj_object_istanciate(nj_state_t *state, nj_object_t *type);
@@ -27,7 +27,7 @@ static nj_object_t *builtin_typeof(nj_state_t *state, int argc, nj_object_t **ar
 		// Unexpected arguments 
 		return 0;
 
-	return argv[0]->type;
+	return nj_object_type_of(state, argv[0]);
 }
 
 static nj_object_t *builtin_typenameof(nj_state_t *state, int argc, nj_object_t **argv)
@@ -40,7 +40,7 @@ static nj_object_t *builtin_typenameof(nj_state_t *state, int argc, nj_object_t
 		// Unexpected arguments 
 		return 0;
 
-	const char *name = ((nj_object_type_t*) argv[0]->type)->name;
+	const char *name = ((nj_object_type_t*) nj_object_type_of(state, argv[0]))->name;
 
 	return nj_object_from_c_string_ref(state, name, strlen(name));
 }
@@ -16,12 +16,17 @@ nj_object_t *builtin_disassemble(nj_state_t *state, int argc, nj_object_t **argv
 	char *code, *data;
 	int code_length, data_length;
 
-	code = state->segments[u32_top(&state->segment_stack)].code;
-	data = state->segments[u32_top(&state->segment_stack)].data;
-	code_length = state->segments[u32_top(&state->segment_stack)].code_size;
-	data_length = state->segments[u32_top(&state->segment_stack)].data_size;
+	uint32_t segment = state->frames[state->frames_used - 1].segment;
 
-	nj_disassemble(code, data, code_length, data_length);
+	code = state->segments[segment].code;
+	data = state->segments[segment].data;
+	code_length = state->segments[segment].code_size;
+	data_length = state->segments[segment].data_size;
+
+	if(state->segments[segment].flags & SEGMENT_IS_REGISTER)
+		nj_disassemble_register(code, data, code_length, data_length);
+	else
+		nj_disassemble(code, data, code_length, data_length);
 
 	return (nj_object_t*) &state->null_object;
 }
\ No newline at end of file
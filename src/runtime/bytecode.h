@@ -14,6 +14,7 @@ enum {
 	OPCODE_PUSH_STRING,
 	OPCODE_PUSH_FUNCTION,
 	OPCODE_PUSH_VARIABLE,
+	OPCODE_PUSH_GLOBAL,
 	OPCODE_SELECT_ATTRIBUTE_AND_REPUSH,
 
 	OPCODE_BUILD_ARRAY,
@@ -33,6 +34,11 @@ enum {
 	OPCODE_VARIABLE_MAP_PUSH,
 	OPCODE_VARIABLE_MAP_POP,
 
+	OPCODE_LOCALS_PUSH,
+	OPCODE_LOCALS_POP,
+	OPCODE_LOAD_LOCAL,
+	OPCODE_STORE_LOCAL,
+
 	OPCODE_CALL,
 	OPCODE_EXPECT,
 	OPCODE_RETURN,
@@ -62,5 +68,123 @@ enum {
 	OPCODE_BITWISE_OR,
 	OPCODE_BITWISE_XOR,
 	OPCODE_BITWISE_NOT,
-	
-};
\ No newline at end of file
+
+	// Superinstructions. The generator doesn't emit them,
+	// they replace frequent sequences in the peephole pass
+	// (see compile/peephole.c).
+
+	OPCODE_ASSIGN_AND_POP,
+	OPCODE_STORE_LOCAL_AND_POP,
+	OPCODE_INC_VARIABLE,
+	OPCODE_INC_LOCAL,
+	OPCODE_PUSH_VARIABLE_SELECT_ATTRIBUTE,
+	OPCODE_LSS_JUMP_IF_FALSE,
+	OPCODE_GRT_JUMP_IF_FALSE,
+	OPCODE_LEQ_JUMP_IF_FALSE,
+	OPCODE_GEQ_JUMP_IF_FALSE,
+	OPCODE_EQL_JUMP_IF_FALSE,
+	OPCODE_NQL_JUMP_IF_FALSE,
+
+	OPCODE_COUNT
+};
+
+//
+// Operand types of each instruction, one character per
+// operand: 'i' i64, 'f' f64, 's' data offset, 'y' symbol
+// index, 'u' u32, 'a' code address. Returns NULL for
+// unknown opcodes.
+//
+const char *nj_get_opcode_operands(uint32_t opcode);
+
+//
+// Name of an opcode, as printed by the disassembler.
+//
+const char *nj_get_opcode_name(uint32_t opcode);
+
+//
+// The register-based instruction set, an alternative to
+// the stack one above (see compile/generate_register.c and
+// execute_register.c). Instructions name their operands and
+// their destination explicitly: ADD d, l, r computes
+// r[l] + r[r] into r[d], where registers are numbered from
+// the base of the current frame.
+//
+// A frame starts with ENTER, which gives the number of
+// registers it uses. The locals of a function come first,
+// starting with its arguments, then the temporaries. CALL
+// expects the callee in r[first] and the arguments in the
+// registers that follow it, which become registers 0..argc
+// of the callee's frame.
+//
+
+enum {
+
+	ROPCODE_NOPE,
+	ROPCODE_QUIT,
+	ROPCODE_OFFSET,
+
+	ROPCODE_ENTER,
+	ROPCODE_MOVE,
+
+	ROPCODE_LOAD_NULL,
+	ROPCODE_LOAD_TRUE,
+	ROPCODE_LOAD_FALSE,
+	ROPCODE_LOAD_INT,
+	ROPCODE_LOAD_FLOAT,
+	ROPCODE_LOAD_STRING,
+	ROPCODE_LOAD_FUNCTION,
+	ROPCODE_LOAD_VARIABLE,
+	ROPCODE_LOAD_GLOBAL,
+	ROPCODE_STORE_VARIABLE,
+
+	ROPCODE_BUILD_ARRAY,
+	ROPCODE_BUILD_DICT,
+
+	ROPCODE_IMPORT,
+	ROPCODE_IMPORT_AS,
+
+	ROPCODE_SELECT,
+	ROPCODE_INSERT,
+	ROPCODE_SELECT_ATTRIBUTE,
+	ROPCODE_INSERT_ATTRIBUTE,
+
+	ROPCODE_VARIABLE_MAP_PUSH,
+	ROPCODE_VARIABLE_MAP_POP,
+
+	ROPCODE_CALL,
+	ROPCODE_RETURN,
+
+	ROPCODE_JUMP,
+	ROPCODE_JUMP_IF_FALSE,
+
+	ROPCODE_ADD,
+	ROPCODE_SUB,
+	ROPCODE_MUL,
+	ROPCODE_DIV,
+	ROPCODE_MOD,
+	ROPCODE_POW,
+	ROPCODE_NEG,
+	ROPCODE_LSS,
+	ROPCODE_GRT,
+	ROPCODE_LEQ,
+	ROPCODE_GEQ,
+	ROPCODE_EQL,
+	ROPCODE_NQL,
+	ROPCODE_AND,
+	ROPCODE_OR,
+	ROPCODE_NOT,
+	ROPCODE_SHL,
+	ROPCODE_SHR,
+	ROPCODE_BITWISE_AND,
+	ROPCODE_BITWISE_OR,
+	ROPCODE_BITWISE_XOR,
+	ROPCODE_BITWISE_NOT,
+
+	ROPCODE_COUNT
+};
+
+//
+// Same as nj_get_opcode_operands for the register set,
+// where 'r' is a register index.
+//
+const char *nj_get_ropcode_operands(uint32_t opcode);
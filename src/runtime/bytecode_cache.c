@@ -0,0 +1,315 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "noja.h"
+#include "bytecode.h"
+#include "utils/hash.h"
+
+//
+// Compiling a file means tokenizing, parsing, checking and
+// generating code for it on every run and every import. The
+// bytecode cache keeps the result in a file, which later runs
+// map in place of compiling, as long as the source and the
+// compiler didn't change.
+//
+// A cache file is a header followed by the code and the data
+// segment, as nj_compile makes them:
+//
+//   header (48 bytes) | code | data
+//
+// The header holds the version of the format, the backend
+// and optimization level the code is for, a fingerprint of
+// the compiler that made it, and the size and hash of the
+// source it came from. Any mismatch means the file is stale
+// and it's compiled and written again. Each backend and
+// optimization level has its own file, so runs that use
+// different ones don't overwrite each other's.
+//
+// The fingerprint is a hash of the operand table of the
+// backend's instruction set and of BYTECODE_GENERATOR_VERSION.
+// The table catches opcodes that are added, removed or have
+// new operands. The version catches the rest: changes to the
+// code generated for the same instructions.
+//
+// There is no line table. Positions in the source are the
+// operands of OFFSET instructions and lines are counted in
+// the source text, which segments keep for error messages
+// anyway. Since the text is read either way, comparing a
+// hash of it is a stronger check than the modification time.
+//
+// Files are written to a temporary name and renamed, so runs
+// that race on the same cache never map a partial one. They
+// are in host byte order. Mapped code is still verified like
+// code that was just compiled.
+//
+
+#define BYTECODE_MAGIC "NJBC"
+#define BYTECODE_VERSION 2
+#define BYTECODE_HASH_SEED 0x6e6f6a61ULL
+
+//
+// Bump this when a change to the compiler makes different
+// code for the same source without touching the operand
+// tables, so that files written before it aren't used.
+//
+#define BYTECODE_GENERATOR_VERSION 1
+
+typedef struct {
+	char     magic[4];
+	uint32_t version;
+	uint32_t backend;
+	uint32_t opt_level;
+	uint32_t code_size;
+	uint32_t data_size;
+	uint64_t compiler;
+	uint64_t source_size;
+	uint64_t source_hash;
+} header_t;
+
+_Static_assert(sizeof(header_t) == 48, "The code must stay aligned to 8 bytes");
+
+//
+// Makes the name of the cache file of [path] for [backend]
+// at [opt_level]. Next to the source, it's the path followed
+// by the backend's letter and the level, like "main.noja.s2.njc".
+// In a cache directory, the path is replaced by the base
+// name of the file and the hash of its absolute path, so
+// that files with the same name don't share it.
+//
+static char *cache_path(const char *path, const char *directory, int backend, int opt_level)
+{
+	size_t size;
+	char *result;
+
+	char kind = backend == NJ_BACKEND_REGISTER ? 'r' : 's';
+
+	if(directory == 0) {
+
+		size = strlen(path) + 32;
+		result = malloc(size);
+
+		if(result)
+			snprintf(result, size, "%s.%c%d.njc", path, kind, opt_level);
+
+		return result;
+	}
+
+	char *absolute = realpath(path, 0);
+
+	if(absolute == 0)
+		return 0;
+
+	const char *base = strrchr(absolute, '/');
+	base = base ? base + 1 : absolute;
+
+	uint64_t hash = hash_string(absolute, BYTECODE_HASH_SEED);
+
+	size = strlen(directory) + strlen(base) + 32;
+	result = malloc(size);
+
+	if(result)
+		snprintf(result, size, "%s/%s-%016llx.%c%d.njc", directory, base, (unsigned long long) hash, kind, opt_level);
+
+	free(absolute);
+	return result;
+}
+
+static uint64_t compiler_fingerprint(int backend)
+{
+	const char *(*get_operands)(uint32_t) = nj_get_opcode_operands;
+	uint32_t count = OPCODE_COUNT;
+
+	if(backend == NJ_BACKEND_REGISTER) {
+		get_operands = nj_get_ropcode_operands;
+		count = ROPCODE_COUNT;
+	}
+
+	uint64_t hash = BYTECODE_HASH_SEED + BYTECODE_GENERATOR_VERSION;
+
+	// The terminator is hashed too, so that moving an
+	// operand from an opcode to the next changes it
+
+	for(uint32_t i = 0; i < count; i++) {
+
+		const char *operands = get_operands(i);
+
+		if(operands == 0)
+			operands = "";
+
+		hash = hash_bytes(operands, strlen(operands) + 1, hash);
+	}
+
+	return hash;
+}
+
+static header_t make_header(int backend, int opt_level, const char *text, int length)
+{
+	header_t header = {
+		.magic = BYTECODE_MAGIC,
+		.version = BYTECODE_VERSION,
+		.backend = backend,
+		.opt_level = opt_level,
+		.compiler = compiler_fingerprint(backend),
+		.source_size = length,
+		.source_hash = hash_bytes(text, length, BYTECODE_HASH_SEED),
+	};
+
+	return header;
+}
+
+//
+// Maps the cache file at [file] if it holds the code for
+// [expected]. Returns 0 if it doesn't or it can't be read.
+//
+static int load(const char *file, const header_t *expected, char **e_data, char **e_code, uint32_t *e_data_size, uint32_t *e_code_size, void **e_mapping, size_t *e_mapping_size)
+{
+	int fd = open(file, O_RDONLY);
+
+	if(fd < 0)
+		return 0;
+
+	struct stat info;
+
+	if(fstat(fd, &info) < 0 || (size_t) info.st_size < sizeof(header_t)) {
+
+		close(fd);
+		return 0;
+	}
+
+	size_t size = info.st_size;
+
+	void *mapping = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	close(fd);
+
+	if(mapping == MAP_FAILED)
+		return 0;
+
+	const header_t *header = mapping;
+
+	int valid = !memcmp(header->magic, expected->magic, sizeof(header->magic))
+		&& header->version      == expected->version
+		&& header->backend      == expected->backend
+		&& header->opt_level    == expected->opt_level
+		&& header->compiler     == expected->compiler
+		&& header->source_size  == expected->source_size
+		&& header->source_hash  == expected->source_hash
+		&& header->code_size % sizeof(uint32_t) == 0
+		&& sizeof(header_t) + (size_t) header->code_size + header->data_size == size;
+
+	if(!valid) {
+
+		munmap(mapping, size);
+		return 0;
+	}
+
+	*e_code = (char*) mapping + sizeof(header_t);
+	*e_data = *e_code + header->code_size;
+	*e_code_size = header->code_size;
+	*e_data_size = header->data_size;
+	*e_mapping = mapping;
+	*e_mapping_size = size;
+	return 1;
+}
+
+static void store(const char *file, header_t header, const char *data, const char *code, uint32_t data_size, uint32_t code_size)
+{
+	size_t size = strlen(file) + 32;
+	char *temp = malloc(size);
+
+	if(temp == 0)
+		return;
+
+	snprintf(temp, size, "%s.%ld.tmp", file, (long) getpid());
+
+	FILE *fp = fopen(temp, "wb");
+
+	if(fp == 0) {
+
+		free(temp);
+		return;
+	}
+
+	header.code_size = code_size;
+	header.data_size = data_size;
+
+	int written = fwrite(&header, sizeof(header), 1, fp) == 1
+		&& fwrite(code, 1, code_size, fp) == code_size
+		&& fwrite(data, 1, data_size, fp) == data_size;
+
+	if(fclose(fp) != 0)
+		written = 0;
+
+	if(!written || rename(temp, file) != 0)
+		remove(temp);
+
+	free(temp);
+}
+
+//
+// Compiles [text], the contents of the file at [path], for
+// [backend] at [opt_level]. When [cache] is set and enabled,
+// the code is mapped from the cache file of [path] if it's
+// up to date, otherwise it's compiled and the cache file
+// written. Failing to use the cache isn't an error. [path]
+// is only used by the cache.
+//
+// Mapped code and data are described by [e_mapping] and
+// [e_mapping_size], which are null and 0 when they were
+// compiled. Either way, they're released by nj_free_bytecode.
+//
+// When [e_imports] isn't null, it also gets the paths that
+// the code imports, as nj_compile_with_imports. Cache files
+// don't hold them, so on a hit the source is parsed for them.
+//
+int nj_compile_file(const char *path, const char *text, int length, int backend, int opt_level, const nj_bytecode_cache_options_t *cache, char **e_data, char **e_code, uint32_t *e_data_size, uint32_t *e_code_size, void **e_mapping, size_t *e_mapping_size, char ***e_imports, uint32_t *e_import_count, string_builder_t *output_builder)
+{
+	*e_mapping = 0;
+	*e_mapping_size = 0;
+
+	char *file = 0;
+	header_t header;
+
+	if(cache && cache->enabled) {
+
+		file = cache_path(path, cache->directory, backend, opt_level);
+		header = make_header(backend, opt_level, text, length);
+
+		if(file && load(file, &header, e_data, e_code, e_data_size, e_code_size, e_mapping, e_mapping_size)) {
+
+			free(file);
+
+			if(e_imports && !nj_scan_imports(text, length, opt_level, e_imports, e_import_count, output_builder)) {
+
+				nj_free_bytecode(*e_data, *e_code, *e_mapping, *e_mapping_size);
+				return 0;
+			}
+
+			return 1;
+		}
+	}
+
+	int compiled = nj_compile_with_imports(text, length, backend == NJ_BACKEND_REGISTER, e_data, e_code, e_data_size, e_code_size, opt_level, e_imports, e_import_count, output_builder);
+
+	if(compiled && file)
+		store(file, header, *e_data, *e_code, *e_data_size, *e_code_size);
+
+	free(file);
+	return compiled;
+}
+
+void nj_free_bytecode(char *data, char *code, void *mapping, size_t mapping_size)
+{
+	if(mapping) {
+		munmap(mapping, mapping_size);
+		return;
+	}
+
+	free(code);
+	free(data);
+}
@@ -0,0 +1,385 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "noja.h"
+#include "bytecode.h"
+
+//
+// Attribute selections and variable reads look names up in
+// dicts: the methods of the container's type, or the local,
+// global and builtin variable maps. Since dicts with the
+// same keys share their shape, the slot where a name was
+// found holds for every dict with that shape, so each of
+// these instructions gets a cache of the shapes it met and
+// the slot they led to. A hit costs a few pointer compares
+// and the value is read from the slot.
+//
+// Values are always read from the dicts, so assignments to
+// names that are already there don't need to be tracked.
+// Adding a name changes the shape of its dict, which makes
+// the entries that relied on the old one miss. Dicts in
+// dictionary mode have no shape and aren't cached.
+//
+// Variable reads that have no local map to look at, which
+// is the case of the top-level code and of the globals of
+// functions, only depend on the global and the builtin map.
+// They keep a single binding, checked against the versions
+// of the two maps instead of their shapes, so it also holds
+// when they're in dictionary mode. Versions only grow, so
+// their sum is enough to tell that neither changed.
+//
+// Caches live in a side table of their segment, made once
+// the segment is verified. The instruction at offset i uses
+// the cache at sites[i / 4], and the one at sites[i / 4 + 1]
+// if it has two (PUSH_VARIABLE_SELECT_ATTRIBUTE).
+//
+
+//
+// A site of an instruction: the kind of its cache and the
+// operand holding the name it looks up.
+//
+typedef struct {
+	int kind;
+	int operand;
+} site_t;
+
+//
+// Stores the sites of [opcode] into [sites] and returns
+// how many it has. The j-th site of the instruction at
+// offset i uses the cache at sites[i / 4 + j].
+//
+static int sites_of(int is_register, uint32_t opcode, site_t sites[2])
+{
+	if(is_register) {
+
+		switch(opcode) {
+			case ROPCODE_SELECT_ATTRIBUTE: sites[0] = (site_t) { NJ_IC_ATTRIBUTE, 2 }; return 1;
+			case ROPCODE_LOAD_VARIABLE:
+			case ROPCODE_LOAD_GLOBAL:      sites[0] = (site_t) { NJ_IC_VARIABLE,  1 }; return 1;
+		}
+
+	} else {
+
+		switch(opcode) {
+			case OPCODE_SELECT_ATTRIBUTE:
+			case OPCODE_SELECT_ATTRIBUTE_AND_REPUSH: sites[0] = (site_t) { NJ_IC_ATTRIBUTE, 0 }; return 1;
+			case OPCODE_PUSH_VARIABLE:
+			case OPCODE_PUSH_GLOBAL:
+			case OPCODE_INC_VARIABLE:                sites[0] = (site_t) { NJ_IC_VARIABLE,  0 }; return 1;
+
+			case OPCODE_PUSH_VARIABLE_SELECT_ATTRIBUTE:
+			sites[0] = (site_t) { NJ_IC_VARIABLE,  0 };
+			sites[1] = (site_t) { NJ_IC_ATTRIBUTE, 1 };
+			return 2;
+		}
+	}
+
+	return 0;
+}
+
+static uint32_t instruction_size(int is_register, uint32_t opcode)
+{
+	const char *operands = is_register ? nj_get_ropcode_operands(opcode) : nj_get_opcode_operands(opcode);
+
+	uint32_t size = sizeof(uint32_t);
+
+	for(int j = 0; operands[j]; j++)
+		size += (operands[j] == 'i' || operands[j] == 'f') ? 8 : 4;
+
+	return size;
+}
+
+static uint32_t operand_offset(int is_register, uint32_t opcode, uint32_t offset, int operand)
+{
+	const char *operands = is_register ? nj_get_ropcode_operands(opcode) : nj_get_opcode_operands(opcode);
+
+	offset += sizeof(uint32_t);
+
+	for(int j = 0; j < operand; j++)
+		offset += (operands[j] == 'i' || operands[j] == 'f') ? 8 : 4;
+
+	return offset;
+}
+
+int nj_make_inline_caches(nj_state_t *state, segment_t *segment)
+{
+	(void) state;
+
+	int is_register = !!(segment->flags & SEGMENT_IS_REGISTER);
+
+	uint32_t count = 0;
+
+	for(uint32_t i = 0; i < segment->code_size; ) {
+
+		uint32_t opcode = *(uint32_t*) (segment->code + i);
+		site_t sites[2];
+
+		count += sites_of(is_register, opcode, sites);
+
+		i += instruction_size(is_register, opcode);
+	}
+
+	segment->caches = calloc(count + 1, sizeof(nj_inline_cache_t));
+	segment->sites = calloc(segment->code_size / sizeof(uint32_t) + 1, sizeof(nj_inline_cache_t*));
+	segment->caches_count = count;
+
+	if(segment->caches == 0 || segment->sites == 0) {
+
+		nj_free_inline_caches(segment);
+		return 0;
+	}
+
+	uint32_t source = 0;
+	count = 0;
+
+	for(uint32_t i = 0; i < segment->code_size; ) {
+
+		uint32_t opcode = *(uint32_t*) (segment->code + i);
+		site_t sites[2];
+
+		uint32_t size = instruction_size(is_register, opcode);
+
+		if(opcode == (is_register ? ROPCODE_OFFSET : OPCODE_OFFSET))
+			source = *(uint32_t*) (segment->code + i + sizeof(uint32_t));
+
+		int n = sites_of(is_register, opcode, sites);
+
+		for(int j = 0; j < n; j++) {
+
+			nj_inline_cache_t *cache = &segment->caches[count++];
+
+			cache->kind = sites[j].kind;
+			cache->offset = i;
+			cache->source = source;
+			cache->name = segment->symbols[*(uint32_t*) (segment->code + operand_offset(is_register, opcode, i, sites[j].operand))];
+
+			segment->sites[i / sizeof(uint32_t) + j] = cache;
+		}
+
+		i += size;
+	}
+
+	return 1;
+}
+
+void nj_free_inline_caches(segment_t *segment)
+{
+	free(segment->caches);
+	free(segment->sites);
+
+	segment->caches = 0;
+	segment->sites = 0;
+	segment->caches_count = 0;
+}
+
+static void install(nj_inline_cache_t *cache, nj_inline_cache_entry_t entry)
+{
+	if(cache->used < NJ_INLINE_CACHE_ENTRIES) {
+
+		cache->entries[cache->used++] = entry;
+		return;
+	}
+
+	cache->entries[cache->next] = entry;
+	cache->next = (cache->next + 1) % NJ_INLINE_CACHE_ENTRIES;
+}
+
+//
+// Same as nj_object_select_attribute_symbol.
+//
+nj_object_t *nj_cached_select_attribute(nj_state_t *state, nj_inline_cache_t *cache, nj_object_t *container, nj_symbol_t *name)
+{
+	nj_object_t *type = nj_object_type_of(state, container);
+	nj_object_dict_t *methods = (nj_object_dict_t*) ((nj_object_type_t*) type)->methods;
+
+	if(methods == 0)
+		return 0;
+
+	for(uint32_t i = 0; i < cache->used; i++) {
+
+		nj_inline_cache_entry_t *entry = &cache->entries[i];
+
+		if(entry->type == type && entry->shapes[0] == methods->shape) {
+
+			cache->hits++;
+			return nj_dictionary_values(methods)[entry->slot];
+		}
+	}
+
+	cache->misses++;
+
+	if(methods->shape == 0)
+		return nj_dictionary_select_symbol(state, (nj_object_t*) methods, name);
+
+	int slot = nj_shape_lookup(methods->shape, name);
+
+	if(slot < 0)
+		return 0;
+
+	install(cache, (nj_inline_cache_entry_t) { .type = type, .shapes = { methods->shape }, .slot = slot });
+
+	return nj_dictionary_values(methods)[slot];
+}
+
+static nj_object_t *select_global(nj_state_t *state, nj_inline_cache_t *cache, nj_object_t *globals, nj_symbol_t *name)
+{
+	nj_object_dict_t *maps[2] = {
+		(nj_object_dict_t*) globals,
+		(nj_object_dict_t*) state->builtins_map,
+	};
+
+	uint64_t version = (uint64_t) maps[0]->version + maps[1]->version;
+
+	if(cache->binding && cache->binding_version == version) {
+
+		cache->hits++;
+		return nj_dictionary_values(maps[cache->binding - 1])[cache->binding_slot];
+	}
+
+	cache->misses++;
+
+	for(int i = 0; i < 2; i++) {
+
+		int slot = nj_dictionary_slot((nj_object_t*) maps[i], name);
+
+		if(slot >= 0) {
+
+			cache->binding = i + 1;
+			cache->binding_slot = slot;
+			cache->binding_version = version;
+
+			return nj_dictionary_values(maps[i])[slot];
+		}
+	}
+
+	return 0;
+}
+
+//
+// Looks [name] up in [locals], if there are any, then in
+// [globals] and in the builtins.
+//
+nj_object_t *nj_cached_select_variable(nj_state_t *state, nj_inline_cache_t *cache, nj_object_t *locals, nj_object_t *globals, nj_symbol_t *name)
+{
+	if(locals == 0)
+		return select_global(state, cache, globals, name);
+
+	nj_object_dict_t *maps[3] = {
+		(nj_object_dict_t*) locals,
+		(nj_object_dict_t*) globals,
+		(nj_object_dict_t*) state->builtins_map,
+	};
+
+	nj_shape_t *shapes[3] = {
+		maps[0]->shape,
+		maps[1]->shape,
+		maps[2]->shape,
+	};
+
+	for(uint32_t i = 0; i < cache->used; i++) {
+
+		nj_inline_cache_entry_t *entry = &cache->entries[i];
+
+		int depth = 0;
+
+		while(depth <= entry->depth && entry->shapes[depth] == shapes[depth])
+			depth++;
+
+		if(depth > entry->depth) {
+
+			cache->hits++;
+			return nj_dictionary_values(maps[entry->depth])[entry->slot];
+		}
+	}
+
+	cache->misses++;
+
+	for(int depth = 0; depth < 3; depth++) {
+
+		if(shapes[depth] == 0)
+			break;
+
+		int slot = nj_shape_lookup(shapes[depth], name);
+
+		if(slot >= 0) {
+
+			nj_inline_cache_entry_t entry = { .depth = depth, .slot = slot };
+
+			memcpy(entry.shapes, shapes, sizeof(nj_shape_t*) * (depth + 1));
+
+			install(cache, entry);
+
+			return nj_dictionary_values(maps[depth])[slot];
+		}
+	}
+
+	// A map in dictionary mode was met
+
+	for(int depth = 0; depth < 3; depth++) {
+
+		nj_object_t *object = nj_dictionary_select_symbol(state, (nj_object_t*) maps[depth], name);
+
+		if(object)
+			return object;
+	}
+
+	return 0;
+}
+
+static uint32_t line_of(segment_t *segment, uint32_t source)
+{
+	uint32_t line = 1;
+
+	if(segment->text == 0)
+		return 0;
+
+	for(uint32_t i = 0; i < source && segment->text[i]; i++)
+		if(segment->text[i] == '\n')
+			line++;
+
+	return line;
+}
+
+//
+// Sums the counters of the caches of every segment into
+// [stats] and passes the caches that ran to [report].
+//
+void nj_report_inline_caches(nj_state_t *state, nj_ic_stats_t *stats, nj_ic_report_t *report)
+{
+	memset(stats, 0, sizeof(nj_ic_stats_t));
+
+	for(int i = 0; i < state->segments_used; i++) {
+
+		segment_t *segment = &state->segments[i];
+
+		for(uint32_t j = 0; j < segment->caches_count; j++) {
+
+			nj_inline_cache_t *cache = &segment->caches[j];
+
+			if(cache->hits + cache->misses == 0)
+				continue;
+
+			stats->hits += cache->hits;
+			stats->misses += cache->misses;
+			stats->sites++;
+
+			if(cache->used > 1)
+				stats->polymorphic++;
+
+			if(report == 0)
+				continue;
+
+			nj_ic_site_t site = {
+				.kind = cache->kind,
+				.segment = segment->name,
+				.line = line_of(segment, cache->source),
+				.name = cache->name->text,
+				.hits = cache->hits,
+				.misses = cache->misses,
+				.entries = cache->used + (cache->binding != 0),
+			};
+
+			report->hook(&site, report->data);
+		}
+	}
+}
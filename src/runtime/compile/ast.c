@@ -266,7 +266,7 @@ node_t *node_float_create(pool_t *pool, int offset, int length, double value)
 	node->super.super.offset = offset;
 	node->super.super.length = length;
 	node->super.super.next = 0;
-	node->super.kind = EXPRESSION_KIND_INT;
+	node->super.kind = EXPRESSION_KIND_FLOAT;
 	node->value = value;
 
 	return (node_t*) node;
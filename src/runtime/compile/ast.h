@@ -1,3 +1,6 @@
+#ifndef _AST_
+#define _AST_
+
 
 #include <stdint.h>
 #include <stdio.h>
@@ -251,3 +254,5 @@ void 	node_get_int(node_t *node, int64_t *e_value);
 void 	node_get_float(node_t *node, int64_t *e_value);
 void 	node_get_string(node_t *node, char **e_content, int *e_length);
 void 	node_print(node_t *node, FILE *fp);
+
+#endif
@@ -0,0 +1,479 @@
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <assert.h>
+#include "builder.h"
+#include "../utils/hash.h"
+
+int builder_init(program_builder_t *builder)
+{
+	memset(builder, 0, sizeof(program_builder_t));
+
+	{
+		builder->head_data_chunk = malloc(sizeof(data_chunk_t));
+
+		if(builder->head_data_chunk == 0)
+			return 0;
+
+		builder->head_data_chunk->used = 0;
+		builder->head_data_chunk->next = NULL;
+
+		builder->tail_data_chunk = builder->head_data_chunk;
+	}
+
+	{
+		builder->strings = calloc(64, sizeof(data_string_t));
+		builder->strings_size = 64;
+		builder->strings_used = 0;
+
+		if(builder->strings == 0) {
+
+			free(builder->head_data_chunk);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+label_t *label_create(block_t *block)
+{
+	label_t *label = malloc(sizeof(label_t));
+
+	assert(label);
+
+	label->block = 0;
+	label->offset_in_block = 0;
+	label->tail_gap = 0;
+
+	// Add to the label list of the builder
+
+	label->prev = block->builder->tail_label;
+	block->builder->tail_label = label;
+
+	return label;
+}
+
+void release_resources_on_abort(program_builder_t *builder)
+{
+	free(builder->strings);
+}
+
+int builder_serialize(program_builder_t *builder, char **e_data, char **e_code, uint32_t *e_data_size, uint32_t *e_code_size)
+{
+	//
+	// Serialize the code
+	//
+
+	uint32_t length = 0; // The lengths of the code. To be calculated!
+
+	// Assigns offsets to the blocks and
+	// calculate the size of the whole
+	// sode segment.
+	{
+		block_t *block = builder->head_block;
+
+		while(block) {
+
+			block->offset = length;
+			length += block->length;
+
+			block = block->next;
+		}
+	}
+
+	// Resolve the gaps associated to each label and while 
+	// doing it free all of the label and gap structures
+
+	{
+		label_t *label = builder->tail_label;
+
+		while(label) {
+
+			// Resolve the gaps associated to this label
+
+			gap_t *gap = label->tail_gap;
+
+			while(gap) {
+
+
+				// Fill the gap
+
+				*(uint32_t*) (gap->chunk->body + gap->offset_in_chunk) = (uint32_t) (label->block->offset + label->offset_in_block);
+
+				// Free the gap and go to the next one
+
+				{
+					gap_t *prev_gap = gap->prev;
+					free(gap);
+					gap = prev_gap;
+				}
+			}
+
+			// Free the label and go to the next one
+
+			{
+				label_t *prev_label = label->prev;
+				free(label);
+				label = prev_label;
+			}
+		}
+	}
+
+	char *code = malloc(length);
+
+	assert(code);
+
+	// Write to the allocated space
+
+	{
+		uint32_t written = 0;
+
+		block_t *block = builder->head_block;
+
+		while(block) {
+
+			chunk_t *chunk = &block->head;
+
+			{
+				memcpy(code + written, chunk->body, chunk->used);
+
+				written += chunk->used;
+			}
+
+			chunk = chunk->next;
+
+			while(chunk) {
+
+				// Write the content
+
+				memcpy(code + written, chunk->body, chunk->used);
+
+				written += chunk->used;
+
+				// Free the chunk and go to the next one
+
+				{
+					chunk_t *next_chunk = chunk->next;
+					free(chunk);
+					chunk = next_chunk;
+				}
+			}
+
+			// Free the block and go to the next one
+
+			{
+				block_t *next_block = block->next;
+				free(block);
+				block = next_block;
+			}
+		}
+	}
+
+	//
+	// Serialize the data
+	//
+
+	char *data = malloc(builder->data_length);
+
+	assert(data);
+
+	{
+		uint32_t written = 0;
+
+		data_chunk_t *chunk = builder->head_data_chunk;
+
+		while(chunk) {
+
+			memcpy(data + written, chunk->body, chunk->used);
+
+			written += chunk->used;
+
+			// Free the chunk and go to the next one
+
+			{
+				data_chunk_t *next_chunk = chunk->next;
+				free(chunk);
+				chunk = next_chunk;
+			}
+		}
+	}
+
+	free(builder->strings);
+
+	// Done!
+
+	*e_data = data;
+	*e_code = code;
+	*e_data_size = builder->data_length;
+	*e_code_size = length;
+
+	return 1;
+}
+
+void label_points_here(block_t *block, label_t *label)
+{
+	label->block = block;
+	label->offset_in_block = block->length;
+}
+
+block_t *block_create(program_builder_t *builder)
+{
+	block_t *block = malloc(sizeof(block_t));
+
+	assert(block);
+
+	block->builder = builder;
+	block->next = 0;
+	block->scope = 0;
+
+	block->offset = 0;
+	block->length = 0;
+
+	block->head.next = NULL;
+	block->head.used = 0;
+
+	block->tail = &block->head;
+
+	// Append block to builder
+
+	if(!builder->head_block) {
+
+		builder->head_block = block;
+
+	} else {
+
+		builder->tail_block->next = block;
+	}
+
+	builder->tail_block = block;
+
+	return block;
+}
+
+block_t *sub_block_create(block_t *parent_block)
+{
+	return block_create(parent_block->builder);
+}
+
+static int block_ensure_space(block_t *block, uint32_t required_space)
+{
+	if(BYTES_PER_CODE_CHUNK - block->tail->used < required_space) {
+
+		// resize
+		chunk_t *chunk = malloc(sizeof(chunk_t));
+
+		if(chunk == 0)
+			return 0;
+
+		chunk->next = 0;
+		chunk->used = 0;
+		block->tail->next = chunk;
+		block->tail = chunk;
+	}
+
+	return 1;
+}
+
+#define DEF_APPENDER(suffix, T) 							\
+static int block_append_ ## suffix (block_t *block, T v) 	\
+{															\
+	if(!block_ensure_space(block, sizeof(T))) 					\
+		return 0;											\
+															\
+	*(T*) (block->tail->body + block->tail->used) = v;		\
+															\
+	block->tail->used += sizeof(T);							\
+	block->length += sizeof(T);								\
+	return 1;												\
+}
+
+DEF_APPENDER(u8 , uint8_t);
+DEF_APPENDER(u16, uint16_t);
+DEF_APPENDER(u32, uint32_t);
+DEF_APPENDER(u64, uint64_t);
+DEF_APPENDER(s8 , int8_t);
+DEF_APPENDER(s16, int16_t);
+DEF_APPENDER(s32, int32_t);
+DEF_APPENDER(s64, int64_t);
+DEF_APPENDER(f32, float);
+DEF_APPENDER(f64, double);
+
+#undef DEF_APPENDER
+
+static data_string_t *find_string(data_string_t *strings, uint32_t size, const char *content, uint64_t hash)
+{
+	uint32_t mask = size - 1;
+	uint32_t i = hash & mask;
+
+	while(strings[i].content) {
+
+		if(strings[i].hash == hash && !strcmp(strings[i].content, content))
+			break;
+
+		i = (i + 1) & mask;
+	}
+
+	return strings + i;
+}
+
+static data_string_t *builder_add_string(program_builder_t *builder, const char *string)
+{
+	uint64_t hash = hash_string(string, 0);
+
+	data_string_t *entry = find_string(builder->strings, builder->strings_size, string, hash);
+
+	if(entry->content)
+		return entry;
+
+	if((builder->strings_used + 1) * 3 > builder->strings_size * 2) {
+
+		uint32_t new_size = builder->strings_size * 2;
+
+		data_string_t *new_strings = calloc(new_size, sizeof(data_string_t));
+
+		if(new_strings == 0)
+			return 0;
+
+		for(uint32_t i = 0; i < builder->strings_size; i++)
+			if(builder->strings[i].content)
+				*find_string(new_strings, new_size, builder->strings[i].content, builder->strings[i].hash) = builder->strings[i];
+
+		free(builder->strings);
+
+		builder->strings = new_strings;
+		builder->strings_size = new_size;
+
+		entry = find_string(builder->strings, builder->strings_size, string, hash);
+	}
+
+	entry->content = string;
+	entry->hash = hash;
+	entry->offset = builder->data_length;
+	entry->index = builder->strings_used++;
+
+	do { 
+
+		if(builder->tail_data_chunk->used == BYTES_PER_DATA_CHUNK) {
+
+			data_chunk_t *chunk = malloc(sizeof(data_chunk_t));
+
+			if(chunk == 0)
+				return 0;
+
+			chunk->used = 0;
+			chunk->next = NULL;
+
+			builder->tail_data_chunk->next = chunk;
+			builder->tail_data_chunk = chunk;
+		}
+
+		builder->tail_data_chunk->body[builder->tail_data_chunk->used++] = *string;
+		builder->data_length++;
+		
+		if(*string == '\0')
+			break;
+		
+		string++;
+
+	} while(1);
+
+	return entry;
+}
+
+static int block_append_string(block_t *block, const char *string)
+{
+	data_string_t *entry = builder_add_string(block->builder, string);
+
+	if(entry == 0)
+		return 0;
+
+	return block_append_u32(block, entry->offset);
+}
+
+static int block_append_symbol(block_t *block, const char *string)
+{
+	data_string_t *entry = builder_add_string(block->builder, string);
+
+	if(entry == 0)
+		return 0;
+
+	return block_append_u32(block, entry->index);
+}
+
+int block_append(block_t *block, ...)
+{
+	va_list args;
+	va_start(args, block);
+
+	int done = 0;
+
+	while(!done) {
+
+		int type = va_arg(args, int);
+
+		switch(type) {
+
+			case U8 : if(!block_append_u8 (block, va_arg(args, int)))  return 0; break;
+			case U16: if(!block_append_u16(block, va_arg(args, int))) return 0; break;
+			case U32: if(!block_append_u32(block, va_arg(args, uint32_t))) return 0; break;
+			case U64: if(!block_append_u64(block, va_arg(args, uint64_t))) return 0; break;
+
+			case S8 : if(!block_append_s8 (block, va_arg(args, int)))  return 0; break;
+			case S16: if(!block_append_s16(block, va_arg(args, int))) return 0; break;
+			case S32: if(!block_append_s32(block, va_arg(args, int))) return 0; break;
+			case S64: if(!block_append_s64(block, va_arg(args, int64_t))) return 0; break;
+
+			case F32: if(!block_append_f32(block, va_arg(args, double)))  return 0; break;
+			case F64: if(!block_append_f64(block, va_arg(args, double))) return 0; break;
+
+			case STR: if(!block_append_string(block, va_arg(args, char*))) return 0; break;
+			case SYM: if(!block_append_symbol(block, va_arg(args, char*))) return 0; break;
+
+			case LBL:
+			{
+				chunk_t *chunk;
+				uint32_t offset_in_chunk;
+
+				if(!block_ensure_space(block, sizeof(uint32_t))) // This is to make sure that the
+					return 0;									 // current chunk is the one the
+																 // next u32 will be written to.
+																 
+				chunk = block->tail;				 // These two represent the location where
+				offset_in_chunk = block->tail->used; // the value is missing.
+
+				label_t *label = va_arg(args, label_t*);
+
+				gap_t *gap = malloc(sizeof(gap_t));
+
+				if(gap == NULL)
+					return 0;
+
+				if(!block_append_u32(block, 0)) {
+
+					free(gap);
+					return 0;
+				}
+
+				gap->chunk = chunk;
+				gap->offset_in_chunk = offset_in_chunk;
+
+				gap->prev = label->tail_gap;
+				label->tail_gap = gap;
+				break;
+			}
+
+			case END: 
+			done = 1; 
+			break;
+			
+			default: 
+			assert(0);
+			break;
+		}
+
+	}
+
+	va_end(args);
+	return 1;
+}
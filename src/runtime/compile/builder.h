@@ -0,0 +1,127 @@
+#ifndef _BUILDER_
+#define _BUILDER_
+
+#include <stdint.h>
+#include <setjmp.h>
+#include "scope.h"
+
+//
+// The program builder is shared by the code generators.
+// Code is appended to blocks (a function body is a block),
+// forward references are labels whose gaps are filled in
+// once every block has its final offset, and strings are
+// written to the data segment only once.
+//
+
+#define BYTES_PER_CODE_CHUNK 1024
+#define BYTES_PER_DATA_CHUNK 1024
+
+typedef struct data_string_t data_string_t;
+struct data_string_t {
+	const char *content;
+	uint64_t hash;
+	uint32_t offset; // Position of the first byte in the data segment
+	uint32_t index;  // Position of the string in the data segment
+};
+
+typedef struct block_t block_t;
+typedef struct program_builder_t program_builder_t;
+
+typedef struct data_chunk_t data_chunk_t;
+struct data_chunk_t {
+	data_chunk_t *next;
+	uint32_t used;
+	char body[BYTES_PER_DATA_CHUNK];
+};
+
+typedef struct chunk_t chunk_t;
+
+struct chunk_t {
+	chunk_t *next;
+	uint32_t used;
+	char body[BYTES_PER_CODE_CHUNK];
+};
+
+typedef struct gap_t gap_t;
+struct gap_t {
+
+	gap_t *prev;
+
+	chunk_t *chunk;  		  //
+	uint32_t offset_in_chunk; // The pointer to the gap
+};
+
+typedef struct label_t label_t;
+struct label_t {
+	
+	label_t *prev;
+
+	block_t *block;  		  // 
+	uint32_t offset_in_block; // The pointer value to fill the gaps with
+
+	gap_t *tail_gap;
+
+};
+
+struct block_t {
+
+	program_builder_t *builder;
+	block_t *next;
+
+	// The locals of the function this block belongs to,
+	// or NULL if variables are resolved by name.
+
+	scope_t *scope;
+
+	uint32_t offset;
+	uint32_t length;
+
+	chunk_t head, *tail;
+
+};
+
+struct program_builder_t {
+
+	label_t *tail_label;
+
+	block_t *head_block,
+			*tail_block;
+
+	data_chunk_t *head_data_chunk,
+				 *tail_data_chunk;
+	uint32_t data_length;
+
+	// Each string is written to the data segment only
+	// once. This table maps its contents to its location.
+
+	data_string_t *strings;
+	uint32_t strings_size;
+	uint32_t strings_used;
+
+	jmp_buf env;
+
+};
+
+enum {
+	END = 0,
+	U8 , S8 ,
+	U16, S16,
+	U32, S32,
+	U64, S64, 
+	F32,
+	F64,
+	STR,
+	SYM,
+	LBL,
+};
+
+int 	 builder_init(program_builder_t *builder);
+int 	 builder_serialize(program_builder_t *builder, char **e_data, char **e_code, uint32_t *e_data_size, uint32_t *e_code_size);
+void 	 release_resources_on_abort(program_builder_t *builder);
+block_t *block_create(program_builder_t *builder);
+block_t *sub_block_create(block_t *parent_block);
+int 	 block_append(block_t *block, ...);
+label_t *label_create(block_t *block);
+void 	 label_points_here(block_t *block, label_t *label);
+
+#endif
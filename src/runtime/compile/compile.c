@@ -1,27 +1,84 @@
 
 #include "ast.h"
+#include "../noja.h"
+
+typedef int (*generator_t)(ast_t ast, char **e_data, char **e_code, uint32_t *e_data_size, uint32_t *e_code_size);
 
 int generate(ast_t ast, char **e_data, char **e_code, uint32_t *e_data_size, uint32_t *e_code_size);
+int generate_register(ast_t ast, char **e_data, char **e_code, uint32_t *e_data_size, uint32_t *e_code_size);
 int parse(const char *source, int source_length, ast_t *e_ast, string_builder_t *output_builder);
+void optimize(ast_t *ast, int level);
+void peephole(char *code, uint32_t *code_size);
+int collect_imports(ast_t ast, char ***e_paths, uint32_t *e_count);
+void nj_free_imports(char **paths, uint32_t count);
 
-int nj_compile(const char *text, size_t length, char **e_data, char **e_code, uint32_t *e_data_size, uint32_t *e_code_size, string_builder_t *output_builder)
+//
+// When [e_imports] isn't null, it's set to the paths of the
+// imports that are known before the code runs, and their
+// number to [e_import_count] (see imports.c). With no
+// [generator], that's all it does.
+//
+static int compile(const char *text, size_t length, char **e_data, char **e_code, uint32_t *e_data_size, uint32_t *e_code_size, int opt_level, char ***e_imports, uint32_t *e_import_count, string_builder_t *output_builder, generator_t generator)
 {
 	ast_t ast;
 
 	if(!parse(text, length, &ast, output_builder))
 		return 0;
 
+	optimize(&ast, opt_level);
+
+	if(e_imports && !collect_imports(ast, e_imports, e_import_count)) {
+
+		string_builder_append(output_builder, "Out of memory");
+		ast_delete(ast);
+		return 0;
+	}
+
+	if(generator == 0) {
+
+		ast_delete(ast);
+		return 1;
+	}
+
 	//
 	// Generate the bytecode
 	//
 
-	if(!generate(ast, e_data, e_code, e_data_size, e_code_size)) {
+	if(!generator(ast, e_data, e_code, e_data_size, e_code_size)) {
 
 		string_builder_append(output_builder, "Failed to generate bytecode");
+
+		if(e_imports)
+			nj_free_imports(*e_imports, *e_import_count);
+
 		ast_delete(ast);
 		return 0;
 	}
 
 	ast_delete(ast);
+
+	if(opt_level >= NJ_OPT_PEEPHOLE && generator == generate)
+		peephole(*e_code, e_code_size);
+
 	return 1;
-}
\ No newline at end of file
+}
+
+int nj_compile(const char *text, size_t length, char **e_data, char **e_code, uint32_t *e_data_size, uint32_t *e_code_size, int opt_level, string_builder_t *output_builder)
+{
+	return compile(text, length, e_data, e_code, e_data_size, e_code_size, opt_level, 0, 0, output_builder, generate);
+}
+
+int nj_compile_register(const char *text, size_t length, char **e_data, char **e_code, uint32_t *e_data_size, uint32_t *e_code_size, int opt_level, string_builder_t *output_builder)
+{
+	return compile(text, length, e_data, e_code, e_data_size, e_code_size, opt_level, 0, 0, output_builder, generate_register);
+}
+
+int nj_compile_with_imports(const char *text, size_t length, int is_register, char **e_data, char **e_code, uint32_t *e_data_size, uint32_t *e_code_size, int opt_level, char ***e_imports, uint32_t *e_import_count, string_builder_t *output_builder)
+{
+	return compile(text, length, e_data, e_code, e_data_size, e_code_size, opt_level, e_imports, e_import_count, output_builder, is_register ? generate_register : generate);
+}
+
+int nj_scan_imports(const char *text, size_t length, int opt_level, char ***e_imports, uint32_t *e_import_count, string_builder_t *output_builder)
+{
+	return compile(text, length, 0, 0, 0, 0, opt_level, e_imports, e_import_count, output_builder, 0);
+}
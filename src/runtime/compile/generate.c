@@ -5,145 +5,22 @@
 #include <string.h>
 #include <assert.h>
 #include "ast.h"
+#include "builder.h"
 #include "../bytecode.h"
 
-#define BYTES_PER_CODE_CHUNK 1024
-#define BYTES_PER_DATA_CHUNK 1024
-
-typedef struct block_t block_t;
-typedef struct program_builder_t program_builder_t;
-
-typedef struct data_chunk_t data_chunk_t;
-struct data_chunk_t {
-	data_chunk_t *next;
-	uint32_t used;
-	char body[BYTES_PER_DATA_CHUNK];
-};
-
-typedef struct chunk_t chunk_t;
-
-struct chunk_t {
-	chunk_t *next;
-	uint32_t used;
-	char body[BYTES_PER_CODE_CHUNK];
-};
-
-typedef struct gap_t gap_t;
-struct gap_t {
-
-	gap_t *prev;
-
-	chunk_t *chunk;  		  //
-	uint32_t offset_in_chunk; // The pointer to the gap
-};
-
-typedef struct label_t label_t;
-struct label_t {
-	
-	label_t *prev;
-
-	block_t *block;  		  // 
-	uint32_t offset_in_block; // The pointer value to fill the gaps with
-
-	gap_t *tail_gap;
-
-};
-
-struct block_t {
-
-	program_builder_t *builder;
-	block_t *next;
-
-	uint32_t offset;
-	uint32_t length;
-
-	chunk_t head, *tail;
-
-};
-
-struct program_builder_t {
-
-	label_t *tail_label;
-
-	block_t *head_block,
-			*tail_block;
-
-	data_chunk_t *head_data_chunk,
-				 *tail_data_chunk;
-	uint32_t data_length;
-
-	jmp_buf env;
-
-};
-
-enum {
-	END = 0,
-	U8 , S8 ,
-	U16, S16,
-	U32, S32,
-	U64, S64, 
-	F32,
-	F64,
-	STR,
-	LBL,
-};
-
-block_t *block_create(program_builder_t *builder);
-int 	 block_append(block_t *block, ...);
-label_t *label_create(block_t *block);
-void 	 label_points_here(block_t *block, label_t *label);
-
 static void throw(program_builder_t *builder)
 {
 	longjmp(builder->env, 1);
 }
 
-label_t *label_create(block_t *block)
-{
-	label_t *label = malloc(sizeof(label_t));
-
-	assert(label);
-
-	label->block = 0;
-	label->offset_in_block = 0;
-	label->tail_gap = 0;
-
-	// Add to the label list of the builder
-
-	label->prev = block->builder->tail_label;
-	block->builder->tail_label = label;
-
-	return label;
-}
-
-void release_resources_on_abort(program_builder_t *builder)
-{
-
-}
-
 static void node_compile(block_t *block, label_t *break_destination, label_t *continue_destination, node_t *node);
 
 int generate(ast_t ast, char **e_data, char **e_code, uint32_t *e_data_size, uint32_t *e_code_size)
 {
-
-	//
-	// Setup stuff
-	//
-
 	program_builder_t builder;
-	memset(&builder, 0, sizeof(program_builder_t));
-
-	{
-		builder.head_data_chunk = malloc(sizeof(data_chunk_t));
 
-		if(builder.head_data_chunk == 0)
-			return 0;
-
-		builder.head_data_chunk->used = 0;
-		builder.head_data_chunk->next = NULL;
-
-		builder.tail_data_chunk = builder.head_data_chunk;
-	}
+	if(!builder_init(&builder))
+		return 0;
 
 	if(setjmp(builder.env)) {
 
@@ -151,10 +28,6 @@ int generate(ast_t ast, char **e_data, char **e_code, uint32_t *e_data_size, uin
 		return 0;
 	}
 
-	//
-	// Do the thing
-	//
-
 	{
 		block_t *first_block = block_create(&builder);
 
@@ -162,351 +35,7 @@ int generate(ast_t ast, char **e_data, char **e_code, uint32_t *e_data_size, uin
 		block_append(first_block, U32, OPCODE_QUIT, END);
 	}
 
-	//
-	// Serialize the code
-	//
-
-	uint32_t length = 0; // The lengths of the code. To be calculated!
-
-	// Assigns offsets to the blocks and
-	// calculate the size of the whole
-	// sode segment.
-	{
-		block_t *block = builder.head_block;
-
-		while(block) {
-
-			block->offset = length;
-			length += block->length;
-
-			block = block->next;
-		}
-	}
-
-	// Resolve the gaps associated to each label and while 
-	// doing it free all of the label and gap structures
-
-	{
-		label_t *label = builder.tail_label;
-
-		while(label) {
-
-			// Resolve the gaps associated to this label
-
-			gap_t *gap = label->tail_gap;
-
-			while(gap) {
-
-
-				// Fill the gap
-
-				*(uint32_t*) (gap->chunk->body + gap->offset_in_chunk) = (uint32_t) (label->block->offset + label->offset_in_block);
-
-				// Free the gap and go to the next one
-
-				{
-					gap_t *prev_gap = gap->prev;
-					free(gap);
-					gap = prev_gap;
-				}
-			}
-
-			// Free the label and go to the next one
-
-			{
-				label_t *prev_label = label->prev;
-				free(label);
-				label = prev_label;
-			}
-		}
-	}
-
-	char *code = malloc(length);
-
-	assert(code);
-
-	// Write to the allocated space
-
-	{
-		uint32_t written = 0;
-
-		block_t *block = builder.head_block;
-
-		while(block) {
-
-			chunk_t *chunk = &block->head;
-
-			{
-				memcpy(code + written, chunk->body, chunk->used);
-
-				written += chunk->used;
-			}
-
-			chunk = chunk->next;
-
-			while(chunk) {
-
-				// Write the content
-
-				memcpy(code + written, chunk->body, chunk->used);
-
-				written += chunk->used;
-
-				// Free the chunk and go to the next one
-
-				{
-					chunk_t *next_chunk = chunk->next;
-					free(chunk);
-					chunk = next_chunk;
-				}
-			}
-
-			// Free the block and go to the next one
-
-			{
-				block_t *next_block = block->next;
-				free(block);
-				block = next_block;
-			}
-		}
-	}
-
-	//
-	// Serialize the data
-	//
-
-	char *data = malloc(builder.data_length);
-
-	assert(data);
-
-	{
-		uint32_t written = 0;
-
-		data_chunk_t *chunk = builder.head_data_chunk;
-
-		while(chunk) {
-
-			memcpy(data + written, chunk->body, chunk->used);
-
-			written += chunk->used;
-
-			// Free the chunk and go to the next one
-
-			{
-				data_chunk_t *next_chunk = chunk->next;
-				free(chunk);
-				chunk = next_chunk;
-			}
-		}
-	}
-
-	// Done!
-
-	*e_data = data;
-	*e_code = code;
-	*e_data_size = builder.data_length;
-	*e_code_size = length;
-
-	return 1;
-}
-
-void label_points_here(block_t *block, label_t *label)
-{
-	label->block = block;
-	label->offset_in_block = block->length;
-}
-
-block_t *block_create(program_builder_t *builder)
-{
-	block_t *block = malloc(sizeof(block_t));
-
-	assert(block);
-
-	block->builder = builder;
-	block->next = 0;
-
-	block->offset = 0;
-	block->length = 0;
-
-	block->head.next = NULL;
-	block->head.used = 0;
-
-	block->tail = &block->head;
-
-	// Append block to builder
-
-	if(!builder->head_block) {
-
-		builder->head_block = block;
-
-	} else {
-
-		builder->tail_block->next = block;
-	}
-
-	builder->tail_block = block;
-
-	return block;
-}
-
-block_t *sub_block_create(block_t *parent_block)
-{
-	return block_create(parent_block->builder);
-}
-
-static int block_ensure_space(block_t *block, uint32_t required_space)
-{
-	if(BYTES_PER_CODE_CHUNK - block->tail->used < required_space) {
-
-		// resize
-		chunk_t *chunk = malloc(sizeof(chunk_t));
-
-		if(chunk == 0)
-			return 0;
-
-		chunk->next = 0;
-		chunk->used = 0;
-		block->tail->next = chunk;
-		block->tail = chunk;
-	}
-
-	return 1;
-}
-
-#define DEF_APPENDER(suffix, T) 							\
-static int block_append_ ## suffix (block_t *block, T v) 	\
-{															\
-	if(!block_ensure_space(block, sizeof(T))) 					\
-		return 0;											\
-															\
-	*(T*) (block->tail->body + block->tail->used) = v;		\
-															\
-	block->tail->used += sizeof(T);							\
-	block->length += sizeof(T);								\
-	return 1;												\
-}
-
-DEF_APPENDER(u8 , uint8_t);
-DEF_APPENDER(u16, uint16_t);
-DEF_APPENDER(u32, uint32_t);
-DEF_APPENDER(u64, uint64_t);
-DEF_APPENDER(s8 , int8_t);
-DEF_APPENDER(s16, int16_t);
-DEF_APPENDER(s32, int32_t);
-DEF_APPENDER(s64, int64_t);
-DEF_APPENDER(f32, float);
-DEF_APPENDER(f64, double);
-
-#undef DEF_APPENDER
-
-static int block_append_string(block_t *block, const char *string)
-{
-	if(!block_append_u32(block, block->builder->data_length))
-		return 0;
-
-	do { 
-
-		if(block->builder->tail_data_chunk->used == BYTES_PER_DATA_CHUNK) {
-
-			data_chunk_t *chunk = malloc(sizeof(data_chunk_t));
-
-			if(chunk == 0)
-				return 0;
-
-			chunk->used = 0;
-			chunk->next = NULL;
-
-			block->builder->tail_data_chunk->next = chunk;
-			block->builder->tail_data_chunk = chunk;
-		}
-
-		block->builder->tail_data_chunk->body[block->builder->tail_data_chunk->used++] = *string;
-		block->builder->data_length++;
-		
-		if(*string == '\0')
-			break;
-		
-		string++;
-
-	} while(1);
-
-	return 1;
-}
-
-int block_append(block_t *block, ...)
-{
-	va_list args;
-	va_start(args, block);
-
-	int done = 0;
-
-	while(!done) {
-
-		int type = va_arg(args, int);
-
-		switch(type) {
-
-			case U8 : if(!block_append_u8 (block, va_arg(args, int)))  return 0; break;
-			case U16: if(!block_append_u16(block, va_arg(args, int))) return 0; break;
-			case U32: if(!block_append_u32(block, va_arg(args, uint32_t))) return 0; break;
-			case U64: if(!block_append_u64(block, va_arg(args, uint64_t))) return 0; break;
-
-			case S8 : if(!block_append_s8 (block, va_arg(args, int)))  return 0; break;
-			case S16: if(!block_append_s16(block, va_arg(args, int))) return 0; break;
-			case S32: if(!block_append_s32(block, va_arg(args, int))) return 0; break;
-			case S64: if(!block_append_s64(block, va_arg(args, int64_t))) return 0; break;
-
-			case F32: if(!block_append_f32(block, va_arg(args, double)))  return 0; break;
-			case F64: if(!block_append_f64(block, va_arg(args, double))) return 0; break;
-
-			case STR: if(!block_append_string(block, va_arg(args, char*))) return 0; break;
-
-			case LBL:
-			{
-				chunk_t *chunk;
-				uint32_t offset_in_chunk;
-
-				if(!block_ensure_space(block, sizeof(uint32_t))) // This is to make sure that the
-					return 0;									 // current chunk is the one the
-																 // next u32 will be written to.
-																 
-				chunk = block->tail;				 // These two represent the location where
-				offset_in_chunk = block->tail->used; // the value is missing.
-
-				label_t *label = va_arg(args, label_t*);
-
-				gap_t *gap = malloc(sizeof(gap_t));
-
-				if(gap == NULL)
-					return 0;
-
-				if(!block_append_u32(block, 0)) {
-
-					free(gap);
-					return 0;
-				}
-
-				gap->chunk = chunk;
-				gap->offset_in_chunk = offset_in_chunk;
-
-				gap->prev = label->tail_gap;
-				label->tail_gap = gap;
-				break;
-			}
-
-			case END: 
-			done = 1; 
-			break;
-			
-			default: 
-			assert(0);
-			break;
-		}
-
-	}
-
-	va_end(args);
-	return 1;
+	return builder_serialize(&builder, e_data, e_code, e_data_size, e_code_size);
 }
 
 static void node_compile(block_t *block, label_t *break_destination, label_t *continue_destination, node_t *node)
@@ -544,7 +73,7 @@ static void node_compile(block_t *block, label_t *break_destination, label_t *co
 			node_compile(block, break_destination, continue_destination, x->expression);
 			
 			block_append(block, 
-				U32, OPCODE_VARIABLE_MAP_POP, 
+				U32, block->scope ? OPCODE_LOCALS_POP : OPCODE_VARIABLE_MAP_POP, 
 				U32, OPCODE_RETURN,
 				END);
 			break;
@@ -564,7 +93,7 @@ static void node_compile(block_t *block, label_t *break_destination, label_t *co
 
 				block_append(block, 
 				U32, OPCODE_IMPORT_AS, 
-				STR, x->name,
+				SYM, x->name,
 				END);
 
 			} else {
@@ -773,6 +302,16 @@ static void node_compile(block_t *block, label_t *break_destination, label_t *co
 
 					label_points_here(sub_block, func_body_start);
 
+					scope_t scope;
+
+					int resolved = scope_resolve(&scope, x);
+
+					assert(resolved);
+					(void) resolved;
+
+					if(!scope.uses_map)
+						sub_block->scope = &scope;
+
 					{
 
 						node_t *argument = x->argument_head;
@@ -790,19 +329,39 @@ static void node_compile(block_t *block, label_t *break_destination, label_t *co
 							}
 						}
 
-						block_append(sub_block, U32, OPCODE_EXPECT, 
-												S64, x->argument_count, 
-												U32, OPCODE_VARIABLE_MAP_PUSH, END);
+						if(sub_block->scope) {
+
+							block_append(sub_block, U32, OPCODE_EXPECT, 
+													S64, x->argument_count, 
+													U32, OPCODE_LOCALS_PUSH,
+													U32, scope.count, END);
+
+							// Iterate it backwards
+
+							for(int j = i-1; j >= 0; j--) {
+
+								block_append(sub_block, U32, OPCODE_STORE_LOCAL, 
+														U32, scope_find(&scope, names[j]), 
+														U32, OPCODE_POP, 
+														S64, 1, END);
+							}
+
+						} else {
 
-						// Iterate it backwards
+							block_append(sub_block, U32, OPCODE_EXPECT, 
+													S64, x->argument_count, 
+													U32, OPCODE_VARIABLE_MAP_PUSH, END);
 
-						for(int j = i-1; j >= 0; j--) {
+							// Iterate it backwards
 
-							block_append(sub_block, U32, OPCODE_ASSIGN, 
-													STR, names[j], 
-													U32, OPCODE_POP, 
-													S64, 1, END);
+							for(int j = i-1; j >= 0; j--) {
 
+								block_append(sub_block, U32, OPCODE_ASSIGN, 
+														SYM, names[j], 
+														U32, OPCODE_POP, 
+														S64, 1, END);
+
+							}
 						}
 	
 						block_append(sub_block, U32, OPCODE_POP,
@@ -814,9 +373,12 @@ static void node_compile(block_t *block, label_t *break_destination, label_t *co
 					if(x->body->kind == NODE_KIND_EXPRESSION)
 						block_append(sub_block, U32, OPCODE_POP, S64, 1, END);
 
-					block_append(sub_block, U32, OPCODE_VARIABLE_MAP_POP,
+					block_append(sub_block, U32, sub_block->scope ? OPCODE_LOCALS_POP : OPCODE_VARIABLE_MAP_POP,
 											U32, OPCODE_PUSH_NULL,
 											U32, OPCODE_RETURN, END);
+
+					sub_block->scope = 0;
+					scope_free(&scope);
 					break;
 				}
 
@@ -847,7 +409,7 @@ static void node_compile(block_t *block, label_t *break_destination, label_t *co
 					node_compile(block, break_destination, continue_destination, (node_t*) l);
 
 					block_append(block, U32, OPCODE_SELECT_ATTRIBUTE, 
-										STR, ((node_expr_identifier_t*) r)->content, END);
+										SYM, ((node_expr_identifier_t*) r)->content, END);
 					break;	
 				}
 
@@ -871,7 +433,7 @@ static void node_compile(block_t *block, label_t *break_destination, label_t *co
 						node_compile(block, break_destination, continue_destination, container);
 
 						block_append(block, U32, OPCODE_SELECT_ATTRIBUTE_AND_REPUSH, 
-											STR, ((node_expr_identifier_t*) identifier)->content, END);
+											SYM, ((node_expr_identifier_t*) identifier)->content, END);
 
 						argc++;
 
@@ -890,8 +452,23 @@ static void node_compile(block_t *block, label_t *break_destination, label_t *co
 				}
 
 				case EXPRESSION_KIND_IDENTIFIER:
-				block_append(block, U32, OPCODE_PUSH_VARIABLE, STR, ((node_expr_identifier_t*) node)->content, END);
-				break;
+				{
+					char *name = ((node_expr_identifier_t*) node)->content;
+
+					if(block->scope == 0) {
+
+						block_append(block, U32, OPCODE_PUSH_VARIABLE, SYM, name, END);
+						break;
+					}
+
+					int slot = scope_find(block->scope, name);
+
+					if(slot < 0)
+						block_append(block, U32, OPCODE_PUSH_GLOBAL, SYM, name, END);
+					else
+						block_append(block, U32, OPCODE_LOAD_LOCAL, U32, slot, END);
+					break;
+				}
 
 				case EXPRESSION_KIND_NOT:
 				node_compile(block, break_destination, continue_destination, ((node_expr_operation_t*) node)->operand_head);
@@ -1046,7 +623,12 @@ static void node_compile(block_t *block, label_t *break_destination, label_t *co
 						{
 							node_compile(block, break_destination, continue_destination, (node_t*) r);
 
-							block_append(block, U32, OPCODE_ASSIGN, STR, ((node_expr_identifier_t*) l)->content, END);
+							char *name = ((node_expr_identifier_t*) l)->content;
+
+							if(block->scope)
+								block_append(block, U32, OPCODE_STORE_LOCAL, U32, scope_find(block->scope, name), END);
+							else
+								block_append(block, U32, OPCODE_ASSIGN, SYM, name, END);
 							break;
 						}
 
@@ -1077,7 +659,7 @@ static void node_compile(block_t *block, label_t *break_destination, label_t *co
 							node_compile(block, break_destination, continue_destination, value);
 
 							block_append(block, U32, OPCODE_INSERT_ATTRIBUTE, 
-												STR, ((node_expr_identifier_t*) attribute_name)->content, END);
+												SYM, ((node_expr_identifier_t*) attribute_name)->content, END);
 							break;
 						}
 					}
@@ -0,0 +1,711 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <string.h>
+#include <assert.h>
+#include "ast.h"
+#include "builder.h"
+#include "../bytecode.h"
+
+//
+// Generates the register-based bytecode (see bytecode.h)
+// from the same AST as generate.c.
+//
+// Every frame has a fixed number of registers. In functions
+// that don't need a variable map, the locals resolved by
+// scope.c live in the first registers, so reading a local
+// costs nothing and assigning to it is done by computing
+// the value directly in its register. Temporaries are
+// allocated above the locals like a stack: each expression
+// releases the ones it used once its value is computed.
+//
+// An expression writes its destination register only with
+// its last instruction, so the destination may be one of
+// the registers it reads.
+//
+
+#define DISCARD UINT32_MAX
+
+typedef struct {
+
+	block_t *block;
+
+	// The locals of the function, or NULL if
+	// variables are resolved by name.
+
+	scope_t *scope;
+
+	uint32_t temps; // First free register
+	uint32_t count; // Registers used by the frame
+
+	label_t *break_destination;
+	label_t *continue_destination;
+
+} frame_t;
+
+static void stmt_compile(frame_t *frame, node_t *node);
+static void expr_compile(frame_t *frame, node_t *node, uint32_t dest);
+
+int generate_register(ast_t ast, char **e_data, char **e_code, uint32_t *e_data_size, uint32_t *e_code_size)
+{
+	program_builder_t builder;
+
+	if(!builder_init(&builder))
+		return 0;
+
+	if(setjmp(builder.env)) {
+
+		release_resources_on_abort(&builder);
+		return 0;
+	}
+
+	{
+		frame_t frame = {
+			.block = block_create(&builder),
+			.scope = 0,
+			.temps = 0,
+			.count = 0,
+			.break_destination = 0,
+			.continue_destination = 0,
+		};
+
+		block_append(frame.block, U32, ROPCODE_ENTER, U32, 0, U32, 0, END);
+
+		stmt_compile(&frame, ast.root);
+
+		block_append(frame.block, U32, ROPCODE_QUIT, END);
+
+		// The register count of ENTER is only known now
+
+		*(uint32_t*) (frame.block->head.body + sizeof(uint32_t)) = frame.count;
+	}
+
+	return builder_serialize(&builder, e_data, e_code, e_data_size, e_code_size);
+}
+
+static uint32_t temp_alloc(frame_t *frame, uint32_t count)
+{
+	uint32_t first = frame->temps;
+
+	frame->temps += count;
+
+	if(frame->temps > frame->count)
+		frame->count = frame->temps;
+
+	return first;
+}
+
+static int local_find(frame_t *frame, node_t *node)
+{
+	if(frame->scope == 0 || node->kind != NODE_KIND_EXPRESSION)
+		return -1;
+
+	if(((node_expr_t*) node)->kind != EXPRESSION_KIND_IDENTIFIER)
+		return -1;
+
+	return scope_find(frame->scope, ((node_expr_identifier_t*) node)->content);
+}
+
+//
+// Tells whether evaluating [node] may assign a variable.
+// Nested functions are skipped since their body isn't
+// evaluated.
+//
+static int may_assign(node_t *node)
+{
+	if(node == 0 || node->kind != NODE_KIND_EXPRESSION)
+		return 0;
+
+	switch(((node_expr_t*) node)->kind) {
+
+		case EXPRESSION_KIND_NULL:
+		case EXPRESSION_KIND_TRUE:
+		case EXPRESSION_KIND_FALSE:
+		case EXPRESSION_KIND_INT:
+		case EXPRESSION_KIND_FLOAT:
+		case EXPRESSION_KIND_STRING:
+		case EXPRESSION_KIND_IDENTIFIER:
+		case EXPRESSION_KIND_FUNCTION:
+		return 0;
+
+		case EXPRESSION_KIND_ASSIGN:
+		return 1;
+
+		case EXPRESSION_KIND_ARRAY:
+		{
+			node_t *item = ((node_expr_array_t*) node)->item_head;
+
+			while(item) {
+
+				if(may_assign(item))
+					return 1;
+
+				item = item->next;
+			}
+
+			return 0;
+		}
+
+		case EXPRESSION_KIND_DICT:
+		{
+			node_t *item = ((node_expr_dict_t*) node)->item_head;
+
+			while(item) {
+
+				node_dict_item_t *x = (node_dict_item_t*) item;
+
+				if(may_assign(x->key) || may_assign(x->value))
+					return 1;
+
+				item = item->next;
+			}
+
+			return 0;
+		}
+
+		default:
+		{
+			node_t *operand = ((node_expr_operation_t*) node)->operand_head;
+
+			while(operand) {
+
+				if(may_assign(operand))
+					return 1;
+
+				operand = operand->next;
+			}
+
+			return 0;
+		}
+	}
+}
+
+//
+// Returns a register holding the value of [node]. Locals
+// are used in place unless the operands evaluated after
+// this one may assign them before they're read, in which
+// case [copy] is set.
+//
+static uint32_t operand_compile(frame_t *frame, node_t *node, int copy)
+{
+	int slot = local_find(frame, node);
+
+	if(slot >= 0 && !copy)
+		return slot;
+
+	uint32_t reg = temp_alloc(frame, 1);
+
+	expr_compile(frame, node, reg);
+	return reg;
+}
+
+static void unary_compile(frame_t *frame, node_t *node, uint32_t dest, uint32_t opcode)
+{
+	node_expr_operation_t *x = (node_expr_operation_t*) node;
+
+	uint32_t operand = operand_compile(frame, x->operand_head, 0);
+
+	block_append(frame->block, U32, opcode, U32, dest, U32, operand, END);
+}
+
+static void binary_compile(frame_t *frame, node_t *node, uint32_t dest, uint32_t opcode)
+{
+	node_expr_operation_t *x = (node_expr_operation_t*) node;
+
+	uint32_t left  = operand_compile(frame, x->operand_head, may_assign(x->operand_tail));
+	uint32_t right = operand_compile(frame, x->operand_tail, 0);
+
+	block_append(frame->block, U32, opcode, U32, dest, U32, left, U32, right, END);
+}
+
+static void function_compile(frame_t *frame, node_expr_function_t *func, uint32_t dest)
+{
+	label_t *func_body_start = label_create(frame->block);
+
+	block_append(frame->block, U32, ROPCODE_LOAD_FUNCTION, U32, dest, LBL, func_body_start, END);
+
+	block_t *sub_block = sub_block_create(frame->block);
+
+	label_points_here(sub_block, func_body_start);
+
+	scope_t scope;
+
+	int resolved = scope_resolve(&scope, func);
+
+	assert(resolved);
+	(void) resolved;
+
+	// The arguments are in the first registers either
+	// way. Functions that use a variable map move them
+	// into it.
+
+	uint32_t first_temp = scope.uses_map ? (uint32_t) func->argument_count : (uint32_t) scope.count;
+
+	frame_t sub_frame = {
+		.block = sub_block,
+		.scope = scope.uses_map ? 0 : &scope,
+		.temps = first_temp,
+		.count = first_temp,
+		.break_destination = 0,
+		.continue_destination = 0,
+	};
+
+	block_append(sub_block, U32, ROPCODE_ENTER, U32, 0, U32, func->argument_count, END);
+
+	if(scope.uses_map) {
+
+		block_append(sub_block, U32, ROPCODE_VARIABLE_MAP_PUSH, END);
+
+		node_t *argument = func->argument_head;
+
+		for(uint32_t i = 0; argument; i++) {
+
+			block_append(sub_block, U32, ROPCODE_STORE_VARIABLE, SYM, ((node_argument_t*) argument)->name, U32, i, END);
+			argument = argument->next;
+		}
+	}
+
+	stmt_compile(&sub_frame, func->body);
+
+	uint32_t result = temp_alloc(&sub_frame, 1);
+
+	block_append(sub_block, U32, ROPCODE_LOAD_NULL, U32, result, END);
+
+	if(scope.uses_map)
+		block_append(sub_block, U32, ROPCODE_VARIABLE_MAP_POP, END);
+
+	block_append(sub_block, U32, ROPCODE_RETURN, U32, result, END);
+
+	*(uint32_t*) (sub_block->head.body + sizeof(uint32_t)) = sub_frame.count;
+
+	scope_free(&scope);
+}
+
+static void call_compile(frame_t *frame, node_expr_operation_t *x, uint32_t dest)
+{
+	node_t *called = x->operand_head;
+	node_t *arg    = called->next;
+
+	// Method calls pass the container as first argument
+
+	int is_method = ((node_expr_t*) called)->kind == EXPRESSION_KIND_DOT_SELECTION;
+
+	uint32_t argc  = x->operand_count + is_method;
+	uint32_t first = temp_alloc(frame, argc + 1);
+
+	if(is_method) {
+
+		node_expr_operation_t *selection = (node_expr_operation_t*) called;
+
+		expr_compile(frame, selection->operand_head, first + 1);
+
+		block_append(frame->block, U32, ROPCODE_SELECT_ATTRIBUTE,
+								   U32, first,
+								   U32, first + 1,
+								   SYM, ((node_expr_identifier_t*) selection->operand_tail)->content, END);
+	} else {
+
+		expr_compile(frame, called, first);
+	}
+
+	for(uint32_t i = 1 + is_method; arg; i++) {
+
+		expr_compile(frame, arg, first + i);
+		arg = arg->next;
+	}
+
+	if(dest == DISCARD)
+		dest = first;
+
+	block_append(frame->block, U32, ROPCODE_CALL, U32, dest, U32, first, U32, argc, END);
+}
+
+static void assign_compile(frame_t *frame, node_expr_operation_t *x, uint32_t dest)
+{
+	node_expr_t *l = (node_expr_t*) x->operand_head;
+	node_t      *r = x->operand_tail;
+
+	switch(l->kind) {
+
+		case EXPRESSION_KIND_IDENTIFIER:
+		{
+			char *name = ((node_expr_identifier_t*) l)->content;
+
+			if(frame->scope) {
+
+				uint32_t slot = scope_find(frame->scope, name);
+
+				expr_compile(frame, r, slot);
+
+				if(dest != DISCARD && dest != slot)
+					block_append(frame->block, U32, ROPCODE_MOVE, U32, dest, U32, slot, END);
+
+			} else {
+
+				if(dest == DISCARD)
+					dest = temp_alloc(frame, 1);
+
+				expr_compile(frame, r, dest);
+
+				block_append(frame->block, U32, ROPCODE_STORE_VARIABLE, SYM, name, U32, dest, END);
+			}
+			break;
+		}
+
+		case EXPRESSION_KIND_INDEX_SELECTION:
+		{
+			node_expr_operation_t *selection = (node_expr_operation_t*) l;
+
+			uint32_t container = operand_compile(frame, selection->operand_head, may_assign(selection->operand_tail) || may_assign(r));
+			uint32_t index     = operand_compile(frame, selection->operand_tail, may_assign(r));
+			uint32_t value     = operand_compile(frame, r, 0);
+
+			block_append(frame->block, U32, ROPCODE_INSERT, U32, container, U32, index, U32, value, END);
+
+			if(dest != DISCARD && dest != value)
+				block_append(frame->block, U32, ROPCODE_MOVE, U32, dest, U32, value, END);
+			break;
+		}
+
+		case EXPRESSION_KIND_DOT_SELECTION:
+		{
+			node_expr_operation_t *selection = (node_expr_operation_t*) l;
+
+			uint32_t container = operand_compile(frame, selection->operand_head, may_assign(r));
+			uint32_t value     = operand_compile(frame, r, 0);
+
+			block_append(frame->block, U32, ROPCODE_INSERT_ATTRIBUTE,
+									   U32, container,
+									   SYM, ((node_expr_identifier_t*) selection->operand_tail)->content,
+									   U32, value, END);
+
+			if(dest != DISCARD && dest != value)
+				block_append(frame->block, U32, ROPCODE_MOVE, U32, dest, U32, value, END);
+			break;
+		}
+	}
+}
+
+static void expr_compile(frame_t *frame, node_t *node, uint32_t dest)
+{
+	assert(node && node->kind == NODE_KIND_EXPRESSION);
+
+	node_expr_t *x = (node_expr_t*) node;
+
+	uint32_t saved_temps = frame->temps;
+
+	// Only assignments and calls can have
+	// their value thrown away for free
+
+	if(dest == DISCARD && x->kind != EXPRESSION_KIND_ASSIGN && x->kind != EXPRESSION_KIND_CALL)
+		dest = temp_alloc(frame, 1);
+
+	switch(x->kind) {
+
+		case EXPRESSION_KIND_NULL:
+		block_append(frame->block, U32, ROPCODE_LOAD_NULL, U32, dest, END);
+		break;
+
+		case EXPRESSION_KIND_TRUE:
+		block_append(frame->block, U32, ROPCODE_LOAD_TRUE, U32, dest, END);
+		break;
+
+		case EXPRESSION_KIND_FALSE:
+		block_append(frame->block, U32, ROPCODE_LOAD_FALSE, U32, dest, END);
+		break;
+
+		case EXPRESSION_KIND_INT:
+		block_append(frame->block, U32, ROPCODE_LOAD_INT, U32, dest, S64, ((node_expr_int_t*) node)->value, END);
+		break;
+
+		case EXPRESSION_KIND_FLOAT:
+		block_append(frame->block, U32, ROPCODE_LOAD_FLOAT, U32, dest, F64, ((node_expr_float_t*) node)->value, END);
+		break;
+
+		case EXPRESSION_KIND_STRING:
+		block_append(frame->block, U32, ROPCODE_LOAD_STRING, U32, dest, STR, ((node_expr_string_t*) node)->content, END);
+		break;
+
+		case EXPRESSION_KIND_ARRAY:
+		{
+			node_expr_array_t *array = (node_expr_array_t*) node;
+
+			uint32_t first = temp_alloc(frame, array->item_count);
+
+			node_t *item = array->item_head;
+
+			for(uint32_t i = 0; item; i++) {
+
+				expr_compile(frame, item, first + i);
+				item = item->next;
+			}
+
+			block_append(frame->block, U32, ROPCODE_BUILD_ARRAY, U32, dest, U32, first, U32, array->item_count, END);
+			break;
+		}
+
+		case EXPRESSION_KIND_DICT:
+		{
+			node_expr_dict_t *dict = (node_expr_dict_t*) node;
+
+			uint32_t first = temp_alloc(frame, 2 * dict->item_count);
+
+			node_t *item = dict->item_head;
+
+			for(uint32_t i = 0; item; i++) {
+
+				node_dict_item_t *pair = (node_dict_item_t*) item;
+
+				expr_compile(frame, pair->key, first + 2 * i);
+				expr_compile(frame, pair->value, first + 2 * i + 1);
+
+				item = item->next;
+			}
+
+			block_append(frame->block, U32, ROPCODE_BUILD_DICT, U32, dest, U32, first, U32, dict->item_count, END);
+			break;
+		}
+
+		case EXPRESSION_KIND_FUNCTION:
+		function_compile(frame, (node_expr_function_t*) node, dest);
+		break;
+
+		case EXPRESSION_KIND_IDENTIFIER:
+		{
+			char *name = ((node_expr_identifier_t*) node)->content;
+
+			int slot = local_find(frame, node);
+
+			if(slot >= 0) {
+
+				if((uint32_t) slot != dest)
+					block_append(frame->block, U32, ROPCODE_MOVE, U32, dest, U32, slot, END);
+
+			} else if(frame->scope) {
+
+				block_append(frame->block, U32, ROPCODE_LOAD_GLOBAL, U32, dest, SYM, name, END);
+
+			} else {
+
+				block_append(frame->block, U32, ROPCODE_LOAD_VARIABLE, U32, dest, SYM, name, END);
+			}
+			break;
+		}
+
+		case EXPRESSION_KIND_INDEX_SELECTION:
+		binary_compile(frame, node, dest, ROPCODE_SELECT);
+		break;
+
+		case EXPRESSION_KIND_DOT_SELECTION:
+		{
+			node_expr_operation_t *selection = (node_expr_operation_t*) node;
+
+			uint32_t container = operand_compile(frame, selection->operand_head, 0);
+
+			block_append(frame->block, U32, ROPCODE_SELECT_ATTRIBUTE,
+									   U32, dest,
+									   U32, container,
+									   SYM, ((node_expr_identifier_t*) selection->operand_tail)->content, END);
+			break;
+		}
+
+		case EXPRESSION_KIND_CALL:
+		call_compile(frame, (node_expr_operation_t*) node, dest);
+		break;
+
+		case EXPRESSION_KIND_ASSIGN:
+		assign_compile(frame, (node_expr_operation_t*) node, dest);
+		break;
+
+		case EXPRESSION_KIND_NOT:         unary_compile(frame, node, dest, ROPCODE_NOT); break;
+		case EXPRESSION_KIND_NEG:         unary_compile(frame, node, dest, ROPCODE_NEG); break;
+		case EXPRESSION_KIND_BITWISE_NOT: unary_compile(frame, node, dest, ROPCODE_BITWISE_NOT); break;
+
+		case EXPRESSION_KIND_ADD: binary_compile(frame, node, dest, ROPCODE_ADD); break;
+		case EXPRESSION_KIND_SUB: binary_compile(frame, node, dest, ROPCODE_SUB); break;
+		case EXPRESSION_KIND_MUL: binary_compile(frame, node, dest, ROPCODE_MUL); break;
+		case EXPRESSION_KIND_DIV: binary_compile(frame, node, dest, ROPCODE_DIV); break;
+		case EXPRESSION_KIND_MOD: binary_compile(frame, node, dest, ROPCODE_MOD); break;
+		case EXPRESSION_KIND_POW: binary_compile(frame, node, dest, ROPCODE_POW); break;
+		case EXPRESSION_KIND_LSS: binary_compile(frame, node, dest, ROPCODE_LSS); break;
+		case EXPRESSION_KIND_GRT: binary_compile(frame, node, dest, ROPCODE_GRT); break;
+		case EXPRESSION_KIND_LEQ: binary_compile(frame, node, dest, ROPCODE_LEQ); break;
+		case EXPRESSION_KIND_GEQ: binary_compile(frame, node, dest, ROPCODE_GEQ); break;
+		case EXPRESSION_KIND_EQL: binary_compile(frame, node, dest, ROPCODE_EQL); break;
+		case EXPRESSION_KIND_NQL: binary_compile(frame, node, dest, ROPCODE_NQL); break;
+		case EXPRESSION_KIND_AND: binary_compile(frame, node, dest, ROPCODE_AND); break;
+		case EXPRESSION_KIND_OR:  binary_compile(frame, node, dest, ROPCODE_OR); break;
+		case EXPRESSION_KIND_SHL: binary_compile(frame, node, dest, ROPCODE_SHL); break;
+		case EXPRESSION_KIND_SHR: binary_compile(frame, node, dest, ROPCODE_SHR); break;
+
+		case EXPRESSION_KIND_BITWISE_AND: binary_compile(frame, node, dest, ROPCODE_BITWISE_AND); break;
+		case EXPRESSION_KIND_BITWISE_OR:  binary_compile(frame, node, dest, ROPCODE_BITWISE_OR); break;
+		case EXPRESSION_KIND_BITWISE_XOR: binary_compile(frame, node, dest, ROPCODE_BITWISE_XOR); break;
+
+		// Not supported by the stack backend either
+
+		case EXPRESSION_KIND_PRE_INC:
+		case EXPRESSION_KIND_PRE_DEC:
+		case EXPRESSION_KIND_POST_INC:
+		case EXPRESSION_KIND_POST_DEC:
+		case EXPRESSION_KIND_ASSIGN_ADD:
+		case EXPRESSION_KIND_ASSIGN_SUB:
+		case EXPRESSION_KIND_ASSIGN_MUL:
+		case EXPRESSION_KIND_ASSIGN_DIV:
+		case EXPRESSION_KIND_ASSIGN_MOD:
+		case EXPRESSION_KIND_ASSIGN_BITWISE_AND:
+		case EXPRESSION_KIND_ASSIGN_BITWISE_OR:
+		case EXPRESSION_KIND_ASSIGN_BITWISE_XOR:
+		case EXPRESSION_KIND_ASSIGN_SHL:
+		case EXPRESSION_KIND_ASSIGN_SHR:
+		assert(0);
+		break;
+	}
+
+	frame->temps = saved_temps;
+}
+
+static void stmt_compile(frame_t *frame, node_t *node)
+{
+	assert(node);
+
+	block_t *block = frame->block;
+
+	switch(node->kind) {
+
+		case NODE_KIND_BREAK:
+		block_append(block, U32, ROPCODE_JUMP, LBL, frame->break_destination, END);
+		break;
+
+		case NODE_KIND_CONTINUE:
+		block_append(block, U32, ROPCODE_JUMP, LBL, frame->continue_destination, END);
+		break;
+
+		case NODE_KIND_RETURN:
+		{
+			node_return_t *x = (node_return_t*) node;
+
+			block_append(block, U32, ROPCODE_OFFSET, U32, node->offset, END);
+
+			uint32_t saved_temps = frame->temps;
+
+			uint32_t value = operand_compile(frame, x->expression, 0);
+
+			if(frame->scope == 0)
+				block_append(block, U32, ROPCODE_VARIABLE_MAP_POP, END);
+
+			block_append(block, U32, ROPCODE_RETURN, U32, value, END);
+
+			frame->temps = saved_temps;
+			break;
+		}
+
+		case NODE_KIND_IMPORT:
+		{
+			node_import_t *x = (node_import_t*) node;
+
+			block_append(block, U32, ROPCODE_OFFSET, U32, node->offset, END);
+
+			uint32_t saved_temps = frame->temps;
+
+			uint32_t path = operand_compile(frame, x->expression, 0);
+
+			if(x->name)
+				block_append(block, U32, ROPCODE_IMPORT_AS, SYM, x->name, U32, path, END);
+			else
+				block_append(block, U32, ROPCODE_IMPORT, U32, path, END);
+
+			frame->temps = saved_temps;
+			break;
+		}
+
+		case NODE_KIND_IFELSE:
+		{
+			node_ifelse_t *x = (node_ifelse_t*) node;
+
+			block_append(block, U32, ROPCODE_OFFSET, U32, node->offset, END);
+
+			label_t *label_else_start = label_create(block);
+			label_t *label_else_end   = label_create(block);
+
+			uint32_t saved_temps = frame->temps;
+
+			uint32_t condition = operand_compile(frame, x->expression, 0);
+
+			frame->temps = saved_temps;
+
+			block_append(block, U32, ROPCODE_JUMP_IF_FALSE, U32, condition, LBL, label_else_start, END);
+
+			stmt_compile(frame, x->if_block);
+
+			if(x->else_block)
+				block_append(block, U32, ROPCODE_JUMP, LBL, label_else_end, END);
+
+			label_points_here(block, label_else_start);
+
+			if(x->else_block)
+				stmt_compile(frame, x->else_block);
+
+			label_points_here(block, label_else_end);
+			break;
+		}
+
+		case NODE_KIND_WHILE:
+		{
+			node_while_t *x = (node_while_t*) node;
+
+			block_append(block, U32, ROPCODE_OFFSET, U32, node->offset, END);
+
+			label_t *label_while_start = label_create(block);
+			label_t *label_while_end   = label_create(block);
+
+			label_points_here(block, label_while_start);
+
+			uint32_t saved_temps = frame->temps;
+
+			uint32_t condition = operand_compile(frame, x->expression, 0);
+
+			frame->temps = saved_temps;
+
+			block_append(block, U32, ROPCODE_JUMP_IF_FALSE, U32, condition, LBL, label_while_end, END);
+
+			label_t *saved_break    = frame->break_destination;
+			label_t *saved_continue = frame->continue_destination;
+
+			frame->break_destination = label_while_end;
+			frame->continue_destination = label_while_start;
+
+			stmt_compile(frame, x->block);
+
+			frame->break_destination = saved_break;
+			frame->continue_destination = saved_continue;
+
+			block_append(block, U32, ROPCODE_JUMP, LBL, label_while_start, END);
+
+			label_points_here(block, label_while_end);
+			break;
+		}
+
+		case NODE_KIND_EXPRESSION:
+		block_append(block, U32, ROPCODE_OFFSET, U32, node->offset, END);
+		expr_compile(frame, node, DISCARD);
+		break;
+
+		case NODE_KIND_COMPOUND:
+		{
+			node_t *stmt = ((node_compound_t*) node)->head;
+
+			while(stmt) {
+
+				stmt_compile(frame, stmt);
+				stmt = stmt->next;
+			}
+			break;
+		}
+
+		case NODE_KIND_ARGUMENT:
+		case NODE_KIND_DICT_ITEM:
+		assert(0);
+		break;
+	}
+}
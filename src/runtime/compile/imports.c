@@ -0,0 +1,162 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ast.h"
+
+//
+// Lists the paths of the imports of a program whose path is
+// a string, once folded, which are the ones that are known
+// before it runs. Imports in the body of functions are listed
+// too, since they run when the function is called. Each path
+// is listed once.
+//
+
+typedef struct {
+	char **paths;
+	uint32_t count;
+	uint32_t size;
+} collector_t;
+
+void nj_free_imports(char **paths, uint32_t count)
+{
+	for(uint32_t i = 0; i < count; i++)
+		free(paths[i]);
+
+	free(paths);
+}
+
+static int add_path(collector_t *c, const char *content, int length)
+{
+	for(uint32_t i = 0; i < c->count; i++)
+		if((int) strlen(c->paths[i]) == length && !memcmp(c->paths[i], content, length))
+			return 1;
+
+	if(c->count == c->size) {
+
+		uint32_t size = c->size == 0 ? 8 : 2 * c->size;
+
+		char **paths = realloc(c->paths, sizeof(char*) * size);
+
+		if(paths == 0)
+			return 0;
+
+		c->paths = paths;
+		c->size = size;
+	}
+
+	char *path = malloc(length + 1);
+
+	if(path == 0)
+		return 0;
+
+	memcpy(path, content, length);
+	path[length] = '\0';
+
+	c->paths[c->count++] = path;
+	return 1;
+}
+
+static int collect_list(collector_t *c, node_t *head);
+
+static int collect(collector_t *c, node_t *node)
+{
+	if(node == 0)
+		return 1;
+
+	switch(node->kind) {
+
+		case NODE_KIND_IMPORT:
+		{
+			node_import_t *x = (node_import_t*) node;
+			node_expr_t *path = (node_expr_t*) x->expression;
+
+			if(path->super.kind == NODE_KIND_EXPRESSION && path->kind == EXPRESSION_KIND_STRING)
+				return add_path(c, ((node_expr_string_t*) path)->content, ((node_expr_string_t*) path)->length);
+
+			return collect(c, x->expression);
+		}
+
+		case NODE_KIND_RETURN:
+		return collect(c, ((node_return_t*) node)->expression);
+
+		case NODE_KIND_IFELSE:
+		{
+			node_ifelse_t *x = (node_ifelse_t*) node;
+
+			return collect(c, x->expression)
+				&& collect(c, x->if_block)
+				&& collect(c, x->else_block);
+		}
+
+		case NODE_KIND_WHILE:
+		{
+			node_while_t *x = (node_while_t*) node;
+
+			return collect(c, x->expression)
+				&& collect(c, x->block);
+		}
+
+		case NODE_KIND_DICT_ITEM:
+		{
+			node_dict_item_t *x = (node_dict_item_t*) node;
+
+			return collect(c, x->key)
+				&& collect(c, x->value);
+		}
+
+		case NODE_KIND_COMPOUND:
+		return collect_list(c, ((node_compound_t*) node)->head);
+
+		case NODE_KIND_EXPRESSION:
+		break;
+
+		default:
+		return 1;
+	}
+
+	switch(((node_expr_t*) node)->kind) {
+
+		case EXPRESSION_KIND_NULL:
+		case EXPRESSION_KIND_TRUE:
+		case EXPRESSION_KIND_FALSE:
+		case EXPRESSION_KIND_INT:
+		case EXPRESSION_KIND_FLOAT:
+		case EXPRESSION_KIND_STRING:
+		case EXPRESSION_KIND_IDENTIFIER:
+		return 1;
+
+		case EXPRESSION_KIND_FUNCTION:
+		return collect(c, ((node_expr_function_t*) node)->body);
+
+		case EXPRESSION_KIND_ARRAY:
+		return collect_list(c, ((node_expr_array_t*) node)->item_head);
+
+		case EXPRESSION_KIND_DICT:
+		return collect_list(c, ((node_expr_dict_t*) node)->item_head);
+	}
+
+	return collect_list(c, ((node_expr_operation_t*) node)->operand_head);
+}
+
+static int collect_list(collector_t *c, node_t *head)
+{
+	for(node_t *node = head; node; node = node->next)
+		if(!collect(c, node))
+			return 0;
+
+	return 1;
+}
+
+int collect_imports(ast_t ast, char ***e_paths, uint32_t *e_count)
+{
+	collector_t c = { 0 };
+
+	if(!collect(&c, ast.root)) {
+
+		nj_free_imports(c.paths, c.count);
+		return 0;
+	}
+
+	*e_paths = c.paths;
+	*e_count = c.count;
+	return 1;
+}
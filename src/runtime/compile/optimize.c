@@ -0,0 +1,596 @@
+#include <math.h>
+#include <string.h>
+#include "ast.h"
+
+//
+// Rewrites the AST between parsing and code generation.
+//
+// Operations whose operands are literals are replaced by
+// their result, and statements that can't run because of a
+// literal condition are dropped. A fold only happens when
+// the runtime would give the same result: operations that
+// would fail (mixed types, division by zero) or overflow
+// are left for it to report.
+//
+// Nodes are only ever added to the pool, so a failed
+// allocation just leaves the node as it was.
+//
+
+typedef struct {
+	pool_t *pool;
+
+	// How many function bodies the walk is in. Names that
+	// are assigned in a function body are its locals, so
+	// statements that do that can't be dropped from it.
+
+	int function_depth;
+} optimizer_t;
+
+static node_t *node_fold(optimizer_t *opt, node_t *node);
+
+static int expr_kind(node_t *node)
+{
+	if(node == 0 || node->kind != NODE_KIND_EXPRESSION)
+		return -1;
+
+	return ((node_expr_t*) node)->kind;
+}
+
+static int is_literal(node_t *node)
+{
+	switch(expr_kind(node)) {
+		case EXPRESSION_KIND_NULL:
+		case EXPRESSION_KIND_TRUE:
+		case EXPRESSION_KIND_FALSE:
+		case EXPRESSION_KIND_INT:
+		case EXPRESSION_KIND_FLOAT:
+		case EXPRESSION_KIND_STRING:
+		return 1;
+	}
+
+	return 0;
+}
+
+//
+// Same as nj_object_test on the object the literal evaluates
+// to. Only ints, floats and bools can be tested, anything
+// else is false.
+//
+static int literal_test(node_t *node)
+{
+	switch(expr_kind(node)) {
+		case EXPRESSION_KIND_TRUE:  return 1;
+		case EXPRESSION_KIND_INT:   return ((node_expr_int_t*) node)->value != 0;
+		case EXPRESSION_KIND_FLOAT: return ((node_expr_float_t*) node)->value != 0;
+	}
+
+	return 0;
+}
+
+//
+// Tells whether [node] assigns a name or imports a module
+// in the scope it belongs to, which both make names local
+// to the function it's in.
+//
+static int binds_names(node_t *node)
+{
+	if(node == 0)
+		return 0;
+
+	switch(node->kind) {
+
+		case NODE_KIND_IMPORT:
+		return 1;
+
+		case NODE_KIND_RETURN:
+		return binds_names(((node_return_t*) node)->expression);
+
+		case NODE_KIND_IFELSE:
+		{
+			node_ifelse_t *x = (node_ifelse_t*) node;
+
+			return binds_names(x->expression)
+				|| binds_names(x->if_block)
+				|| binds_names(x->else_block);
+		}
+
+		case NODE_KIND_WHILE:
+		{
+			node_while_t *x = (node_while_t*) node;
+
+			return binds_names(x->expression)
+				|| binds_names(x->block);
+		}
+
+		case NODE_KIND_DICT_ITEM:
+		{
+			node_dict_item_t *x = (node_dict_item_t*) node;
+
+			return binds_names(x->key)
+				|| binds_names(x->value);
+		}
+
+		case NODE_KIND_COMPOUND:
+		{
+			for(node_t *stmt = ((node_compound_t*) node)->head; stmt; stmt = stmt->next)
+				if(binds_names(stmt))
+					return 1;
+
+			return 0;
+		}
+
+		case NODE_KIND_EXPRESSION:
+		break;
+
+		default:
+		return 0;
+	}
+
+	node_t *item;
+
+	switch(((node_expr_t*) node)->kind) {
+
+		case EXPRESSION_KIND_NULL:
+		case EXPRESSION_KIND_TRUE:
+		case EXPRESSION_KIND_FALSE:
+		case EXPRESSION_KIND_INT:
+		case EXPRESSION_KIND_FLOAT:
+		case EXPRESSION_KIND_STRING:
+		case EXPRESSION_KIND_IDENTIFIER:
+		case EXPRESSION_KIND_FUNCTION:
+		return 0;
+
+		case EXPRESSION_KIND_ARRAY:
+		item = ((node_expr_array_t*) node)->item_head;
+		break;
+
+		case EXPRESSION_KIND_DICT:
+		item = ((node_expr_dict_t*) node)->item_head;
+		break;
+
+		default:
+		{
+			node_expr_operation_t *op = (node_expr_operation_t*) node;
+
+			if(((node_expr_t*) node)->kind == EXPRESSION_KIND_ASSIGN && expr_kind(op->operand_head) == EXPRESSION_KIND_IDENTIFIER)
+				return 1;
+
+			item = op->operand_head;
+			break;
+		}
+	}
+
+	for(; item; item = item->next)
+		if(binds_names(item))
+			return 1;
+
+	return 0;
+}
+
+//
+// Whether the statement [node] can be removed without
+// changing the locals of the function it's in.
+//
+static int can_drop(optimizer_t *opt, node_t *node)
+{
+	return opt->function_depth == 0 || !binds_names(node);
+}
+
+static node_t *empty_block(optimizer_t *opt, node_t *node)
+{
+	return node_compound_create(opt->pool, node->offset, node->length, 0, 0, 0);
+}
+
+//
+// Folds each node of the list starting at [*head], linking
+// the results in its place.
+//
+static void fold_list(optimizer_t *opt, node_t **head, node_t **tail)
+{
+	node_t *last = 0;
+
+	for(node_t **link = head; *link; link = &(*link)->next) {
+
+		node_t *next = (*link)->next;
+
+		*link = node_fold(opt, *link);
+		(*link)->next = next;
+
+		last = *link;
+	}
+
+	if(tail)
+		*tail = last;
+}
+
+//
+// Computes [x] [kind] [r] as the int type does. Returns 0
+// when the runtime would fail or the result isn't defined
+// by C, in which case the operation stays.
+//
+static int fold_int(int kind, int64_t x, int64_t r, int64_t *result)
+{
+	switch(kind) {
+		case EXPRESSION_KIND_ADD: return !__builtin_add_overflow(x, r, result);
+		case EXPRESSION_KIND_SUB: return !__builtin_sub_overflow(x, r, result);
+		case EXPRESSION_KIND_MUL: return !__builtin_mul_overflow(x, r, result);
+
+		case EXPRESSION_KIND_DIV:
+		case EXPRESSION_KIND_MOD:
+
+		if(r == 0 || (x == INT64_MIN && r == -1))
+			return 0;
+
+		*result = kind == EXPRESSION_KIND_DIV ? x / r : x % r;
+		return 1;
+
+		case EXPRESSION_KIND_POW:
+		{
+			double p = pow(x, r);
+
+			if(!(p >= -0x1p63 && p < 0x1p63))
+				return 0;
+
+			*result = p;
+			return 1;
+		}
+
+		case EXPRESSION_KIND_LSS: *result = x <  r; return 1;
+		case EXPRESSION_KIND_GRT: *result = x >  r; return 1;
+		case EXPRESSION_KIND_LEQ: *result = x <= r; return 1;
+		case EXPRESSION_KIND_GEQ: *result = x >= r; return 1;
+		case EXPRESSION_KIND_EQL: *result = x == r; return 1;
+		case EXPRESSION_KIND_NQL: *result = x != r; return 1;
+		case EXPRESSION_KIND_AND: *result = x && r; return 1;
+		case EXPRESSION_KIND_OR:  *result = x || r; return 1;
+
+		case EXPRESSION_KIND_BITWISE_AND: *result = x & r; return 1;
+		case EXPRESSION_KIND_BITWISE_OR:  *result = x | r; return 1;
+		case EXPRESSION_KIND_BITWISE_XOR: *result = x ^ r; return 1;
+
+		case EXPRESSION_KIND_SHL:
+
+		if(r < 0 || r > 63 || x < 0 || x > (INT64_MAX >> r))
+			return 0;
+
+		*result = x << r;
+		return 1;
+
+		case EXPRESSION_KIND_SHR:
+
+		if(r < 0 || r > 63)
+			return 0;
+
+		*result = x >> r;
+		return 1;
+	}
+
+	return 0;
+}
+
+static node_t *fold_concat(optimizer_t *opt, node_t *node, node_expr_string_t *l, node_expr_string_t *r)
+{
+	// String literals are pushed up to their first zero byte
+
+	size_t l_length = strlen(l->content);
+	size_t r_length = strlen(r->content);
+
+	if(l_length + r_length > INT32_MAX)
+		return node;
+
+	char *content = pool_request(opt->pool, l_length + r_length + 1);
+
+	if(content == 0)
+		return node;
+
+	memcpy(content, l->content, l_length);
+	memcpy(content + l_length, r->content, r_length);
+	content[l_length + r_length] = '\0';
+
+	node_t *folded = node_string_create(opt->pool, node->offset, node->length, content, l_length + r_length);
+
+	return folded ? folded : node;
+}
+
+static node_t *fold_unary(optimizer_t *opt, node_t *node, int kind, node_t *operand)
+{
+	node_t *folded = 0;
+
+	switch(expr_kind(operand)) {
+
+		case EXPRESSION_KIND_INT:
+		{
+			int64_t x = ((node_expr_int_t*) operand)->value;
+
+			if(kind == EXPRESSION_KIND_NEG && x != INT64_MIN)
+				folded = node_int_create(opt->pool, node->offset, node->length, -x);
+
+			if(kind == EXPRESSION_KIND_BITWISE_NOT)
+				folded = node_int_create(opt->pool, node->offset, node->length, ~x);
+			break;
+		}
+
+		case EXPRESSION_KIND_FLOAT:
+		{
+			double x = ((node_expr_float_t*) operand)->value;
+
+			if(kind == EXPRESSION_KIND_NEG)
+				folded = node_float_create(opt->pool, node->offset, node->length, -x);
+			break;
+		}
+	}
+
+	return folded ? folded : node;
+}
+
+static node_t *fold_binary(optimizer_t *opt, node_t *node, int kind, node_t *left, node_t *right)
+{
+	int l_kind = expr_kind(left);
+	int r_kind = expr_kind(right);
+
+	node_t *folded = 0;
+
+	if(l_kind == EXPRESSION_KIND_INT && r_kind == EXPRESSION_KIND_INT) {
+
+		int64_t x = ((node_expr_int_t*) left)->value;
+		int64_t r = ((node_expr_int_t*) right)->value;
+		int64_t result;
+
+		if(fold_int(kind, x, r, &result))
+			folded = node_int_create(opt->pool, node->offset, node->length, result);
+
+	} else if(l_kind == EXPRESSION_KIND_INT && kind == EXPRESSION_KIND_EQL && is_literal(right)) {
+
+		// Ints are different from anything that isn't an int
+
+		folded = node_int_create(opt->pool, node->offset, node->length, 0);
+
+	} else if(l_kind == EXPRESSION_KIND_FLOAT && r_kind == EXPRESSION_KIND_FLOAT && kind == EXPRESSION_KIND_ADD) {
+
+		double x = ((node_expr_float_t*) left)->value;
+		double r = ((node_expr_float_t*) right)->value;
+
+		folded = node_float_create(opt->pool, node->offset, node->length, x + r);
+
+	} else if(l_kind == EXPRESSION_KIND_STRING && r_kind == EXPRESSION_KIND_STRING && kind == EXPRESSION_KIND_ADD) {
+
+		return fold_concat(opt, node, (node_expr_string_t*) left, (node_expr_string_t*) right);
+
+	} else if((kind == EXPRESSION_KIND_ADD || kind == EXPRESSION_KIND_MUL) && r_kind == EXPRESSION_KIND_INT && expr_kind(left) == kind) {
+
+		// (a + c1) + c2 is a + (c1 + c2), and the same goes
+		// for products. Only ints take an int right operand,
+		// so [a] is either an int or both forms fail, and the
+		// wrapping ints of the runtime associate.
+
+		node_expr_operation_t *inner = (node_expr_operation_t*) left;
+
+		if(expr_kind(inner->operand_tail) == EXPRESSION_KIND_INT && !is_literal(inner->operand_head)) {
+
+			int64_t c1 = ((node_expr_int_t*) inner->operand_tail)->value;
+			int64_t c2 = ((node_expr_int_t*) right)->value;
+			int64_t c;
+
+			if(fold_int(kind, c1, c2, &c)) {
+
+				node_t *constant = node_int_create(opt->pool, right->offset, right->length, c);
+
+				if(constant) {
+
+					inner->operand_head->next = constant;
+					inner->operand_tail = constant;
+
+					inner->super.super.offset = node->offset;
+					inner->super.super.length = node->length;
+
+					return left;
+				}
+			}
+		}
+	}
+
+	return folded ? folded : node;
+}
+
+static node_t *fold_expression(optimizer_t *opt, node_t *node)
+{
+	node_expr_t *x = (node_expr_t*) node;
+
+	switch(x->kind) {
+
+		case EXPRESSION_KIND_NULL:
+		case EXPRESSION_KIND_TRUE:
+		case EXPRESSION_KIND_FALSE:
+		case EXPRESSION_KIND_INT:
+		case EXPRESSION_KIND_FLOAT:
+		case EXPRESSION_KIND_STRING:
+		case EXPRESSION_KIND_IDENTIFIER:
+		return node;
+
+		case EXPRESSION_KIND_FUNCTION:
+		{
+			node_expr_function_t *f = (node_expr_function_t*) node;
+
+			opt->function_depth++;
+			f->body = node_fold(opt, f->body);
+			opt->function_depth--;
+			return node;
+		}
+
+		case EXPRESSION_KIND_ARRAY:
+		{
+			node_expr_array_t *a = (node_expr_array_t*) node;
+
+			fold_list(opt, &a->item_head, &a->item_tail);
+			return node;
+		}
+
+		case EXPRESSION_KIND_DICT:
+		{
+			node_expr_dict_t *d = (node_expr_dict_t*) node;
+
+			fold_list(opt, &d->item_head, &d->item_tail);
+			return node;
+		}
+
+		case EXPRESSION_KIND_DOT_SELECTION:
+		{
+			// The right operand is the name of the attribute
+
+			node_expr_operation_t *op = (node_expr_operation_t*) node;
+
+			node_t *name = op->operand_tail;
+
+			op->operand_head = node_fold(opt, op->operand_head);
+			op->operand_head->next = name;
+			return node;
+		}
+	}
+
+	node_expr_operation_t *op = (node_expr_operation_t*) node;
+
+	if(op->operand_count == 1) {
+
+		op->operand_head = node_fold(opt, op->operand_head);
+		op->operand_tail = op->operand_head;
+
+		switch(x->kind) {
+			case EXPRESSION_KIND_NEG:
+			case EXPRESSION_KIND_BITWISE_NOT:
+			return fold_unary(opt, node, x->kind, op->operand_head);
+		}
+
+		return node;
+	}
+
+	fold_list(opt, &op->operand_head, &op->operand_tail);
+
+	switch(x->kind) {
+		case EXPRESSION_KIND_ADD:
+		case EXPRESSION_KIND_SUB:
+		case EXPRESSION_KIND_MUL:
+		case EXPRESSION_KIND_DIV:
+		case EXPRESSION_KIND_MOD:
+		case EXPRESSION_KIND_POW:
+		case EXPRESSION_KIND_LSS:
+		case EXPRESSION_KIND_GRT:
+		case EXPRESSION_KIND_LEQ:
+		case EXPRESSION_KIND_GEQ:
+		case EXPRESSION_KIND_EQL:
+		case EXPRESSION_KIND_NQL:
+		case EXPRESSION_KIND_AND:
+		case EXPRESSION_KIND_OR:
+		case EXPRESSION_KIND_BITWISE_AND:
+		case EXPRESSION_KIND_BITWISE_OR:
+		case EXPRESSION_KIND_BITWISE_XOR:
+		case EXPRESSION_KIND_SHL:
+		case EXPRESSION_KIND_SHR:
+		return fold_binary(opt, node, x->kind, op->operand_head, op->operand_tail);
+	}
+
+	return node;
+}
+
+//
+// Returns the node that replaces [node], which may be
+// [node] itself. Its [next] field is left to the caller.
+//
+static node_t *node_fold(optimizer_t *opt, node_t *node)
+{
+	if(node == 0)
+		return 0;
+
+	switch(node->kind) {
+
+		case NODE_KIND_RETURN:
+		{
+			node_return_t *x = (node_return_t*) node;
+
+			x->expression = node_fold(opt, x->expression);
+			return node;
+		}
+
+		case NODE_KIND_IMPORT:
+		{
+			node_import_t *x = (node_import_t*) node;
+
+			x->expression = node_fold(opt, x->expression);
+			return node;
+		}
+
+		case NODE_KIND_IFELSE:
+		{
+			node_ifelse_t *x = (node_ifelse_t*) node;
+
+			x->expression = node_fold(opt, x->expression);
+			x->if_block = node_fold(opt, x->if_block);
+			x->else_block = node_fold(opt, x->else_block);
+
+			if(!is_literal(x->expression))
+				return node;
+
+			node_t *taken   = literal_test(x->expression) ? x->if_block : x->else_block;
+			node_t *dropped = literal_test(x->expression) ? x->else_block : x->if_block;
+
+			if(!can_drop(opt, dropped))
+				return node;
+
+			node_t *folded = taken ? taken : empty_block(opt, node);
+
+			return folded ? folded : node;
+		}
+
+		case NODE_KIND_WHILE:
+		{
+			node_while_t *x = (node_while_t*) node;
+
+			x->expression = node_fold(opt, x->expression);
+			x->block = node_fold(opt, x->block);
+
+			if(!is_literal(x->expression) || literal_test(x->expression) || !can_drop(opt, x->block))
+				return node;
+
+			node_t *folded = empty_block(opt, node);
+
+			return folded ? folded : node;
+		}
+
+		case NODE_KIND_DICT_ITEM:
+		{
+			node_dict_item_t *x = (node_dict_item_t*) node;
+
+			x->key = node_fold(opt, x->key);
+			x->value = node_fold(opt, x->value);
+			return node;
+		}
+
+		case NODE_KIND_COMPOUND:
+		{
+			node_compound_t *x = (node_compound_t*) node;
+
+			fold_list(opt, &x->head, &x->tail);
+			return node;
+		}
+
+		case NODE_KIND_EXPRESSION:
+		return fold_expression(opt, node);
+	}
+
+	return node;
+}
+
+//
+// Optimizes [ast] in place. At level 0 it's left as it is.
+//
+void optimize(ast_t *ast, int level)
+{
+	if(level <= 0)
+		return;
+
+	optimizer_t opt = {
+		.pool = ast->pool,
+		.function_depth = 0,
+	};
+
+	ast->root = node_fold(&opt, ast->root);
+}
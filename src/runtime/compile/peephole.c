@@ -0,0 +1,445 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../bytecode.h"
+
+//
+// Rewrites the stack code made by generate() once its labels
+// are resolved:
+//
+//   - Jumps to unconditional jumps go to the final target;
+//   - Code that no path reaches, NOPEs, jumps to the next
+//     instruction and OFFSETs whose value is overwritten by
+//     the next instruction are removed;
+//   - Frequent sequences are replaced by superinstructions.
+//
+// The instructions of a sequence after the first one must
+// not be jump targets. Removed instructions stand for the
+// instruction that follows them, so addresses are moved to
+// the new offset of that one.
+//
+// Conditional jumps are only made to go forward, so that
+// every loop still goes through a JUMP_ABSOLUTE backwards,
+// which is where the collector gets to run.
+//
+// The pass only works on code that it can decode and leaves
+// it as it was otherwise.
+//
+
+typedef struct {
+	uint32_t offset;
+	uint32_t size;
+	uint32_t opcode;
+	uint8_t  reachable;
+	uint8_t  target;
+} instr_t;
+
+typedef struct {
+	char *code;
+	uint32_t code_size;
+
+	instr_t *instrs;
+	uint32_t count;
+
+	// Index of the instruction starting at each multiple
+	// of 4 bytes, or UINT32_MAX.
+
+	uint32_t *index;
+} peephole_t;
+
+static uint32_t read_u32(const char *code, uint32_t offset)
+{
+	uint32_t value;
+	memcpy(&value, code + offset, sizeof(value));
+	return value;
+}
+
+static int64_t read_i64(const char *code, uint32_t offset)
+{
+	int64_t value;
+	memcpy(&value, code + offset, sizeof(value));
+	return value;
+}
+
+static void write_u32(char *code, uint32_t offset, uint32_t value)
+{
+	memcpy(code + offset, &value, sizeof(value));
+}
+
+static void write_i64(char *code, uint32_t offset, int64_t value)
+{
+	memcpy(code + offset, &value, sizeof(value));
+}
+
+static int has_address(uint32_t opcode)
+{
+	// Addresses are always the only operand
+
+	return nj_get_opcode_operands(opcode)[0] == 'a';
+}
+
+//
+// The first operand of the k-th instruction.
+//
+static uint32_t operand_u32(peephole_t *p, uint32_t k)
+{
+	return read_u32(p->code, p->instrs[k].offset + sizeof(uint32_t));
+}
+
+static int64_t operand_i64(peephole_t *p, uint32_t k)
+{
+	return read_i64(p->code, p->instrs[k].offset + sizeof(uint32_t));
+}
+
+//
+// Index of the instruction at [offset], or UINT32_MAX if no
+// instruction starts there.
+//
+static uint32_t instr_at(peephole_t *p, uint32_t offset)
+{
+	if(offset >= p->code_size || offset % sizeof(uint32_t))
+		return UINT32_MAX;
+
+	return p->index[offset / sizeof(uint32_t)];
+}
+
+static int decode(peephole_t *p)
+{
+	uint32_t capacity = p->code_size / sizeof(uint32_t);
+
+	p->instrs = malloc(sizeof(instr_t) * capacity);
+	p->index = malloc(sizeof(uint32_t) * capacity);
+	p->count = 0;
+
+	if(p->instrs == 0 || p->index == 0)
+		return 0;
+
+	for(uint32_t i = 0; i < capacity; i++)
+		p->index[i] = UINT32_MAX;
+
+	for(uint32_t i = 0; i < p->code_size; ) {
+
+		if(i + sizeof(uint32_t) > p->code_size)
+			return 0;
+
+		uint32_t opcode = read_u32(p->code, i);
+
+		const char *operands = nj_get_opcode_operands(opcode);
+
+		if(operands == 0)
+			return 0;
+
+		uint32_t size = sizeof(uint32_t);
+
+		for(int j = 0; operands[j]; j++)
+			size += (operands[j] == 'i' || operands[j] == 'f') ? 8 : 4;
+
+		if(i + size > p->code_size)
+			return 0;
+
+		p->index[i / sizeof(uint32_t)] = p->count;
+		p->instrs[p->count++] = (instr_t) { .offset = i, .size = size, .opcode = opcode };
+
+		i += size;
+	}
+
+	// Every address must point to an instruction
+
+	for(uint32_t k = 0; k < p->count; k++)
+		if(has_address(p->instrs[k].opcode) && instr_at(p, operand_u32(p, k)) == UINT32_MAX)
+			return 0;
+
+	return 1;
+}
+
+static void thread_jumps(peephole_t *p)
+{
+	for(uint32_t k = 0; k < p->count; k++) {
+
+		uint32_t opcode = p->instrs[k].opcode;
+
+		if(opcode != OPCODE_JUMP_ABSOLUTE && opcode != OPCODE_JUMP_IF_FALSE_AND_POP)
+			continue;
+
+		uint32_t dest = operand_u32(p, k);
+
+		// Jumps may loop on each other, so the chain is
+		// followed at most once per instruction.
+
+		for(uint32_t hops = 0; hops < p->count; hops++) {
+
+			uint32_t next = instr_at(p, dest);
+
+			if(p->instrs[next].opcode != OPCODE_JUMP_ABSOLUTE || next == k)
+				break;
+
+			dest = operand_u32(p, next);
+		}
+
+		if(opcode == OPCODE_JUMP_ABSOLUTE || dest > p->instrs[k].offset)
+			write_u32(p->code, p->instrs[k].offset + sizeof(uint32_t), dest);
+	}
+}
+
+//
+// Marks the instructions reachable from the entry point
+// and from the functions it creates, then the ones that
+// reachable code jumps to.
+//
+static int mark(peephole_t *p)
+{
+	uint32_t *worklist = malloc(sizeof(uint32_t) * p->count);
+	uint32_t used = 0;
+
+	if(worklist == 0)
+		return 0;
+
+	p->instrs[0].reachable = 1;
+	worklist[used++] = 0;
+
+	while(used > 0) {
+
+		uint32_t k = worklist[--used];
+		uint32_t opcode = p->instrs[k].opcode;
+
+		uint32_t successors[2];
+		int n = 0;
+
+		if(opcode != OPCODE_QUIT && opcode != OPCODE_RETURN && opcode != OPCODE_JUMP_ABSOLUTE && k + 1 < p->count)
+			successors[n++] = k + 1;
+
+		if(has_address(opcode))
+			successors[n++] = instr_at(p, operand_u32(p, k));
+
+		for(int j = 0; j < n; j++) {
+
+			if(p->instrs[successors[j]].reachable)
+				continue;
+
+			p->instrs[successors[j]].reachable = 1;
+			worklist[used++] = successors[j];
+		}
+	}
+
+	free(worklist);
+
+	for(uint32_t k = 0; k < p->count; k++)
+		if(p->instrs[k].reachable && has_address(p->instrs[k].opcode))
+			p->instrs[instr_at(p, operand_u32(p, k))].target = 1;
+
+	return 1;
+}
+
+//
+// Tells whether the instructions from the k-th have the
+// [count] opcodes of [pattern], with no jumps into them.
+//
+static int matches(peephole_t *p, uint32_t k, const uint32_t *pattern, uint32_t count)
+{
+	if(k + count > p->count)
+		return 0;
+
+	for(uint32_t j = 0; j < count; j++) {
+
+		if(p->instrs[k + j].opcode != pattern[j])
+			return 0;
+
+		if(j > 0 && p->instrs[k + j].target)
+			return 0;
+	}
+
+	return 1;
+}
+
+static uint32_t compare_and_jump(uint32_t opcode)
+{
+	switch(opcode) {
+		case OPCODE_LSS: return OPCODE_LSS_JUMP_IF_FALSE;
+		case OPCODE_GRT: return OPCODE_GRT_JUMP_IF_FALSE;
+		case OPCODE_LEQ: return OPCODE_LEQ_JUMP_IF_FALSE;
+		case OPCODE_GEQ: return OPCODE_GEQ_JUMP_IF_FALSE;
+		case OPCODE_EQL: return OPCODE_EQL_JUMP_IF_FALSE;
+		case OPCODE_NQL: return OPCODE_NQL_JUMP_IF_FALSE;
+	}
+
+	return OPCODE_NOPE;
+}
+
+//
+// Writes to [out] the superinstruction that replaces the
+// sequence starting at the k-th instruction, if there's
+// one. Returns the length of the sequence, or 0.
+//
+static uint32_t fuse(peephole_t *p, uint32_t k, char *out, uint32_t *size)
+{
+	uint32_t opcode = p->instrs[k].opcode;
+
+	// x = x + c;
+
+	static const uint32_t inc_local[] = {
+		OPCODE_LOAD_LOCAL, OPCODE_OFFSET, OPCODE_PUSH_INT, OPCODE_ADD, OPCODE_STORE_LOCAL, OPCODE_POP,
+	};
+
+	static const uint32_t inc_variable[] = {
+		OPCODE_PUSH_VARIABLE, OPCODE_OFFSET, OPCODE_PUSH_INT, OPCODE_ADD, OPCODE_ASSIGN, OPCODE_POP,
+	};
+
+	if((matches(p, k, inc_local, 6) || matches(p, k, inc_variable, 6))
+	&& operand_u32(p, k) == operand_u32(p, k + 4) && operand_i64(p, k + 5) == 1) {
+
+		write_u32(out, 0, opcode == OPCODE_LOAD_LOCAL ? OPCODE_INC_LOCAL : OPCODE_INC_VARIABLE);
+		write_u32(out, 4, operand_u32(p, k));
+		write_i64(out, 8, operand_i64(p, k + 2));
+		write_u32(out, 16, operand_u32(p, k + 1));
+
+		*size = 20;
+		return 6;
+	}
+
+	static const uint32_t assign_and_pop[] = { OPCODE_ASSIGN, OPCODE_POP };
+	static const uint32_t store_local_and_pop[] = { OPCODE_STORE_LOCAL, OPCODE_POP };
+
+	if((matches(p, k, assign_and_pop, 2) || matches(p, k, store_local_and_pop, 2)) && operand_i64(p, k + 1) == 1) {
+
+		write_u32(out, 0, opcode == OPCODE_ASSIGN ? OPCODE_ASSIGN_AND_POP : OPCODE_STORE_LOCAL_AND_POP);
+		write_u32(out, 4, operand_u32(p, k));
+
+		*size = 8;
+		return 2;
+	}
+
+	static const uint32_t push_variable_select_attribute[] = { OPCODE_PUSH_VARIABLE, OPCODE_SELECT_ATTRIBUTE };
+
+	if(matches(p, k, push_variable_select_attribute, 2)) {
+
+		write_u32(out, 0, OPCODE_PUSH_VARIABLE_SELECT_ATTRIBUTE);
+		write_u32(out, 4, operand_u32(p, k));
+		write_u32(out, 8, operand_u32(p, k + 1));
+
+		*size = 12;
+		return 2;
+	}
+
+	uint32_t compare[] = { opcode, OPCODE_JUMP_IF_FALSE_AND_POP };
+
+	if(compare_and_jump(opcode) != OPCODE_NOPE && matches(p, k, compare, 2)) {
+
+		write_u32(out, 0, compare_and_jump(opcode));
+		write_u32(out, 4, operand_u32(p, k + 1));
+
+		*size = 8;
+		return 2;
+	}
+
+	return 0;
+}
+
+//
+// Tells whether the jump at the k-th instruction goes to
+// what would run next anyway.
+//
+static int jumps_to_next(peephole_t *p, uint32_t k)
+{
+	uint32_t dest = operand_u32(p, k);
+
+	if(dest <= p->instrs[k].offset)
+		return 0;
+
+	for(uint32_t j = k + 1; p->instrs[j].offset < dest; j++)
+		if(p->instrs[j].reachable && p->instrs[j].opcode != OPCODE_NOPE)
+			return 0;
+
+	return 1;
+}
+
+static int rewrite(peephole_t *p)
+{
+	char *out = malloc(p->code_size);
+	uint32_t *moved = malloc(sizeof(uint32_t) * p->count);
+
+	if(out == 0 || moved == 0) {
+
+		free(out);
+		free(moved);
+		return 0;
+	}
+
+	uint32_t used = 0;
+
+	for(uint32_t k = 0; k < p->count; ) {
+
+		instr_t *x = &p->instrs[k];
+
+		moved[k] = used;
+
+		int dropped = !x->reachable
+			|| x->opcode == OPCODE_NOPE
+			|| (x->opcode == OPCODE_OFFSET && k + 1 < p->count && p->instrs[k + 1].opcode == OPCODE_OFFSET)
+			|| (x->opcode == OPCODE_JUMP_ABSOLUTE && jumps_to_next(p, k));
+
+		if(dropped) {
+			k++;
+			continue;
+		}
+
+		uint32_t size;
+		uint32_t n = fuse(p, k, out + used, &size);
+
+		if(n > 0) {
+
+			for(uint32_t j = 1; j < n; j++)
+				moved[k + j] = used;
+
+			used += size;
+			k += n;
+			continue;
+		}
+
+		memcpy(out + used, p->code + x->offset, x->size);
+		used += x->size;
+		k++;
+	}
+
+	// Move the addresses
+
+	for(uint32_t i = 0; i < used; ) {
+
+		uint32_t opcode = read_u32(out, i);
+
+		if(has_address(opcode))
+			write_u32(out, i + sizeof(uint32_t), moved[instr_at(p, read_u32(out, i + sizeof(uint32_t)))]);
+
+		const char *operands = nj_get_opcode_operands(opcode);
+
+		i += sizeof(uint32_t);
+
+		for(int j = 0; operands[j]; j++)
+			i += (operands[j] == 'i' || operands[j] == 'f') ? 8 : 4;
+	}
+
+	memcpy(p->code, out, used);
+	p->code_size = used;
+
+	free(out);
+	free(moved);
+	return 1;
+}
+
+void peephole(char *code, uint32_t *code_size)
+{
+	peephole_t p = {
+		.code = code,
+		.code_size = *code_size,
+	};
+
+	if(p.code_size > 0 && decode(&p)) {
+
+		thread_jumps(&p);
+
+		if(mark(&p) && rewrite(&p))
+			*code_size = p.code_size;
+	}
+
+	free(p.instrs);
+	free(p.index);
+}
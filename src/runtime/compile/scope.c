@@ -0,0 +1,415 @@
+#include <stdlib.h>
+#include <string.h>
+#include "scope.h"
+
+int scope_find(scope_t *scope, const char *name)
+{
+	for(int i = 0; i < scope->count; i++)
+		if(!strcmp(scope->names[i], name))
+			return i;
+
+	return -1;
+}
+
+static int scope_add(scope_t *scope, char *name)
+{
+	if(scope_find(scope, name) >= 0)
+		return 1;
+
+	if(scope->count == scope->size) {
+
+		int new_size = scope->size ? scope->size * 2 : 8;
+
+		char **names = realloc(scope->names, sizeof(char*) * new_size);
+
+		if(names == 0)
+			return 0;
+
+		scope->names = names;
+		scope->size = new_size;
+	}
+
+	scope->names[scope->count++] = name;
+	return 1;
+}
+
+static int node_resolve(scope_t *scope, node_t *node)
+{
+	if(node == 0)
+		return 1;
+
+	switch(node->kind) {
+
+		case NODE_KIND_BREAK:
+		case NODE_KIND_CONTINUE:
+		case NODE_KIND_ARGUMENT:
+		return 1;
+
+		case NODE_KIND_RETURN:
+		return node_resolve(scope, ((node_return_t*) node)->expression);
+
+		case NODE_KIND_IMPORT:
+		{
+			// Imports write into the variable map (either
+			// the module's names or its alias), so these
+			// functions keep one.
+
+			scope->uses_map = 1;
+
+			return node_resolve(scope, ((node_import_t*) node)->expression);
+		}
+
+		case NODE_KIND_IFELSE:
+		{
+			node_ifelse_t *x = (node_ifelse_t*) node;
+
+			return node_resolve(scope, x->expression)
+				&& node_resolve(scope, x->if_block)
+				&& node_resolve(scope, x->else_block);
+		}
+
+		case NODE_KIND_WHILE:
+		{
+			node_while_t *x = (node_while_t*) node;
+
+			return node_resolve(scope, x->expression)
+				&& node_resolve(scope, x->block);
+		}
+
+		case NODE_KIND_DICT_ITEM:
+		{
+			node_dict_item_t *x = (node_dict_item_t*) node;
+
+			return node_resolve(scope, x->key)
+				&& node_resolve(scope, x->value);
+		}
+
+		case NODE_KIND_COMPOUND:
+		{
+			node_t *stmt = ((node_compound_t*) node)->head;
+
+			while(stmt) {
+
+				if(!node_resolve(scope, stmt))
+					return 0;
+
+				stmt = stmt->next;
+			}
+
+			return 1;
+		}
+
+		case NODE_KIND_EXPRESSION:
+		{
+			node_expr_t *x = (node_expr_t*) node;
+
+			switch(x->kind) {
+
+				case EXPRESSION_KIND_NULL:
+				case EXPRESSION_KIND_TRUE:
+				case EXPRESSION_KIND_FALSE:
+				case EXPRESSION_KIND_INT:
+				case EXPRESSION_KIND_FLOAT:
+				case EXPRESSION_KIND_STRING:
+				case EXPRESSION_KIND_IDENTIFIER:
+				return 1;
+
+				// Nested functions have their own scope
+
+				case EXPRESSION_KIND_FUNCTION:
+				return 1;
+
+				case EXPRESSION_KIND_ARRAY:
+				{
+					node_t *item = ((node_expr_array_t*) node)->item_head;
+
+					while(item) {
+
+						if(!node_resolve(scope, item))
+							return 0;
+
+						item = item->next;
+					}
+
+					return 1;
+				}
+
+				case EXPRESSION_KIND_DICT:
+				{
+					node_t *item = ((node_expr_dict_t*) node)->item_head;
+
+					while(item) {
+
+						if(!node_resolve(scope, item))
+							return 0;
+
+						item = item->next;
+					}
+
+					return 1;
+				}
+
+				default:
+				{
+					node_expr_operation_t *op = (node_expr_operation_t*) node;
+
+					if(x->kind == EXPRESSION_KIND_ASSIGN) {
+
+						node_expr_t *l = (node_expr_t*) op->operand_head;
+
+						if(l->kind == EXPRESSION_KIND_IDENTIFIER)
+							if(!scope_add(scope, ((node_expr_identifier_t*) l)->content))
+								return 0;
+					}
+
+					node_t *operand = op->operand_head;
+
+					while(operand) {
+
+						if(!node_resolve(scope, operand))
+							return 0;
+
+						operand = operand->next;
+					}
+
+					return 1;
+				}
+			}
+		}
+	}
+
+	return 1;
+}
+
+//
+// Before the function assigns one of its names, reading it
+// gets the global or builtin with that name. Slots can't do
+// that, so a function that may read a name before it's
+// assigned keeps a variable map, like one that imports.
+//
+// [assigned] holds a flag per name, set once the name is
+// assigned on every path that leads to the current node.
+// Names assigned in a branch or a loop body only count
+// inside it, except for the ones both branches of an if-else
+// assign. Reads in a loop body that come before the name is
+// assigned in it run before it on the first iteration.
+//
+
+static int node_check(scope_t *scope, node_t *node, char *assigned);
+
+static int list_check(scope_t *scope, node_t *head, char *assigned)
+{
+	for(node_t *node = head; node; node = node->next)
+		if(!node_check(scope, node, assigned))
+			return 0;
+
+	return 1;
+}
+
+static int branch_check(scope_t *scope, node_t *node, const char *assigned, char **e_assigned)
+{
+	char *copy = malloc(scope->count + 1);
+
+	if(copy == 0)
+		return 0;
+
+	memcpy(copy, assigned, scope->count);
+
+	if(!node_check(scope, node, copy)) {
+
+		free(copy);
+		return 0;
+	}
+
+	*e_assigned = copy;
+	return 1;
+}
+
+static int node_check(scope_t *scope, node_t *node, char *assigned)
+{
+	if(node == 0 || scope->uses_map)
+		return 1;
+
+	switch(node->kind) {
+
+		case NODE_KIND_RETURN:
+		return node_check(scope, ((node_return_t*) node)->expression, assigned);
+
+		case NODE_KIND_IFELSE:
+		{
+			node_ifelse_t *x = (node_ifelse_t*) node;
+
+			if(!node_check(scope, x->expression, assigned))
+				return 0;
+
+			char *if_assigned, *else_assigned;
+
+			if(!branch_check(scope, x->if_block, assigned, &if_assigned))
+				return 0;
+
+			if(!branch_check(scope, x->else_block, assigned, &else_assigned)) {
+
+				free(if_assigned);
+				return 0;
+			}
+
+			for(int i = 0; i < scope->count; i++)
+				assigned[i] = if_assigned[i] && else_assigned[i];
+
+			free(if_assigned);
+			free(else_assigned);
+			return 1;
+		}
+
+		case NODE_KIND_WHILE:
+		{
+			node_while_t *x = (node_while_t*) node;
+
+			if(!node_check(scope, x->expression, assigned))
+				return 0;
+
+			char *body_assigned;
+
+			if(!branch_check(scope, x->block, assigned, &body_assigned))
+				return 0;
+
+			free(body_assigned);
+			return 1;
+		}
+
+		case NODE_KIND_DICT_ITEM:
+		{
+			node_dict_item_t *x = (node_dict_item_t*) node;
+
+			return node_check(scope, x->key, assigned)
+				&& node_check(scope, x->value, assigned);
+		}
+
+		case NODE_KIND_COMPOUND:
+		return list_check(scope, ((node_compound_t*) node)->head, assigned);
+
+		case NODE_KIND_EXPRESSION:
+		break;
+
+		default:
+		return 1;
+	}
+
+	node_expr_t *x = (node_expr_t*) node;
+
+	switch(x->kind) {
+
+		case EXPRESSION_KIND_NULL:
+		case EXPRESSION_KIND_TRUE:
+		case EXPRESSION_KIND_FALSE:
+		case EXPRESSION_KIND_INT:
+		case EXPRESSION_KIND_FLOAT:
+		case EXPRESSION_KIND_STRING:
+		case EXPRESSION_KIND_FUNCTION:
+		return 1;
+
+		case EXPRESSION_KIND_IDENTIFIER:
+		{
+			int slot = scope_find(scope, ((node_expr_identifier_t*) node)->content);
+
+			if(slot >= 0 && !assigned[slot])
+				scope->uses_map = 1;
+
+			return 1;
+		}
+
+		case EXPRESSION_KIND_ARRAY:
+		return list_check(scope, ((node_expr_array_t*) node)->item_head, assigned);
+
+		case EXPRESSION_KIND_DICT:
+		return list_check(scope, ((node_expr_dict_t*) node)->item_head, assigned);
+
+		case EXPRESSION_KIND_DOT_SELECTION:
+
+		// The right operand is the name of the attribute
+
+		return node_check(scope, ((node_expr_operation_t*) node)->operand_head, assigned);
+
+		case EXPRESSION_KIND_ASSIGN:
+		{
+			node_expr_operation_t *op = (node_expr_operation_t*) node;
+			node_expr_t *l = (node_expr_t*) op->operand_head;
+
+			if(l->kind != EXPRESSION_KIND_IDENTIFIER)
+				break;
+
+			// The value is computed before it's stored
+
+			if(!node_check(scope, op->operand_tail, assigned))
+				return 0;
+
+			assigned[scope_find(scope, ((node_expr_identifier_t*) l)->content)] = 1;
+			return 1;
+		}
+
+		default:
+		break;
+	}
+
+	return list_check(scope, ((node_expr_operation_t*) node)->operand_head, assigned);
+}
+
+int scope_resolve(scope_t *scope, node_expr_function_t *func)
+{
+	scope->names = 0;
+	scope->count = 0;
+	scope->size = 0;
+	scope->uses_map = 0;
+
+	node_t *argument = func->argument_head;
+
+	while(argument) {
+
+		if(!scope_add(scope, ((node_argument_t*) argument)->name)) {
+
+			scope_free(scope);
+			return 0;
+		}
+
+		argument = argument->next;
+	}
+
+	if(!node_resolve(scope, func->body)) {
+
+		scope_free(scope);
+		return 0;
+	}
+
+	if(scope->uses_map)
+		return 1;
+
+	char *assigned = calloc(scope->count + 1, 1);
+
+	if(assigned == 0) {
+
+		scope_free(scope);
+		return 0;
+	}
+
+	// Arguments are assigned on entry
+
+	for(node_t *argument = func->argument_head; argument; argument = argument->next)
+		assigned[scope_find(scope, ((node_argument_t*) argument)->name)] = 1;
+
+	int checked = node_check(scope, func->body, assigned);
+
+	free(assigned);
+
+	if(!checked) {
+
+		scope_free(scope);
+		return 0;
+	}
+
+	return 1;
+}
+
+void scope_free(scope_t *scope)
+{
+	free(scope->names);
+}
@@ -0,0 +1,30 @@
+#ifndef _SCOPE_
+#define _SCOPE_
+
+#include "ast.h"
+
+//
+// The local variables of a function. Arguments come first,
+// then every other name assigned to by the function body,
+// in order of appearance. The position of a name in this
+// list is the frame slot it lives in.
+//
+// Functions that import modules can't know all of their
+// names at compile time, and functions that may read one of
+// their names before assigning it read the global with that
+// name until they do, so both keep using a variable map
+// (uses_map is set).
+//
+
+typedef struct {
+	char **names;
+	int    count;
+	int    size;
+	int    uses_map;
+} scope_t;
+
+int  scope_resolve(scope_t *scope, node_expr_function_t *func);
+int  scope_find(scope_t *scope, const char *name);
+void scope_free(scope_t *scope);
+
+#endif
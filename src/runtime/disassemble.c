@@ -2,6 +2,7 @@
 #include <stdint.h>
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
 #include "bytecode.h"
 
 static const char *operand_types[] = {
@@ -9,7 +10,7 @@ static const char *operand_types[] = {
 	[OPCODE_NOPE] = "",
 	[OPCODE_QUIT] = "",
 
-	[OPCODE_OFFSET] = "a",
+	[OPCODE_OFFSET] = "u",
 
 	[OPCODE_PUSH_NULL] = "",
 	[OPCODE_PUSH_TRUE] = "",
@@ -20,23 +21,29 @@ static const char *operand_types[] = {
 	[OPCODE_BUILD_ARRAY] = "i",
 	[OPCODE_BUILD_DICT] = "i",
 	[OPCODE_PUSH_FUNCTION] = "a",
-	[OPCODE_PUSH_VARIABLE] = "s",
-	[OPCODE_SELECT_ATTRIBUTE_AND_REPUSH] = "s",
+	[OPCODE_PUSH_VARIABLE] = "y",
+	[OPCODE_PUSH_GLOBAL] = "y",
+	[OPCODE_SELECT_ATTRIBUTE_AND_REPUSH] = "y",
 
 	[OPCODE_POP] = "i",
 
 	[OPCODE_IMPORT] = "",
-	[OPCODE_IMPORT_AS] = "s",
+	[OPCODE_IMPORT_AS] = "y",
 
-	[OPCODE_ASSIGN] = "s",
+	[OPCODE_ASSIGN] = "y",
 	[OPCODE_SELECT] = "",
 	[OPCODE_INSERT] = "",
-	[OPCODE_SELECT_ATTRIBUTE] = "s",
-	[OPCODE_INSERT_ATTRIBUTE] = "s",
+	[OPCODE_SELECT_ATTRIBUTE] = "y",
+	[OPCODE_INSERT_ATTRIBUTE] = "y",
 
 	[OPCODE_VARIABLE_MAP_PUSH] = "",
 	[OPCODE_VARIABLE_MAP_POP] = "",
 
+	[OPCODE_LOCALS_PUSH] = "u",
+	[OPCODE_LOCALS_POP] = "",
+	[OPCODE_LOAD_LOCAL] = "u",
+	[OPCODE_STORE_LOCAL] = "u",
+
 	[OPCODE_CALL] = "i",
 	[OPCODE_EXPECT] = "i",
 	[OPCODE_RETURN] = "",
@@ -66,14 +73,29 @@ static const char *operand_types[] = {
 	[OPCODE_BITWISE_OR] = "",
 	[OPCODE_BITWISE_XOR] = "",
 	[OPCODE_BITWISE_NOT] = "",
+
+	[OPCODE_ASSIGN_AND_POP] = "y",
+	[OPCODE_STORE_LOCAL_AND_POP] = "u",
+	[OPCODE_INC_VARIABLE] = "yiu",
+	[OPCODE_INC_LOCAL] = "uiu",
+	[OPCODE_PUSH_VARIABLE_SELECT_ATTRIBUTE] = "yy",
+	[OPCODE_LSS_JUMP_IF_FALSE] = "a",
+	[OPCODE_GRT_JUMP_IF_FALSE] = "a",
+	[OPCODE_LEQ_JUMP_IF_FALSE] = "a",
+	[OPCODE_GEQ_JUMP_IF_FALSE] = "a",
+	[OPCODE_EQL_JUMP_IF_FALSE] = "a",
+	[OPCODE_NQL_JUMP_IF_FALSE] = "a",
 };
 
-static const char *get_instruction_operands(int opcode)
+const char *nj_get_opcode_operands(uint32_t opcode)
 {
+	if(opcode >= OPCODE_COUNT)
+		return 0;
+
 	return operand_types[opcode];
 }
 
-static const char *get_opcode_name(int opcode)
+const char *nj_get_opcode_name(uint32_t opcode)
 {
 	switch(opcode) {
 
@@ -92,6 +114,7 @@ static const char *get_opcode_name(int opcode)
 		case OPCODE_BUILD_DICT: return "BUILD_DICT";
 		case OPCODE_PUSH_FUNCTION: return "PUSH_FUNCTION";
 		case OPCODE_PUSH_VARIABLE: return "PUSH_VARIABLE";
+		case OPCODE_PUSH_GLOBAL: return "PUSH_GLOBAL";
 		case OPCODE_SELECT_ATTRIBUTE_AND_REPUSH: return "SELECT_ATTRIBUTE_AND_REPUSH";
 
 		case OPCODE_POP: return "POP";
@@ -108,6 +131,11 @@ static const char *get_opcode_name(int opcode)
 		case OPCODE_VARIABLE_MAP_PUSH: return "VARIABLE_MAP_PUSH";
 		case OPCODE_VARIABLE_MAP_POP: return "VARIABLE_MAP_POP";
 
+		case OPCODE_LOCALS_PUSH: return "LOCALS_PUSH";
+		case OPCODE_LOCALS_POP: return "LOCALS_POP";
+		case OPCODE_LOAD_LOCAL: return "LOAD_LOCAL";
+		case OPCODE_STORE_LOCAL: return "STORE_LOCAL";
+
 		case OPCODE_CALL: return "CALL";
 		case OPCODE_EXPECT: return "EXPECT";
 		case OPCODE_RETURN: return "RETURN";
@@ -137,12 +165,164 @@ static const char *get_opcode_name(int opcode)
 		case OPCODE_BITWISE_OR: return "BITWISE_OR";
 		case OPCODE_BITWISE_XOR: return "BITWISE_XOR";
 		case OPCODE_BITWISE_NOT: return "BITWISE_NOT";
+
+		case OPCODE_ASSIGN_AND_POP: return "ASSIGN_AND_POP";
+		case OPCODE_STORE_LOCAL_AND_POP: return "STORE_LOCAL_AND_POP";
+		case OPCODE_INC_VARIABLE: return "INC_VARIABLE";
+		case OPCODE_INC_LOCAL: return "INC_LOCAL";
+		case OPCODE_PUSH_VARIABLE_SELECT_ATTRIBUTE: return "PUSH_VARIABLE_SELECT_ATTRIBUTE";
+		case OPCODE_LSS_JUMP_IF_FALSE: return "LSS_JUMP_IF_FALSE";
+		case OPCODE_GRT_JUMP_IF_FALSE: return "GRT_JUMP_IF_FALSE";
+		case OPCODE_LEQ_JUMP_IF_FALSE: return "LEQ_JUMP_IF_FALSE";
+		case OPCODE_GEQ_JUMP_IF_FALSE: return "GEQ_JUMP_IF_FALSE";
+		case OPCODE_EQL_JUMP_IF_FALSE: return "EQL_JUMP_IF_FALSE";
+		case OPCODE_NQL_JUMP_IF_FALSE: return "NQL_JUMP_IF_FALSE";
 	}
 
 	return "???";
 }
 
-void nj_disassemble(char *code, char *data, uint32_t code_size, uint32_t data_size)
+static const char *roperand_types[] = {
+	
+	[ROPCODE_NOPE] = "",
+	[ROPCODE_QUIT] = "",
+	[ROPCODE_OFFSET] = "u",
+
+	[ROPCODE_ENTER] = "uu",
+	[ROPCODE_MOVE] = "rr",
+
+	[ROPCODE_LOAD_NULL] = "r",
+	[ROPCODE_LOAD_TRUE] = "r",
+	[ROPCODE_LOAD_FALSE] = "r",
+	[ROPCODE_LOAD_INT] = "ri",
+	[ROPCODE_LOAD_FLOAT] = "rf",
+	[ROPCODE_LOAD_STRING] = "rs",
+	[ROPCODE_LOAD_FUNCTION] = "ra",
+	[ROPCODE_LOAD_VARIABLE] = "ry",
+	[ROPCODE_LOAD_GLOBAL] = "ry",
+	[ROPCODE_STORE_VARIABLE] = "yr",
+
+	[ROPCODE_BUILD_ARRAY] = "rru",
+	[ROPCODE_BUILD_DICT] = "rru",
+
+	[ROPCODE_IMPORT] = "r",
+	[ROPCODE_IMPORT_AS] = "yr",
+
+	[ROPCODE_SELECT] = "rrr",
+	[ROPCODE_INSERT] = "rrr",
+	[ROPCODE_SELECT_ATTRIBUTE] = "rry",
+	[ROPCODE_INSERT_ATTRIBUTE] = "ryr",
+
+	[ROPCODE_VARIABLE_MAP_PUSH] = "",
+	[ROPCODE_VARIABLE_MAP_POP] = "",
+
+	[ROPCODE_CALL] = "rru",
+	[ROPCODE_RETURN] = "r",
+
+	[ROPCODE_JUMP] = "a",
+	[ROPCODE_JUMP_IF_FALSE] = "ra",
+
+	[ROPCODE_ADD] = "rrr",
+	[ROPCODE_SUB] = "rrr",
+	[ROPCODE_MUL] = "rrr",
+	[ROPCODE_DIV] = "rrr",
+	[ROPCODE_MOD] = "rrr",
+	[ROPCODE_POW] = "rrr",
+	[ROPCODE_NEG] = "rr",
+	[ROPCODE_LSS] = "rrr",
+	[ROPCODE_GRT] = "rrr",
+	[ROPCODE_LEQ] = "rrr",
+	[ROPCODE_GEQ] = "rrr",
+	[ROPCODE_EQL] = "rrr",
+	[ROPCODE_NQL] = "rrr",
+	[ROPCODE_AND] = "rrr",
+	[ROPCODE_OR] = "rrr",
+	[ROPCODE_NOT] = "rr",
+	[ROPCODE_SHL] = "rrr",
+	[ROPCODE_SHR] = "rrr",
+	[ROPCODE_BITWISE_AND] = "rrr",
+	[ROPCODE_BITWISE_OR] = "rrr",
+	[ROPCODE_BITWISE_XOR] = "rrr",
+	[ROPCODE_BITWISE_NOT] = "rr",
+};
+
+const char *nj_get_ropcode_operands(uint32_t opcode)
+{
+	if(opcode >= ROPCODE_COUNT)
+		return 0;
+
+	return roperand_types[opcode];
+}
+
+static const char *get_ropcode_name(uint32_t opcode)
+{
+	switch(opcode) {
+		case ROPCODE_NOPE: return "NOPE";
+		case ROPCODE_QUIT: return "QUIT";
+		case ROPCODE_OFFSET: return "OFFSET";
+
+		case ROPCODE_ENTER: return "ENTER";
+		case ROPCODE_MOVE: return "MOVE";
+
+		case ROPCODE_LOAD_NULL: return "LOAD_NULL";
+		case ROPCODE_LOAD_TRUE: return "LOAD_TRUE";
+		case ROPCODE_LOAD_FALSE: return "LOAD_FALSE";
+		case ROPCODE_LOAD_INT: return "LOAD_INT";
+		case ROPCODE_LOAD_FLOAT: return "LOAD_FLOAT";
+		case ROPCODE_LOAD_STRING: return "LOAD_STRING";
+		case ROPCODE_LOAD_FUNCTION: return "LOAD_FUNCTION";
+		case ROPCODE_LOAD_VARIABLE: return "LOAD_VARIABLE";
+		case ROPCODE_LOAD_GLOBAL: return "LOAD_GLOBAL";
+		case ROPCODE_STORE_VARIABLE: return "STORE_VARIABLE";
+
+		case ROPCODE_BUILD_ARRAY: return "BUILD_ARRAY";
+		case ROPCODE_BUILD_DICT: return "BUILD_DICT";
+
+		case ROPCODE_IMPORT: return "IMPORT";
+		case ROPCODE_IMPORT_AS: return "IMPORT_AS";
+
+		case ROPCODE_SELECT: return "SELECT";
+		case ROPCODE_INSERT: return "INSERT";
+		case ROPCODE_SELECT_ATTRIBUTE: return "SELECT_ATTRIBUTE";
+		case ROPCODE_INSERT_ATTRIBUTE: return "INSERT_ATTRIBUTE";
+
+		case ROPCODE_VARIABLE_MAP_PUSH: return "VARIABLE_MAP_PUSH";
+		case ROPCODE_VARIABLE_MAP_POP: return "VARIABLE_MAP_POP";
+
+		case ROPCODE_CALL: return "CALL";
+		case ROPCODE_RETURN: return "RETURN";
+
+		case ROPCODE_JUMP: return "JUMP";
+		case ROPCODE_JUMP_IF_FALSE: return "JUMP_IF_FALSE";
+
+		case ROPCODE_ADD: return "ADD";
+		case ROPCODE_SUB: return "SUB";
+		case ROPCODE_MUL: return "MUL";
+		case ROPCODE_DIV: return "DIV";
+		case ROPCODE_MOD: return "MOD";
+		case ROPCODE_POW: return "POW";
+		case ROPCODE_NEG: return "NEG";
+		case ROPCODE_LSS: return "LSS";
+		case ROPCODE_GRT: return "GRT";
+		case ROPCODE_LEQ: return "LEQ";
+		case ROPCODE_GEQ: return "GEQ";
+		case ROPCODE_EQL: return "EQL";
+		case ROPCODE_NQL: return "NQL";
+		case ROPCODE_AND: return "AND";
+		case ROPCODE_OR: return "OR";
+		case ROPCODE_NOT: return "NOT";
+		case ROPCODE_SHL: return "SHL";
+		case ROPCODE_SHR: return "SHR";
+		case ROPCODE_BITWISE_AND: return "BITWISE_AND";
+		case ROPCODE_BITWISE_OR: return "BITWISE_OR";
+		case ROPCODE_BITWISE_XOR: return "BITWISE_XOR";
+		case ROPCODE_BITWISE_NOT: return "BITWISE_NOT";
+	}
+
+	return "???";
+}
+
+static void disassemble(char *code, char *data, uint32_t code_size, uint32_t data_size, const char *(*get_operands)(uint32_t), const char *(*get_name)(uint32_t))
 {
 	{
 		uint32_t i = 0;
@@ -172,13 +352,13 @@ void nj_disassemble(char *code, char *data, uint32_t code_size, uint32_t data_si
 
 		uint32_t opcode = *(uint32_t*) (code + i);
 
-		const char *name = get_opcode_name(opcode);
+		const char *name = get_name(opcode);
 
 		fprintf(stdout, "%-4d | %s ", i, name);
 
 		i += sizeof(uint32_t);
 
-		const char *operands = get_instruction_operands(opcode);
+		const char *operands = get_operands(opcode);
 
 		assert(operands);
 
@@ -202,6 +382,21 @@ void nj_disassemble(char *code, char *data, uint32_t code_size, uint32_t data_si
 					i += sizeof(uint32_t);
 					break;
 				}
+				case 'y':
+				{
+					uint32_t index = *(uint32_t*) (code + i);
+					uint32_t offset = 0;
+
+					// Symbol n is the n-th string of the data segment
+
+					for(uint32_t k = 0; k < index && offset < data_size; k++)
+						offset += strlen(data + offset) + 1;
+
+					fprintf(stdout, "%d (%s)", index, offset < data_size ? data + offset : "???");
+
+					i += sizeof(uint32_t);
+					break;
+				}
 				case 'f':
 				{
 					fprintf(stdout, "%f", *(double*) (code + i));
@@ -210,6 +405,15 @@ void nj_disassemble(char *code, char *data, uint32_t code_size, uint32_t data_si
 					break;
 				}
 
+				case 'r':
+				{
+					fprintf(stdout, "r%d", *(uint32_t*) (code + i));
+
+					i += sizeof(uint32_t);
+					break;
+				}
+
+				case 'u':
 				case 'a':
 				{
 					fprintf(stdout, "%d", *(uint32_t*) (code + i));
@@ -229,4 +433,14 @@ void nj_disassemble(char *code, char *data, uint32_t code_size, uint32_t data_si
 
 		fprintf(stdout, "\n");
 	}
-}
\ No newline at end of file
+}
+
+void nj_disassemble(char *code, char *data, uint32_t code_size, uint32_t data_size)
+{
+	disassemble(code, data, code_size, data_size, nj_get_opcode_operands, nj_get_opcode_name);
+}
+
+void nj_disassemble_register(char *code, char *data, uint32_t code_size, uint32_t data_size)
+{
+	disassemble(code, data, code_size, data_size, nj_get_ropcode_operands, get_ropcode_name);
+}
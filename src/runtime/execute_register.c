@@ -0,0 +1,958 @@
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+
+#include "noja.h"
+#include "bytecode.h"
+
+//
+// The execution loop of the register-based bytecode. Like
+// nj_execute, it relies on the segments being verified when
+// they're loaded, dispatches through a table of labels when
+// the compiler supports it and only collects at safepoints.
+//
+// The registers of all frames live in a single array. A
+// CALL starts the callee's frame right after the callable,
+// so the arguments the caller computed in the registers
+// that follow it become the callee's first registers
+// without being copied.
+//
+
+#if defined(__GNUC__) && !defined(NJ_SWITCH_DISPATCH)
+#define NJ_THREADED_DISPATCH
+#endif
+
+typedef struct {
+	uint32_t segment;
+	char *code;
+	char *ip;
+	char *data;
+	nj_symbol_t **symbols;
+	nj_inline_cache_t **sites;
+} cursor_t;
+
+static inline void cursor_load(nj_state_t *state, cursor_t *cur);
+static inline void cursor_save(nj_state_t *state, cursor_t *cur);
+
+static inline void fetch_u32(cursor_t *cur, uint32_t *value);
+static inline void fetch_i64(cursor_t *cur, int64_t *value);
+static inline void fetch_f64(cursor_t *cur, double *value);
+static inline void fetch_string(cursor_t *cur, char **value);
+static inline void fetch_symbol(cursor_t *cur, nj_symbol_t **value);
+static inline nj_inline_cache_t *site_cache(cursor_t *cur);
+
+static int grow_registers(nj_state_t *state, uint32_t count);
+static int push_frame(nj_state_t *state, uint32_t dest);
+
+//
+// Collections only happen when entering a frame and on
+// backward jumps. At that point every live value is in
+// a register.
+//
+
+#define SAFEPOINT()									\
+	do {											\
+		if(nj_should_collect(state))				\
+			if(!nj_collect(state)) {				\
+				nj_fail(state, "Out of heap");		\
+				return 0;							\
+			}										\
+	} while(0)
+
+#ifdef NJ_COUNT_DISPATCH
+#define COUNT_DISPATCH() (state->dispatched++)
+#else
+#define COUNT_DISPATCH()
+#endif
+
+#ifdef NJ_THREADED_DISPATCH
+
+#define CASE(opcode) label_##opcode
+
+#define NEXT											\
+	do {												\
+		uint32_t opcode;								\
+		COUNT_DISPATCH();								\
+		fetch_u32(&cur, &opcode);						\
+		goto *dispatch_table[opcode];					\
+	} while(0)
+
+#else
+
+#define CASE(opcode) case opcode
+#define NEXT break
+
+#endif
+
+#define BINARY_OPERATION(routine, name)							\
+	{															\
+		uint32_t dest, left, right;								\
+																\
+		fetch_u32(&cur, &dest);									\
+		fetch_u32(&cur, &left);									\
+		fetch_u32(&cur, &right);								\
+																\
+		nj_object_t *result = routine(state, regs[left], regs[right]);	\
+																\
+		if(result == 0) {										\
+																\
+			/* #ERROR */										\
+			nj_fail(state, "Failed to execute " name);			\
+			return 0;											\
+		}														\
+																\
+		regs[dest] = result;									\
+		NEXT;													\
+	}
+
+#define UNARY_OPERATION(name)									\
+	{															\
+		/* #ERROR */											\
+		nj_fail(state, name " isn't implemented");				\
+		return 0;												\
+	}
+
+//
+// Runs the register segment on top of the segment stack,
+// starting from the offset on top of the offset stack, until
+// its QUIT instruction. Its frame starts after the registers
+// that are in use. Returns 0 on failure.
+//
+int nj_execute_register(nj_state_t *state)
+{
+	uint32_t saved_base = state->registers_base;
+	uint32_t saved_used = state->registers_used;
+	uint32_t frames_at_entry = state->register_frames_used;
+
+	state->registers_base = state->registers_used;
+
+	cursor_t cur;
+
+	cursor_load(state, &cur);
+
+	// Set by the ENTER every segment starts with
+
+	nj_object_t **regs = 0;
+
+#ifdef NJ_THREADED_DISPATCH
+
+	static void *dispatch_table[ROPCODE_COUNT] = {
+		[ROPCODE_NOPE] = &&label_ROPCODE_NOPE,
+		[ROPCODE_QUIT] = &&label_ROPCODE_QUIT,
+		[ROPCODE_OFFSET] = &&label_ROPCODE_OFFSET,
+		[ROPCODE_ENTER] = &&label_ROPCODE_ENTER,
+		[ROPCODE_MOVE] = &&label_ROPCODE_MOVE,
+		[ROPCODE_LOAD_NULL] = &&label_ROPCODE_LOAD_NULL,
+		[ROPCODE_LOAD_TRUE] = &&label_ROPCODE_LOAD_TRUE,
+		[ROPCODE_LOAD_FALSE] = &&label_ROPCODE_LOAD_FALSE,
+		[ROPCODE_LOAD_INT] = &&label_ROPCODE_LOAD_INT,
+		[ROPCODE_LOAD_FLOAT] = &&label_ROPCODE_LOAD_FLOAT,
+		[ROPCODE_LOAD_STRING] = &&label_ROPCODE_LOAD_STRING,
+		[ROPCODE_LOAD_FUNCTION] = &&label_ROPCODE_LOAD_FUNCTION,
+		[ROPCODE_LOAD_VARIABLE] = &&label_ROPCODE_LOAD_VARIABLE,
+		[ROPCODE_LOAD_GLOBAL] = &&label_ROPCODE_LOAD_GLOBAL,
+		[ROPCODE_STORE_VARIABLE] = &&label_ROPCODE_STORE_VARIABLE,
+		[ROPCODE_BUILD_ARRAY] = &&label_ROPCODE_BUILD_ARRAY,
+		[ROPCODE_BUILD_DICT] = &&label_ROPCODE_BUILD_DICT,
+		[ROPCODE_IMPORT] = &&label_ROPCODE_IMPORT,
+		[ROPCODE_IMPORT_AS] = &&label_ROPCODE_IMPORT_AS,
+		[ROPCODE_SELECT] = &&label_ROPCODE_SELECT,
+		[ROPCODE_INSERT] = &&label_ROPCODE_INSERT,
+		[ROPCODE_SELECT_ATTRIBUTE] = &&label_ROPCODE_SELECT_ATTRIBUTE,
+		[ROPCODE_INSERT_ATTRIBUTE] = &&label_ROPCODE_INSERT_ATTRIBUTE,
+		[ROPCODE_VARIABLE_MAP_PUSH] = &&label_ROPCODE_VARIABLE_MAP_PUSH,
+		[ROPCODE_VARIABLE_MAP_POP] = &&label_ROPCODE_VARIABLE_MAP_POP,
+		[ROPCODE_CALL] = &&label_ROPCODE_CALL,
+		[ROPCODE_RETURN] = &&label_ROPCODE_RETURN,
+		[ROPCODE_JUMP] = &&label_ROPCODE_JUMP,
+		[ROPCODE_JUMP_IF_FALSE] = &&label_ROPCODE_JUMP_IF_FALSE,
+		[ROPCODE_ADD] = &&label_ROPCODE_ADD,
+		[ROPCODE_SUB] = &&label_ROPCODE_SUB,
+		[ROPCODE_MUL] = &&label_ROPCODE_MUL,
+		[ROPCODE_DIV] = &&label_ROPCODE_DIV,
+		[ROPCODE_MOD] = &&label_ROPCODE_MOD,
+		[ROPCODE_POW] = &&label_ROPCODE_POW,
+		[ROPCODE_NEG] = &&label_ROPCODE_NEG,
+		[ROPCODE_LSS] = &&label_ROPCODE_LSS,
+		[ROPCODE_GRT] = &&label_ROPCODE_GRT,
+		[ROPCODE_LEQ] = &&label_ROPCODE_LEQ,
+		[ROPCODE_GEQ] = &&label_ROPCODE_GEQ,
+		[ROPCODE_EQL] = &&label_ROPCODE_EQL,
+		[ROPCODE_NQL] = &&label_ROPCODE_NQL,
+		[ROPCODE_AND] = &&label_ROPCODE_AND,
+		[ROPCODE_OR] = &&label_ROPCODE_OR,
+		[ROPCODE_NOT] = &&label_ROPCODE_NOT,
+		[ROPCODE_SHL] = &&label_ROPCODE_SHL,
+		[ROPCODE_SHR] = &&label_ROPCODE_SHR,
+		[ROPCODE_BITWISE_AND] = &&label_ROPCODE_BITWISE_AND,
+		[ROPCODE_BITWISE_OR] = &&label_ROPCODE_BITWISE_OR,
+		[ROPCODE_BITWISE_XOR] = &&label_ROPCODE_BITWISE_XOR,
+		[ROPCODE_BITWISE_NOT] = &&label_ROPCODE_BITWISE_NOT,
+	};
+
+	NEXT;
+
+	{
+#else
+
+	while(1) {
+
+		uint32_t opcode;
+
+		COUNT_DISPATCH();
+		fetch_u32(&cur, &opcode);
+
+		switch(opcode) {
+#endif
+
+		CASE(ROPCODE_NOPE): NEXT;
+
+		CASE(ROPCODE_QUIT):
+		cursor_save(state, &cur);
+		state->registers_base = saved_base;
+		state->registers_used = saved_used;
+		return 1;
+
+		CASE(ROPCODE_OFFSET):
+		{
+			uint32_t offset;
+
+			fetch_u32(&cur, &offset);
+
+			state->offset = offset;
+			NEXT;
+		}
+
+		CASE(ROPCODE_ENTER):
+		{
+			uint32_t count, argc;
+
+			fetch_u32(&cur, &count);
+			fetch_u32(&cur, &argc);
+
+			// The CALL already checked the argument count
+
+			uint32_t base = state->registers_base;
+
+			if(!grow_registers(state, base + count)) {
+
+				// #ERROR
+				nj_fail(state, "Out of memory. Failed to grow the registers");
+				return 0;
+			}
+
+			// The arguments are already in place
+
+			for(uint32_t i = argc; i < count; i++)
+				state->registers[base + i] = (nj_object_t*) &state->null_object;
+
+			state->registers_used = base + count;
+
+			regs = state->registers + base;
+
+			SAFEPOINT();
+			NEXT;
+		}
+
+		CASE(ROPCODE_MOVE):
+		{
+			uint32_t dest, source;
+
+			fetch_u32(&cur, &dest);
+			fetch_u32(&cur, &source);
+
+			regs[dest] = regs[source];
+			NEXT;
+		}
+
+		CASE(ROPCODE_LOAD_NULL):
+		{
+			uint32_t dest;
+
+			fetch_u32(&cur, &dest);
+
+			regs[dest] = (nj_object_t*) &state->null_object;
+			NEXT;
+		}
+
+		CASE(ROPCODE_LOAD_TRUE):
+		{
+			uint32_t dest;
+
+			fetch_u32(&cur, &dest);
+
+			regs[dest] = (nj_object_t*) &state->true_object;
+			NEXT;
+		}
+
+		CASE(ROPCODE_LOAD_FALSE):
+		{
+			uint32_t dest;
+
+			fetch_u32(&cur, &dest);
+
+			regs[dest] = (nj_object_t*) &state->false_object;
+			NEXT;
+		}
+
+		CASE(ROPCODE_LOAD_INT):
+		{
+			uint32_t dest;
+			int64_t value;
+
+			fetch_u32(&cur, &dest);
+			fetch_i64(&cur, &value);
+
+			nj_object_t *object = nj_object_from_c_int(state, value);
+
+			if(object == 0) {
+
+				// #ERROR
+				nj_fail(state, "Failed to create integer object");
+				return 0;
+			}
+
+			regs[dest] = object;
+			NEXT;
+		}
+
+		CASE(ROPCODE_LOAD_FLOAT):
+		{
+			uint32_t dest;
+			double value;
+
+			fetch_u32(&cur, &dest);
+			fetch_f64(&cur, &value);
+
+			nj_object_t *object = nj_object_from_c_float(state, value);
+
+			if(object == 0) {
+
+				// #ERROR
+				nj_fail(state, "Failed to create floating point object");
+				return 0;
+			}
+
+			regs[dest] = object;
+			NEXT;
+		}
+
+		CASE(ROPCODE_LOAD_STRING):
+		{
+			uint32_t dest;
+			char *value;
+
+			fetch_u32(&cur, &dest);
+			fetch_string(&cur, &value);
+
+			nj_object_t *object = nj_object_from_c_string_ref(state, value, strlen(value));
+
+			if(object == 0) {
+
+				// #ERROR
+				nj_fail(state, "Failed to create string object");
+				return 0;
+			}
+
+			regs[dest] = object;
+			NEXT;
+		}
+
+		CASE(ROPCODE_LOAD_FUNCTION):
+		{
+			uint32_t dest, address;
+
+			fetch_u32(&cur, &dest);
+			fetch_u32(&cur, &address);
+
+			nj_object_t *object = nj_object_from_segment_and_offset(state, cur.segment, address);
+
+			if(object == 0) {
+
+				// #ERROR
+				nj_fail(state, "Failed to create function object");
+				return 0;
+			}
+
+			regs[dest] = object;
+			NEXT;
+		}
+
+		CASE(ROPCODE_LOAD_VARIABLE):
+		{
+			nj_inline_cache_t *cache = site_cache(&cur);
+			uint32_t dest;
+			nj_symbol_t *name;
+
+			fetch_u32(&cur, &dest);
+			fetch_symbol(&cur, &name);
+
+			nj_object_t *locals = 0;
+
+			if(object_stack_size(&state->vars_stack) > 0)
+				locals = object_top(&state->vars_stack);
+
+			nj_object_t *object = nj_cached_select_variable(state, cache, locals, state->segments[cur.segment].global_variables_map, name);
+
+			if(object == 0) {
+
+				// #ERROR
+				nj_fail(state, "Undefined variable [${zero-terminated-string}] was referenced", name->text);
+				return 0;
+			}
+
+			regs[dest] = object;
+			NEXT;
+		}
+
+		CASE(ROPCODE_LOAD_GLOBAL):
+		{
+			nj_inline_cache_t *cache = site_cache(&cur);
+			uint32_t dest;
+			nj_symbol_t *name;
+
+			fetch_u32(&cur, &dest);
+			fetch_symbol(&cur, &name);
+
+			nj_object_t *object = nj_cached_select_variable(state, cache, 0, state->segments[cur.segment].global_variables_map, name);
+
+			if(object == 0) {
+
+				// #ERROR
+				nj_fail(state, "Undefined variable [${zero-terminated-string}] was referenced", name->text);
+				return 0;
+			}
+
+			regs[dest] = object;
+			NEXT;
+		}
+
+		CASE(ROPCODE_STORE_VARIABLE):
+		{
+			uint32_t source;
+			nj_symbol_t *name;
+
+			fetch_symbol(&cur, &name);
+			fetch_u32(&cur, &source);
+
+			nj_object_t *map;
+
+			if(object_stack_size(&state->vars_stack) == 0)
+				map = state->segments[cur.segment].global_variables_map;
+			else
+				map = object_top(&state->vars_stack);
+
+			if(!nj_dictionary_insert_symbol(state, map, name, regs[source])) {
+
+				// #ERROR
+				nj_fail(state, "Failed to execute STORE_VARIABLE instruction. Couldn't insert into the variable map");
+				return 0;
+			}
+			NEXT;
+		}
+
+		CASE(ROPCODE_BUILD_ARRAY):
+		{
+			uint32_t dest, first, count;
+
+			fetch_u32(&cur, &dest);
+			fetch_u32(&cur, &first);
+			fetch_u32(&cur, &count);
+
+			nj_object_t *object = nj_object_istanciate(state, (nj_object_t*) &state->type_object_array);
+
+			if(object == 0) {
+
+				// #ERROR
+				nj_fail(state, "Failed to create array object");
+				return 0;
+			}
+
+			// Same item order as the stack backend
+
+			for(uint32_t i = 0; i < count; i++)
+				if(!nj_array_insert(state, object, i, regs[first + count - i - 1])) {
+
+					// #ERROR
+					nj_fail(state, "Failed to insert item into array while building it");
+					return 0;
+				}
+
+			regs[dest] = object;
+			NEXT;
+		}
+
+		CASE(ROPCODE_BUILD_DICT):
+		{
+			uint32_t dest, first, count;
+
+			fetch_u32(&cur, &dest);
+			fetch_u32(&cur, &first);
+			fetch_u32(&cur, &count);
+
+			nj_object_t *object = nj_object_istanciate(state, (nj_object_t*) &state->type_object_dict);
+
+			if(object == 0) {
+
+				// #ERROR
+				nj_fail(state, "Failed to create dict object");
+				return 0;
+			}
+
+			// Same insertion order as the stack backend
+
+			for(uint32_t i = 0; i < count; i++) {
+
+				uint32_t pair = first + 2 * (count - i - 1);
+
+				if(!nj_object_insert(state, object, regs[pair], regs[pair + 1])) {
+
+					// #ERROR
+					nj_fail(state, "Failed to insert object into dict while building it");
+					return 0;
+				}
+			}
+
+			regs[dest] = object;
+			NEXT;
+		}
+
+		CASE(ROPCODE_IMPORT):
+		{
+			uint32_t path;
+
+			fetch_u32(&cur, &path);
+
+			if(!nj_stack_reserve(state, 1)) {
+
+				// #ERROR
+				nj_fail(state, "Out of memory. Failed to grow evaluation stack");
+				return 0;
+			}
+
+			*state->stack_top++ = regs[path];
+
+			cursor_save(state, &cur);
+
+			if(!nj_import(state))
+				return 0;
+
+			cursor_load(state, &cur);
+
+			// The imported module may have grown them
+
+			regs = state->registers + state->registers_base;
+			NEXT;
+		}
+
+		CASE(ROPCODE_IMPORT_AS):
+		{
+			nj_symbol_t *name;
+			uint32_t path;
+
+			fetch_symbol(&cur, &name);
+			fetch_u32(&cur, &path);
+
+			if(!nj_stack_reserve(state, 1)) {
+
+				// #ERROR
+				nj_fail(state, "Out of memory. Failed to grow evaluation stack");
+				return 0;
+			}
+
+			*state->stack_top++ = regs[path];
+
+			cursor_save(state, &cur);
+
+			if(!nj_import_as(state, name))
+				return 0;
+
+			cursor_load(state, &cur);
+
+			regs = state->registers + state->registers_base;
+			NEXT;
+		}
+
+		CASE(ROPCODE_SELECT):
+		{
+			uint32_t dest, container, key;
+
+			fetch_u32(&cur, &dest);
+			fetch_u32(&cur, &container);
+			fetch_u32(&cur, &key);
+
+			nj_object_t *item = nj_object_select(state, regs[container], regs[key]);
+
+			if(item == 0) {
+
+				// #ERROR
+				nj_fail(state, "Object doesn't contain item");
+				return 0;
+			}
+
+			regs[dest] = item;
+			NEXT;
+		}
+
+		CASE(ROPCODE_INSERT):
+		{
+			uint32_t container, key, item;
+
+			fetch_u32(&cur, &container);
+			fetch_u32(&cur, &key);
+			fetch_u32(&cur, &item);
+
+			if(!nj_object_insert(state, regs[container], regs[key], regs[item])) {
+
+				// #ERROR
+				nj_fail(state, "Failed to insert item into object");
+				return 0;
+			}
+			NEXT;
+		}
+
+		CASE(ROPCODE_SELECT_ATTRIBUTE):
+		{
+			nj_inline_cache_t *cache = site_cache(&cur);
+			uint32_t dest, container;
+			nj_symbol_t *name;
+
+			fetch_u32(&cur, &dest);
+			fetch_u32(&cur, &container);
+			fetch_symbol(&cur, &name);
+
+			nj_object_t *selected = nj_cached_select_attribute(state, cache, regs[container], name);
+
+			if(selected == 0) {
+
+				// #ERROR
+				nj_fail(state, "Failed to select attribute");
+				return 0;
+			}
+
+			regs[dest] = selected;
+			NEXT;
+		}
+
+		CASE(ROPCODE_INSERT_ATTRIBUTE):
+		{
+			uint32_t container, item;
+			nj_symbol_t *name;
+
+			fetch_u32(&cur, &container);
+			fetch_symbol(&cur, &name);
+			fetch_u32(&cur, &item);
+
+			if(!nj_object_insert_attribute_symbol(state, regs[container], name, regs[item])) {
+
+				// #ERROR
+				nj_fail(state, "Failed to insert attribute");
+				return 0;
+			}
+			NEXT;
+		}
+
+		CASE(ROPCODE_VARIABLE_MAP_PUSH):
+		{
+			nj_object_t *dict = nj_object_istanciate(state, (nj_object_t*) &state->type_object_dict);
+
+			if(dict == 0) {
+
+				// #ERROR
+				nj_fail(state, "Failed to create variable map object");
+				return 0;
+			}
+
+			if(!object_push(&state->vars_stack, dict)) {
+
+				// #ERROR
+				nj_fail(state, "Out of memory. Failed to grow variable map stack");
+				return 0;
+			}
+			NEXT;
+		}
+
+		CASE(ROPCODE_VARIABLE_MAP_POP):
+		{
+			if(object_stack_size(&state->vars_stack) == 0) {
+
+				// #ERROR
+				nj_fail(state, "VARIABLE_MAP_POP while the variable map stack is empty");
+				return 0;
+			}
+
+			object_pop(&state->vars_stack);
+			NEXT;
+		}
+
+		CASE(ROPCODE_CALL):
+		{
+			uint32_t dest, first, argc;
+
+			fetch_u32(&cur, &dest);
+			fetch_u32(&cur, &first);
+			fetch_u32(&cur, &argc);
+
+			nj_object_t *callable = regs[first];
+			nj_object_t *type = nj_object_type_of(state, callable);
+
+			if(type == (nj_object_t*) &state->type_object_cfunction) {
+
+				// The arguments are passed in place
+
+				nj_object_t *result = ((nj_object_cfunction_t*) callable)->routine(state, argc, regs + first + 1);
+
+				if(result == 0) {
+
+					if(!nj_failed(state))
+						nj_fail(state, "C function returned NULL but didn't raise an error!");
+					return 0;
+				}
+
+				regs[dest] = result;
+
+			} else if(type == (nj_object_t*) &state->type_object_function) {
+
+				nj_object_function_t *function = (nj_object_function_t*) callable;
+
+				// Functions start with ENTER count, argc
+
+				segment_t *segment = state->segments + function->segment;
+
+				assert(segment->flags & SEGMENT_IS_REGISTER);
+
+				if(*(uint32_t*) (segment->code + function->offset + 8) != argc) {
+
+					// #ERROR
+					nj_fail(state, "Function call didn't provide the required number of arguments");
+					return 0;
+				}
+
+				if(!push_frame(state, dest)) {
+
+					// #ERROR
+					nj_fail(state, "Out of memory. Failed to grow the frame stack");
+					return 0;
+				}
+
+				cursor_save(state, &cur);
+
+				if(!nj_push_frame(state, function->segment, function->offset)) {
+
+					// #ERROR
+					nj_fail(state, "Out of memory. Failed to grow the frame stack");
+					return 0;
+				}
+
+				state->registers_base += first + 1;
+
+				// The callee's ENTER sets up its registers
+
+				cursor_load(state, &cur);
+
+			} else {
+
+				// #ERROR
+				nj_fail(state, "CALL on something that is not callable");
+				return 0;
+			}
+			NEXT;
+		}
+
+		CASE(ROPCODE_RETURN):
+		{
+			uint32_t source;
+
+			fetch_u32(&cur, &source);
+
+			if(state->register_frames_used == frames_at_entry) {
+
+				// #ERROR
+				nj_fail(state, "RETURN but the call depth is 0");
+				return 0;
+			}
+
+			nj_object_t *result = regs[source];
+
+			nj_register_frame_t *frame = state->register_frames + --state->register_frames_used;
+
+			state->registers_base = frame->base;
+			state->registers_used = frame->used;
+
+			regs = state->registers + frame->base;
+			regs[frame->dest] = result;
+
+			state->frames_used--;
+
+			cursor_load(state, &cur);
+			NEXT;
+		}
+
+		CASE(ROPCODE_JUMP):
+		{
+			uint32_t dest;
+
+			fetch_u32(&cur, &dest);
+
+			if(cur.code + dest < cur.ip)
+				SAFEPOINT();
+
+			cur.ip = cur.code + dest;
+			NEXT;
+		}
+
+		CASE(ROPCODE_JUMP_IF_FALSE):
+		{
+			uint32_t condition, dest;
+
+			fetch_u32(&cur, &condition);
+			fetch_u32(&cur, &dest);
+
+			if(!nj_object_test(state, regs[condition]))
+				cur.ip = cur.code + dest;
+			NEXT;
+		}
+
+		CASE(ROPCODE_ADD): BINARY_OPERATION(nj_object_add, "ADD")
+		CASE(ROPCODE_SUB): BINARY_OPERATION(nj_object_sub, "SUB")
+		CASE(ROPCODE_MUL): BINARY_OPERATION(nj_object_mul, "MUL")
+		CASE(ROPCODE_DIV): BINARY_OPERATION(nj_object_div, "DIV")
+		CASE(ROPCODE_MOD): BINARY_OPERATION(nj_object_mod, "MOD")
+		CASE(ROPCODE_POW): BINARY_OPERATION(nj_object_pow, "POW")
+		CASE(ROPCODE_LSS): BINARY_OPERATION(nj_object_lss, "LSS")
+		CASE(ROPCODE_GRT): BINARY_OPERATION(nj_object_grt, "GRT")
+		CASE(ROPCODE_LEQ): BINARY_OPERATION(nj_object_leq, "LEQ")
+		CASE(ROPCODE_GEQ): BINARY_OPERATION(nj_object_geq, "GEQ")
+		CASE(ROPCODE_EQL): BINARY_OPERATION(nj_object_eql, "EQL")
+		CASE(ROPCODE_NQL): BINARY_OPERATION(nj_object_nql, "NQL")
+		CASE(ROPCODE_AND): BINARY_OPERATION(nj_object_and, "AND")
+		CASE(ROPCODE_OR):  BINARY_OPERATION(nj_object_or,  "OR")
+		CASE(ROPCODE_SHL): BINARY_OPERATION(nj_object_shl, "SHL")
+		CASE(ROPCODE_SHR): BINARY_OPERATION(nj_object_shr, "SHR")
+
+		CASE(ROPCODE_BITWISE_AND): BINARY_OPERATION(nj_object_bitwise_and, "BITWISE_AND")
+		CASE(ROPCODE_BITWISE_OR):  BINARY_OPERATION(nj_object_bitwise_or,  "BITWISE_OR")
+		CASE(ROPCODE_BITWISE_XOR): BINARY_OPERATION(nj_object_bitwise_xor, "BITWISE_XOR")
+
+		// Not implemented by the stack backend either
+
+		CASE(ROPCODE_NEG):         UNARY_OPERATION("NEG")
+		CASE(ROPCODE_NOT):         UNARY_OPERATION("NOT")
+		CASE(ROPCODE_BITWISE_NOT): UNARY_OPERATION("BITWISE_NOT")
+
+#ifndef NJ_THREADED_DISPATCH
+		default:
+		// #ERROR
+		// Unexpected opcode
+		nj_fail(state, "Unknown opcode");
+		return 0;
+		}
+#endif
+	}
+}
+
+static int grow_registers(nj_state_t *state, uint32_t count)
+{
+	if(count <= state->registers_size)
+		return 1;
+
+	uint32_t new_size = state->registers_size ? state->registers_size * 2 : 256;
+
+	while(new_size < count)
+		new_size *= 2;
+
+	nj_object_t **registers = realloc(state->registers, sizeof(nj_object_t*) * new_size);
+
+	if(registers == 0)
+		return 0;
+
+	state->registers = registers;
+	state->registers_size = new_size;
+	return 1;
+}
+
+static int push_frame(nj_state_t *state, uint32_t dest)
+{
+	if(state->register_frames_used == state->register_frames_size) {
+
+		uint32_t new_size = state->register_frames_size ? state->register_frames_size * 2 : 64;
+
+		nj_register_frame_t *frames = realloc(state->register_frames, sizeof(nj_register_frame_t) * new_size);
+
+		if(frames == 0)
+			return 0;
+
+		state->register_frames = frames;
+		state->register_frames_size = new_size;
+	}
+
+	state->register_frames[state->register_frames_used++] = (nj_register_frame_t) {
+		.base = state->registers_base,
+		.used = state->registers_used,
+		.dest = dest,
+	};
+
+	return 1;
+}
+
+static inline void cursor_load(nj_state_t *state, cursor_t *cur)
+{
+	nj_frame_t *frame = state->frames + state->frames_used - 1;
+
+	cur->segment = frame->segment;
+
+	segment_t *segment = state->segments + cur->segment;
+
+	assert(segment->flags & SEGMENT_IS_TRUSTED);
+	assert(segment->flags & SEGMENT_IS_REGISTER);
+
+	cur->code = segment->code;
+	cur->ip = segment->code + frame->offset;
+	cur->data = segment->data;
+	cur->symbols = segment->symbols;
+	cur->sites = segment->sites;
+}
+
+static inline void cursor_save(nj_state_t *state, cursor_t *cur)
+{
+	state->frames[state->frames_used - 1].offset = cur->ip - cur->code;
+}
+
+static inline void fetch_u32(cursor_t *cur, uint32_t *value)
+{
+	*value = *(uint32_t*) cur->ip;
+	cur->ip += sizeof(uint32_t);
+}
+
+static inline void fetch_i64(cursor_t *cur, int64_t *value)
+{
+	*value = *(int64_t*) cur->ip;
+	cur->ip += sizeof(int64_t);
+}
+
+static inline void fetch_f64(cursor_t *cur, double *value)
+{
+	*value = *(double*) cur->ip;
+	cur->ip += sizeof(double);
+}
+
+static inline void fetch_string(cursor_t *cur, char **value)
+{
+	*value = cur->data + *(uint32_t*) cur->ip;
+	cur->ip += sizeof(uint32_t);
+}
+
+static inline void fetch_symbol(cursor_t *cur, nj_symbol_t **value)
+{
+	*value = cur->symbols[*(uint32_t*) cur->ip];
+	cur->ip += sizeof(uint32_t);
+}
+
+//
+// The inline cache of the instruction whose opcode was just
+// fetched.
+//
+static inline nj_inline_cache_t *site_cache(cursor_t *cur)
+{
+	return cur->sites[(cur->ip - cur->code) / sizeof(uint32_t) - 1];
+}
@@ -1,4 +1,5 @@
 
+#include <time.h>
 #include <string.h>
 #include <stdlib.h>
 #include "noja.h"
@@ -17,6 +18,218 @@ int nj_collect_children(nj_state_t *state, nj_object_t *object)
 	return 1;
 }
 
+#define ALIGN8(size) (((size) + 7) & ~(size_t) 7)
+
+// Offset of the first object of a block
+#define BLOCK_START ALIGN8(sizeof(nj_block_t))
+
+static nj_block_t *block_of(nj_object_t *object)
+{
+	return (nj_block_t*) ((uintptr_t) object & ~(uintptr_t) (NJ_BLOCK_SIZE - 1));
+}
+
+static nj_block_t *append_block(nj_heap_t *heap)
+{
+	void *memory;
+
+	if(posix_memalign(&memory, NJ_BLOCK_SIZE, NJ_BLOCK_SIZE))
+		return 0;
+
+	nj_block_t *block = memory;
+	block->next = NULL;
+	block->used = BLOCK_START;
+	block->epoch = heap->epoch;
+
+	if(heap->last)
+		heap->last->next = block;
+	else
+		heap->blocks = block;
+
+	heap->last = block;
+
+	return block;
+}
+
+static void *old_allocate(nj_heap_t *heap, size_t size)
+{
+	nj_block_t *block = heap->last;
+
+	assert(BLOCK_START + size <= NJ_BLOCK_SIZE);
+
+	if(block == NULL || block->used + size > NJ_BLOCK_SIZE) {
+
+		block = append_block(heap);
+
+		if(block == 0)
+			return 0;
+	}
+
+	void *address = (char*) block + block->used;
+
+	block->used += size;
+	heap->old_used += size;
+
+	return address;
+}
+
+int nj_init_heap(nj_heap_t *heap, const nj_heap_options_t *options)
+{
+	heap->nursery = malloc(options->nursery_size);
+
+	if(heap->nursery == 0)
+		return 0;
+
+	heap->nursery_size = options->nursery_size;
+	heap->nursery_used = 0;
+
+	heap->allocated = 0;
+	heap->budget = options->nursery_size;
+	heap->min_budget = options->nursery_size;
+	heap->growth = options->growth;
+
+	heap->blocks = NULL;
+	heap->last = NULL;
+	heap->condemned = NULL;
+	heap->old_used = 0;
+	heap->old_limit = options->heap_size;
+	heap->heap_size = options->heap_size;
+	heap->epoch = 0;
+	heap->major = 0;
+
+	heap->incremental = options->incremental;
+	heap->max_pause_ns = (uint64_t) options->max_pause_us * 1000;
+	heap->marking = 0;
+	heap->stepping = 0;
+	heap->sweeping = 0;
+	heap->compact = 0;
+	heap->mark_overflow = 0;
+	heap->trigger = options->nursery_size;
+	heap->gray = NULL;
+	heap->gray_size = 0;
+	heap->gray_used = 0;
+	heap->sweep_link = NULL;
+	heap->sweep_stop = NULL;
+	heap->swept_used = 0;
+	heap->swept_live = 0;
+
+	heap->remembered = NULL;
+	heap->remembered_size = 0;
+	heap->remembered_used = 0;
+	heap->remembered_overflow = 0;
+
+	nj_init_payloads(&heap->payloads);
+
+	memset(&heap->finalizable_young, 0, sizeof(nj_finalizable_t));
+	memset(&heap->finalizable_old, 0, sizeof(nj_finalizable_t));
+
+	memset(&heap->stats, 0, sizeof(heap->stats));
+	heap->trace = NULL;
+
+	return 1;
+}
+
+void *nj_heap_allocate(nj_state_t *state, size_t size)
+{
+	nj_heap_t *heap = &state->heap;
+
+	size = ALIGN8(size);
+
+	heap->allocated += size;
+	heap->stats.bytes_allocated += size;
+
+	if(heap->nursery_used + size <= heap->nursery_size) {
+
+		void *address = heap->nursery + heap->nursery_used;
+
+		heap->nursery_used += size;
+
+		return address;
+	}
+
+	// The nursery is full. The object goes directly in the old
+	// space, where the write barrier takes care of it.
+
+	return old_allocate(heap, size);
+}
+
+void nj_remember(nj_state_t *state, nj_object_t *object)
+{
+	nj_heap_t *heap = &state->heap;
+
+	if(heap->remembered_used == heap->remembered_size) {
+
+		uint32_t size = heap->remembered_size ? heap->remembered_size * 2 : 256;
+
+		nj_object_t **remembered = realloc(heap->remembered, sizeof(nj_object_t*) * size);
+
+		if(remembered == 0) {
+
+			heap->remembered_overflow = 1;
+			return;
+		}
+
+		heap->remembered = remembered;
+		heap->remembered_size = size;
+	}
+
+	object->flags |= OBJECT_IS_REMEMBERED;
+
+	heap->remembered[heap->remembered_used++] = object;
+}
+
+//
+// Marks an old object and queues it, so that a following
+// marking step marks its children.
+//
+static void shade(nj_heap_t *heap, nj_object_t *object)
+{
+	if(object->flags & OBJECT_IS_MARKED)
+		return;
+
+	object->flags |= OBJECT_IS_MARKED;
+
+	if(heap->gray_used == heap->gray_size) {
+
+		uint32_t size = heap->gray_size ? heap->gray_size * 2 : 256;
+
+		nj_object_t **gray = realloc(heap->gray, sizeof(nj_object_t*) * size);
+
+		if(gray == 0) {
+
+			heap->mark_overflow = 1;
+			return;
+		}
+
+		heap->gray = gray;
+		heap->gray_size = size;
+	}
+
+	heap->gray[heap->gray_used++] = object;
+}
+
+void nj_shade(nj_state_t *state, nj_object_t *object)
+{
+	shade(&state->heap, object);
+}
+
+//
+// Tells whether [object] is in the space being evacuated:
+// the nursery and, during major collections, the old
+// blocks that were created before it started.
+//
+static int is_condemned(nj_heap_t *heap, nj_object_t *object)
+{
+	if(nj_is_young(heap, object))
+		return 1;
+
+	return heap->major && block_of(object)->epoch != heap->epoch;
+}
+
+//
+// Copies the object to the old space, leaving a forwarding
+// pointer behind. Its children are copied when the copy is
+// reached by the scan of the old space.
+//
 int nj_collect_object(nj_state_t *state, nj_object_t **reference)
 {
 
@@ -30,41 +243,60 @@ int nj_collect_object(nj_state_t *state, nj_object_t **reference)
 		return 1;
 	}
 
+	if(nj_is_immediate(*reference))
+		return 1;
+
+	if(!((*reference)->flags & OBJECT_IS_COLLECTABLE))
+
+		return nj_collect_children(state, *reference);
+
 	if((*reference)->flags & OBJECT_WAS_MOVED) {
 
 		*reference = (*(nj_moved_object_t**) reference)->new_location;
 
 		return 1;
 	}
-	
-	if(!((*reference)->flags & OBJECT_IS_COLLECTABLE))
 
-		return nj_collect_children(state, *reference);
+	// Objects that were already copied and old objects
+	// during minor collections stay where they are. While
+	// marking, the old ones are shaded. Marking steps
+	// don't copy anything.
 
-	// Align heap pointer
+	if(state->heap.stepping || !is_condemned(&state->heap, *reference)) {
 
-	if(state->temp_heap.used & 7)
-		state->temp_heap.used = (state->temp_heap.used & ~7) + 8;
+		if(state->heap.marking && !nj_is_young(&state->heap, *reference))
+			shade(&state->heap, *reference);
 
-	// Allocate
+		return 1;
+	}
 
-	nj_update_reference(&(*reference)->type);
+	size_t object_size = OBJECT_TYPE(*reference)->size;
 
-	size_t object_size = ((nj_object_type_t*) (*reference)->type)->size;
+	nj_object_t *object_copy = old_allocate(&state->heap, ALIGN8(object_size));
 
-	if(state->temp_heap.used + object_size > state->temp_heap.size)
+	if(object_copy == 0)
 
 		// Out of heap
 		return 0;
 
-	nj_object_t *object_copy = (nj_object_t*) (state->temp_heap.chunk + state->temp_heap.used);
+	state->heap.stats.objects_copied++;
+	state->heap.stats.bytes_copied += ALIGN8(object_size);
 
-	state->temp_heap.used += object_size;
+	if(nj_is_young(&state->heap, *reference))
+		state->heap.stats.bytes_promoted += ALIGN8(object_size);
 
 	// Copy the object in the newly allocated space
 
 	memcpy(object_copy, *reference, object_size);
 
+	object_copy->flags &= ~(OBJECT_IS_REMEMBERED | OBJECT_IS_MARKED);
+
+	// Objects promoted while marking are considered reachable
+	// by it. Their children are copied or shaded by the scan.
+
+	if(state->heap.marking)
+		object_copy->flags |= OBJECT_IS_MARKED;
+
 	// Set the old object copy and set the new location pointer
 
 	(*reference)->flags |= OBJECT_WAS_MOVED;
@@ -75,21 +307,24 @@ int nj_collect_object(nj_state_t *state, nj_object_t **reference)
 
 	*reference = object_copy;
 
-	return nj_collect_children(state, object_copy);
+	return 1;
 }
 
 int nj_should_collect(nj_state_t *state)
 {
-	return !!state->heap.overflow_allocations;
+	return state->heap.allocated >= state->heap.trigger;
 }
 
-static int nj_collect_inner(nj_state_t *state)
+//
+// Copies the objects referenced by the roots, adding to
+// [roots] how many they are.
+//
+static int nj_collect_inner(nj_state_t *state, uint64_t *roots)
 {
-
-	printf("Collecting global variable maps (there are %d)\n", state->segments_used);
-
 	// Collect global variable maps
 	{
+		*roots += state->segments_used;
+
 		for(int i = 0; i < state->segments_used; i++) {
 
 			if(!nj_collect_object(state, &state->segments[i].global_variables_map))
@@ -97,10 +332,50 @@ static int nj_collect_inner(nj_state_t *state)
 		}
 	}
 
-	printf("Collecting variable maps\n");
+	// Collect the maps of the imported modules. Those of
+	// source files are also global variable maps, but the
+	// ones made by libraries aren't referenced elsewhere.
+	{
+		*roots += state->modules_used;
+
+		for(uint32_t i = 0; i < state->modules_used; i++) {
+
+			if(state->modules[i].map && !nj_collect_object(state, &state->modules[i].map))
+				return 0;
+		}
+	}
+
+	// Collect the builtins and the method tables of
+	// the types, which are reachable even when no
+	// object of that type is.
+	{
+		if(!nj_collect_object(state, &state->builtins_map))
+			return 0;
+
+		nj_object_type_t *types[] = {
+			&state->type_object_int,
+			&state->type_object_dict,
+			&state->type_object_bool,
+			&state->type_object_null,
+			&state->type_object_type,
+			&state->type_object_array,
+			&state->type_object_float,
+			&state->type_object_string,
+			&state->type_object_function,
+			&state->type_object_cfunction,
+		};
+
+		for(size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+			if(!nj_collect_object(state, &types[i]->methods))
+				return 0;
+
+		*roots += 1 + sizeof(types) / sizeof(types[0]);
+	}
 
 	// Collect variable maps
 	{
+		*roots += state->vars_stack.absolute_size;
+
 		object_stack_chunk_t *chunk = state->vars_stack.tail;
 
 		for(size_t i = 0; i < state->vars_stack.relative_size; i++)
@@ -119,26 +394,31 @@ static int nj_collect_inner(nj_state_t *state)
 		}
 	}
 
-	printf("Collecting stack\n");
-
-	// Collect stack
+	// Collect frame slots
 	{
-		object_stack_chunk_t *chunk = state->eval_stack.tail;
+		*roots += state->locals_used;
 
-		for(size_t i = 0; i < state->eval_stack.relative_size; i++)
-			if(!nj_collect_object(state, &chunk->items[i]))
+		for(uint32_t i = 0; i < state->locals_used; i++)
+			if(!nj_collect_object(state, &state->locals[i]))
 				return 0;
+	}
 
-		chunk = chunk->prev;
+	// Collect the registers of every frame
+	{
+		*roots += state->registers_used;
 
-		while(chunk) {
+		for(uint32_t i = 0; i < state->registers_used; i++)
+			if(!nj_collect_object(state, &state->registers[i]))
+				return 0;
+	}
 
-			for(size_t i = 0; i < OBJECT_STACK_ITEMS_PER_CHUNK; i++)
-				if(!nj_collect_object(state, &chunk->items[i]))
-					return 0;
+	// Collect stack
+	{
+		*roots += state->stack_top - state->stack;
 
-			chunk = chunk->prev;
-		}
+		for(nj_object_t **item = state->stack; item < state->stack_top; item++)
+			if(!nj_collect_object(state, item))
+				return 0;
 	}
 
 	return 1;
@@ -151,75 +431,792 @@ void nj_update_reference(nj_object_t **reference)
 		(*reference) = ((nj_moved_object_t*) *reference)->new_location;
 }
 
+static int reserve(nj_finalizable_t *list, uint32_t count)
+{
+	if(list->used + count <= list->size)
+		return 1;
+
+	uint32_t size = list->size ? list->size : 64;
+
+	while(size < list->used + count)
+		size *= 2;
+
+	nj_object_t **items = realloc(list->items, sizeof(nj_object_t*) * size);
+
+	if(items == 0)
+		return 0;
+
+	list->items = items;
+	list->size = size;
+
+	return 1;
+}
+
+//
+// Called when an object whose type has a finalizer is
+// created.
+//
+int nj_track_finalizable(nj_state_t *state, nj_object_t *object)
+{
+	nj_heap_t *heap = &state->heap;
+
+	nj_finalizable_t *list = nj_is_young(heap, object) ? &heap->finalizable_young : &heap->finalizable_old;
+
+	if(!reserve(list, 1))
+		return 0;
+
+	list->items[list->used++] = object;
+
+	return 1;
+}
+
+//
+// Runs the finalizers of the objects of [list] that didn't
+// survive. The young survivors that were promoted move to
+// the old list, which must have room for them.
+//
+static void finalize(nj_state_t *state, nj_finalizable_t *list, nj_survives_t survives)
+{
+	nj_heap_t *heap = &state->heap;
+
+	uint32_t kept = 0;
+
+	for(uint32_t i = 0; i < list->used; i++) {
+
+		nj_object_t *object = list->items[i];
+
+		if(!survives(heap, &object)) {
+
+			OBJECT_TYPE(object)->on_deinit(state, object);
+
+			heap->stats.objects_finalized++;
+
+		} else if(list == &heap->finalizable_young && !nj_is_young(heap, object))
+
+			heap->finalizable_old.items[heap->finalizable_old.used++] = object;
+
+		else
+
+			list->items[kept++] = object;
+	}
+
+	list->used = kept;
+}
+
+static int survives_none(nj_heap_t *heap, nj_object_t **object)
+{
+	(void) heap;
+	(void) object;
+
+	return 0;
+}
+
+static void free_blocks(nj_state_t *state, nj_block_t *block)
+{
+	while(block) {
+
+		nj_block_t *next = block->next;
+
+		free(block);
+		block = next;
+
+		state->heap.stats.blocks_freed++;
+	}
+}
+
 void nj_destroy_heap(nj_state_t *state, nj_heap_t *heap)
 {
-	size_t i = 0;
+	finalize(state, &heap->finalizable_young, survives_none);
+	finalize(state, &heap->finalizable_old, survives_none);
 
-	while(i < state->heap.used) {
+	free(heap->finalizable_young.items);
+	free(heap->finalizable_old.items);
 
-		if(i & 7)
-			i = (i & ~7) + 8;
+	free_blocks(state, heap->blocks);
+	free_blocks(state, heap->condemned);
 
-		nj_object_t *object = (nj_object_t*) (state->heap.chunk + i);
+	nj_destroy_payloads(&heap->payloads);
 
-		if(!(object->flags & OBJECT_WAS_MOVED)) {
+	free(heap->nursery);
+	free(heap->remembered);
+	free(heap->gray);
+}
 
-			nj_update_reference(&object->type);
+//
+// Tells whether the owner of a payload survived a copying
+// collection, updating it to its new location.
+//
+static int survives_copy(nj_heap_t *heap, nj_object_t **owner)
+{
+	if(!((*owner)->flags & OBJECT_IS_COLLECTABLE))
+		return 1;
 
-			nj_object_type_t *type = (nj_object_type_t*) object->type;
+	if((*owner)->flags & OBJECT_WAS_MOVED) {
 
-			if(type->on_deinit)
-				type->on_deinit(state, object);
+		*owner = ((nj_moved_object_t*) *owner)->new_location;
+		return 1;
+	}
 
+	return !is_condemned(heap, *owner);
+}
+
+//
+// Tells whether the owner of a payload was marked, once
+// marking is done.
+//
+static int survives_mark(nj_heap_t *heap, nj_object_t **owner)
+{
+	(void) heap;
+
+	return ((*owner)->flags & (OBJECT_IS_COLLECTABLE | OBJECT_IS_MARKED)) != OBJECT_IS_COLLECTABLE;
+}
+
+//
+// The old space, payloads included.
+//
+static size_t old_size(nj_heap_t *heap)
+{
+	return heap->old_used + heap->payloads.old_used;
+}
+
+//
+// Copies the children of the objects that were copied to
+// the old space after [offset] of [block], including the
+// ones copied by the scan itself. A NULL [block] means the
+// old space was empty when the collection started.
+//
+static int scan(nj_state_t *state, nj_block_t *block, uint32_t offset)
+{
+	if(block == NULL) {
+
+		block = state->heap.blocks;
+		offset = BLOCK_START;
+	}
+
+	while(block) {
+
+		while(offset < block->used) {
+
+			nj_object_t *object = (nj_object_t*) ((char*) block + offset);
+
+			offset += ALIGN8(OBJECT_TYPE(object)->size);
+
+			if(!nj_collect_children(state, object))
+				return 0;
 		}
 
-		i += OBJECT_TYPE(object)->size;
+		block = block->next;
+		offset = BLOCK_START;
 	}
 
-	overflow_allocation_t *p = state->heap.overflow_allocations;
+	return 1;
+}
 
-	while(p) {
+//
+// Sets the allocation budget of the next cycle from the size
+// of the old space. The nursery is resized to fit it, so that
+// the whole budget is bump-allocated. Sizes are rounded to
+// powers of two to avoid reallocating it at every cycle.
+// Incremental collection keeps the configured size, since
+// the pause of minor collections grows with the nursery.
+//
+static void pace(nj_heap_t *heap)
+{
+	size_t budget = heap->min_budget;
 
-		nj_object_t *object = (nj_object_t*) p->body;
+	while(!heap->incremental && budget < old_size(heap) / 100 * heap->growth && budget < NJ_MAX_NURSERY_SIZE)
+		budget *= 2;
 
-		nj_update_reference(&object->type);
+	heap->allocated = 0;
+	heap->budget = budget;
 
-		nj_object_type_t *type = (nj_object_type_t*) object->type;
+	if(budget != heap->nursery_size) {
 
-		if(type->on_deinit)
-			type->on_deinit(state, object);
+		char *nursery = malloc(budget);
 
-		{
-			overflow_allocation_t *prev_p = p->prev;
-			free(p);
-			p = prev_p;
+		if(nursery == 0) {
+
+			// Keep the current one
+
+			heap->budget = heap->nursery_size;
+			return;
 		}
+
+		free(heap->nursery);
+		heap->nursery = nursery;
+		heap->nursery_size = budget;
 	}
+}
+
+//
+// While marking or sweeping, a step runs every time this
+// fraction of the budget is allocated. When marking has
+// nothing left to do, it's finished at the next safepoint.
+//
+
+#define STEPS_PER_BUDGET 8
+
+static void set_trigger(nj_heap_t *heap)
+{
+	heap->trigger = heap->budget;
+
+	if(heap->marking && heap->gray_used == 0)
+		heap->trigger = heap->allocated;
 
-	free(state->heap.chunk);
+	else if((heap->marking || heap->sweeping) && heap->allocated + heap->budget / STEPS_PER_BUDGET < heap->budget)
+		heap->trigger = heap->allocated + heap->budget / STEPS_PER_BUDGET;
 }
 
-int nj_collect(nj_state_t *state)
+static uint64_t now_ns(void)
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t) time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+//
+// Ends a phase of a collection, when it's traced.
+//
+static void end_phase(nj_gc_event_t *event, int phase, uint64_t *clock)
+{
+	if(event) {
+
+		uint64_t time = now_ns();
+
+		event->phase_ns[phase] = time - *clock;
+
+		*clock = time;
+	}
+}
+
+//
+// Promotes the live objects of the nursery. The roots are
+// the usual ones plus the old objects in the remembered set.
+//
+static int collect_minor(nj_state_t *state, uint64_t *roots, nj_gc_event_t *event)
 {
-	char *chunk = malloc(state->heap.size);
+	nj_heap_t *heap = &state->heap;
+
+	uint64_t clock = event ? now_ns() : 0;
 
-	if(chunk == 0)
+	nj_block_t *block = heap->last;
+	uint32_t offset = block ? block->used : 0;
+
+	if(!reserve(&heap->finalizable_old, heap->finalizable_young.used))
 		return 0;
 
-	state->temp_heap.chunk = chunk;
-	state->temp_heap.size = state->heap.size;
-	state->temp_heap.used = 0;
-	state->temp_heap.overflow_allocations = NULL;
+	for(uint32_t i = 0; i < heap->remembered_used; i++)
+		if(!nj_collect_children(state, heap->remembered[i]))
+			return 0;
+
+	if(!nj_collect_inner(state, roots))
+		return 0;
 
-	if(!nj_collect_inner(state)) {
+	end_phase(event, NJ_GC_PHASE_ROOTS, &clock);
 
-		free(state->temp_heap.chunk);
+	if(!scan(state, block, offset))
 		return 0;
+
+	end_phase(event, NJ_GC_PHASE_SCAN, &clock);
+
+	nj_sweep_young_payloads(state, survives_copy);
+
+	finalize(state, &heap->finalizable_young, survives_copy);
+
+	heap->nursery_used = 0;
+
+	for(uint32_t i = 0; i < heap->remembered_used; i++)
+		heap->remembered[i]->flags &= ~OBJECT_IS_REMEMBERED;
+
+	heap->remembered_used = 0;
+
+	end_phase(event, NJ_GC_PHASE_SWEEP, &clock);
+
+	heap->stats.minor_cycles++;
+
+	pace(heap);
+
+	return 1;
+}
+
+//
+// Copies the live objects of both generations to a new set
+// of blocks.
+//
+static int collect_major(nj_state_t *state, uint64_t *roots, nj_gc_event_t *event)
+{
+	nj_heap_t *heap = &state->heap;
+
+	uint64_t clock = event ? now_ns() : 0;
+
+	if(!reserve(&heap->finalizable_old, heap->finalizable_young.used))
+		return 0;
+
+	heap->condemned = heap->blocks;
+	heap->blocks = NULL;
+	heap->last = NULL;
+	heap->old_used = 0;
+	heap->epoch++;
+	heap->major = 1;
+
+	state->symbols.epoch++;
+
+	if(!nj_collect_inner(state, roots)) {
+
+		heap->major = 0;
+		return 0;
+	}
+
+	end_phase(event, NJ_GC_PHASE_ROOTS, &clock);
+
+	if(!scan(state, NULL, 0)) {
+
+		heap->major = 0;
+		return 0;
+	}
+
+	end_phase(event, NJ_GC_PHASE_SCAN, &clock);
+
+	nj_sweep_young_payloads(state, survives_copy);
+	nj_sweep_old_payloads(state, survives_copy);
+
+	finalize(state, &heap->finalizable_old, survives_copy);
+	finalize(state, &heap->finalizable_young, survives_copy);
+
+	nj_symbol_table_sweep(state);
+
+	heap->major = 0;
+
+	heap->nursery_used = 0;
+
+	free_blocks(state, heap->condemned);
+	heap->condemned = NULL;
+
+	// The remembered objects were either copied, which
+	// clears their flag, or released.
+
+	heap->remembered_used = 0;
+	heap->remembered_overflow = 0;
+
+	end_phase(event, NJ_GC_PHASE_SWEEP, &clock);
+
+	heap->old_limit = old_size(heap) + old_size(heap) / 100 * heap->growth;
+
+	if(heap->old_limit < heap->heap_size)
+		heap->old_limit = heap->heap_size;
+
+	heap->compact = 0;
+
+	heap->stats.major_cycles++;
+
+	pace(heap);
+
+	return 1;
+}
+
+//
+// Marks the children of the queued objects until there are
+// none left or [deadline] passes, if it's not zero. A batch
+// is always marked, so that marking makes progress whatever
+// the pause target.
+//
+
+#define MARK_BATCH 64
+
+static int mark(nj_state_t *state, uint64_t deadline)
+{
+	nj_heap_t *heap = &state->heap;
+
+	heap->stepping = 1;
+
+	while(heap->gray_used) {
+
+		for(int i = 0; i < MARK_BATCH && heap->gray_used; i++)
+			if(!nj_collect_children(state, heap->gray[--heap->gray_used])) {
+
+				heap->stepping = 0;
+				return 0;
+			}
+
+		if(deadline && now_ns() >= deadline)
+			break;
+	}
+
+	heap->stepping = 0;
+
+	return 1;
+}
+
+//
+// Marks the old objects referenced by the roots.
+//
+static int mark_roots(nj_state_t *state, uint64_t *roots)
+{
+	state->heap.stepping = 1;
+
+	int marked = nj_collect_inner(state, roots);
+
+	state->heap.stepping = 0;
+
+	return marked;
+}
+
+//
+// Unmarks the objects of [block]. Returns how many bytes of
+// them are live. The dead ones were already finalized when
+// marking finished.
+//
+static size_t sweep_block(nj_block_t *block)
+{
+	size_t live = 0;
+
+	char *cursor = (char*) block + BLOCK_START;
+	char *end = (char*) block + block->used;
+
+	while(cursor < end) {
+
+		nj_object_t *object = (nj_object_t*) cursor;
+
+		size_t size = ALIGN8(OBJECT_TYPE(object)->size);
+
+		if(object->flags & OBJECT_IS_MARKED) {
+
+			object->flags &= ~OBJECT_IS_MARKED;
+
+			live += size;
+		}
+
+		cursor += size;
+	}
+
+	return live;
+}
+
+//
+// Sweeps the blocks that were in the old space when marking
+// finished until they're over or [deadline] passes, if it's
+// not zero. Blocks without live objects are freed. Nothing
+// is allocated in these blocks while they're swept.
+//
+static void sweep(nj_state_t *state, uint64_t deadline)
+{
+	nj_heap_t *heap = &state->heap;
+
+	while(*heap->sweep_link != heap->sweep_stop) {
+
+		nj_block_t *block = *heap->sweep_link;
+
+		size_t live = sweep_block(block);
+
+		if(live == 0) {
+
+			*heap->sweep_link = block->next;
+
+			heap->old_used -= block->used - BLOCK_START;
+
+			free(block);
+
+			heap->stats.blocks_freed++;
+
+		} else {
+
+			heap->swept_used += block->used - BLOCK_START;
+			heap->swept_live += live;
+
+			heap->sweep_link = &block->next;
+		}
+
+		if(deadline && now_ns() >= deadline)
+			return;
+	}
+
+	// Done. Without a block to stop at, the last one may
+	// have been freed.
+
+	if(heap->sweep_stop == NULL) {
+
+		heap->last = NULL;
+
+		for(nj_block_t *block = heap->blocks; block; block = block->next)
+			heap->last = block;
+	}
+
+	heap->sweeping = 0;
+
+	heap->old_limit = old_size(heap) + (heap->swept_live + heap->payloads.old_used) / 100 * heap->growth;
+
+	if(heap->old_limit < heap->heap_size)
+		heap->old_limit = heap->heap_size;
+
+	// Too much dead space is kept by the blocks that weren't
+	// freed, so the next major collection will compact.
+
+	heap->compact = heap->swept_used > 2 * heap->swept_live;
+
+	heap->stats.major_cycles++;
+}
+
+//
+// Starts an incremental major collection.
+//
+static int start_marking(nj_state_t *state, uint64_t deadline, uint64_t *roots, nj_gc_event_t *event)
+{
+	nj_heap_t *heap = &state->heap;
+
+	uint64_t clock = event ? now_ns() : 0;
+
+	if(!collect_minor(state, roots, NULL))
+		return 0;
+
+	heap->marking = 1;
+
+	state->symbols.epoch++;
+
+	if(!mark_roots(state, roots))
+		return 0;
+
+	end_phase(event, NJ_GC_PHASE_ROOTS, &clock);
+
+	if(!mark(state, deadline))
+		return 0;
+
+	end_phase(event, NJ_GC_PHASE_SCAN, &clock);
+
+	return 1;
+}
+
+//
+// Ends marking. The nursery is promoted, which also marks the
+// old objects it refers to, and the roots are marked again to
+// find the objects they started referring to while marking.
+//
+static int finish_marking(nj_state_t *state, uint64_t *roots, nj_gc_event_t *event)
+{
+	nj_heap_t *heap = &state->heap;
+
+	uint64_t clock = event ? now_ns() : 0;
+
+	if(!collect_minor(state, roots, NULL) || !mark_roots(state, roots))
+		return 0;
+
+	end_phase(event, NJ_GC_PHASE_ROOTS, &clock);
+
+	if(!mark(state, 0))
+		return 0;
+
+	end_phase(event, NJ_GC_PHASE_SCAN, &clock);
+
+	if(heap->mark_overflow)
+		return 1;
+
+	heap->marking = 0;
+
+	// The payloads are released and the dead objects are
+	// finalized right away, before their blocks can be freed.
+
+	nj_sweep_old_payloads(state, survives_mark);
+
+	finalize(state, &heap->finalizable_old, survives_mark);
+
+	nj_symbol_table_sweep(state);
+
+	// Objects are allocated in a new block from now on, so
+	// that the ones to sweep stay where they are. If it
+	// can't be created, everything is swept right away.
+
+	heap->sweeping = 1;
+	heap->sweep_link = &heap->blocks;
+	heap->sweep_stop = append_block(heap);
+	heap->swept_used = 0;
+	heap->swept_live = 0;
+
+	if(heap->sweep_stop == NULL)
+		sweep(state, 0);
+
+	end_phase(event, NJ_GC_PHASE_SWEEP, &clock);
+
+	return 1;
+}
+
+//
+// Drops the incremental collection in progress so that a
+// copying one can be run.
+//
+static void abandon_incremental(nj_state_t *state)
+{
+	nj_heap_t *heap = &state->heap;
+
+	if(heap->sweeping)
+		sweep(state, 0);
+
+	// The copies of the marked objects are unmarked
+
+	heap->marking = 0;
+	heap->mark_overflow = 0;
+	heap->gray_used = 0;
+}
+
+//
+// Runs a step of the incremental collection in progress, and
+// the minor collection that is due, if any.
+//
+static int step(nj_state_t *state, uint64_t deadline, uint64_t *roots, nj_gc_event_t *event, int *kind)
+{
+	nj_heap_t *heap = &state->heap;
+
+	if(heap->remembered_overflow || heap->mark_overflow) {
+
+		abandon_incremental(state);
+
+		*kind = NJ_GC_MAJOR;
+		return collect_major(state, roots, event);
+	}
+
+	if(heap->marking && heap->gray_used == 0) {
+
+		*kind = NJ_GC_MARK_FINISH;
+
+		if(!finish_marking(state, roots, event))
+			return 0;
+
+		if(heap->mark_overflow) {
+
+			abandon_incremental(state);
+
+			*kind = NJ_GC_MAJOR;
+			return collect_major(state, roots, event);
+		}
+
+		return 1;
+	}
+
+	uint64_t clock = event ? now_ns() : 0;
+
+	if(heap->allocated >= heap->budget && !collect_minor(state, roots, NULL))
+		return 0;
+
+	end_phase(event, NJ_GC_PHASE_ROOTS, &clock);
+
+	if(heap->sweeping) {
+
+		*kind = NJ_GC_SWEEP_STEP;
+
+		sweep(state, deadline);
+
+		end_phase(event, NJ_GC_PHASE_SWEEP, &clock);
+
+		return 1;
 	}
 
-	nj_destroy_heap(state, &state->temp_heap);
+	*kind = NJ_GC_MARK_STEP;
 
-	state->heap = state->temp_heap;
+	if(!mark(state, deadline))
+		return 0;
+
+	end_phase(event, NJ_GC_PHASE_SCAN, &clock);
+
+	heap->stats.mark_steps++;
 
 	return 1;
-}
\ No newline at end of file
+}
+
+static void record(nj_gc_trace_t *trace, nj_gc_event_t *event)
+{
+	event->cycle = trace->recorded + 1;
+
+	if(trace->events_size)
+		trace->events[trace->recorded % trace->events_size] = *event;
+
+	trace->recorded++;
+
+	if(trace->hook)
+		trace->hook(event, trace->data);
+}
+
+int nj_collect(nj_state_t *state)
+{
+	nj_heap_t *heap = &state->heap;
+
+	// The event is only filled in when tracing
+
+	nj_gc_event_t event;
+	nj_gc_event_t *traced = NULL;
+	nj_gc_stats_t before;
+
+	if(heap->trace) {
+
+		memset(&event, 0, sizeof(event));
+		event.remembered = heap->remembered_used;
+
+		before = heap->stats;
+		traced = &event;
+	}
+
+	uint64_t start = now_ns();
+	uint64_t roots = 0;
+
+	int kind;
+	int collected;
+
+	if(heap->marking || heap->sweeping)
+
+		collected = step(state, start + heap->max_pause_ns, &roots, traced, &kind);
+
+	else if(old_size(heap) >= heap->old_limit || heap->remembered_overflow) {
+
+		if(heap->incremental && !heap->compact && !heap->remembered_overflow) {
+
+			kind = NJ_GC_MARK_START;
+			collected = start_marking(state, start + heap->max_pause_ns, &roots, traced);
+
+		} else {
+
+			kind = NJ_GC_MAJOR;
+			collected = collect_major(state, &roots, traced);
+		}
+
+	} else {
+
+		kind = NJ_GC_MINOR;
+		collected = collect_minor(state, &roots, traced);
+	}
+
+	if(!collected)
+		return 0;
+
+	set_trigger(heap);
+
+	uint64_t pause = now_ns() - start;
+
+	heap->stats.pause_ns += pause;
+
+	if(heap->stats.max_pause_ns < pause)
+		heap->stats.max_pause_ns = pause;
+
+	{
+		int bucket = 0;
+
+		for(uint64_t us = pause / 1000; us && bucket < NJ_GC_PAUSE_BUCKETS - 1; us >>= 1)
+			bucket++;
+
+		heap->stats.pause_histogram[bucket]++;
+	}
+
+	if(traced) {
+
+		event.kind = kind;
+		event.pause_ns = pause;
+		event.roots = roots;
+		event.objects_copied = heap->stats.objects_copied - before.objects_copied;
+		event.bytes_copied = heap->stats.bytes_copied - before.bytes_copied;
+		event.bytes_promoted = heap->stats.bytes_promoted - before.bytes_promoted;
+		event.objects_finalized = heap->stats.objects_finalized - before.objects_finalized;
+		event.blocks_freed = heap->stats.blocks_freed - before.blocks_freed;
+		event.old_used = heap->old_used;
+		event.budget = heap->budget;
+
+		record(heap->trace, &event);
+	}
+
+	return 1;
+}
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <dlfcn.h>
+#include <sys/stat.h>
 
 #include "utils/basic.h"
 #include "noja.h"
@@ -54,21 +55,47 @@ static nj_object_t *do_text_import(nj_state_t *state, char *path)
 	char *text;
 	int length;
 
-	if(!load_text(path, &text, &length)) {
+	int is_register = state->backend == NJ_BACKEND_REGISTER;
 
-		nj_fail(state, "Failed to open \"${zero-terminated-string}\"", path);
+	void *mapping;
+	size_t mapping_size;
 
-		free(path_copy);
-		return 0;
-	}
+	nj_precompiled_t precompiled;
 
-	if(!nj_compile(text, length, &data, &code, &data_size, &code_size, state->output_builder)) {
+	if(nj_take_precompiled(state, path, &precompiled)) {
 
-		nj_fail(state, "Failed to generate bytecode for \"${zero-terminated-string}\"", path);
-		
-		free(text);
-		free(path_copy);
-		return 0;
+		// Compiled before the run (see precompile.c)
+
+		text = precompiled.text;
+		length = precompiled.length;
+		data = precompiled.data;
+		code = precompiled.code;
+		data_size = precompiled.data_size;
+		code_size = precompiled.code_size;
+		mapping = precompiled.mapping;
+		mapping_size = precompiled.mapping_size;
+
+	} else {
+
+		if(!load_text(path, &text, &length)) {
+
+			nj_fail(state, "Failed to open \"${zero-terminated-string}\"", path);
+
+			free(path_copy);
+			return 0;
+		}
+
+		// Modules are compiled for the backend of the run, at
+		// its optimization level and through its bytecode cache
+
+		if(!nj_compile_file(path, text, length, state->backend, state->opt_level, &state->bytecode_cache, &data, &code, &data_size, &code_size, &mapping, &mapping_size, 0, 0, state->output_builder)) {
+
+			nj_fail(state, "Failed to generate bytecode for \"${zero-terminated-string}\"", path);
+
+			free(text);
+			free(path_copy);
+			return 0;
+		}
 	}
 
 	//
@@ -77,72 +104,118 @@ static nj_object_t *do_text_import(nj_state_t *state, char *path)
 
 	uint32_t imported_segment;
 
-	if(!append_segment(state, code, data, code_size, data_size, path_copy, text, SEGMENT_OWNS_NAME | SEGMENT_OWNS_TEXT, &imported_segment)) {
+	if(!append_segment(state, code, data, code_size, data_size, path_copy, text, SEGMENT_OWNS_NAME | SEGMENT_OWNS_TEXT | (is_register ? SEGMENT_IS_REGISTER : 0), &imported_segment)) {
 
 		// #ERROR
 
-		free(code);
-		free(data);
+		nj_free_bytecode(data, code, mapping, mapping_size);
 		free(text);
 		free(path_copy);
 
-		nj_fail(state, "Out of memory. Failed to grow segment array");
+		if(!nj_failed(state))
+			nj_fail(state, "Out of memory. Failed to grow segment array");
 		return 0;
 	}
 
+	state->segments[imported_segment].mapping = mapping;
+	state->segments[imported_segment].mapping_size = mapping_size;
+
 	//
 	// Run the segment
 	//
 
-	u32_push(&state->segment_stack, imported_segment);
-	u32_push(&state->offset_stack, 0);
+	if(!nj_push_frame(state, imported_segment, 0)) {
 
-	while(nj_step(state));
+		// #ERROR
+		nj_fail(state, "Out of memory. Failed to grow the frame stack");
+		return 0;
+	}
 
-	if(state->failed)
+	if(!(is_register ? nj_execute_register(state) : nj_execute(state)))
 		return 0;
 
-	u32_pop(&state->segment_stack);
-	u32_pop(&state->offset_stack);
+	state->frames_used--;
 
 	return state->segments[imported_segment].global_variables_map;
 }
 
-static nj_object_t *current_map(nj_state_t *state)
+//
+// Each file is imported once per run: its module is looked
+// up in the registry of the state by the device and inode of
+// the file, so that every path that leads to it, relative,
+// absolute or through links, gets the same module. The first
+// import runs it and the ones after get the map it left.
+//
+// A module is registered before it runs, with no map, so an
+// import that finds it that way comes from its own top-level
+// code, directly or through other modules, and is a cycle.
+// When it fails to load, it's taken out of the registry.
+//
+// Paths that can't be stat'ed skip the registry, so that the
+// loaders report why.
+//
+
+static int register_module(nj_state_t *state, struct stat *info, char *path)
 {
-	if(object_stack_size(&state->vars_stack) == 0)
+	if(state->modules_used == state->modules_size) {
 
-		return state->segments[u32_top(&state->segment_stack)].global_variables_map;
+		uint32_t size = state->modules_size == 0 ? 8 : 2 * state->modules_size;
 
-	return object_top(&state->vars_stack);
+		nj_module_t *modules = realloc(state->modules, sizeof(nj_module_t) * size);
+
+		if(modules == 0)
+			return 0;
+
+		state->modules = modules;
+		state->modules_size = size;
+	}
+
+	state->modules[state->modules_used++] = (nj_module_t) {
+		.device = info->st_dev,
+		.inode = info->st_ino,
+		.path = path,
+		.map = 0,
+	};
+
+	return 1;
 }
 
-int nj_import_as(nj_state_t *state, const char *name)
+static nj_module_t *find_module(nj_state_t *state, struct stat *info)
 {
+	for(uint32_t i = 0; i < state->modules_used; i++)
+		if(state->modules[i].device == (uint64_t) info->st_dev && state->modules[i].inode == (uint64_t) info->st_ino)
+			return &state->modules[i];
 
-	if(object_stack_size(&state->eval_stack) == 0) {
+	return 0;
+}
 
-		// #ERROR
-		nj_fail(state, "OPCODE_IMPORT_AS on an empty stack");
-		return 0;
-	}
+//
+// Registers the file that's run, as a module that's still
+// running, so that importing it from one of its modules is
+// reported as a cycle instead of running it again.
+//
+int nj_register_entry(nj_state_t *state, const char *path)
+{
+	struct stat info;
 
-	// Pop an object from the evaluation stack
-	// and try to get the path from it.
-	
-	nj_object_t *path_object = object_pop(&state->eval_stack);
+	if(stat(path, &info) < 0)
+		return 1;
+
+	char *canonical = realpath(path, 0);
 
-	if(path_object->type != (nj_object_t*) &state->type_object_string) {
+	if(canonical == 0 || !register_module(state, &info, canonical)) {
 
 		// #ERROR
-		nj_fail(state, "The imported path expression is not a string");
+		free(canonical);
+		nj_fail(state, "Out of memory. Failed to grow the module registry");
 		return 0;
 	}
 
-	// Get the raw path representation
+	return 1;
+}
 
-	char *path = ((nj_object_string_t*) path_object)->value;
-	
+static nj_object_t *load_module(nj_state_t *state, char *path)
+{
 	// Get the extension
 
 	char *extension = strrchr(path, '.');
@@ -150,50 +223,95 @@ int nj_import_as(nj_state_t *state, const char *name)
     // If there is no extension, or if there is an extension but it's not ".dll" or ".so",
 	// we expect a noja text source file, else we expect a shared library.
 
-	nj_object_t *map;
-
 	if(!extension || (strcmp(extension, ".dll") && strcmp(extension, ".so"))) {
 
 		// Handle the import of a noja source
 
-		map = do_text_import(state, path);
+		return do_text_import(state, path);
 
 	} else {
 
 		// Handle the import of a shared library
 
-		map = do_binary_import(state, path);
+		return do_binary_import(state, path);
 	}
+}
 
-	if(nj_failed(state))
-		return 0;
+static nj_object_t *do_import(nj_state_t *state, char *path)
+{
+	struct stat info;
+
+	if(stat(path, &info) < 0)
+		return load_module(state, path);
+
+	nj_module_t *module = find_module(state, &info);
+
+	if(module) {
+
+		if(module->map == 0) {
+
+			// #ERROR
+			nj_fail(state, "Import cycle: \"${zero-terminated-string}\" imports itself before it finished running", path);
+			return 0;
+		}
+
+		return module->map;
+	}
 
-	if(!nj_dictionary_insert(state, current_map(state), name, map)) {
+	char *canonical = realpath(path, 0);
+
+	if(canonical == 0 || !register_module(state, &info, canonical)) {
 
 		// #ERROR
-		nj_fail(state, "Failed to create imported module variable. Couldn't insert into the variable map");
+		free(canonical);
+		nj_fail(state, "Out of memory. Failed to grow the module registry");
 		return 0;
 	}
 
-	return 1;
+	// Modules it imports are registered after it and the
+	// array may move, so it's referred to by index
+
+	uint32_t index = state->modules_used - 1;
+
+	nj_object_t *map = load_module(state, path);
+
+	if(map == 0) {
+
+		free(state->modules[index].path);
+		memmove(&state->modules[index], &state->modules[index + 1], sizeof(nj_module_t) * (state->modules_used - index - 1));
+		state->modules_used--;
+		return 0;
+	}
+
+	state->modules[index].map = map;
+	return map;
 }
 
-int nj_import(nj_state_t *state)
+static nj_object_t *current_map(nj_state_t *state)
 {
+	if(object_stack_size(&state->vars_stack) == 0)
 
-	if(object_stack_size(&state->eval_stack) == 0) {
+		return state->segments[state->frames[state->frames_used - 1].segment].global_variables_map;
+
+	return object_top(&state->vars_stack);
+}
+
+int nj_import_as(nj_state_t *state, nj_symbol_t *name)
+{
+
+	if(state->stack_top == state->stack) {
 
 		// #ERROR
-		nj_fail(state, "OPCODE_IMPORT on an empty stack");
+		nj_fail(state, "OPCODE_IMPORT_AS on an empty stack");
 		return 0;
 	}
 
 	// Pop an object from the evaluation stack
 	// and try to get the path from it.
 	
-	nj_object_t *path_object = object_pop(&state->eval_stack);
+	nj_object_t *path_object = *--state->stack_top;
 
-	if(path_object->type != (nj_object_t*) &state->type_object_string) {
+	if(nj_object_type_of(state, path_object) != (nj_object_t*) &state->type_object_string) {
 
 		// #ERROR
 		nj_fail(state, "The imported path expression is not a string");
@@ -203,29 +321,50 @@ int nj_import(nj_state_t *state)
 	// Get the raw path representation
 
 	char *path = ((nj_object_string_t*) path_object)->value;
-	
-	// Get the extension
 
-	char *extension = strrchr(path, '.');
+	nj_object_t *map = do_import(state, path);
 
-    // If there is no extension, or if there is an extension but it's not ".dll" or ".so",
-	// we expect a noja text source file, else we expect a shared library.
+	if(nj_failed(state))
+		return 0;
 
-	nj_object_t *map;
+	if(!nj_dictionary_insert_symbol(state, current_map(state), name, map)) {
 
-	if(!extension || (strcmp(extension, ".dll") && strcmp(extension, ".so"))) {
+		// #ERROR
+		nj_fail(state, "Failed to create imported module variable. Couldn't insert into the variable map");
+		return 0;
+	}
 
-		// Handle the import of a noja source
+	return 1;
+}
 
-		map = do_text_import(state, path);
+int nj_import(nj_state_t *state)
+{
 
-	} else {
+	if(state->stack_top == state->stack) {
 
-		// Handle the import of a shared library
+		// #ERROR
+		nj_fail(state, "OPCODE_IMPORT on an empty stack");
+		return 0;
+	}
 
-		map = do_binary_import(state, path);
+	// Pop an object from the evaluation stack
+	// and try to get the path from it.
+	
+	nj_object_t *path_object = *--state->stack_top;
+
+	if(nj_object_type_of(state, path_object) != (nj_object_t*) &state->type_object_string) {
+
+		// #ERROR
+		nj_fail(state, "The imported path expression is not a string");
+		return 0;
 	}
 
+	// Get the raw path representation
+
+	char *path = ((nj_object_string_t*) path_object)->value;
+
+	nj_object_t *map = do_import(state, path);
+
 	if(nj_failed(state))
 		return 0;
 
@@ -4,21 +4,173 @@
 #include <string.h>
 #include "noja.h"
 
+static void print_gc_event(const nj_gc_event_t *event, void *data)
+{
+	(void) data;
+
+	static const char *kinds[] = {
+		[NJ_GC_MINOR] = "minor",
+		[NJ_GC_MAJOR] = "major",
+		[NJ_GC_MARK_START] = "mark start",
+		[NJ_GC_MARK_STEP] = "mark step",
+		[NJ_GC_MARK_FINISH] = "mark finish",
+		[NJ_GC_SWEEP_STEP] = "sweep step",
+	};
+
+	fprintf(stderr, "GC %llu: %s, %llu roots, %llu remembered, %llu objects copied (%llu bytes, %llu promoted), %llu finalized, %llu blocks freed, "
+					"roots %.3f ms, scan %.3f ms, sweep %.3f ms, pause %.3f ms, old space %zu bytes, budget %zu bytes\n",
+		(unsigned long long) event->cycle,
+		kinds[event->kind],
+		(unsigned long long) event->roots,
+		(unsigned long long) event->remembered,
+		(unsigned long long) event->objects_copied,
+		(unsigned long long) event->bytes_copied,
+		(unsigned long long) event->bytes_promoted,
+		(unsigned long long) event->objects_finalized,
+		(unsigned long long) event->blocks_freed,
+		event->phase_ns[NJ_GC_PHASE_ROOTS] / 1e6,
+		event->phase_ns[NJ_GC_PHASE_SCAN] / 1e6,
+		event->phase_ns[NJ_GC_PHASE_SWEEP] / 1e6,
+		event->pause_ns / 1e6,
+		event->old_used,
+		event->budget);
+}
+
+static void print_ic_site(const nj_ic_site_t *site, void *data)
+{
+	(void) data;
+
+	fprintf(stderr, "IC %s:%u: %s %s, %llu hits, %llu misses, %u entries\n",
+		site->segment,
+		site->line,
+		site->kind == NJ_IC_ATTRIBUTE ? "attribute" : "variable",
+		site->name,
+		(unsigned long long) site->hits,
+		(unsigned long long) site->misses,
+		site->entries);
+}
+
 int main(int argc, char **argv)
 {
-	if(argc == 1) {
+	nj_run_options_t options = { .backend = NJ_BACKEND_STACK, .opt_level = NJ_OPT_DEFAULT };
+
+	nj_gc_trace_t gc_trace = { .hook = print_gc_event };
+
+	nj_ic_report_t ic_report = { .hook = print_ic_site };
+
+	int print_gc_stats = 0;
+	int print_ic_stats = 0;
+	int arg = 1;
+
+	while(arg < argc && !strncmp(argv[arg], "--", 2)) {
+
+		if(!strcmp(argv[arg], "--register"))
+			options.backend = NJ_BACKEND_REGISTER;
+
+		else if(!strcmp(argv[arg], "--gc-stats"))
+			print_gc_stats = 1;
+
+		else if(!strcmp(argv[arg], "--gc-trace"))
+			options.gc_trace = &gc_trace;
+
+		else if(!strcmp(argv[arg], "--gc-incremental"))
+			options.heap.incremental = 1;
+
+		else if(!strncmp(argv[arg], "--opt-level=", 12))
+			options.opt_level = atoi(argv[arg] + 12);
+
+		else if(!strncmp(argv[arg], "--compile-threads=", 18))
+			options.compile_threads = atoi(argv[arg] + 18);
+
+		else if(!strcmp(argv[arg], "--bytecode-cache"))
+			options.bytecode_cache.enabled = 1;
+
+		else if(!strncmp(argv[arg], "--bytecode-cache=", 17)) {
+			options.bytecode_cache.enabled = 1;
+			options.bytecode_cache.directory = argv[arg] + 17;
+		}
+
+		else if(!strcmp(argv[arg], "--ic-stats")) {
+			options.ic_report = &ic_report;
+			print_ic_stats = 1;
+		}
+
+		else {
+
+			fprintf(stderr, "Unknown option %s\n", argv[arg]);
+			return -1;
+		}
+
+		arg++;
+	}
+
+	if(arg == argc) {
 
 		fprintf(stderr, "A file path was expected\n");
 		return -1;
 	}
 
+	char *path = argv[arg];
+
 	char *error_text;
 
-	if(!nj_run_file(argv[1], &error_text)) {
+	if(!nj_run_file_with_options(path, &options, &error_text)) {
 
 		fprintf(stderr, "%s\n", error_text);
 		free(error_text);
 	}
 
+	if(print_gc_stats) {
+
+		nj_gc_stats_t *stats = &options.gc_stats;
+
+		fprintf(stderr, "GC: %llu minor and %llu major cycles, %llu bytes allocated, %llu bytes copied, %.3f ms paused (longest %.3f ms)\n",
+			(unsigned long long) stats->minor_cycles,
+			(unsigned long long) stats->major_cycles,
+			(unsigned long long) stats->bytes_allocated,
+			(unsigned long long) stats->bytes_copied,
+			stats->pause_ns / 1e6,
+			stats->max_pause_ns / 1e6);
+
+		if(stats->mark_steps)
+			fprintf(stderr, "GC: %llu marking steps\n", (unsigned long long) stats->mark_steps);
+
+		for(int i = 0; i < NJ_GC_PAUSE_BUCKETS; i++)
+			if(stats->pause_histogram[i])
+				fprintf(stderr, "GC: %llu pauses %s %llu us\n",
+					(unsigned long long) stats->pause_histogram[i],
+					i < NJ_GC_PAUSE_BUCKETS - 1 ? "under" : "of at least",
+					i < NJ_GC_PAUSE_BUCKETS - 1 ? 1ULL << i : 1ULL << (i - 1));
+
+		for(int k = 0; k < NJ_PAYLOAD_CLASSES; k++) {
+
+			nj_payload_stats_t *payloads = &stats->payload_classes[k];
+
+			if(payloads->allocated)
+				fprintf(stderr, "GC: %llu payloads of %d bytes allocated, %llu released, %llu pages (%llu freed)\n",
+					(unsigned long long) payloads->allocated,
+					NJ_PAYLOAD_MIN_SIZE << k,
+					(unsigned long long) payloads->released,
+					(unsigned long long) payloads->pages,
+					(unsigned long long) payloads->pages_freed);
+		}
+
+		if(stats->large_payloads.allocated)
+			fprintf(stderr, "GC: %llu larger payloads allocated, %llu released\n",
+				(unsigned long long) stats->large_payloads.allocated,
+				(unsigned long long) stats->large_payloads.released);
+	}
+
+	if(print_ic_stats) {
+
+		nj_ic_stats_t *stats = &options.ic_stats;
+
+		fprintf(stderr, "IC: %llu hits, %llu misses over %u sites (%u polymorphic)\n",
+			(unsigned long long) stats->hits,
+			(unsigned long long) stats->misses,
+			stats->sites,
+			stats->polymorphic);
+	}
+
 	return 0;
 }
\ No newline at end of file
@@ -2,8 +2,10 @@
 #include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "utils/string_builder.h"
+#include "utils/pool.h"
 
 typedef struct nj_state_t nj_state_t;
 typedef struct nj_object_t nj_object_t;
@@ -13,6 +15,55 @@ struct nj_object_t {
 	uint32_t flags;
 };
 
+typedef struct nj_symbol_t nj_symbol_t;
+
+struct nj_symbol_t {
+	uint64_t hash;
+	uint32_t length;
+	uint32_t epoch; // Last major collection that found it in use
+	char text[];
+};
+
+typedef struct {
+	nj_symbol_t **slots;
+	uint32_t size, used;
+	uint32_t epoch;
+} nj_symbol_table_t;
+
+//
+// A shape describes the keys of a dict and the slot of
+// each one in its values. Dicts built by inserting the
+// same keys in the same order end up with the same shape,
+// since shapes are reached from the empty one through a
+// table of transitions that add one key each.
+//
+// Shapes live until the state is destroyed.
+//
+
+#define NJ_SHAPE_MAX_KEYS 32
+#define NJ_SHAPE_MAX_COUNT 65536
+
+// Shapes with more keys than this get a map
+#define NJ_SHAPE_SCAN_KEYS 8
+
+typedef struct nj_shape_t nj_shape_t;
+
+struct nj_shape_t {
+	nj_shape_t   *parent;
+	nj_symbol_t  *key;
+	nj_symbol_t **keys;
+	int *map;
+	int  map_size;
+	uint32_t count;
+};
+
+typedef struct {
+	nj_shape_t *root;
+	nj_shape_t **transitions;
+	uint32_t size, used;
+	pool_t *pool;
+} nj_shape_table_t;
+
 typedef struct nj_moved_object_t nj_moved_object_t;
 
 struct nj_moved_object_t {
@@ -29,6 +80,8 @@ typedef struct {
 enum {
 	OBJECT_IS_COLLECTABLE = 1,
 	OBJECT_WAS_MOVED = 2,
+	OBJECT_IS_REMEMBERED = 4, // In the remembered set of the heap
+	OBJECT_IS_MARKED = 8,     // Reached by the incremental marking
 };
 
 typedef struct {
@@ -77,17 +130,62 @@ typedef struct {
 
 } nj_object_type_t;
 
-typedef struct overflow_allocation_t overflow_allocation_t;
-struct overflow_allocation_t {
-	overflow_allocation_t *prev;
-	char body[];
-};
-
 enum {
 	SEGMENT_OWNS_NAME = 1,
 	SEGMENT_OWNS_TEXT = 2,
+	SEGMENT_IS_TRUSTED = 4,
+	SEGMENT_IS_REGISTER = 8, // Holds register-based bytecode
+};
+
+//
+// Inline caches remember where the instructions that look
+// names up found them the last times they ran, as the shapes
+// of the dicts that were searched and the slot of the value
+// (see cache.c). A cache holds up to NJ_INLINE_CACHE_ENTRIES
+// entries, after which the older ones are replaced.
+//
+
+#define NJ_INLINE_CACHE_ENTRIES 4
+
+enum {
+	NJ_IC_ATTRIBUTE,
+	NJ_IC_VARIABLE,
 };
 
+typedef struct {
+
+	// Attribute sites: type of the container and shape of
+	// its methods. Variable sites: shapes of the local,
+	// global and builtin maps up to the one that holds the
+	// variable, which is [depth].
+
+	nj_object_t *type;
+	nj_shape_t  *shapes[3];
+	int depth;
+	int slot;
+} nj_inline_cache_entry_t;
+
+typedef struct {
+	int kind;
+	uint32_t offset;
+	uint32_t source; // Offset in the source text
+	nj_symbol_t *name;
+	uint64_t hits;
+	uint64_t misses;
+	uint32_t used;
+	uint32_t next; // Entry to replace when all are used
+	nj_inline_cache_entry_t entries[NJ_INLINE_CACHE_ENTRIES];
+
+	// Variable sites that ran without a local map: the map
+	// that held the name (1 for the globals, 2 for the
+	// builtins, 0 if none yet), the slot and the sum of the
+	// versions of the two maps back then.
+
+	int binding;
+	int binding_slot;
+	uint64_t binding_version;
+} nj_inline_cache_t;
+
 typedef struct {
 	int flags;
 	char *name;
@@ -96,9 +194,57 @@ typedef struct {
 	char *code;
 	uint32_t data_size;
 	uint32_t code_size;
+	nj_symbol_t **symbols;
+	uint32_t symbols_count;
+	uint32_t max_depth; // Deepest evaluation stack of its frames, set by the verifier
 	nj_object_t *global_variables_map;
+
+	// The inline caches of its instructions, and for each
+	// 4 bytes of code the cache of the instruction there.
+
+	nj_inline_cache_t  *caches;
+	nj_inline_cache_t **sites;
+	uint32_t caches_count;
+
+	// When the code and data were mapped from the bytecode
+	// cache, the mapping that holds them.
+
+	void *mapping;
+	size_t mapping_size;
 } segment_t;
 
+//
+// A module imported by a run, known by the device and inode
+// of its file. [map] is what importing it gives, and it's
+// null while the module is still running its top-level code.
+//
+
+typedef struct {
+	uint64_t device;
+	uint64_t inode;
+	char *path; // Canonical path of the file
+	nj_object_t *map;
+} nj_module_t;
+
+//
+// A module compiled before the run that imports it (see
+// precompile.c). It's taken by the import, after which
+// [text] is null.
+//
+
+typedef struct {
+	uint64_t device;
+	uint64_t inode;
+	char *text;
+	int length;
+	char *data;
+	char *code;
+	uint32_t data_size;
+	uint32_t code_size;
+	void *mapping;
+	size_t mapping_size;
+} nj_precompiled_t;
+
 #define OBJECT_STACK_ITEMS_PER_CHUNK 128
 #define U32_STACK_ITEMS_PER_CHUNK 128
 
@@ -128,10 +274,428 @@ typedef struct {
 
 typedef struct nj_heap_t nj_heap_t;
 
+//
+// Which instruction set the program is compiled to. The
+// backend is chosen per run and also applies to the
+// modules it imports.
+//
+
+enum {
+	NJ_BACKEND_STACK,
+	NJ_BACKEND_REGISTER,
+};
+
+//
+// How much the AST is optimized before the bytecode is
+// generated. At NJ_OPT_FOLD, operations on literals are
+// folded and statements behind literal conditions that
+// can't run are dropped. At NJ_OPT_PEEPHOLE, the code of
+// the stack backend also goes through the peephole pass,
+// which cleans up jumps and uses superinstructions. Like
+// the backend, the level of a run also applies to its
+// modules.
+//
+
+enum {
+	NJ_OPT_NONE,
+	NJ_OPT_FOLD,
+	NJ_OPT_PEEPHOLE,
+};
+
+#define NJ_OPT_DEFAULT NJ_OPT_PEEPHOLE
+
+//
+// Sizes of the heap, in bytes. A zero size is taken from the
+// NOJA_NURSERY_SIZE and NOJA_HEAP_SIZE environment variables
+// or, when they're not set, from the defaults below.
+//
+// Collections are paced by allocation: after each one, the
+// bytes that can be allocated before the next are [growth]
+// percent of the old space (NOJA_GC_GROWTH), but never less
+// than [nursery_size] nor more than NJ_MAX_NURSERY_SIZE.
+// Major collections happen when the old space grows by the
+// same percentage over what survived the last one.
+//
+// Major collections copy the whole live set in one pause
+// unless [incremental] is set (NOJA_GC_INCREMENTAL). Then
+// the old space is marked a bit at a time, in steps that
+// take at most [max_pause_us] microseconds each
+// (NOJA_GC_MAX_PAUSE), and swept in place. A copying
+// collection still compacts it when too much of it is dead.
+// The allocation budget stays at [nursery_size], because
+// minor pauses grow with it.
+//
+
+#define NJ_DEFAULT_NURSERY_SIZE (256 * 1024)
+#define NJ_DEFAULT_HEAP_SIZE (1024 * 1024)
+#define NJ_DEFAULT_GC_GROWTH 100
+#define NJ_DEFAULT_GC_MAX_PAUSE_US 1000
+#define NJ_MAX_NURSERY_SIZE (16 * 1024 * 1024)
+
+typedef struct {
+	size_t nursery_size;
+	size_t heap_size; // Old space usage that triggers the first major collection
+	size_t growth;
+	int incremental;
+	size_t max_pause_us;
+} nj_heap_options_t;
+
+//
+// The compiled code of files can be kept in cache files and
+// mapped back by later runs while their source stays the
+// same (see bytecode_cache.c). When [enabled], cache files
+// go in [directory] or, if it's null, next to their source.
+// Each backend and optimization level has its own file.
+//
+
+typedef struct {
+	int enabled;
+	const char *directory;
+} nj_bytecode_cache_options_t;
+
+//
+// Bucket i of the pause histogram counts the pauses shorter
+// than 2^i microseconds that don't fit in the previous one.
+// The last bucket also counts the longer ones.
+//
+
+#define NJ_GC_PAUSE_BUCKETS 20
+
+//
+// Payload allocations of a size class. Classes are the
+// powers of two from NJ_PAYLOAD_MIN_SIZE bytes, and the
+// payloads larger than the last one are counted apart.
+//
+
+#define NJ_PAYLOAD_MIN_SIZE 16
+#define NJ_PAYLOAD_CLASSES 9 // Up to 4 KiB
+
+typedef struct {
+	uint64_t allocated;
+	uint64_t released; // Explicitly or by a collection
+	uint64_t pages;    // Allocated for the class
+	uint64_t pages_freed;
+} nj_payload_stats_t;
+
+typedef struct {
+	uint64_t minor_cycles;
+	uint64_t major_cycles; // Copying or incremental
+	uint64_t mark_steps;
+	uint64_t bytes_allocated;
+	uint64_t objects_copied;
+	uint64_t bytes_copied;
+	uint64_t bytes_promoted; // Copied from the nursery to the old space
+	uint64_t objects_finalized;
+	nj_payload_stats_t payload_classes[NJ_PAYLOAD_CLASSES];
+	nj_payload_stats_t large_payloads;
+	uint64_t blocks_freed;
+	uint64_t pause_ns; // Total time spent collecting
+	uint64_t max_pause_ns;
+	uint64_t pause_histogram[NJ_GC_PAUSE_BUCKETS];
+} nj_gc_stats_t;
+
+//
+// Record of a collection pause. The phases are the copy, or
+// the marking, of the objects referenced by the roots, the
+// scan of the copies, or the marking of the queued objects,
+// and the release of the unreachable ones. The minor
+// collections run as part of incremental marking count as
+// its roots phase.
+//
+
+enum {
+	NJ_GC_MINOR,
+	NJ_GC_MAJOR,
+	NJ_GC_MARK_START,
+	NJ_GC_MARK_STEP,
+	NJ_GC_MARK_FINISH,
+	NJ_GC_SWEEP_STEP,
+};
+
+enum {
+	NJ_GC_PHASE_ROOTS,
+	NJ_GC_PHASE_SCAN,
+	NJ_GC_PHASE_SWEEP,
+	NJ_GC_PHASES,
+};
+
+typedef struct {
+	uint64_t cycle; // Number of the pause, counted from 1
+	int kind;
+	uint64_t phase_ns[NJ_GC_PHASES];
+	uint64_t pause_ns;
+	uint64_t roots;
+	uint64_t remembered;
+	uint64_t objects_copied;
+	uint64_t bytes_copied;
+	uint64_t bytes_promoted;
+	uint64_t objects_finalized;
+	uint64_t blocks_freed;
+	size_t old_used; // After the collection
+	size_t budget;   // Of the next one
+} nj_gc_event_t;
+
+//
+// Collection tracing. When a run has one, every collection is
+// timed and its event is passed to [hook] and stored in the
+// [events] ring, at index [recorded] modulo [events_size].
+// Either can be left out. Without tracing, collections only
+// measure their pause.
+//
+
+typedef struct {
+	void (*hook)(const nj_gc_event_t *event, void *data);
+	void *data;
+	nj_gc_event_t *events;
+	uint32_t events_size;
+	uint64_t recorded;
+} nj_gc_trace_t;
+
+typedef struct {
+	uint64_t hits;
+	uint64_t misses;
+	uint32_t sites; // That ran at least once
+	uint32_t polymorphic; // Sites with more than one entry
+} nj_ic_stats_t;
+
+typedef struct {
+	int kind;
+	const char *segment;
+	uint32_t line;
+	const char *name;
+	uint64_t hits;
+	uint64_t misses;
+	uint32_t entries;
+} nj_ic_site_t;
+
+typedef struct {
+	void (*hook)(const nj_ic_site_t *site, void *data);
+	void *data;
+} nj_ic_report_t;
+
+typedef struct {
+	int backend;
+	int opt_level;
+	nj_heap_options_t heap;
+
+	// Applies to the file of nj_run_file_with_options and
+	// to the modules it imports.
+
+	nj_bytecode_cache_options_t bytecode_cache;
+
+	// When greater than 0, the modules that the file of
+	// nj_run_file_with_options imports, and the ones they
+	// import, are compiled before it runs on this many
+	// threads. Only imports with a literal path are seen.
+
+	int compile_threads;
+
+	// Number of instructions dispatched by the run. Only
+	// counted when built with NJ_COUNT_DISPATCH.
+
+	uint64_t dispatched;
+
+	// When built with NJ_COUNT_PAIRS and this is set, the
+	// stack backend counts each opcode that follows another
+	// at [opcode_pairs][previous * OPCODE_COUNT + opcode].
+	// It must have room for OPCODE_COUNT * OPCODE_COUNT
+	// counters.
+
+	uint64_t *opcode_pairs;
+
+	// Collector statistics of the run, and its tracing
+	// if [gc_trace] is set.
+
+	nj_gc_stats_t gc_stats;
+	nj_gc_trace_t *gc_trace;
+
+	// Totals of the inline caches of the run. When [ic_report]
+	// is set, it's also called for each cache that was used
+	// before the state is destroyed.
+
+	nj_ic_stats_t ic_stats;
+	nj_ic_report_t *ic_report;
+} nj_run_options_t;
+
+//
+// A running activation of some code: the top-level code of a
+// run or of an imported module, or a function call. [offset]
+// is where execution resumes when the frames above it return.
+//
+
+typedef struct {
+	uint32_t segment;
+	uint32_t offset;
+	uint32_t stack_base;  // Index of its first value on the evaluation stack
+	uint32_t locals_base; // Index of its first local slot
+	int64_t  argc;        // Arguments passed by the CALL, -1 for top-level code
+} nj_frame_t;
+
+//
+// Caller state saved by a CALL of the register backend.
+//
+
+typedef struct {
+	uint32_t base;
+	uint32_t used;
+	uint32_t dest;
+} nj_register_frame_t;
+
+//
+// The heap has two generations. Objects are created in the
+// nursery and the ones that survive a minor collection are
+// promoted to the old space, a list of aligned blocks that
+// grows with the live set. Major collections compact the
+// old space into new blocks and release the previous ones,
+// or mark it incrementally and free the blocks left empty.
+//
+
+#define NJ_BLOCK_SIZE (64 * 1024)
+
+typedef struct nj_block_t nj_block_t;
+struct nj_block_t {
+	nj_block_t *next;
+	uint32_t used;  // Bytes used, header included
+	uint32_t epoch; // Major collection that created it
+};
+
+//
+// Payloads are the variable-sized buffers of heap objects,
+// like the items of an array or the bytes of a string. They
+// don't move, so they're kept out of the blocks, in pages of
+// cells of the same size class, or on their own when they
+// don't fit one. Each points back to the object that owns
+// it, so collections release the payloads of the objects
+// they found unreachable without visiting those objects.
+// The payloads of young objects are also listed, so that
+// minor collections only look at them.
+//
+// Each class caches its latest free cells in a magazine,
+// which allocations empty and releases fill before they
+// fall back to the free list or to a new page. Cells move
+// in batches of half a magazine. A state runs on a single
+// thread, so the magazines aren't shared.
+//
+
+#define NJ_PAYLOAD_PAGE_SIZE (64 * 1024)
+#define NJ_PAYLOAD_MAGAZINE_SIZE 64
+
+enum {
+	PAYLOAD_IS_YOUNG = 1,
+	PAYLOAD_IS_LARGE = 2,
+};
+
+typedef struct nj_payload_t nj_payload_t;
+struct nj_payload_t {
+	nj_object_t *owner; // NULL once released
+	uint32_t size;      // Usable bytes, which follow the header
+	uint32_t flags;
+};
+
+typedef struct nj_payload_page_t nj_payload_page_t;
+struct nj_payload_page_t {
+	nj_payload_page_t *next;
+	uint64_t used; // Bytes used, header included
+};
+
+typedef struct nj_large_payload_t nj_large_payload_t;
+struct nj_large_payload_t {
+	nj_large_payload_t *prev;
+	nj_large_payload_t *next;
+	nj_payload_t header;
+};
+
+typedef struct {
+	nj_payload_page_t *pages;
+	nj_payload_t *free; // Linked through their first bytes
+	nj_payload_t *magazine[NJ_PAYLOAD_MAGAZINE_SIZE];
+	uint32_t magazine_used;
+} nj_payload_class_t;
+
+typedef struct {
+	nj_payload_class_t classes[NJ_PAYLOAD_CLASSES];
+	nj_large_payload_t *large;
+	nj_payload_t **young;
+	uint32_t young_size;
+	uint32_t young_used;
+	size_t old_used; // Bytes of the old payloads, headers included
+} nj_payload_space_t;
+
+//
+// Objects whose type has a finalizer, in one list per
+// generation. Collections only visit these to finalize the
+// ones that died, so the others cost nothing to release.
+//
+
+typedef struct {
+	nj_object_t **items;
+	uint32_t size;
+	uint32_t used;
+} nj_finalizable_t;
+
 struct nj_heap_t {
-	char *chunk;
-	uint32_t size, used;
-	overflow_allocation_t *overflow_allocations;
+
+	char  *nursery;
+	size_t nursery_size;
+	size_t nursery_used;
+
+	// Bytes allocated since the last collection, and how
+	// many trigger the next one. Objects allocated once the
+	// nursery is full go in the old space until the next
+	// safepoint collects.
+
+	size_t allocated;
+	size_t budget;
+	size_t min_budget;
+	size_t growth;
+
+	nj_block_t *blocks;
+	nj_block_t *last;
+	nj_block_t *condemned; // Blocks of the major collection being run
+	size_t old_used;
+	size_t old_limit; // Old space usage that triggers a major collection
+	size_t heap_size;
+	uint32_t epoch;
+	int major;
+
+	// Incremental collection. [gray] holds the marked objects
+	// whose children weren't marked yet. When it can't grow,
+	// marking is abandoned for a copying collection, which
+	// is also used to compact when [compact] is set. Once
+	// marked, the blocks from [*sweep_link] to [sweep_stop]
+	// are swept.
+
+	int incremental;
+	uint64_t max_pause_ns;
+	int marking;
+	int stepping; // Running a marking step, nothing is copied
+	int sweeping;
+	int compact;
+	int mark_overflow;
+	size_t trigger; // Allocations that trigger the next step or collection
+	nj_object_t **gray;
+	uint32_t gray_size;
+	uint32_t gray_used;
+	nj_block_t **sweep_link;
+	nj_block_t  *sweep_stop;
+	size_t swept_used;
+	size_t swept_live;
+
+	// Old objects that may point to young ones. When it
+	// can't grow, the next collection is a major one.
+
+	nj_object_t **remembered;
+	uint32_t remembered_size;
+	uint32_t remembered_used;
+	int remembered_overflow;
+
+	nj_payload_space_t payloads;
+
+	nj_finalizable_t finalizable_young;
+	nj_finalizable_t finalizable_old;
+
+	nj_gc_stats_t stats;
+	nj_gc_trace_t *trace;
 };
 
 struct nj_state_t {
@@ -152,27 +716,207 @@ struct nj_state_t {
 	nj_object_type_t type_object_cfunction;
 
 	int failed;
-	int64_t argc;
+	uint64_t hash_seed;
+	nj_symbol_table_t symbols;
+	nj_shape_table_t shapes;
 	uint32_t offset;
 
 	string_builder_t *output_builder;
 
 	nj_heap_t heap;
-	nj_heap_t temp_heap;
 
-	object_stack_t eval_stack;
+	// Evaluation stack. Values go from [stack] to [stack_top]
+	// and there's space up to [stack_end].
+
+	nj_object_t **stack;
+	nj_object_t **stack_top;
+	nj_object_t **stack_end;
+
 	object_stack_t vars_stack;
 	nj_object_t *builtins_map;
-	u32_stack_t segment_stack;
-	u32_stack_t offset_stack;
+
+	// Call frames. The running one is the last.
+
+	nj_frame_t *frames;
+	uint32_t frames_size;
+	uint32_t frames_used;
+
+	// Frame slots of the functions that don't use
+	// a variable map. The slots of the current call
+	// start at the [locals_base] of its frame.
+
+	nj_object_t **locals;
+	uint32_t locals_size;
+	uint32_t locals_used;
+
+	// Register backend. The registers of the current frame
+	// go from [registers_base] to [registers_used].
+
+	int backend;
+	int opt_level;
+	nj_bytecode_cache_options_t bytecode_cache;
+	uint64_t dispatched;
+	uint64_t *opcode_pairs;
+	uint32_t previous_opcode;
+
+	nj_object_t **registers;
+	uint32_t registers_size;
+	uint32_t registers_used;
+	uint32_t registers_base;
+
+	nj_register_frame_t *register_frames;
+	uint32_t register_frames_size;
+	uint32_t register_frames_used;
 
 	// Virtual memory simulation stuff
 
 	segment_t *segments;
 	int segments_size;
 	int segments_used;
+
+	// Modules imported by the run (see import.c)
+
+	nj_module_t *modules;
+	uint32_t modules_size;
+	uint32_t modules_used;
+
+	// Modules compiled before the run
+
+	nj_precompiled_t *precompiled;
+	uint32_t precompiled_count;
 };
 
+//
+// Values are tagged pointers. Integers that fit in 63 bits
+// are stored in the pointer itself with the low bit set,
+// floats whose exponent fits in 9 bits are stored with the
+// two low bits set to 10. Everything else is a pointer to an
+// 8 byte aligned object (ints and floats out of the ranges
+// above are still allocated on the heap). Null and the two
+// booleans live inside the state, so they are never
+// allocated either.
+//
+// The type of a value must be obtained through
+// nj_object_type_of instead of reading ->type directly.
+//
+
+#define NJ_TAG_MASK 3
+#define NJ_TAG_FLOAT 2
+
+#define NJ_FLOAT_EXPONENT_OFFSET (768ULL << 53)
+
+static inline int nj_is_immediate(nj_object_t *object)
+{
+	return (uintptr_t) object & NJ_TAG_MASK;
+}
+
+static inline int nj_is_small_int(nj_object_t *object)
+{
+	return (uintptr_t) object & 1;
+}
+
+static inline int nj_is_small_float(nj_object_t *object)
+{
+	return ((uintptr_t) object & NJ_TAG_MASK) == NJ_TAG_FLOAT;
+}
+
+static inline int nj_small_int_fits(int64_t value)
+{
+	return ((int64_t) ((uint64_t) value << 1) >> 1) == value;
+}
+
+static inline nj_object_t *nj_small_int_make(int64_t value)
+{
+	return (nj_object_t*) (((uintptr_t) value << 1) | 1);
+}
+
+static inline int64_t nj_small_int_value(nj_object_t *object)
+{
+	return (intptr_t) object >> 1;
+}
+
+//
+// A small float is the double with its sign bit rotated to
+// the bottom and its exponent rebased so that the two top
+// bits are free. Zeroes are kept as they are (the smallest
+// exponent is excluded so they can't collide with anything).
+//
+
+static inline nj_object_t *nj_small_float_make(double value)
+{
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+
+	uint64_t exponent = (bits >> 52) & 0x7ff;
+	uint64_t rotated = (bits << 1) | (bits >> 63);
+
+	if(rotated > 1) {
+
+		if(exponent <= 768 || exponent >= 1280)
+			return 0;
+
+		rotated -= NJ_FLOAT_EXPONENT_OFFSET;
+	}
+
+	return (nj_object_t*) ((rotated << 2) | NJ_TAG_FLOAT);
+}
+
+static inline double nj_small_float_value(nj_object_t *object)
+{
+	uint64_t rotated = (uintptr_t) object >> 2;
+
+	if(rotated > 1)
+		rotated += NJ_FLOAT_EXPONENT_OFFSET;
+
+	uint64_t bits = (rotated >> 1) | (rotated << 63);
+
+	double value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+static inline int nj_is_young(nj_heap_t *heap, nj_object_t *object)
+{
+	return (uintptr_t) object - (uintptr_t) heap->nursery < heap->nursery_size;
+}
+
+void nj_remember(nj_state_t *state, nj_object_t *object);
+void nj_shade(nj_state_t *state, nj_object_t *object);
+
+//
+// Must follow every store of [value] in a field of the heap
+// object [container], so that minor collections can find
+// the old objects pointing to young ones, and so that an
+// old object stored while marking is in progress doesn't
+// get lost behind an already marked one.
+//
+
+static inline void nj_write_barrier(nj_state_t *state, nj_object_t *container, nj_object_t *value)
+{
+	if(value == NULL || nj_is_immediate(value))
+		return;
+
+	if(nj_is_young(&state->heap, value)) {
+
+		if(!nj_is_young(&state->heap, container)
+		&& (container->flags & (OBJECT_IS_COLLECTABLE | OBJECT_IS_REMEMBERED)) == OBJECT_IS_COLLECTABLE)
+			nj_remember(state, container);
+
+	} else if(state->heap.marking && (value->flags & (OBJECT_IS_COLLECTABLE | OBJECT_IS_MARKED)) == OBJECT_IS_COLLECTABLE)
+		nj_shade(state, value);
+}
+
+static inline nj_object_t *nj_object_type_of(nj_state_t *state, nj_object_t *object)
+{
+	if(nj_is_small_int(object))
+		return (nj_object_t*) &state->type_object_int;
+
+	if(nj_is_small_float(object))
+		return (nj_object_t*) &state->type_object_float;
+
+	return object->type;
+}
+
 typedef struct {
 
 	nj_object_t super;
@@ -199,21 +943,52 @@ typedef struct {
 	size_t length;
 } nj_object_string_t;
 
+//
+// Small dicts and arrays keep their items in the object
+// itself. The buffer pointers stay NULL until they outgrow
+// it, so that the object can be copied as it is.
+//
+// A dict only stores its values, its keys are described by
+// its [shape]. Dicts with too many keys, or whose shape
+// couldn't be made, switch to dictionary mode: the shape
+// is NULL and the dict holds its own keys and map.
+//
+// The [version] of a dict changes every time a key is added
+// to it, in either mode. Where a name was found stays valid
+// until then, which lets the variable lookups of the VM be
+// revalidated with a compare (see cache.c).
+//
+
+#define NJ_DICT_INLINE_ITEMS 4
+#define NJ_ARRAY_INLINE_ITEMS 4
+
 typedef struct {
 
 	nj_object_t super;
-	
-	int *map;
+
+	nj_shape_t *shape;
+
+	uint32_t version;
+
+	// Dictionary mode only
 	int  map_size;
+	int *map;
+	nj_symbol_t **item_keys;
 
-	char     **item_keys;
 	nj_object_t **item_values;
 
 	int item_size;
 	int item_used;
 
+	nj_object_t *inline_values[NJ_DICT_INLINE_ITEMS];
+
 } nj_object_dict_t;
 
+static inline nj_object_t **nj_dictionary_values(nj_object_dict_t *d)
+{
+	return d->item_values ? d->item_values : d->inline_values;
+}
+
 typedef struct {
 
 	nj_object_t super;
@@ -223,6 +998,8 @@ typedef struct {
 	int item_size;
 	int item_used;
 
+	nj_object_t *inline_items[NJ_ARRAY_INLINE_ITEMS];
+
 } nj_object_array_t;
 
 typedef struct {
@@ -252,6 +1029,8 @@ nj_object_t  *object_top(object_stack_t *stack);
 nj_object_t **object_top_ref(object_stack_t *stack);
 nj_object_t  *object_nth_from_top(object_stack_t *stack, int count);
 void 	      object_stack_print(nj_state_t *state, object_stack_t *stack, FILE *fp);
+int           nj_stack_reserve(nj_state_t *state, uint32_t count);
+nj_frame_t   *nj_push_frame(nj_state_t *state, uint32_t segment, uint32_t offset);
 
 void 	  u32_stack_init(u32_stack_t *stack);
 int 	  u32_stack_size(u32_stack_t *stack);
@@ -261,18 +1040,37 @@ uint32_t  u32_pop(u32_stack_t *stack);
 uint32_t  u32_top(u32_stack_t *stack);
 uint32_t *u32_top_ref(u32_stack_t *stack);
 
+int 		 nj_symbol_table_init(nj_symbol_table_t *table);
+void 		 nj_symbol_table_deinit(nj_symbol_table_t *table);
+nj_symbol_t *nj_symbol_lookup(nj_state_t *state, const char *text, size_t length);
+nj_symbol_t *nj_symbol_intern(nj_state_t *state, const char *text, size_t length);
+void 		 nj_symbol_mark(nj_state_t *state, nj_symbol_t *symbol);
+void 		 nj_symbol_table_sweep(nj_state_t *state);
+void 		 nj_symbol_map_insert(int *map, int map_size, nj_symbol_t *key, int index);
+int 		 nj_symbol_map_find(int *map, int map_size, nj_symbol_t **keys, nj_symbol_t *key);
+
+int 		 nj_shape_table_init(nj_shape_table_t *table);
+void 		 nj_shape_table_deinit(nj_shape_table_t *table);
+nj_shape_t  *nj_shape_transition(nj_state_t *state, nj_shape_t *shape, nj_symbol_t *key);
+int 		 nj_shape_lookup(nj_shape_t *shape, nj_symbol_t *key);
+
 int 	  	 nj_dictionary_merge_in(nj_state_t *state, nj_object_t *self, nj_object_t *other);
 nj_object_t *nj_dictionary_select(nj_state_t *state, nj_object_t *self, const char *name);
 int 	  	 nj_dictionary_insert(nj_state_t *state, nj_object_t *self, const char *name, nj_object_t *value);
+nj_object_t *nj_dictionary_select_symbol(nj_state_t *state, nj_object_t *self, nj_symbol_t *name);
+int 		 nj_dictionary_slot(nj_object_t *self, nj_symbol_t *name);
+int 	  	 nj_dictionary_insert_symbol(nj_state_t *state, nj_object_t *self, nj_symbol_t *name, nj_object_t *value);
 
 nj_object_t *nj_array_select(nj_state_t *state, nj_object_t *self, int64_t index);
 int 	     nj_array_insert(nj_state_t *state, nj_object_t *self, int64_t index, nj_object_t *value);
 
 int nj_object_to_c_int(nj_state_t *state, nj_object_t *object, int64_t *value);
 int nj_object_to_c_float(nj_state_t *state, nj_object_t *object, double *value);
+int nj_object_to_c_bool(nj_state_t *state, nj_object_t *object, uint8_t *value);
 int nj_object_to_c_string(nj_state_t *state, nj_object_t *object, const char **value, int *length);
 
 nj_object_t *nj_object_from_c_int(nj_state_t *state, int64_t value);
+nj_object_t *nj_object_from_c_bool(nj_state_t *state, uint8_t value);
 nj_object_t *nj_object_from_c_float(nj_state_t *state, double value);
 nj_object_t *nj_object_from_c_string(nj_state_t *state, char *value, size_t length);
 nj_object_t *nj_object_from_c_string_ref(nj_state_t *state, const char *value, size_t length);
@@ -281,7 +1079,7 @@ nj_object_t *nj_object_from_c_function(nj_state_t *state, nj_object_t *(*routine
 nj_object_t *nj_object_from_segment_and_offset(nj_state_t *state, uint32_t segment, uint32_t offset);
 nj_object_t *nj_object_istanciate(nj_state_t *state, nj_object_t *type);
 void 	     nj_object_print(nj_state_t *state, nj_object_t *self, FILE *fp);
-nj_object_t *nj_object_type(nj_object_t *self);
+nj_object_t *nj_object_type(nj_state_t *state, nj_object_t *self);
 nj_object_t *nj_object_add(nj_state_t *state, nj_object_t *self, nj_object_t *right);
 nj_object_t *nj_object_sub(nj_state_t *state, nj_object_t *self, nj_object_t *right);
 nj_object_t *nj_object_mul(nj_state_t *state, nj_object_t *self, nj_object_t *right);
@@ -307,6 +1105,8 @@ nj_object_t *nj_object_select(nj_state_t *state, nj_object_t *self, nj_object_t
 int 	  	 nj_object_insert(nj_state_t *state, nj_object_t *self, nj_object_t *key, nj_object_t *item);
 nj_object_t *nj_object_select_attribute(nj_state_t *state, nj_object_t *self, const char *name);
 int 	  	 nj_object_insert_attribute(nj_state_t *state, nj_object_t *self, const char *name, nj_object_t *value);
+nj_object_t *nj_object_select_attribute_symbol(nj_state_t *state, nj_object_t *self, nj_symbol_t *name);
+int 	  	 nj_object_insert_attribute_symbol(nj_state_t *state, nj_object_t *self, nj_symbol_t *name, nj_object_t *value);
 
 nj_object_t *nj_get_dict_type_object(nj_state_t *state);
 nj_object_t *nj_get_int_type_object(nj_state_t *state);
@@ -327,22 +1127,67 @@ int nj_collect_object(nj_state_t *state, nj_object_t **reference);
 int nj_collect_children(nj_state_t *state, nj_object_t *object);
 int nj_should_collect(nj_state_t *state);
 void nj_update_reference(nj_object_t **reference);
+int nj_init_heap(nj_heap_t *heap, const nj_heap_options_t *options);
+void *nj_heap_allocate(nj_state_t *state, size_t size);
 void nj_destroy_heap(nj_state_t *state, nj_heap_t *heap);
 
+int nj_track_finalizable(nj_state_t *state, nj_object_t *object);
+
+//
+// How the collector tells whether an object survived the
+// collection that just ran. It may update its address.
+//
+
+typedef int (*nj_survives_t)(nj_heap_t *heap, nj_object_t **object);
+
+//
+// Payloads are allocated for an [owner] and released with
+// it, or earlier by nj_payload_free.
+//
+
+void  nj_init_payloads(nj_payload_space_t *space);
+void  nj_destroy_payloads(nj_payload_space_t *space);
+void *nj_payload_allocate(nj_state_t *state, nj_object_t *owner, size_t size);
+void  nj_payload_free(nj_state_t *state, void *data);
+void  nj_sweep_young_payloads(nj_state_t *state, nj_survives_t survives);
+void  nj_sweep_old_payloads(nj_state_t *state, nj_survives_t survives);
+
 void nj_fail(nj_state_t *state, const char *fmt, ...);
 int  nj_failed(nj_state_t *state);
 
 int nj_run(const char *name, const char *text, int length, char **error_text);
 int nj_run_file(const char *path, char **error_text);
+int nj_run_with_options(const char *name, const char *text, int length, nj_run_options_t *options, char **error_text);
+int nj_run_file_with_options(const char *path, nj_run_options_t *options, char **error_text);
 
 void nj_disassemble(char *code, char *data, uint32_t code_size, uint32_t data_size);
-int nj_compile(const char *text, size_t length, char **e_data, char **e_code, uint32_t *e_data_size, uint32_t *e_code_size, string_builder_t *output_builder);
+void nj_disassemble_register(char *code, char *data, uint32_t code_size, uint32_t data_size);
+int nj_compile(const char *text, size_t length, char **e_data, char **e_code, uint32_t *e_data_size, uint32_t *e_code_size, int opt_level, string_builder_t *output_builder);
+int nj_compile_register(const char *text, size_t length, char **e_data, char **e_code, uint32_t *e_data_size, uint32_t *e_code_size, int opt_level, string_builder_t *output_builder);
+int nj_compile_with_imports(const char *text, size_t length, int is_register, char **e_data, char **e_code, uint32_t *e_data_size, uint32_t *e_code_size, int opt_level, char ***e_imports, uint32_t *e_import_count, string_builder_t *output_builder);
+int nj_scan_imports(const char *text, size_t length, int opt_level, char ***e_imports, uint32_t *e_import_count, string_builder_t *output_builder);
+void nj_free_imports(char **paths, uint32_t count);
+int nj_compile_file(const char *path, const char *text, int length, int backend, int opt_level, const nj_bytecode_cache_options_t *cache, char **e_data, char **e_code, uint32_t *e_data_size, uint32_t *e_code_size, void **e_mapping, size_t *e_mapping_size, char ***e_imports, uint32_t *e_import_count, string_builder_t *output_builder);
+void nj_free_bytecode(char *data, char *code, void *mapping, size_t mapping_size);
+
+int  nj_precompile_imports(char **imports, uint32_t import_count, int threads, int backend, int opt_level, const nj_bytecode_cache_options_t *cache, nj_precompiled_t **e_modules, uint32_t *e_count);
+int  nj_take_precompiled(nj_state_t *state, const char *path, nj_precompiled_t *module);
+void nj_free_precompiled(nj_precompiled_t *modules, uint32_t count);
 
 int nj_import(nj_state_t *state);
-int nj_import_as(nj_state_t *state, const char *name);
+int nj_register_entry(nj_state_t *state, const char *path);
+int nj_import_as(nj_state_t *state, nj_symbol_t *name);
 
 int  nj_state_init(nj_state_t *state, string_builder_t *output_builder);
+int  nj_state_init_with_options(nj_state_t *state, string_builder_t *output_builder, const nj_heap_options_t *options);
 void nj_state_deinit(nj_state_t *state);
-int  nj_step(nj_state_t *state);
-
+int  nj_execute(nj_state_t *state);
+int  nj_execute_register(nj_state_t *state);
+
+int nj_verify_segment(nj_state_t *state, segment_t *segment);
+int nj_make_inline_caches(nj_state_t *state, segment_t *segment);
+void nj_free_inline_caches(segment_t *segment);
+void nj_report_inline_caches(nj_state_t *state, nj_ic_stats_t *stats, nj_ic_report_t *report);
+nj_object_t *nj_cached_select_attribute(nj_state_t *state, nj_inline_cache_t *cache, nj_object_t *container, nj_symbol_t *name);
+nj_object_t *nj_cached_select_variable(nj_state_t *state, nj_inline_cache_t *cache, nj_object_t *locals, nj_object_t *globals, nj_symbol_t *name);
 int append_segment(nj_state_t *state, char *code, char *data, uint32_t code_size, uint32_t data_size, char *name, char *text, int flags, uint32_t *e_segment);
\ No newline at end of file
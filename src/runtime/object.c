@@ -70,20 +70,21 @@ nj_object_t *nj_get_false_object(nj_state_t *state)
 
 int nj_object_to_c_int(nj_state_t *state, nj_object_t *object, int64_t *value)
 {
+	nj_object_t *type = nj_object_type_of(state, object);
 
-	if(object->type == nj_get_int_type_object(state)) {
+	if(type == nj_get_int_type_object(state)) {
 
 		if(value)
-			*value = ((nj_object_int_t*) object)->value;
+			*value = nj_is_small_int(object) ? nj_small_int_value(object) : ((nj_object_int_t*) object)->value;
 	
 		return 1;
 	}
 
 
-	if(object->type == nj_get_float_type_object(state)) {
+	if(type == nj_get_float_type_object(state)) {
 
 		if(value)
-			*value = ((nj_object_float_t*) object)->value;
+			*value = nj_is_small_float(object) ? nj_small_float_value(object) : ((nj_object_float_t*) object)->value;
 
 		return 1;
 	}
@@ -93,20 +94,35 @@ int nj_object_to_c_int(nj_state_t *state, nj_object_t *object, int64_t *value)
 
 int nj_object_to_c_float(nj_state_t *state, nj_object_t *object, double *value)
 {
+	nj_object_t *type = nj_object_type_of(state, object);
 
-	if(object->type == nj_get_int_type_object(state)) {
+	if(type == nj_get_int_type_object(state)) {
 
 		if(value)
-			*value = ((nj_object_int_t*) object)->value;
+			*value = nj_is_small_int(object) ? nj_small_int_value(object) : ((nj_object_int_t*) object)->value;
 	
 		return 1;
 	}
 
 
-	if(object->type == nj_get_float_type_object(state)) {
+	if(type == nj_get_float_type_object(state)) {
 
 		if(value)
-			*value = ((nj_object_float_t*) object)->value;
+			*value = nj_is_small_float(object) ? nj_small_float_value(object) : ((nj_object_float_t*) object)->value;
+
+		return 1;
+	}
+
+	return 0;
+}
+
+int nj_object_to_c_bool(nj_state_t *state, nj_object_t *object, uint8_t *value)
+{
+
+	if(nj_object_type_of(state, object) == nj_get_bool_type_object(state)) {
+
+		if(value)
+			*value = ((nj_object_bool_t*) object)->value;
 
 		return 1;
 	}
@@ -117,7 +133,7 @@ int nj_object_to_c_float(nj_state_t *state, nj_object_t *object, double *value)
 int nj_object_to_c_string(nj_state_t *state, nj_object_t *object, const char **value, int *length)
 {
 
-	if(object->type == nj_get_string_type_object(state)) {
+	if(nj_object_type_of(state, object) == nj_get_string_type_object(state)) {
 
 		if(value)
 			*value = ((nj_object_string_t*) object)->value;
@@ -133,6 +149,9 @@ int nj_object_to_c_string(nj_state_t *state, nj_object_t *object, const char **v
 
 nj_object_t *nj_object_from_c_int(nj_state_t *state, int64_t value)
 {
+	if(nj_small_int_fits(value))
+		return nj_small_int_make(value);
+
 	nj_object_t *o = nj_object_istanciate(state, (nj_object_t*) &state->type_object_int);
 
 	if(o == 0)
@@ -145,8 +164,18 @@ nj_object_t *nj_object_from_c_int(nj_state_t *state, int64_t value)
 	return o;
 }
 
+nj_object_t *nj_object_from_c_bool(nj_state_t *state, uint8_t value)
+{
+	return value ? nj_get_true_object(state) : nj_get_false_object(state);
+}
+
 nj_object_t *nj_object_from_c_float(nj_state_t *state, double value)
 {
+	nj_object_t *small = nj_small_float_make(value);
+
+	if(small)
+		return small;
+
 	nj_object_t *o = nj_object_istanciate(state, (nj_object_t*) &state->type_object_float);
 
 	if(o == 0)
@@ -174,15 +203,15 @@ nj_object_t *nj_object_from_segment_and_offset(nj_state_t *state, uint32_t segme
 	return o;
 }
 
-nj_object_t *nj_object_type(nj_object_t *self)
+nj_object_t *nj_object_type(nj_state_t *state, nj_object_t *self)
 {
-	return self->type;
+	return nj_object_type_of(state, self);
 }
 
 nj_object_t *nj_object_select(nj_state_t *state, nj_object_t *self, nj_object_t *key)
 {
 
-	nj_object_type_t *type = (nj_object_type_t*) self->type;
+	nj_object_type_t *type = (nj_object_type_t*) nj_object_type_of(state, self);
 	
 	if(type->on_select == 0)
 		return 0;
@@ -192,7 +221,7 @@ nj_object_t *nj_object_select(nj_state_t *state, nj_object_t *self, nj_object_t
 
 int nj_object_insert(nj_state_t *state, nj_object_t *self, nj_object_t *key, nj_object_t *item)
 {
-	nj_object_type_t *type = (nj_object_type_t*) self->type;
+	nj_object_type_t *type = (nj_object_type_t*) nj_object_type_of(state, self);
 
 	if(type->on_insert == 0)
 		return 0;
@@ -200,19 +229,19 @@ int nj_object_insert(nj_state_t *state, nj_object_t *self, nj_object_t *key, nj_
 	return type->on_insert(state, self, key, item);
 }
 
-nj_object_t *nj_object_select_attribute(nj_state_t *state, nj_object_t *self, const char *name)
+nj_object_t *nj_object_select_attribute_symbol(nj_state_t *state, nj_object_t *self, nj_symbol_t *name)
 {
-	nj_object_type_t *type = (nj_object_type_t*) self->type;
+	nj_object_type_t *type = (nj_object_type_t*) nj_object_type_of(state, self);
 
 	if(type->methods == 0)
 		return 0;
 
-	return nj_dictionary_select(state, type->methods, name);
+	return nj_dictionary_select_symbol(state, type->methods, name);
 }
 
-int nj_object_insert_attribute(nj_state_t *state, nj_object_t *self, const char *name, nj_object_t *value)
+int nj_object_insert_attribute_symbol(nj_state_t *state, nj_object_t *self, nj_symbol_t *name, nj_object_t *value)
 {
-	nj_object_type_t *type = (nj_object_type_t*) self->type;
+	nj_object_type_t *type = (nj_object_type_t*) nj_object_type_of(state, self);
 
 	if(type->methods == 0) {
 
@@ -224,14 +253,34 @@ int nj_object_insert_attribute(nj_state_t *state, nj_object_t *self, const char
 		type->methods = dict;
 	}
 
-	return nj_dictionary_insert(state, type->methods, name, value);
+	return nj_dictionary_insert_symbol(state, type->methods, name, value);
+}
+
+nj_object_t *nj_object_select_attribute(nj_state_t *state, nj_object_t *self, const char *name)
+{
+	nj_symbol_t *symbol = nj_symbol_lookup(state, name, strlen(name));
+
+	if(symbol == 0)
+		return 0;
+
+	return nj_object_select_attribute_symbol(state, self, symbol);
+}
+
+int nj_object_insert_attribute(nj_state_t *state, nj_object_t *self, const char *name, nj_object_t *value)
+{
+	nj_symbol_t *symbol = nj_symbol_intern(state, name, strlen(name));
+
+	if(symbol == 0)
+		return 0;
+
+	return nj_object_insert_attribute_symbol(state, self, symbol, value);
 }
 
 
 
 uint8_t nj_object_test(nj_state_t *state, nj_object_t *object)
 {
-	nj_object_type_t *type = (nj_object_type_t*) object->type;
+	nj_object_type_t *type = (nj_object_type_t*) nj_object_type_of(state, object);
 
 	if(type->on_test)
 		return type->on_test(state, object);
@@ -243,40 +292,12 @@ nj_object_t *nj_object_istanciate(nj_state_t *state, nj_object_t *type)
 {
 
 	size_t object_size = ((nj_object_type_t*) type)->size;
-	
-	//
-	// Align the heap pointer
-	//
-
-	if(state->heap.used & 7)
-		state->heap.used = (state->heap.used & ~7) + 8;
-
-	//
-	// Determine if there is space in the heap or
-	// this is an "overflowing allocation"
-	//
-
-	nj_object_t *object;
-
-	if(state->heap.used + object_size > state->heap.size) {
 
-		overflow_allocation_t *allocation = malloc(sizeof(overflow_allocation_t) + object_size);
+	nj_object_t *object = nj_heap_allocate(state, object_size);
 
-		if(allocation == 0)
-			return 0;
-
-		allocation->prev = state->heap.overflow_allocations;
-		state->heap.overflow_allocations = allocation;
-		
-		object = (nj_object_t*) allocation->body;
-	
-	} else {
-
-		object = (nj_object_t*) (state->heap.chunk + state->heap.used);
+	if(object == 0)
+		return 0;
 
-		state->heap.used += object_size;
-	}
-	
 	//
 	// Initialize the object
 	//
@@ -286,15 +307,24 @@ nj_object_t *nj_object_istanciate(nj_state_t *state, nj_object_t *type)
 	object->type = type;
 	object->flags = OBJECT_IS_COLLECTABLE;
 
-	if(((nj_object_type_t*) type)->on_init)
-		((nj_object_type_t*) type)->on_init(state, object);
+	// Objects created in the old space while marking are
+	// considered reachable by it.
+
+	if(state->heap.marking && !nj_is_young(&state->heap, object))
+		object->flags |= OBJECT_IS_MARKED;
+
+	if(((nj_object_type_t*) type)->on_deinit && !nj_track_finalizable(state, object))
+		return 0;
+
+	if(((nj_object_type_t*) type)->on_init && !((nj_object_type_t*) type)->on_init(state, object))
+		return 0;
 
 	return object;
 }
 
 void nj_object_print(nj_state_t *state, nj_object_t *self, FILE *fp)
 {
-	nj_object_type_t *t = (nj_object_type_t*) self->type;
+	nj_object_type_t *t = (nj_object_type_t*) nj_object_type_of(state, self);
 
 	if(t->on_print) {
 
@@ -308,7 +338,7 @@ void nj_object_print(nj_state_t *state, nj_object_t *self, FILE *fp)
 
 nj_object_t *nj_object_add(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
-	nj_object_type_t *t = (nj_object_type_t*) self->type;
+	nj_object_type_t *t = (nj_object_type_t*) nj_object_type_of(state, self);
 
 	if(t->on_add == 0) {
 
@@ -322,7 +352,7 @@ nj_object_t *nj_object_add(nj_state_t *state, nj_object_t *self, nj_object_t *ri
 
 nj_object_t *nj_object_sub(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
-	nj_object_type_t *t = (nj_object_type_t*) self->type;
+	nj_object_type_t *t = (nj_object_type_t*) nj_object_type_of(state, self);
 
 	if(t->on_sub == 0) {
 
@@ -336,7 +366,7 @@ nj_object_t *nj_object_sub(nj_state_t *state, nj_object_t *self, nj_object_t *ri
 
 nj_object_t *nj_object_mul(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
-	nj_object_type_t *t = (nj_object_type_t*) self->type;
+	nj_object_type_t *t = (nj_object_type_t*) nj_object_type_of(state, self);
 
 	if(t->on_mul == 0) {
 
@@ -350,7 +380,7 @@ nj_object_t *nj_object_mul(nj_state_t *state, nj_object_t *self, nj_object_t *ri
 
 nj_object_t *nj_object_div(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
-	nj_object_type_t *t = (nj_object_type_t*) self->type;
+	nj_object_type_t *t = (nj_object_type_t*) nj_object_type_of(state, self);
 
 	if(t->on_div == 0) {
 
@@ -364,7 +394,7 @@ nj_object_t *nj_object_div(nj_state_t *state, nj_object_t *self, nj_object_t *ri
 
 nj_object_t *nj_object_mod(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
-	nj_object_type_t *t = (nj_object_type_t*) self->type;
+	nj_object_type_t *t = (nj_object_type_t*) nj_object_type_of(state, self);
 
 	if(t->on_mod == 0) {
 
@@ -378,7 +408,7 @@ nj_object_t *nj_object_mod(nj_state_t *state, nj_object_t *self, nj_object_t *ri
 
 nj_object_t *nj_object_pow(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
-	nj_object_type_t *t = (nj_object_type_t*) self->type;
+	nj_object_type_t *t = (nj_object_type_t*) nj_object_type_of(state, self);
 
 	if(t->on_pow == 0) {
 
@@ -393,7 +423,7 @@ nj_object_t *nj_object_pow(nj_state_t *state, nj_object_t *self, nj_object_t *ri
 
 nj_object_t *nj_object_lss(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
-	nj_object_type_t *t = (nj_object_type_t*) self->type;
+	nj_object_type_t *t = (nj_object_type_t*) nj_object_type_of(state, self);
 
 	if(t->on_lss == 0) {
 
@@ -407,7 +437,7 @@ nj_object_t *nj_object_lss(nj_state_t *state, nj_object_t *self, nj_object_t *ri
 
 nj_object_t *nj_object_grt(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
-	nj_object_type_t *t = (nj_object_type_t*) self->type;
+	nj_object_type_t *t = (nj_object_type_t*) nj_object_type_of(state, self);
 
 	if(t->on_grt == 0) {
 
@@ -421,7 +451,7 @@ nj_object_t *nj_object_grt(nj_state_t *state, nj_object_t *self, nj_object_t *ri
 
 nj_object_t *nj_object_leq(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
-	nj_object_type_t *t = (nj_object_type_t*) self->type;
+	nj_object_type_t *t = (nj_object_type_t*) nj_object_type_of(state, self);
 
 	if(t->on_leq == 0) {
 
@@ -435,7 +465,7 @@ nj_object_t *nj_object_leq(nj_state_t *state, nj_object_t *self, nj_object_t *ri
 
 nj_object_t *nj_object_geq(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
-	nj_object_type_t *t = (nj_object_type_t*) self->type;
+	nj_object_type_t *t = (nj_object_type_t*) nj_object_type_of(state, self);
 
 	if(t->on_geq == 0) {
 
@@ -449,7 +479,7 @@ nj_object_t *nj_object_geq(nj_state_t *state, nj_object_t *self, nj_object_t *ri
 
 nj_object_t *nj_object_eql(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
-	nj_object_type_t *t = (nj_object_type_t*) self->type;
+	nj_object_type_t *t = (nj_object_type_t*) nj_object_type_of(state, self);
 
 	if(t->on_eql == 0) {
 
@@ -463,7 +493,7 @@ nj_object_t *nj_object_eql(nj_state_t *state, nj_object_t *self, nj_object_t *ri
 
 nj_object_t *nj_object_nql(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
-	nj_object_type_t *t = (nj_object_type_t*) self->type;
+	nj_object_type_t *t = (nj_object_type_t*) nj_object_type_of(state, self);
 
 	if(t->on_nql == 0) {
 
@@ -477,7 +507,7 @@ nj_object_t *nj_object_nql(nj_state_t *state, nj_object_t *self, nj_object_t *ri
 
 nj_object_t *nj_object_and(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
-	nj_object_type_t *t = (nj_object_type_t*) self->type;
+	nj_object_type_t *t = (nj_object_type_t*) nj_object_type_of(state, self);
 
 	if(t->on_and == 0) {
 
@@ -491,7 +521,7 @@ nj_object_t *nj_object_and(nj_state_t *state, nj_object_t *self, nj_object_t *ri
 
 nj_object_t *nj_object_or(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
-	nj_object_type_t *t = (nj_object_type_t*) self->type;
+	nj_object_type_t *t = (nj_object_type_t*) nj_object_type_of(state, self);
 
 	if(t->on_or == 0) {
 
@@ -505,7 +535,7 @@ nj_object_t *nj_object_or(nj_state_t *state, nj_object_t *self, nj_object_t *rig
 
 nj_object_t *nj_object_bitwise_and(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
-	nj_object_type_t *t = (nj_object_type_t*) self->type;
+	nj_object_type_t *t = (nj_object_type_t*) nj_object_type_of(state, self);
 
 	if(t->on_bitwise_and == 0) {
 
@@ -519,7 +549,7 @@ nj_object_t *nj_object_bitwise_and(nj_state_t *state, nj_object_t *self, nj_obje
 
 nj_object_t *nj_object_bitwise_or(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
-	nj_object_type_t *t = (nj_object_type_t*) self->type;
+	nj_object_type_t *t = (nj_object_type_t*) nj_object_type_of(state, self);
 
 	if(t->on_bitwise_or == 0) {
 
@@ -533,7 +563,7 @@ nj_object_t *nj_object_bitwise_or(nj_state_t *state, nj_object_t *self, nj_objec
 
 nj_object_t *nj_object_bitwise_xor(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
-	nj_object_type_t *t = (nj_object_type_t*) self->type;
+	nj_object_type_t *t = (nj_object_type_t*) nj_object_type_of(state, self);
 
 	if(t->on_bitwise_xor == 0) {
 
@@ -547,7 +577,7 @@ nj_object_t *nj_object_bitwise_xor(nj_state_t *state, nj_object_t *self, nj_obje
 
 nj_object_t *nj_object_shl(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
-	nj_object_type_t *t = (nj_object_type_t*) self->type;
+	nj_object_type_t *t = (nj_object_type_t*) nj_object_type_of(state, self);
 
 	if(t->on_shl == 0) {
 
@@ -561,7 +591,7 @@ nj_object_t *nj_object_shl(nj_state_t *state, nj_object_t *self, nj_object_t *ri
 
 nj_object_t *nj_object_shr(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
-	nj_object_type_t *t = (nj_object_type_t*) self->type;
+	nj_object_type_t *t = (nj_object_type_t*) nj_object_type_of(state, self);
 
 	if(t->on_shr == 0) {
 
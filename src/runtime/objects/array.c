@@ -9,25 +9,16 @@ static int array_init(nj_state_t *state, nj_object_t *self)
 
 	nj_object_array_t *x = (nj_object_array_t*) self;
 
-	x->items = malloc(sizeof(nj_object_t*) * 8);
+	x->items = NULL;
 	x->item_used = 0;
-	x->item_size = 8;
-
-	if(x->items == 0)
-		return 0;
+	x->item_size = NJ_ARRAY_INLINE_ITEMS;
 
 	return 1;
 }
 
-static int array_deinit(nj_state_t *state, nj_object_t *self)
+static nj_object_t **items_of(nj_object_array_t *array)
 {
-	(void) state;
-
-	nj_object_array_t *x = (nj_object_array_t*) self;
-
-	free(x->items);
-
-	return 1;
+	return array->items ? array->items : array->inline_items;
 }
 
 static void array_print(nj_state_t *state, nj_object_t *self, FILE *fp)
@@ -40,7 +31,7 @@ static void array_print(nj_state_t *state, nj_object_t *self, FILE *fp)
 
 	for(int i = 0; i < x->item_used; i++) {
 
-		nj_object_print(state, x->items[i], fp);
+		nj_object_print(state, items_of(x)[i], fp);
 
 		if(i+1 < x->item_used)
 			fprintf(fp, ", ");
@@ -58,13 +49,11 @@ nj_object_t *nj_array_select(nj_state_t *state, nj_object_t *self, int64_t index
 	if(index < 0 || index > a->item_used-1)
 		return 0;
 
-	return a->items[index];
+	return items_of(a)[index];
 }
 
 int nj_array_insert(nj_state_t *state, nj_object_t *self, int64_t index, nj_object_t *value)
 {
-	(void) state;
-
 	nj_object_array_t *a = (nj_object_array_t*) self;
 
 	if(index < 0 || index > a->item_used)
@@ -74,51 +63,64 @@ int nj_array_insert(nj_state_t *state, nj_object_t *self, int64_t index, nj_obje
 
 		if(a->item_used == a->item_size) {
 
-			nj_object_t **items = malloc(sizeof(nj_object_t*) * a->item_size * 2);
+			nj_object_t **items = nj_payload_allocate(state, self, sizeof(nj_object_t*) * a->item_size * 2);
+
+			if(items == 0)
+				return 0;
 
-			memcpy(items, a->items, sizeof(nj_object_t*) * a->item_used);
+			memcpy(items, items_of(a), sizeof(nj_object_t*) * a->item_used);
 
-			free(a->items);
+			nj_payload_free(state, a->items);
 
 			a->items = items;
 			a->item_size *= 2;
 
 		}
 
-		a->items[a->item_used++] = value;
+		items_of(a)[a->item_used++] = value;
 
 	} else {
 
-		a->items[index] = value;
+		items_of(a)[index] = value;
 	}
 
+	nj_write_barrier(state, self, value);
+
 	return 1;
 }
 
 static nj_object_t *array_select(nj_state_t *state, nj_object_t *self, nj_object_t *key)
 {
 
-	if(key->type != (nj_object_t*) &state->type_object_int) {
+	if(nj_object_type_of(state, key) != (nj_object_t*) &state->type_object_int) {
 
 		// #ERROR
 		// Expected an int value as array key
 		return 0;
 	}
 
-	return nj_array_select(state, self, ((nj_object_int_t*) key)->value);
+	int64_t index;
+
+	nj_object_to_c_int(state, key, &index);
+
+	return nj_array_select(state, self, index);
 }
 
 static int array_insert(nj_state_t *state, nj_object_t *self, nj_object_t *key, nj_object_t *value)
 {
 
-	if(key->type != (nj_object_t*) &state->type_object_int) {
+	if(nj_object_type_of(state, key) != (nj_object_t*) &state->type_object_int) {
 
 		// #ERROR
 		// Expected int value as array key
 		return 0;
 	}
 
-	return nj_array_insert(state, self, ((nj_object_int_t*) key)->value, value);
+	int64_t index;
+
+	nj_object_to_c_int(state, key, &index);
+
+	return nj_array_insert(state, self, index, value);
 }
 
 static nj_object_t *method_length(nj_state_t *state, int argc, nj_object_t **argv)
@@ -126,7 +128,7 @@ static nj_object_t *method_length(nj_state_t *state, int argc, nj_object_t **arg
 	if(argc != 1)
 		return 0;
 
-	if(argv[0]->type != (nj_object_t*) &state->type_object_array)
+	if(nj_object_type_of(state, argv[0]) != (nj_object_t*) &state->type_object_array)
 		return 0;
 
 	return nj_object_from_c_int(state, ((nj_object_array_t*) argv[0])->item_used);
@@ -161,8 +163,10 @@ static int collect_children(nj_state_t *state, nj_object_t *self)
 {
 	nj_object_array_t *array = (nj_object_array_t*) self;
 
+	nj_object_t **items = items_of(array);
+
 	for(int i = 0; i < array->item_used; i++)
-		if(!nj_collect_object(state, array->items + i))
+		if(!nj_collect_object(state, items + i))
 			return 0;
 
 	return 1;
@@ -176,7 +180,7 @@ int array_setup(nj_state_t *state)
 		.size = sizeof(nj_object_array_t),
 		.methods = 0, // Must be created
 		.on_init = array_init,
-		.on_deinit = array_deinit,
+		.on_deinit = 0,
 		.on_select = array_select,
 		.on_insert = array_insert,
 		.on_print = array_print,
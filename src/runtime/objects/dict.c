@@ -3,75 +3,39 @@
 #include <stdlib.h>
 #include "../noja.h"
 
-static int hash(const char *key) {
-
-	(void) key;
-	return 0;
+static nj_symbol_t *key_at(nj_object_dict_t *d, int i)
+{
+	return d->shape ? d->shape->keys[i] : d->item_keys[i];
 }
 
-static void map_insert(int *map, int map_size, const char *name, int index) {
-
-	int x, p, i, mask;
-
-	x = hash(name);
-	p = x;
-
-	mask = map_size - 1;
-
-	i = x & mask;
-
-	while(1) {
-
-		if(map[i] == -1)
-			break;
+//
+// Returns the index of the value associated to [name], or
+// -1 if there's none.
+//
+int nj_dictionary_slot(nj_object_t *self, nj_symbol_t *name)
+{
+	nj_object_dict_t *d = (nj_object_dict_t*) self;
 
-		p >>= 5;
-		i = (i*5 + p + 1) & mask;
-	}
+	if(d->shape)
+		return nj_shape_lookup(d->shape, name);
 
-	map[i] = index;
+	return nj_symbol_map_find(d->map, d->map_size, d->item_keys, name);
 }
 
 static int dict_init(nj_state_t *state, nj_object_t *self)
 {
-	(void) state;
-
 	nj_object_dict_t *x = (nj_object_dict_t*) self;
 
-	x->map = malloc(sizeof(int) * 8);
-	x->map_size = 8;
+	x->shape = state->shapes.root;
+	x->version = 0;
 
-	if(x->map == 0)
-		return 0;
+	x->map = NULL;
+	x->map_size = 0;
 
-	for(int i = 0; i < 8; i++)
-		x->map[i] = -1;
-
-	x->item_keys   = malloc((sizeof(char*) + sizeof(nj_object_t*)) * 8);
-	x->item_values = (nj_object_t**) (x->item_keys + 8);
+	x->item_keys   = NULL;
+	x->item_values = NULL;
 	x->item_used = 0;
-	x->item_size = 8;
-
-	if(x->item_keys == 0) {
-
-		free(x->map);
-		return 0;
-	}
-
-	return 1;
-}
-
-static int dict_deinit(nj_state_t *state, nj_object_t *self)
-{
-	(void) state;
-
-	nj_object_dict_t *x = (nj_object_dict_t*) self;
-
-	for(int i = 0; i < x->item_used; i++)
-		free(x->item_keys[i]);
-
-	free(x->map);
-	free(x->item_keys);
+	x->item_size = NJ_DICT_INLINE_ITEMS;
 
 	return 1;
 }
@@ -86,8 +50,8 @@ static void dict_print(nj_state_t *state, nj_object_t *self, FILE *fp)
 
 	for(int i = 0; i < x->item_used; i++) {
 
-		fprintf(fp, "\"%s\": ", x->item_keys[i]);
-		nj_object_print(state, x->item_values[i], fp);
+		fprintf(fp, "\"%s\": ", key_at(x, i)->text);
+		nj_object_print(state, nj_dictionary_values(x)[i], fp);
 
 		if(i+1 < x->item_used)
 			fprintf(fp, ", ");
@@ -96,120 +60,122 @@ static void dict_print(nj_state_t *state, nj_object_t *self, FILE *fp)
 	fprintf(fp, "}");
 }
 
-nj_object_t *nj_dictionary_select(nj_state_t *state, nj_object_t *self, const char *name)
+nj_object_t *nj_dictionary_select_symbol(nj_state_t *state, nj_object_t *self, nj_symbol_t *name)
 {
 	(void) state;
 
 	nj_object_dict_t *d = (nj_object_dict_t*) self;
 
-	int i, x, p, mask;
-
-	x = hash(name);
-	p = x;
-
-	mask = d->map_size - 1;
-
-	i = x & mask;
-
-	while(1) {
-
-		if(d->map[i] == -1)
-			return 0;
-
-		if(!strcmp(d->item_keys[d->map[i]], name))
-				return d->item_values[d->map[i]];
+	int i = nj_dictionary_slot(self, name);
 
-		p >>= 5;
-		i = (i*5 + p + 1) & mask;
-	}
+	if(i < 0)
+		return 0;
 
-	return 0;
+	return nj_dictionary_values(d)[i];
 }
 
-int nj_dictionary_merge_in(nj_state_t *state, nj_object_t *self, nj_object_t *other)
+nj_object_t *nj_dictionary_select(nj_state_t *state, nj_object_t *self, const char *name)
 {
-	nj_object_dict_t *y = (nj_object_dict_t*) other;
+	nj_symbol_t *symbol = nj_symbol_lookup(state, name, strlen(name));
 
-	for(int i = 0; i < y->item_used; i++)
-		if(!nj_dictionary_insert(state, self, y->item_keys[i], y->item_values[i]))
-			return 0;
+	// If the name was never interned, no
+	// dict can have it as a key.
 
-	return 1;
+	if(symbol == 0)
+		return 0;
+
+	return nj_dictionary_select_symbol(state, self, symbol);
 }
 
-int nj_dictionary_insert(nj_state_t *state, nj_object_t *self, const char *key, nj_object_t *value)
+//
+// Moves the keys of [d] out of its shape, along with its
+// values, and indexes them with a map of its own.
+//
+static int to_dictionary_mode(nj_state_t *state, nj_object_dict_t *d)
 {
-	(void) state;
+	int new_size = d->item_size * 2;
 
-	nj_object_dict_t *d = (nj_object_dict_t*) self;
+	char *chunk = nj_payload_allocate(state, (nj_object_t*) d, (sizeof(nj_symbol_t*) + sizeof(nj_object_t*)) * new_size);
 
-	// Check if the key was already inserted
+	if(chunk == 0)
+		return 0;
 
-	{
-		int x, p, i, mask;
+	int  map_size = 16;
 
-		mask = d->map_size - 1;
+	while(map_size * 2 < new_size * 3)
+		map_size *= 2;
 
-		x = hash(key);
-		p = x;
+	int *map = nj_payload_allocate(state, (nj_object_t*) d, sizeof(int) * map_size);
 
-		i = x & mask;
+	if(map == 0) {
+		nj_payload_free(state, chunk);
+		return 0;
+	}
 
-		while(1) {
+	nj_symbol_t **new_keys = (nj_symbol_t**) chunk;
+	nj_object_t **new_values = (nj_object_t**) (new_keys + new_size);
 
-			if(d->map[i] == -1)
+	// The empty shape has no key array
 
-				// The item isn't here
-				break;
+	if(d->item_used) {
+		memcpy(new_keys,   d->shape->keys, sizeof(nj_symbol_t*) * d->item_used);
+		memcpy(new_values, nj_dictionary_values(d),   sizeof(nj_object_t*) * d->item_used);
+	}
 
-			if(!strcmp(d->item_keys[d->map[i]], key)) {
+	for(int i = 0; i < map_size; i++)
+		map[i] = -1;
 
-				// Found the item! It's already contained!
+	for(int i = 0; i < d->item_used; i++)
+		nj_symbol_map_insert(map, map_size, new_keys[i], i);
 
-				d->item_values[d->map[i]] = value;
-				return 1;
-			}
+	nj_payload_free(state, d->item_values);
 
-			p >>= 5;
-			i = (i*5 + p + 1) & mask;
-		}
-	}
+	d->shape = NULL;
+	d->map = map;
+	d->map_size = map_size;
+	d->item_keys   = new_keys;
+	d->item_values = new_values;
+	d->item_size   = new_size;
 
+	return 1;
+}
+
+//
+// Adds [key] to a dict in dictionary mode.
+//
+static int insert_key(nj_state_t *state, nj_object_dict_t *d, nj_symbol_t *key, nj_object_t *value)
+{
 	// ensure there is enough space for the field
 
 	if(d->item_used == d->item_size) {
 
-		char *chunk = malloc((sizeof(char*) + sizeof(nj_object_t*)) * d->item_size * 2);
+		char *chunk = nj_payload_allocate(state, (nj_object_t*) d, (sizeof(nj_symbol_t*) + sizeof(nj_object_t*)) * d->item_size * 2);
 
 		if(chunk == 0)
 			return 0;
 
-		char 	 **new_keys = (char**) chunk;
-		nj_object_t **new_values = (nj_object_t**) (chunk + sizeof(char*) * d->item_size * 2);
-
-
-		for(int i = 0; i < d->item_used; i++) {
-	
-			new_keys[i] = d->item_keys[i];
-			new_values[i] = d->item_values[i];
-		}
+		nj_symbol_t **new_keys = (nj_symbol_t**) chunk;
+		nj_object_t **new_values = (nj_object_t**) (new_keys + d->item_size * 2);
 
+		memcpy(new_keys,   d->item_keys,   sizeof(nj_symbol_t*) * d->item_used);
+		memcpy(new_values, d->item_values, sizeof(nj_object_t*) * d->item_used);
 		
-		free(d->item_keys);
+		// The keys are owned by the symbol table
+
+		nj_payload_free(state, d->item_keys);
 
-		
 		d->item_keys   = new_keys;
 		d->item_values = new_values;
 
 		d->item_size *= 2;
 	}
 
-	
-	if(d->map_size * 2 < d->item_used * 3) {
+	// Grow the map when it gets too full
+
+	if(d->map_size * 2 < (d->item_used + 1) * 3) {
 
-		
 		int  new_map_size = d->map_size * 2;
-		int *new_map = malloc(sizeof(int) * new_map_size);
+		int *new_map = nj_payload_allocate(state, (nj_object_t*) d, sizeof(int) * new_map_size);
 	
 		if(new_map == 0)
 			return 0;
@@ -217,33 +183,105 @@ int nj_dictionary_insert(nj_state_t *state, nj_object_t *self, const char *key,
 		for(int i = 0; i < new_map_size; i++)
 			new_map[i] = -1;
 
-		
+		// Rehash using the hashes cached in the symbols
+
 		for(int i = 0; i < d->item_used; i++)
-			map_insert(new_map, new_map_size, d->item_keys[i], i);
+			nj_symbol_map_insert(new_map, new_map_size, d->item_keys[i], i);
 
-		
-		free(d->map);
+		nj_payload_free(state, d->map);
 
-		
 		d->map 	 = new_map;
 		d->map_size = new_map_size;
+	}
 	
+	nj_symbol_map_insert(d->map, d->map_size, key, d->item_used);
+
+	d->item_keys[d->item_used] = key;
+	d->item_values[d->item_used] = value;
+	d->item_used++;
+
+	return 1;
+}
+
+int nj_dictionary_insert_symbol(nj_state_t *state, nj_object_t *self, nj_symbol_t *key, nj_object_t *value)
+{
+	nj_object_dict_t *d = (nj_object_dict_t*) self;
+
+	// Check if the key was already inserted
+
+	{
+		int i = nj_dictionary_slot(self, key);
+
+		if(i >= 0) {
+
+			// Found the item! It's already contained!
+
+			nj_dictionary_values(d)[i] = value;
+			nj_write_barrier(state, self, value);
+			return 1;
+		}
 	}
 
-	char *key_copy = malloc(strlen(key)+1);
+	nj_symbol_mark(state, key);
+
+	nj_shape_t *shape = d->shape ? nj_shape_transition(state, d->shape, key) : NULL;
+
+	if(shape == NULL) {
+
+		if(d->shape && !to_dictionary_mode(state, d))
+			return 0;
+
+		if(!insert_key(state, d, key, value))
+			return 0;
+
+	} else {
+
+		// ensure there is enough space for the value
+
+		if(d->item_used == d->item_size) {
+
+			nj_object_t **new_values = nj_payload_allocate(state, self, sizeof(nj_object_t*) * d->item_size * 2);
+
+			if(new_values == 0)
+				return 0;
+
+			memcpy(new_values, nj_dictionary_values(d), sizeof(nj_object_t*) * d->item_used);
+
+			nj_payload_free(state, d->item_values);
 
-	if(key_copy == 0)
+			d->item_values = new_values;
+			d->item_size *= 2;
+		}
+
+		nj_dictionary_values(d)[d->item_used] = value;
+		d->item_used++;
+		d->shape = shape;
+	}
+
+	d->version++;
+
+	nj_write_barrier(state, self, value);
+
+	return 1;
+}
+
+int nj_dictionary_insert(nj_state_t *state, nj_object_t *self, const char *key, nj_object_t *value)
+{
+	nj_symbol_t *symbol = nj_symbol_intern(state, key, strlen(key));
+
+	if(symbol == 0)
 		return 0;
 
-	strcpy(key_copy, key);
-	
-	// insert the value
-	
-	map_insert(d->map, d->map_size, key_copy, d->item_used);
+	return nj_dictionary_insert_symbol(state, self, symbol, value);
+}
 
-	d->item_keys[d->item_used] = key_copy;
-	d->item_values[d->item_used] = value;	
-	d->item_used++;
+int nj_dictionary_merge_in(nj_state_t *state, nj_object_t *self, nj_object_t *other)
+{
+	nj_object_dict_t *y = (nj_object_dict_t*) other;
+
+	for(int i = 0; i < y->item_used; i++)
+		if(!nj_dictionary_insert_symbol(state, self, key_at(y, i), nj_dictionary_values(y)[i]))
+			return 0;
 
 	return 1;
 }
@@ -252,28 +290,42 @@ static nj_object_t *dict_select(nj_state_t *state, nj_object_t *self, nj_object_
 {
 	(void) state;
 
-	if(key->type != (nj_object_t*) &state->type_object_string) {
+	if(nj_object_type_of(state, key) != (nj_object_t*) &state->type_object_string) {
 
 		// #ERROR
 		// Expected string value as dict key
 		return 0;
 	}
 
-	return nj_dictionary_select(state, self, ((nj_object_string_t*) key)->value);
+	nj_object_string_t *string = (nj_object_string_t*) key;
+
+	nj_symbol_t *symbol = nj_symbol_lookup(state, string->value, string->length);
+
+	if(symbol == 0)
+		return 0;
+
+	return nj_dictionary_select_symbol(state, self, symbol);
 }
 
 static int dict_insert(nj_state_t *state, nj_object_t *self, nj_object_t *key, nj_object_t *value)
 {
 	(void) state;
 
-	if(key->type != (nj_object_t*) &state->type_object_string) {
+	if(nj_object_type_of(state, key) != (nj_object_t*) &state->type_object_string) {
 
 		// #ERROR
 		// Expected string value as dict key
 		return 0;
 	}
 
-	return nj_dictionary_insert(state, self, ((nj_object_string_t*) key)->value, value);
+	nj_object_string_t *string = (nj_object_string_t*) key;
+
+	nj_symbol_t *symbol = nj_symbol_intern(state, string->value, string->length);
+
+	if(symbol == 0)
+		return 0;
+
+	return nj_dictionary_insert_symbol(state, self, symbol, value);
 }
 
 static nj_object_t *method_keys(nj_state_t *state, int argc, nj_object_t **argv)
@@ -281,7 +333,7 @@ static nj_object_t *method_keys(nj_state_t *state, int argc, nj_object_t **argv)
 	if(argc != 1)
 		return 0;
 
-	if(argv[0]->type != (nj_object_t*) &state->type_object_dict)
+	if(nj_object_type_of(state, argv[0]) != (nj_object_t*) &state->type_object_dict)
 		return 0;
 
 	nj_object_dict_t *x = (nj_object_dict_t*) argv[0];
@@ -293,7 +345,9 @@ static nj_object_t *method_keys(nj_state_t *state, int argc, nj_object_t **argv)
 
 	for(int i = 0; i < x->item_used; i++) {
 
-		nj_object_t *string = nj_object_from_c_string(state, x->item_keys[i], strlen(x->item_keys[i]));
+		nj_symbol_t *key = key_at(x, i);
+
+		nj_object_t *string = nj_object_from_c_string(state, key->text, key->length);
 
 		if(string == 0)
 			return 0;
@@ -310,7 +364,7 @@ static nj_object_t *method_length(nj_state_t *state, int argc, nj_object_t **arg
 	if(argc != 1)
 		return 0;
 
-	if(argv[0]->type != (nj_object_t*) &state->type_object_dict)
+	if(nj_object_type_of(state, argv[0]) != (nj_object_t*) &state->type_object_dict)
 		return 0;
 
 	nj_object_dict_t *x = (nj_object_dict_t*) argv[0];
@@ -347,10 +401,18 @@ static int collect_children(nj_state_t *state, nj_object_t *self)
 {
 	nj_object_dict_t *dict = (nj_object_dict_t*) self;
 
+	nj_object_t **values = nj_dictionary_values(dict);
+
 	for(int i = 0; i < dict->item_used; i++)
-		if(!nj_collect_object(state, dict->item_values + i))
+		if(!nj_collect_object(state, values + i))
 			return 0;
 
+	// The keys of shapes are always in use
+
+	if(dict->shape == NULL)
+		for(int i = 0; i < dict->item_used; i++)
+			nj_symbol_mark(state, dict->item_keys[i]);
+
 	return 1;
 }
 
@@ -363,7 +425,7 @@ int dict_setup(nj_state_t *state)
 		.size = sizeof(nj_object_dict_t),
 		.methods = 0, // Must be created
 		.on_init = dict_init,
-		.on_deinit = dict_deinit,
+		.on_deinit = 0,
 		.on_select = dict_select,
 		.on_insert = dict_insert,
 		.on_print = dict_print,
@@ -1,40 +1,48 @@
 
 #include "../noja.h"
 
+static double float_value(nj_object_t *self)
+{
+	if(nj_is_small_float(self))
+		return nj_small_float_value(self);
+
+	return ((nj_object_float_t*) self)->value;
+}
+
 static void float_print(nj_state_t *state, nj_object_t *self, FILE *fp)
 {
 	(void) state;
 
-	nj_object_float_t *x = (nj_object_float_t*) self;
+	double x = float_value(self);
 	
-	fprintf(fp, "%g", x->value);
+	fprintf(fp, "%g", x);
 }
 
 static nj_object_t *float_add(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
 	(void) state;
 
-	nj_object_float_t *x = (nj_object_float_t*) self;
+	double x = float_value(self);
 
-	if(right->type != (nj_object_t*) &state->type_object_float) {
+	if(nj_object_type_of(state, right) != (nj_object_t*) &state->type_object_float) {
 
 		// #ERROR
 		// Unexpected type in add operation
 		return 0;
 	}
 
-	nj_object_float_t *r = (nj_object_float_t*) right;
+	double r = float_value(right);
 
-	return nj_object_from_c_float(state, x->value + r->value);
+	return nj_object_from_c_float(state, x + r);
 }
 
 static uint8_t float_test(nj_state_t *state, nj_object_t *self)
 {
 	(void) state;
 	
-	nj_object_float_t *x = (nj_object_float_t*) self;
+	double x = float_value(self);
 
-	return x->value != 0;
+	return x != 0;
 }
 
 int float_methods_setup(nj_state_t *state)
@@ -26,368 +26,376 @@ static nj_object_t *int_shr(nj_state_t *state, nj_object_t *self, nj_object_t *r
 
 static uint8_t int_test(nj_state_t *state, nj_object_t *self);
 
+static int64_t int_value(nj_object_t *self)
+{
+	if(nj_is_small_int(self))
+		return nj_small_int_value(self);
+
+	return ((nj_object_int_t*) self)->value;
+}
+
 static void int_print(nj_state_t *state, nj_object_t *self, FILE *fp)
 {
-	nj_object_int_t *x = (nj_object_int_t*) self;
+	int64_t x = int_value(self);
 
 	(void) state;
 	
-	fprintf(fp, "%ld", x->value);
+	fprintf(fp, "%ld", x);
 }
 
 static nj_object_t *int_add(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
-	nj_object_int_t *x = (nj_object_int_t*) self;
+	int64_t x = int_value(self);
 
-	if(right->type != (nj_object_t*) &state->type_object_int) {
+	if(nj_object_type_of(state, right) != (nj_object_t*) &state->type_object_int) {
 
 		// #ERROR
 		// Unexpected type in add operation
 		return 0;
 	}
 
-	nj_object_int_t *r = (nj_object_int_t*) right;
+	int64_t r = int_value(right);
 
-	return nj_object_from_c_int(state, x->value + r->value);
+	return nj_object_from_c_int(state, x + r);
 }
 
 static nj_object_t *int_sub(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
 	(void) state;
 
-	nj_object_int_t *x = (nj_object_int_t*) self;
+	int64_t x = int_value(self);
 
-	if(right->type != (nj_object_t*) &state->type_object_int) {
+	if(nj_object_type_of(state, right) != (nj_object_t*) &state->type_object_int) {
 
 		// #ERROR
 		// Unexpected type in sub operation
 		return 0;
 	}
 
-	nj_object_int_t *r = (nj_object_int_t*) right;
+	int64_t r = int_value(right);
 
-	return nj_object_from_c_int(state, x->value - r->value);
+	return nj_object_from_c_int(state, x - r);
 }
 
 static nj_object_t *int_mul(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
 	(void) state;
 
-	nj_object_int_t *x = (nj_object_int_t*) self;
+	int64_t x = int_value(self);
 
-	if(right->type != (nj_object_t*) &state->type_object_int) {
+	if(nj_object_type_of(state, right) != (nj_object_t*) &state->type_object_int) {
 
 		// #ERROR
 		// Unexpected type in mul operation
 		return 0;
 	}
 
-	nj_object_int_t *r = (nj_object_int_t*) right;
+	int64_t r = int_value(right);
 
-	return nj_object_from_c_int(state, x->value * r->value);
+	return nj_object_from_c_int(state, x * r);
 }
 
 static nj_object_t *int_div(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
 	(void) state;
 
-	nj_object_int_t *x = (nj_object_int_t*) self;
+	int64_t x = int_value(self);
 
-	if(right->type != (nj_object_t*) &state->type_object_int) {
+	if(nj_object_type_of(state, right) != (nj_object_t*) &state->type_object_int) {
 
 		// #ERROR
 		// Unexpected type in div operation
 		return 0;
 	}
 
-	nj_object_int_t *r = (nj_object_int_t*) right;
+	int64_t r = int_value(right);
 
-	if(r->value == 0)
+	if(r == 0)
 
 		// #ERROR
 		// Division by zero
 		return 0;
 
-	return nj_object_from_c_int(state, x->value / r->value);
+	return nj_object_from_c_int(state, x / r);
 }
 
 static nj_object_t *int_mod(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
 	(void) state;
 
-	nj_object_int_t *x = (nj_object_int_t*) self;
+	int64_t x = int_value(self);
 
-	if(right->type != (nj_object_t*) &state->type_object_int) {
+	if(nj_object_type_of(state, right) != (nj_object_t*) &state->type_object_int) {
 
 		// #ERROR
 		// Unexpected type in mod operation
 		return 0;
 	}
 
-	nj_object_int_t *r = (nj_object_int_t*) right;
+	int64_t r = int_value(right);
 
-	return nj_object_from_c_int(state, x->value % r->value);
+	return nj_object_from_c_int(state, x % r);
 }
 
 static nj_object_t *int_pow(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
 	(void) state;
 
-	nj_object_int_t *x = (nj_object_int_t*) self;
+	int64_t x = int_value(self);
 
-	if(right->type != (nj_object_t*) &state->type_object_int) {
+	if(nj_object_type_of(state, right) != (nj_object_t*) &state->type_object_int) {
 
 		// #ERROR
 		// Unexpected type in pow operation
 		return 0;
 	}
 
-	nj_object_int_t *r = (nj_object_int_t*) right;
+	int64_t r = int_value(right);
 
-	return nj_object_from_c_int(state, pow(x->value, r->value));
+	return nj_object_from_c_int(state, pow(x, r));
 }
 
 static nj_object_t *int_lss(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
 	(void) state;
 
-	nj_object_int_t *x = (nj_object_int_t*) self;
+	int64_t x = int_value(self);
 
-	if(right->type != (nj_object_t*) &state->type_object_int) {
+	if(nj_object_type_of(state, right) != (nj_object_t*) &state->type_object_int) {
 
 		// #ERROR
 		// Unexpected type
 		return 0;
 	}
 
-	nj_object_int_t *r = (nj_object_int_t*) right;
+	int64_t r = int_value(right);
 
-	return nj_object_from_c_int(state, x->value < r->value);
+	return nj_object_from_c_int(state, x < r);
 }
 
 static nj_object_t *int_grt(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
 	(void) state;
 
-	nj_object_int_t *x = (nj_object_int_t*) self;
+	int64_t x = int_value(self);
 
-	if(right->type != (nj_object_t*) &state->type_object_int) {
+	if(nj_object_type_of(state, right) != (nj_object_t*) &state->type_object_int) {
 
 		// #ERROR
 		// Unexpected type
 		return 0;
 	}
 
-	nj_object_int_t *r = (nj_object_int_t*) right;
+	int64_t r = int_value(right);
 
-	return nj_object_from_c_int(state, x->value > r->value);
+	return nj_object_from_c_int(state, x > r);
 }
 
 static nj_object_t *int_leq(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
 	(void) state;
 
-	nj_object_int_t *x = (nj_object_int_t*) self;
+	int64_t x = int_value(self);
 
-	if(right->type != (nj_object_t*) &state->type_object_int) {
+	if(nj_object_type_of(state, right) != (nj_object_t*) &state->type_object_int) {
 
 		// #ERROR
 		// Unexpected type
 		return 0;
 	}
 
-	nj_object_int_t *r = (nj_object_int_t*) right;
+	int64_t r = int_value(right);
 
-	return nj_object_from_c_int(state, x->value <= r->value);
+	return nj_object_from_c_int(state, x <= r);
 }
 
 static nj_object_t *int_geq(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
 	(void) state;
 
-	nj_object_int_t *x = (nj_object_int_t*) self;
+	int64_t x = int_value(self);
 
-	if(right->type != (nj_object_t*) &state->type_object_int) {
+	if(nj_object_type_of(state, right) != (nj_object_t*) &state->type_object_int) {
 
 		// #ERROR
 		// Unexpected type
 		return 0;
 	}
 
-	nj_object_int_t *r = (nj_object_int_t*) right;
+	int64_t r = int_value(right);
 
-	return nj_object_from_c_int(state, x->value >= r->value);
+	return nj_object_from_c_int(state, x >= r);
 }
 
 static nj_object_t *int_eql(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
 	(void) state;
 
-	nj_object_int_t *x = (nj_object_int_t*) self;
+	int64_t x = int_value(self);
 
-	if(right->type != (nj_object_t*) &state->type_object_int) {
+	if(nj_object_type_of(state, right) != (nj_object_t*) &state->type_object_int) {
 
 		// #ERROR
 		// Unexpected type
 		return nj_object_from_c_int(state, 0);
 	}
 
-	nj_object_int_t *r = (nj_object_int_t*) right;
+	int64_t r = int_value(right);
 
-	return nj_object_from_c_int(state, x->value == r->value);
+	return nj_object_from_c_int(state, x == r);
 }
 
 static nj_object_t *int_nql(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
 	(void) state;
 
-	nj_object_int_t *x = (nj_object_int_t*) self;
+	int64_t x = int_value(self);
 
-	if(right->type != (nj_object_t*) &state->type_object_int) {
+	if(nj_object_type_of(state, right) != (nj_object_t*) &state->type_object_int) {
 
 		// #ERROR
 		// Unexpected type
 		return 0;
 	}
 
-	nj_object_int_t *r = (nj_object_int_t*) right;
+	int64_t r = int_value(right);
 
-	return nj_object_from_c_int(state, x->value != r->value);
+	return nj_object_from_c_int(state, x != r);
 }
 
 static nj_object_t *int_and(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
 	(void) state;
 
-	nj_object_int_t *x = (nj_object_int_t*) self;
+	int64_t x = int_value(self);
 
-	if(right->type != (nj_object_t*) &state->type_object_int) {
+	if(nj_object_type_of(state, right) != (nj_object_t*) &state->type_object_int) {
 
 		// #ERROR
 		// Unexpected type
 		return 0;
 	}
 
-	nj_object_int_t *r = (nj_object_int_t*) right;
+	int64_t r = int_value(right);
 
-	return nj_object_from_c_int(state, x->value && r->value);
+	return nj_object_from_c_int(state, x && r);
 }
 
 static nj_object_t *int_or(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
 	(void) state;
 
-	nj_object_int_t *x = (nj_object_int_t*) self;
+	int64_t x = int_value(self);
 
-	if(right->type != (nj_object_t*) &state->type_object_int) {
+	if(nj_object_type_of(state, right) != (nj_object_t*) &state->type_object_int) {
 
 		// #ERROR
 		// Unexpected type
 		return 0;
 	}
 
-	nj_object_int_t *r = (nj_object_int_t*) right;
+	int64_t r = int_value(right);
 
-	return nj_object_from_c_int(state, x->value || r->value);
+	return nj_object_from_c_int(state, x || r);
 }
 
 static nj_object_t *int_bitwise_and(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
 	(void) state;
 
-	nj_object_int_t *x = (nj_object_int_t*) self;
+	int64_t x = int_value(self);
 
-	if(right->type != (nj_object_t*) &state->type_object_int) {
+	if(nj_object_type_of(state, right) != (nj_object_t*) &state->type_object_int) {
 
 		// #ERROR
 		// Unexpected type
 		return 0;
 	}
 
-	nj_object_int_t *r = (nj_object_int_t*) right;
+	int64_t r = int_value(right);
 
-	return nj_object_from_c_int(state, x->value & r->value);
+	return nj_object_from_c_int(state, x & r);
 }
 
 static nj_object_t *int_bitwise_or(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
 	(void) state;
 
-	nj_object_int_t *x = (nj_object_int_t*) self;
+	int64_t x = int_value(self);
 
-	if(right->type != (nj_object_t*) &state->type_object_int) {
+	if(nj_object_type_of(state, right) != (nj_object_t*) &state->type_object_int) {
 
 		// #ERROR
 		// Unexpected type
 		return 0;
 	}
 
-	nj_object_int_t *r = (nj_object_int_t*) right;
+	int64_t r = int_value(right);
 
-	return nj_object_from_c_int(state, x->value | r->value);
+	return nj_object_from_c_int(state, x | r);
 }
 
 static nj_object_t *int_bitwise_xor(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
 	(void) state;
 
-	nj_object_int_t *x = (nj_object_int_t*) self;
+	int64_t x = int_value(self);
 
-	if(right->type != (nj_object_t*) &state->type_object_int) {
+	if(nj_object_type_of(state, right) != (nj_object_t*) &state->type_object_int) {
 
 		// #ERROR
 		// Unexpected type
 		return 0;
 	}
 
-	nj_object_int_t *r = (nj_object_int_t*) right;
+	int64_t r = int_value(right);
 
-	return nj_object_from_c_int(state, x->value ^ r->value);
+	return nj_object_from_c_int(state, x ^ r);
 }
 
 static nj_object_t *int_shl(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
 	(void) state;
 
-	nj_object_int_t *x = (nj_object_int_t*) self;
+	int64_t x = int_value(self);
 
-	if(right->type != (nj_object_t*) &state->type_object_int) {
+	if(nj_object_type_of(state, right) != (nj_object_t*) &state->type_object_int) {
 
 		// #ERROR
 		// Unexpected type
 		return 0;
 	}
 
-	nj_object_int_t *r = (nj_object_int_t*) right;
+	int64_t r = int_value(right);
 
-	return nj_object_from_c_int(state, x->value << r->value);
+	return nj_object_from_c_int(state, x << r);
 }
 
 static nj_object_t *int_shr(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
 	(void) state;
 
-	nj_object_int_t *x = (nj_object_int_t*) self;
+	int64_t x = int_value(self);
 
-	if(right->type != (nj_object_t*) &state->type_object_int) {
+	if(nj_object_type_of(state, right) != (nj_object_t*) &state->type_object_int) {
 
 		// #ERROR
 		// Unexpected type
 		return 0;
 	}
 
-	nj_object_int_t *r = (nj_object_int_t*) right;
+	int64_t r = int_value(right);
 
-	return nj_object_from_c_int(state, x->value >> r->value);
+	return nj_object_from_c_int(state, x >> r);
 }
 
 static uint8_t int_test(nj_state_t *state, nj_object_t *self)
 {
 	(void) state;
 	
-	nj_object_int_t *x = (nj_object_int_t*) self;
+	int64_t x = int_value(self);
 
-	return x->value != 0;
+	return x != 0;
 }
 
 int int_methods_setup(nj_state_t *state)
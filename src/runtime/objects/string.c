@@ -9,8 +9,8 @@ enum {
 };
 
 static int string_init(nj_state_t *state, nj_object_t *self);
-static int string_deinit(nj_state_t *state, nj_object_t *self);
 static void string_print(nj_state_t *state, nj_object_t *self, FILE *fp);
+static nj_object_t *string_add(nj_state_t *state, nj_object_t *self, nj_object_t *right);
 
 nj_object_t *nj_object_from_c_string_ref(nj_state_t *state, const char *value, size_t length)
 {
@@ -28,7 +28,11 @@ nj_object_t *nj_object_from_c_string_ref(nj_state_t *state, const char *value, s
 	return o;
 }
 
-nj_object_t *nj_object_from_c_string_ref_2(nj_state_t *state, const char *value, size_t length)
+//
+// Creates a string of [length] bytes whose value is a
+// payload of its own, left for the caller to fill in.
+//
+static nj_object_t *new_owned_string(nj_state_t *state, size_t length)
 {
 	nj_object_t *o = nj_object_istanciate(state, (nj_object_t*) &state->type_object_string);
 
@@ -38,30 +42,38 @@ nj_object_t *nj_object_from_c_string_ref_2(nj_state_t *state, const char *value,
 	nj_object_string_t *x = (nj_object_string_t*) o;
 
 	x->flags = STRING_IS_OWNED;
-	x->ref_value = value;
+	x->value = nj_payload_allocate(state, o, length + 1);
 	x->length = length;
 
+	if(x->value == 0)
+		return 0;
+
+	x->value[length] = '\0';
+
 	return o;
 }
 
 nj_object_t *nj_object_from_c_string(nj_state_t *state, char *value, size_t length)
 {
-	nj_object_t *o = nj_object_istanciate(state, (nj_object_t*) &state->type_object_string);
+	nj_object_t *o = new_owned_string(state, length);
 
 	if(o == 0)
 		return 0;
 
-	nj_object_string_t *x = (nj_object_string_t*) o;
+	memcpy(((nj_object_string_t*) o)->value, value, length);
 
-	x->flags = STRING_IS_OWNED;
-	x->value = malloc(length + 1);
-	x->length = length;
+	return o;
+}
 
-	if(x->value == 0)
-		return 0;
+//
+// Takes ownership of [value], which was allocated with
+// malloc. Its bytes are moved to a payload.
+//
+nj_object_t *nj_object_from_c_string_ref_2(nj_state_t *state, const char *value, size_t length)
+{
+	nj_object_t *o = nj_object_from_c_string(state, (char*) value, length);
 
-	memcpy(x->value, value, length);
-	x->value[length] = '\0';
+	free((char*) value);
 
 	return o;
 }
@@ -78,24 +90,39 @@ static int string_init(nj_state_t *state, nj_object_t *self)
 	return 1;
 }
 
-static int string_deinit(nj_state_t *state, nj_object_t *self)
+static void string_print(nj_state_t *state, nj_object_t *self, FILE *fp)
 {
 	(void) state;
 
 	nj_object_string_t *x = (nj_object_string_t*) self;
 
-	if(x->flags & STRING_IS_OWNED)
-		free(x->value);
-	return 1;	
+	fprintf(fp, "%s", x->value);
 }
 
-static void string_print(nj_state_t *state, nj_object_t *self, FILE *fp)
+static nj_object_t *string_add(nj_state_t *state, nj_object_t *self, nj_object_t *right)
 {
-	(void) state;
-
 	nj_object_string_t *x = (nj_object_string_t*) self;
 
-	fprintf(fp, "%s", x->value);
+	if(nj_object_type_of(state, right) != (nj_object_t*) &state->type_object_string) {
+
+		// #ERROR
+		// Unexpected type in add operation
+		return 0;
+	}
+
+	nj_object_string_t *r = (nj_object_string_t*) right;
+
+	nj_object_t *o = new_owned_string(state, x->length + r->length);
+
+	if(o == 0)
+		return 0;
+
+	char *value = ((nj_object_string_t*) o)->value;
+
+	memcpy(value, x->value, x->length);
+	memcpy(value + x->length, r->value, r->length);
+
+	return o;
 }
 
 int string_methods_setup(nj_state_t *state)
@@ -136,11 +163,11 @@ int string_setup(nj_state_t *state)
 		.size = sizeof(nj_object_string_t),
 		.methods = 0, // Must be created
 		.on_init = string_init,
-		.on_deinit = string_deinit,
+		.on_deinit = 0,
 		.on_select = 0,
 		.on_insert = 0,
 		.on_print = string_print,
-		.on_add = 0,
+		.on_add = string_add,
 		.on_sub = 0,
 		.on_mul = 0,
 		.on_div = 0,
@@ -0,0 +1,429 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "noja.h"
+
+//
+// The payload space. Cells of a class are carved out of its
+// newest page and reused through its magazine and its free
+// list. Payloads
+// released while young stay listed with a NULL owner until
+// the next minor collection, so that the young list never
+// refers to a cell that was reused.
+//
+
+// Offset of the first cell of a page
+#define PAGE_START sizeof(nj_payload_page_t)
+
+//
+// Index of the smallest class that fits [size] bytes, or -1
+// when none does. The size is rounded up to a power of two,
+// whose exponent is 4 for the first class.
+//
+static int class_of(size_t size)
+{
+	if(size <= NJ_PAYLOAD_MIN_SIZE)
+		return 0;
+
+	int k = 64 - __builtin_clzll((unsigned long long) size - 1) - 4;
+
+	return k < NJ_PAYLOAD_CLASSES ? k : -1;
+}
+
+static size_t cell_size(int k)
+{
+	return sizeof(nj_payload_t) + ((size_t) NJ_PAYLOAD_MIN_SIZE << k);
+}
+
+//
+// Bytes of memory taken by [payload], header included.
+//
+static size_t footprint(nj_payload_t *payload)
+{
+	if(payload->flags & PAYLOAD_IS_LARGE)
+		return sizeof(nj_large_payload_t) + payload->size;
+
+	return sizeof(nj_payload_t) + payload->size;
+}
+
+void nj_init_payloads(nj_payload_space_t *space)
+{
+	memset(space, 0, sizeof(nj_payload_space_t));
+}
+
+void nj_destroy_payloads(nj_payload_space_t *space)
+{
+	for(int k = 0; k < NJ_PAYLOAD_CLASSES; k++) {
+
+		nj_payload_page_t *page = space->classes[k].pages;
+
+		while(page) {
+
+			nj_payload_page_t *next = page->next;
+
+			free(page);
+			page = next;
+		}
+	}
+
+	nj_large_payload_t *large = space->large;
+
+	while(large) {
+
+		nj_large_payload_t *next = large->next;
+
+		free(large);
+		large = next;
+	}
+
+	free(space->young);
+}
+
+//
+// Fills the empty magazine of class [k] with half a magazine
+// of cells from its free list or, when it's empty, from its
+// newest page.
+//
+static int refill(nj_heap_t *heap, int k)
+{
+	nj_payload_class_t *class = &heap->payloads.classes[k];
+
+	while(class->magazine_used < NJ_PAYLOAD_MAGAZINE_SIZE / 2 && class->free) {
+
+		nj_payload_t *payload = class->free;
+
+		class->free = *(nj_payload_t**) (payload + 1);
+		class->magazine[class->magazine_used++] = payload;
+	}
+
+	if(class->magazine_used)
+		return 1;
+
+	nj_payload_page_t *page = class->pages;
+
+	if(page == NULL || page->used + cell_size(k) > NJ_PAYLOAD_PAGE_SIZE) {
+
+		page = malloc(NJ_PAYLOAD_PAGE_SIZE);
+
+		if(page == 0)
+			return 0;
+
+		page->next = class->pages;
+		page->used = PAGE_START;
+
+		class->pages = page;
+
+		heap->stats.payload_classes[k].pages++;
+	}
+
+	// The cells of a page are looked at by the sweeps up to
+	// [used], so the carved ones must read as free.
+
+	while(class->magazine_used < NJ_PAYLOAD_MAGAZINE_SIZE / 2 && page->used + cell_size(k) <= NJ_PAYLOAD_PAGE_SIZE) {
+
+		nj_payload_t *payload = (nj_payload_t*) ((char*) page + page->used);
+
+		page->used += cell_size(k);
+
+		payload->owner = NULL;
+		payload->size = NJ_PAYLOAD_MIN_SIZE << k;
+		payload->flags = 0;
+
+		class->magazine[class->magazine_used++] = payload;
+	}
+
+	return 1;
+}
+
+static nj_payload_t *allocate_cell(nj_heap_t *heap, int k)
+{
+	nj_payload_class_t *class = &heap->payloads.classes[k];
+
+	if(class->magazine_used == 0 && !refill(heap, k))
+		return 0;
+
+	return class->magazine[--class->magazine_used];
+}
+
+static nj_payload_t *allocate_large(nj_payload_space_t *space, size_t size)
+{
+	if(size > UINT32_MAX)
+		return 0;
+
+	nj_large_payload_t *large = malloc(sizeof(nj_large_payload_t) + size);
+
+	if(large == 0)
+		return 0;
+
+	large->prev = NULL;
+	large->next = space->large;
+
+	if(space->large)
+		space->large->prev = large;
+
+	space->large = large;
+
+	large->header.size = size;
+
+	return &large->header;
+}
+
+void *nj_payload_allocate(nj_state_t *state, nj_object_t *owner, size_t size)
+{
+	nj_heap_t *heap = &state->heap;
+	nj_payload_space_t *space = &heap->payloads;
+
+	int young = nj_is_young(heap, owner);
+
+	if(young && space->young_used == space->young_size) {
+
+		uint32_t young_size = space->young_size ? space->young_size * 2 : 256;
+
+		nj_payload_t **list = realloc(space->young, sizeof(nj_payload_t*) * young_size);
+
+		if(list == 0)
+			return 0;
+
+		space->young = list;
+		space->young_size = young_size;
+	}
+
+	int k = class_of(size);
+
+	nj_payload_t *payload = k < 0 ? allocate_large(space, size) : allocate_cell(heap, k);
+
+	if(payload == 0)
+		return 0;
+
+	if(k < 0)
+		heap->stats.large_payloads.allocated++;
+	else
+		heap->stats.payload_classes[k].allocated++;
+
+	payload->owner = owner;
+	payload->flags = k < 0 ? PAYLOAD_IS_LARGE : 0;
+
+	if(young) {
+
+		payload->flags |= PAYLOAD_IS_YOUNG;
+
+		space->young[space->young_used++] = payload;
+
+	} else
+
+		space->old_used += footprint(payload);
+
+	// Payloads count towards the allocation budget, since
+	// only a collection gets them back.
+
+	heap->allocated += payload->size;
+	heap->stats.bytes_allocated += payload->size;
+
+	return payload + 1;
+}
+
+static void release(nj_state_t *state, nj_payload_t *payload)
+{
+	nj_heap_t *heap = &state->heap;
+	nj_payload_space_t *space = &heap->payloads;
+
+	if(payload->flags & PAYLOAD_IS_LARGE) {
+
+		heap->stats.large_payloads.released++;
+
+		nj_large_payload_t *large = (nj_large_payload_t*) ((char*) payload - offsetof(nj_large_payload_t, header));
+
+		if(large->prev)
+			large->prev->next = large->next;
+		else
+			space->large = large->next;
+
+		if(large->next)
+			large->next->prev = large->prev;
+
+		free(large);
+
+	} else {
+
+		int k = class_of(payload->size);
+
+		nj_payload_class_t *class = &space->classes[k];
+
+		heap->stats.payload_classes[k].released++;
+
+		payload->owner = NULL;
+		payload->flags = 0;
+
+		// When the magazine is full, its older half goes
+		// to the free list.
+
+		if(class->magazine_used == NJ_PAYLOAD_MAGAZINE_SIZE) {
+
+			for(int i = 0; i < NJ_PAYLOAD_MAGAZINE_SIZE / 2; i++) {
+
+				*(nj_payload_t**) (class->magazine[i] + 1) = class->free;
+				class->free = class->magazine[i];
+			}
+
+			memmove(class->magazine, class->magazine + NJ_PAYLOAD_MAGAZINE_SIZE / 2, sizeof(nj_payload_t*) * (NJ_PAYLOAD_MAGAZINE_SIZE / 2));
+
+			class->magazine_used = NJ_PAYLOAD_MAGAZINE_SIZE / 2;
+		}
+
+		class->magazine[class->magazine_used++] = payload;
+	}
+}
+
+void nj_payload_free(nj_state_t *state, void *data)
+{
+	if(data == NULL)
+		return;
+
+	nj_payload_t *payload = (nj_payload_t*) data - 1;
+
+	if(payload->flags & PAYLOAD_IS_YOUNG) {
+
+		payload->owner = NULL;
+		return;
+	}
+
+	state->heap.payloads.old_used -= footprint(payload);
+
+	release(state, payload);
+}
+
+//
+// Releases the young payloads whose owner didn't survive and
+// moves to the old generation the ones whose owner was
+// promoted.
+//
+void nj_sweep_young_payloads(nj_state_t *state, nj_survives_t survives)
+{
+	nj_heap_t *heap = &state->heap;
+	nj_payload_space_t *space = &heap->payloads;
+
+	uint32_t kept = 0;
+
+	for(uint32_t i = 0; i < space->young_used; i++) {
+
+		nj_payload_t *payload = space->young[i];
+
+		if(payload->owner == NULL || !survives(heap, &payload->owner)) {
+
+			release(state, payload);
+
+		} else if(nj_is_young(heap, payload->owner))
+
+			space->young[kept++] = payload;
+
+		else {
+
+			payload->flags &= ~PAYLOAD_IS_YOUNG;
+
+			space->old_used += footprint(payload);
+		}
+	}
+
+	space->young_used = kept;
+}
+
+//
+// Releases the old payloads whose owner didn't survive. The
+// magazines are emptied and the free lists rebuilt along the
+// way, leaving out the pages that have no payload left,
+// which are freed.
+//
+void nj_sweep_old_payloads(nj_state_t *state, nj_survives_t survives)
+{
+	nj_heap_t *heap = &state->heap;
+	nj_payload_space_t *space = &heap->payloads;
+
+	for(int k = 0; k < NJ_PAYLOAD_CLASSES; k++) {
+
+		nj_payload_class_t *class = &space->classes[k];
+
+		nj_payload_page_t **link = &class->pages;
+
+		class->free = NULL;
+		class->magazine_used = 0;
+
+		while(*link) {
+
+			nj_payload_page_t *page = *link;
+
+			nj_payload_t *free_cells = NULL;
+			nj_payload_t *free_tail = NULL;
+			int live = 0;
+
+			for(size_t offset = PAGE_START; offset < page->used; offset += cell_size(k)) {
+
+				nj_payload_t *payload = (nj_payload_t*) ((char*) page + offset);
+
+				if(payload->flags & PAYLOAD_IS_YOUNG) {
+
+					live = 1;
+					continue;
+				}
+
+				if(payload->owner) {
+
+					if(survives(heap, &payload->owner)) {
+
+						live = 1;
+						continue;
+					}
+
+					space->old_used -= footprint(payload);
+
+					payload->owner = NULL;
+
+					heap->stats.payload_classes[k].released++;
+				}
+
+				if(free_tail == NULL)
+					free_tail = payload;
+
+				*(nj_payload_t**) (payload + 1) = free_cells;
+				free_cells = payload;
+			}
+
+			if(!live) {
+
+				*link = page->next;
+
+				free(page);
+
+				heap->stats.payload_classes[k].pages_freed++;
+				continue;
+			}
+
+			// Append the free cells of the page to the class'
+
+			if(free_cells) {
+
+				*(nj_payload_t**) (free_tail + 1) = class->free;
+				class->free = free_cells;
+			}
+
+			link = &page->next;
+		}
+	}
+
+	nj_large_payload_t *large = space->large;
+
+	while(large) {
+
+		nj_large_payload_t *next = large->next;
+
+		nj_payload_t *payload = &large->header;
+
+		if(!(payload->flags & PAYLOAD_IS_YOUNG) && !survives(heap, &payload->owner)) {
+
+			space->old_used -= footprint(payload);
+
+			release(state, payload);
+		}
+
+		large = next;
+	}
+}
@@ -0,0 +1,313 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "noja.h"
+#include "utils/basic.h"
+
+//
+// Imports are compiled when they run, one after the other.
+// When a run asks for it, the modules it imports are instead
+// compiled before it starts, on a pool of threads, following
+// the imports whose path is known from the source (see
+// compile/imports.c) from the file that's run to the modules
+// they lead to.
+//
+// Modules still run when their import statement does, so the
+// order of their effects doesn't change. do_text_import takes
+// the code of a module from here when there is one, and
+// compiles it otherwise. Modules that fail to compile aren't
+// kept, so that the import reports the error as usual.
+//
+// Compilation doesn't touch the state, so the workers only
+// share the list of modules. Each module is one job, known by
+// the device and inode of its file like in the registry of
+// imported modules. A worker takes the next job, compiles it
+// and adds the modules it imports that aren't listed yet. The
+// pool is done when no job is left and none is running.
+//
+
+typedef struct {
+	char *path;
+	nj_precompiled_t module;
+	int compiled;
+} job_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t  wake;
+
+	job_t *jobs;
+	uint32_t jobs_used;
+	uint32_t jobs_size;
+
+	uint32_t next;    // Next job to take
+	uint32_t running; // Jobs taken but not done
+
+	int backend;
+	int opt_level;
+	const nj_bytecode_cache_options_t *cache;
+} precompiler_t;
+
+static int is_library(const char *path)
+{
+	const char *extension = strrchr(path, '.');
+
+	return extension && (!strcmp(extension, ".dll") || !strcmp(extension, ".so"));
+}
+
+//
+// Lists [path] as a job, unless it's a library, it doesn't
+// exist or it's already listed. Must hold the lock once the
+// workers started. Returns 0 if it ran out of memory.
+//
+static int add_job(precompiler_t *pool, const char *path)
+{
+	struct stat info;
+
+	if(is_library(path) || stat(path, &info) < 0)
+		return 1;
+
+	for(uint32_t i = 0; i < pool->jobs_used; i++)
+		if(pool->jobs[i].module.device == (uint64_t) info.st_dev && pool->jobs[i].module.inode == (uint64_t) info.st_ino)
+			return 1;
+
+	if(pool->jobs_used == pool->jobs_size) {
+
+		uint32_t size = pool->jobs_size == 0 ? 16 : 2 * pool->jobs_size;
+
+		job_t *jobs = realloc(pool->jobs, sizeof(job_t) * size);
+
+		if(jobs == 0)
+			return 0;
+
+		pool->jobs = jobs;
+		pool->jobs_size = size;
+	}
+
+	char *copy = malloc(strlen(path) + 1);
+
+	if(copy == 0)
+		return 0;
+
+	strcpy(copy, path);
+
+	pool->jobs[pool->jobs_used++] = (job_t) {
+		.path = copy,
+		.module = {
+			.device = info.st_dev,
+			.inode = info.st_ino,
+		},
+	};
+
+	return 1;
+}
+
+//
+// Compiles the module at [path] into [module], and sets the
+// paths it imports. Runs without the lock.
+//
+static int compile_module(precompiler_t *pool, const char *path, nj_precompiled_t *module, char ***e_imports, uint32_t *e_import_count)
+{
+	if(!load_text(path, &module->text, &module->length))
+		return 0;
+
+	string_builder_t output_builder;
+	string_builder_init(&output_builder);
+
+	int compiled = nj_compile_file(path, module->text, module->length, pool->backend, pool->opt_level, pool->cache,
+		&module->data, &module->code, &module->data_size, &module->code_size, &module->mapping, &module->mapping_size,
+		e_imports, e_import_count, &output_builder);
+
+	string_builder_deinit(&output_builder);
+
+	if(!compiled) {
+
+		free(module->text);
+		module->text = 0;
+		return 0;
+	}
+
+	return 1;
+}
+
+static void *work(void *data)
+{
+	precompiler_t *pool = data;
+
+	pthread_mutex_lock(&pool->lock);
+
+	while(1) {
+
+		while(pool->next == pool->jobs_used && pool->running > 0)
+			pthread_cond_wait(&pool->wake, &pool->lock);
+
+		if(pool->next == pool->jobs_used)
+			break;
+
+		// The array may move while the lock isn't held, so
+		// the job is copied out and back.
+
+		uint32_t index = pool->next++;
+		job_t job = pool->jobs[index];
+
+		pool->running++;
+
+		pthread_mutex_unlock(&pool->lock);
+
+		char **imports;
+		uint32_t import_count;
+
+		job.compiled = compile_module(pool, job.path, &job.module, &imports, &import_count);
+
+		pthread_mutex_lock(&pool->lock);
+
+		pool->jobs[index] = job;
+
+		if(job.compiled) {
+
+			// Running out of memory only means that fewer
+			// modules are compiled ahead
+
+			for(uint32_t i = 0; i < import_count; i++)
+				if(!add_job(pool, imports[i]))
+					break;
+
+			nj_free_imports(imports, import_count);
+		}
+
+		pool->running--;
+
+		pthread_cond_broadcast(&pool->wake);
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+	return 0;
+}
+
+//
+// Compiles the modules reachable from [imports], the paths
+// imported by the file that's run, on [threads] threads for
+// [backend] at [opt_level], through the bytecode [cache] if
+// there's one. The ones that compiled are stored into
+// [e_modules] and their number into [e_count].
+//
+int nj_precompile_imports(char **imports, uint32_t import_count, int threads, int backend, int opt_level, const nj_bytecode_cache_options_t *cache, nj_precompiled_t **e_modules, uint32_t *e_count)
+{
+	precompiler_t pool = {
+		.backend = backend,
+		.opt_level = opt_level,
+		.cache = cache,
+	};
+
+	*e_modules = 0;
+	*e_count = 0;
+
+	for(uint32_t i = 0; i < import_count; i++)
+		if(!add_job(&pool, imports[i]))
+			break;
+
+	if(pool.jobs_used == 0) {
+
+		free(pool.jobs);
+		return 1;
+	}
+
+	pthread_t *workers = malloc(sizeof(pthread_t) * threads);
+
+	if(workers == 0 || pthread_mutex_init(&pool.lock, 0) != 0) {
+
+		free(workers);
+		free(pool.jobs);
+		return 0;
+	}
+
+	pthread_cond_init(&pool.wake, 0);
+
+	int started = 0;
+
+	while(started < threads && pthread_create(&workers[started], 0, work, &pool) == 0)
+		started++;
+
+	// With no worker, the jobs are done here
+
+	if(started == 0)
+		work(&pool);
+
+	for(int i = 0; i < started; i++)
+		pthread_join(workers[i], 0);
+
+	pthread_cond_destroy(&pool.wake);
+	pthread_mutex_destroy(&pool.lock);
+	free(workers);
+
+	// Keep the modules that compiled
+
+	nj_precompiled_t *modules = malloc(sizeof(nj_precompiled_t) * pool.jobs_used);
+	uint32_t count = 0;
+
+	for(uint32_t i = 0; i < pool.jobs_used; i++) {
+
+		job_t *job = &pool.jobs[i];
+
+		free(job->path);
+
+		if(!job->compiled)
+			continue;
+
+		if(modules)
+			modules[count++] = job->module;
+		else {
+			free(job->module.text);
+			nj_free_bytecode(job->module.data, job->module.code, job->module.mapping, job->module.mapping_size);
+		}
+	}
+
+	free(pool.jobs);
+
+	*e_modules = modules;
+	*e_count = count;
+	return modules != 0;
+}
+
+void nj_free_precompiled(nj_precompiled_t *modules, uint32_t count)
+{
+	for(uint32_t i = 0; i < count; i++) {
+
+		if(modules[i].text == 0)
+			continue;
+
+		free(modules[i].text);
+		nj_free_bytecode(modules[i].data, modules[i].code, modules[i].mapping, modules[i].mapping_size);
+	}
+
+	free(modules);
+}
+
+//
+// Takes the code of the module at [path] out of the modules
+// compiled ahead of the run, if it's there. The caller owns
+// it from then on.
+//
+int nj_take_precompiled(nj_state_t *state, const char *path, nj_precompiled_t *module)
+{
+	struct stat info;
+
+	if(state->precompiled_count == 0 || stat(path, &info) < 0)
+		return 0;
+
+	for(uint32_t i = 0; i < state->precompiled_count; i++) {
+
+		nj_precompiled_t *candidate = &state->precompiled[i];
+
+		if(candidate->text && candidate->device == (uint64_t) info.st_dev && candidate->inode == (uint64_t) info.st_ino) {
+
+			*module = *candidate;
+			candidate->text = 0;
+			return 1;
+		}
+	}
+
+	return 0;
+}
@@ -6,6 +6,47 @@
 #include "noja.h"
 #include "utils/basic.h"
 
+//
+// Interns every string of the data segment. The compiler
+// refers to names by their position in the data segment
+// (the n-th string is symbol n), so the interpreter can
+// turn an operand into a symbol with a single array access.
+//
+static int intern_data(nj_state_t *state, char *data, uint32_t data_size, nj_symbol_t ***e_symbols, uint32_t *e_count)
+{
+	uint32_t count = 0;
+
+	for(uint32_t i = 0; i < data_size; i++)
+		if(data[i] == '\0')
+			count++;
+
+	nj_symbol_t **symbols = malloc(sizeof(nj_symbol_t*) * (count + 1));
+
+	if(symbols == 0)
+		return 0;
+
+	uint32_t offset = 0;
+
+	for(uint32_t i = 0; i < count; i++) {
+
+		size_t length = strlen(data + offset);
+
+		symbols[i] = nj_symbol_intern(state, data + offset, length);
+
+		if(symbols[i] == 0) {
+
+			free(symbols);
+			return 0;
+		}
+
+		offset += length + 1;
+	}
+
+	*e_symbols = symbols;
+	*e_count = count;
+	return 1;
+}
+
 int append_segment(nj_state_t *state, char *code, char *data, uint32_t code_size, uint32_t data_size, char *name, char *text, int flags, uint32_t *e_segment)
 {
 	if(state->segments_used == state->segments_size) {
@@ -26,12 +67,13 @@ int append_segment(nj_state_t *state, char *code, char *data, uint32_t code_size
 	if(e_segment)
 		*e_segment = state->segments_used;
 
-	nj_object_t *map = nj_object_istanciate(state, (nj_object_t*) &state->type_object_dict);
+	nj_symbol_t **symbols;
+	uint32_t symbols_count;
 
-	if(map == 0)
+	if(!intern_data(state, data, data_size, &symbols, &symbols_count))
 		return 0;
 
-	state->segments[state->segments_used] = (segment_t) { 
+	segment_t segment = { 
 		.flags = flags,
 		.name = name,
 		.text = text,
@@ -39,28 +81,102 @@ int append_segment(nj_state_t *state, char *code, char *data, uint32_t code_size
 		.data = data, 
 		.code_size = code_size, 
 		.data_size = data_size,
-		.global_variables_map = map,
+		.symbols = symbols,
+		.symbols_count = symbols_count,
+		.global_variables_map = 0,
 	};
 
+	if(!nj_verify_segment(state, &segment)) {
+
+		free(symbols);
+		return 0;
+	}
+
+	segment.global_variables_map = nj_object_istanciate(state, (nj_object_t*) &state->type_object_dict);
+
+	if(segment.global_variables_map == 0) {
+
+		free(symbols);
+		return 0;
+	}
+
+	if(!nj_make_inline_caches(state, &segment)) {
+
+		free(symbols);
+		return 0;
+	}
+
+	state->segments[state->segments_used] = segment;
+
 	state->segments_used++;
 
 	return 1;
 }
 
-static int run_text_inner(const char *name, const char *text, int length, string_builder_t *output_builder)
+//
+// Runs [text]. When it's the contents of a file, [path] is
+// the path of the file and its code may come from the
+// bytecode cache, otherwise it's null.
+//
+static int run_text_inner(const char *name, const char *path, const char *text, int length, nj_run_options_t *options, string_builder_t *output_builder)
 {
 	char *code, *data;
 	uint32_t code_size, data_size;
 
-	if(!nj_compile(text, length, &data, &code, &data_size, &code_size, output_builder))
+	void *mapping;
+	size_t mapping_size;
+
+	int is_register = options->backend == NJ_BACKEND_REGISTER;
+
+	const nj_bytecode_cache_options_t *cache = path ? &options->bytecode_cache : 0;
+
+	// The imports are only listed when they're compiled
+	// ahead of the run
+
+	int precompile = path && options->compile_threads > 0;
+
+	char **imports = 0;
+	uint32_t import_count = 0;
+
+	if(!nj_compile_file(path, text, length, options->backend, options->opt_level, cache, &data, &code, &data_size, &code_size, &mapping, &mapping_size, precompile ? &imports : 0, &import_count, output_builder))
 		return 0;
 
+	nj_precompiled_t *precompiled = 0;
+	uint32_t precompiled_count = 0;
+
+	if(precompile) {
+
+		// Failing to compile ahead isn't an error, the
+		// modules are compiled when they're imported
+
+		nj_precompile_imports(imports, import_count, options->compile_threads, options->backend, options->opt_level, cache, &precompiled, &precompiled_count);
+		nj_free_imports(imports, import_count);
+	}
+
 	nj_state_t state;
 
-	if(!nj_state_init(&state, output_builder)) {
+	if(!nj_state_init_with_options(&state, output_builder, &options->heap)) {
 
-		free(code);
-		free(data);
+		nj_free_bytecode(data, code, mapping, mapping_size);
+		nj_free_precompiled(precompiled, precompiled_count);
+		return 0;
+	}
+
+	state.precompiled = precompiled;
+	state.precompiled_count = precompiled_count;
+
+	state.backend = options->backend;
+	state.opt_level = options->opt_level;
+	state.bytecode_cache = options->bytecode_cache;
+	state.opcode_pairs = options->opcode_pairs;
+	state.heap.trace = options->gc_trace;
+
+	if(path && !nj_register_entry(&state, path)) {
+
+		string_builder_append(output_builder, " in ${zero-terminated-string}", name);
+
+		nj_free_bytecode(data, code, mapping, mapping_size);
+		nj_state_deinit(&state);
 		return 0;
 	}
 
@@ -70,19 +186,45 @@ static int run_text_inner(const char *name, const char *text, int length, string
 
 	strcpy(name_copy, name);
 
-	append_segment(&state, code, data, code_size, data_size, name, text, SEGMENT_OWNS_NAME, 0); // Can't fail 
+	if(!append_segment(&state, code, data, code_size, data_size, name, text, SEGMENT_OWNS_NAME | (is_register ? SEGMENT_IS_REGISTER : 0), 0)) {
+
+		if(!state.failed)
+			nj_fail(&state, "Out of memory. Failed to grow segment array");
+
+		string_builder_append(output_builder, " in ${zero-terminated-string}", name);
+
+		nj_free_bytecode(data, code, mapping, mapping_size);
+		nj_state_deinit(&state);
+		return 0;
+	}
 
-	u32_push(&state.segment_stack, 0);
-	u32_push(&state.offset_stack, 0);
+	state.segments[0].mapping = mapping;
+	state.segments[0].mapping_size = mapping_size;
 
-	while(nj_step(&state));
+	if(!nj_push_frame(&state, 0, 0)) {
+
+		string_builder_append(output_builder, "Out of memory. Failed to grow the frame stack");
+
+		nj_state_deinit(&state);
+		return 0;
+	}
+
+	if(is_register)
+		nj_execute_register(&state);
+	else
+		nj_execute(&state);
+
+	options->dispatched = state.dispatched;
+	options->gc_stats = state.heap.stats;
+
+	nj_report_inline_caches(&state, &options->ic_stats, options->ic_report);
 
 	if(state.failed) {
 
 		uint32_t lineno = 1;
 		uint32_t offset = 0;
 
-		segment_t *segment = state.segments + u32_top(&state.segment_stack);
+		segment_t *segment = state.segments + state.frames[state.frames_used - 1].segment;
 		
 		while(offset < state.offset) {
 
@@ -95,8 +237,7 @@ static int run_text_inner(const char *name, const char *text, int length, string
 		string_builder_append(output_builder, " in ${zero-terminated-string}:${integer}", segment->name, lineno);
 	}
 
-	u32_pop(&state.segment_stack);
-	u32_pop(&state.offset_stack);
+	state.frames_used = 0;
 
 	int result = !state.failed;
 
@@ -105,11 +246,18 @@ static int run_text_inner(const char *name, const char *text, int length, string
 }
 
 int nj_run(const char *name, const char *text, int length, char **error_text)
+{
+	nj_run_options_t options = { .backend = NJ_BACKEND_STACK, .opt_level = NJ_OPT_DEFAULT };
+
+	return nj_run_with_options(name, text, length, &options, error_text);
+}
+
+static int run_text(const char *name, const char *path, const char *text, int length, nj_run_options_t *options, char **error_text)
 {
 	string_builder_t output_builder;
 	string_builder_init(&output_builder);
 
-	int result = run_text_inner(name, text, length, &output_builder);
+	int result = run_text_inner(name, path, text, length, options, &output_builder);
 
 	if(!result && error_text) {
 
@@ -123,7 +271,19 @@ int nj_run(const char *name, const char *text, int length, char **error_text)
 	return result;
 }
 
+int nj_run_with_options(const char *name, const char *text, int length, nj_run_options_t *options, char **error_text)
+{
+	return run_text(name, 0, text, length, options, error_text);
+}
+
 int nj_run_file(const char *path, char **error_text)
+{
+	nj_run_options_t options = { .backend = NJ_BACKEND_STACK, .opt_level = NJ_OPT_DEFAULT };
+
+	return nj_run_file_with_options(path, &options, error_text);
+}
+
+int nj_run_file_with_options(const char *path, nj_run_options_t *options, char **error_text)
 {
 	char *text;
 	int length;
@@ -135,7 +295,7 @@ int nj_run_file(const char *path, char **error_text)
 		return 0;
 	}
 
-	int result = nj_run(path, text, length, error_text);
+	int result = run_text(path, path, text, length, options, error_text);
 
 	free(text);
 
@@ -0,0 +1,203 @@
+#include <stdlib.h>
+#include <string.h>
+#include "noja.h"
+
+//
+// The shape table holds the empty shape and the transitions
+// between shapes. A transition is stored as the shape it
+// leads to, which knows its parent and the key it added, so
+// the table is a set of shapes hashed by those two.
+//
+
+int nj_shape_table_init(nj_shape_table_t *table)
+{
+	table->pool = pool_create_2(4096);
+
+	if(table->pool == 0)
+		return 0;
+
+	table->root = pool_request(table->pool, sizeof(nj_shape_t));
+
+	if(table->root == 0) {
+
+		pool_destroy(table->pool);
+		return 0;
+	}
+
+	table->root->parent = NULL;
+	table->root->key = NULL;
+	table->root->keys = NULL;
+	table->root->map = NULL;
+	table->root->map_size = 0;
+	table->root->count = 0;
+
+	table->transitions = calloc(256, sizeof(nj_shape_t*));
+	table->size = 256;
+	table->used = 0;
+
+	if(table->transitions == 0) {
+
+		pool_destroy(table->pool);
+		return 0;
+	}
+
+	return 1;
+}
+
+void nj_shape_table_deinit(nj_shape_table_t *table)
+{
+	free(table->transitions);
+	pool_destroy(table->pool);
+}
+
+static uint64_t transition_hash(nj_shape_t *parent, nj_symbol_t *key)
+{
+	return key->hash ^ ((uintptr_t) parent >> 3) * 0x9E3779B97F4A7C15ull;
+}
+
+static uint32_t find_slot(nj_shape_t **slots, uint32_t size, nj_shape_t *parent, nj_symbol_t *key)
+{
+	uint32_t mask = size - 1;
+	uint32_t i = transition_hash(parent, key) & mask;
+
+	while(slots[i]) {
+
+		if(slots[i]->parent == parent && slots[i]->key == key)
+			break;
+
+		i = (i + 1) & mask;
+	}
+
+	return i;
+}
+
+static int grow(nj_shape_table_t *table)
+{
+	uint32_t new_size = table->size * 2;
+
+	nj_shape_t **new_slots = calloc(new_size, sizeof(nj_shape_t*));
+
+	if(new_slots == 0)
+		return 0;
+
+	for(uint32_t i = 0; i < table->size; i++) {
+
+		nj_shape_t *shape = table->transitions[i];
+
+		if(shape)
+			new_slots[find_slot(new_slots, new_size, shape->parent, shape->key)] = shape;
+	}
+
+	free(table->transitions);
+
+	table->transitions = new_slots;
+	table->size = new_size;
+	return 1;
+}
+
+//
+// Makes the shape that has the keys of [parent] followed by
+// [key], which must not be one of them.
+//
+static nj_shape_t *make_shape(nj_shape_table_t *table, nj_shape_t *parent, nj_symbol_t *key)
+{
+	uint32_t count = parent->count + 1;
+
+	nj_shape_t *shape = pool_request(table->pool, sizeof(nj_shape_t));
+
+	if(shape == 0)
+		return 0;
+
+	shape->keys = pool_request(table->pool, sizeof(nj_symbol_t*) * count);
+
+	if(shape->keys == 0)
+		return 0;
+
+	if(parent->count)
+		memcpy(shape->keys, parent->keys, sizeof(nj_symbol_t*) * parent->count);
+
+	shape->keys[parent->count] = key;
+
+	shape->parent = parent;
+	shape->key = key;
+	shape->count = count;
+	shape->map = NULL;
+	shape->map_size = 0;
+
+	if(count > NJ_SHAPE_SCAN_KEYS) {
+
+		int map_size = 16;
+
+		while(map_size < (int) count * 2)
+			map_size *= 2;
+
+		shape->map = pool_request(table->pool, sizeof(int) * map_size);
+
+		if(shape->map == 0)
+			return 0;
+
+		shape->map_size = map_size;
+
+		for(int i = 0; i < map_size; i++)
+			shape->map[i] = -1;
+
+		for(uint32_t i = 0; i < count; i++)
+			nj_symbol_map_insert(shape->map, map_size, shape->keys[i], i);
+	}
+
+	return shape;
+}
+
+//
+// Returns the shape a dict with [shape] gets when [key] is
+// added to it. Returns NULL when the shape would have too
+// many keys, when there are too many shapes already or on
+// allocation failure. The dict is then expected to hold its
+// keys by itself.
+//
+nj_shape_t *nj_shape_transition(nj_state_t *state, nj_shape_t *shape, nj_symbol_t *key)
+{
+	nj_shape_table_t *table = &state->shapes;
+
+	uint32_t i = find_slot(table->transitions, table->size, shape, key);
+
+	if(table->transitions[i])
+		return table->transitions[i];
+
+	if(shape->count == NJ_SHAPE_MAX_KEYS || table->used == NJ_SHAPE_MAX_COUNT)
+		return 0;
+
+	if((table->used + 1) * 3 > table->size * 2) {
+
+		if(!grow(table))
+			return 0;
+
+		i = find_slot(table->transitions, table->size, shape, key);
+	}
+
+	nj_shape_t *child = make_shape(table, shape, key);
+
+	if(child == 0)
+		return 0;
+
+	table->transitions[i] = child;
+	table->used++;
+
+	return child;
+}
+
+//
+// Returns the slot of [key] in dicts with [shape], or -1 if
+// they don't have it.
+//
+int nj_shape_lookup(nj_shape_t *shape, nj_symbol_t *key)
+{
+	if(shape->map)
+		return nj_symbol_map_find(shape->map, shape->map_size, shape->keys, key);
+
+	for(uint32_t i = 0; i < shape->count; i++)
+		if(shape->keys[i] == key)
+			return i;
+
+	return -1;
+}
@@ -215,4 +215,61 @@ uint32_t u32_top(u32_stack_t *stack)
 uint32_t *u32_top_ref(u32_stack_t *stack)
 {
 	return stack->tail->items + stack->relative_size - 1;
-}
\ No newline at end of file
+}
+//
+// Makes sure the evaluation stack has space for [count]
+// more values. Returns 0 if it couldn't grow it.
+//
+int nj_stack_reserve(nj_state_t *state, uint32_t count)
+{
+	if((size_t) (state->stack_end - state->stack_top) >= count)
+		return 1;
+
+	size_t used = state->stack_top - state->stack;
+	size_t size = state->stack_end - state->stack;
+
+	size_t new_size = size ? size * 2 : 1024;
+
+	while(new_size < used + count)
+		new_size *= 2;
+
+	nj_object_t **stack = realloc(state->stack, sizeof(nj_object_t*) * new_size);
+
+	if(stack == 0)
+		return 0;
+
+	state->stack = stack;
+	state->stack_top = stack + used;
+	state->stack_end = stack + new_size;
+	return 1;
+}
+
+//
+// Pushes a frame that runs [segment] from [offset]. Its
+// values and locals start at the current tops. Returns 0
+// if it couldn't grow the frame stack.
+//
+nj_frame_t *nj_push_frame(nj_state_t *state, uint32_t segment, uint32_t offset)
+{
+	if(state->frames_used == state->frames_size) {
+
+		uint32_t new_size = state->frames_size ? state->frames_size * 2 : 64;
+
+		nj_frame_t *frames = realloc(state->frames, sizeof(nj_frame_t) * new_size);
+
+		if(frames == 0)
+			return 0;
+
+		state->frames = frames;
+		state->frames_size = new_size;
+	}
+
+	nj_frame_t *frame = state->frames + state->frames_used++;
+
+	frame->segment = segment;
+	frame->offset = offset;
+	frame->stack_base = state->stack_top - state->stack;
+	frame->locals_base = state->locals_used;
+	frame->argc = -1;
+	return frame;
+}
@@ -2,6 +2,7 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include "noja.h"
+#include "utils/hash.h"
 
 void nj_fail(nj_state_t *state, const char *fmt, ...)
 {
@@ -42,23 +43,121 @@ int string_methods_setup(nj_state_t *state);
 int type_methods_setup(nj_state_t *state);
 int float_methods_setup(nj_state_t *state);
 
+//
+// Reads a size in bytes, optionally followed by K or M, from
+// the environment variable [name]. Returns [fallback] if it
+// isn't set or isn't a valid size.
+//
+static size_t size_from_env(const char *name, size_t fallback)
+{
+	const char *text = getenv(name);
+
+	if(text == NULL)
+		return fallback;
+
+	char *end;
+	unsigned long long size = strtoull(text, &end, 10);
+
+	if(end == text)
+		return fallback;
+
+	switch(*end) {
+		case 'k': case 'K': size <<= 10; end++; break;
+		case 'm': case 'M': size <<= 20; end++; break;
+	}
+
+	if(*end != '\0' || size == 0)
+		return fallback;
+
+	return size;
+}
+
 int nj_state_init(nj_state_t *state, string_builder_t *output_builder)
 {
-	state->heap.chunk = malloc(65536);
-	state->heap.size = 65536;
-	state->heap.used = 0;
-	state->heap.overflow_allocations = NULL;
+	return nj_state_init_with_options(state, output_builder, NULL);
+}
 
-	if(state->heap.chunk == 0)
+int nj_state_init_with_options(nj_state_t *state, string_builder_t *output_builder, const nj_heap_options_t *options)
+{
+	nj_heap_options_t heap_options = { 0 };
+
+	if(options)
+		heap_options = *options;
+
+	if(heap_options.nursery_size == 0)
+		heap_options.nursery_size = size_from_env("NOJA_NURSERY_SIZE", NJ_DEFAULT_NURSERY_SIZE);
+
+	if(heap_options.heap_size == 0)
+		heap_options.heap_size = size_from_env("NOJA_HEAP_SIZE", NJ_DEFAULT_HEAP_SIZE);
+
+	if(heap_options.growth == 0)
+		heap_options.growth = size_from_env("NOJA_GC_GROWTH", NJ_DEFAULT_GC_GROWTH);
+
+	if(heap_options.incremental == 0)
+		heap_options.incremental = size_from_env("NOJA_GC_INCREMENTAL", 0) != 0;
+
+	if(heap_options.max_pause_us == 0)
+		heap_options.max_pause_us = size_from_env("NOJA_GC_MAX_PAUSE", NJ_DEFAULT_GC_MAX_PAUSE_US);
+
+	if(!nj_init_heap(&state->heap, &heap_options))
 		return 0;
 
 	state->failed = 0;
+	state->hash_seed = hash_make_seed(state);
+
+	if(!nj_symbol_table_init(&state->symbols)) {
+
+		free(state->heap.nursery);
+		return 0;
+	}
+
+	if(!nj_shape_table_init(&state->shapes)) {
+
+		nj_symbol_table_deinit(&state->symbols);
+		free(state->heap.nursery);
+		return 0;
+	}
+
 	state->output_builder = output_builder;
 
-	object_stack_init(&state->eval_stack);
+	state->stack = malloc(sizeof(nj_object_t*) * 1024);
+
+	if(state->stack == 0) {
+
+		nj_shape_table_deinit(&state->shapes);
+		nj_symbol_table_deinit(&state->symbols);
+		free(state->heap.nursery);
+		return 0;
+	}
+
+	state->stack_top = state->stack;
+	state->stack_end = state->stack + 1024;
+
 	object_stack_init(&state->vars_stack);
-	u32_stack_init(&state->segment_stack);
-	u32_stack_init(&state->offset_stack);
+
+	state->frames = 0;
+	state->frames_size = 0;
+	state->frames_used = 0;
+
+	state->locals = 0;
+	state->locals_size = 0;
+	state->locals_used = 0;
+
+	state->backend = NJ_BACKEND_STACK;
+	state->opt_level = NJ_OPT_DEFAULT;
+	state->bytecode_cache = (nj_bytecode_cache_options_t) { 0 };
+	state->dispatched = 0;
+	state->opcode_pairs = 0;
+	state->previous_opcode = UINT32_MAX;
+
+	state->registers = 0;
+	state->registers_size = 0;
+	state->registers_used = 0;
+	state->registers_base = 0;
+
+	state->register_frames = 0;
+	state->register_frames_size = 0;
+	state->register_frames_used = 0;
 
 	assert(cfunction_setup(state));
 	assert(dict_setup(state));
@@ -88,7 +187,12 @@ int nj_state_init(nj_state_t *state, string_builder_t *output_builder)
 	if(!insert_builtins(state, state->builtins_map))
 		return 0;
 
-	state->argc = -1;
+	state->modules = 0;
+	state->modules_size = 0;
+	state->modules_used = 0;
+
+	state->precompiled = 0;
+	state->precompiled_count = 0;
 
 	state->segments = malloc(sizeof(segment_t) * 4);
 	state->segments_size = 4;
@@ -104,13 +208,30 @@ void nj_state_deinit(nj_state_t *state)
 {
 	nj_destroy_heap(state, &state->heap);
 
-	for(int i = 0; i < state->segments_used; i++)
-		free(state->segments[i].code);
+	for(int i = 0; i < state->segments_used; i++) {
+		segment_t *segment = &state->segments[i];
+		nj_free_bytecode(segment->data, segment->code, segment->mapping, segment->mapping_size);
+		free(segment->symbols);
+		nj_free_inline_caches(segment);
+	}
 
 	free(state->segments);
 
-	object_stack_deinit(&state->eval_stack);
+	for(uint32_t i = 0; i < state->modules_used; i++)
+		free(state->modules[i].path);
+
+	free(state->modules);
+
+	nj_free_precompiled(state->precompiled, state->precompiled_count);
+
+	free(state->stack);
 	object_stack_deinit(&state->vars_stack);
-	u32_stack_deinit(&state->segment_stack);
-	u32_stack_deinit(&state->offset_stack);
+	free(state->frames);
+
+	free(state->locals);
+	free(state->registers);
+	free(state->register_frames);
+
+	nj_shape_table_deinit(&state->shapes);
+	nj_symbol_table_deinit(&state->symbols);
 }
@@ -1,4 +1,3 @@
-
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
@@ -6,107 +5,328 @@
 #include "noja.h"
 #include "bytecode.h"
 
-static void fetch_u32(nj_state_t *state, uint32_t *value);
-static void fetch_i64(nj_state_t *state, int64_t *value);
-static void fetch_f64(nj_state_t *state, double *value);
-static void fetch_string(nj_state_t *state, char **value);
+//
+// The execution loop doesn't go through the frame stack for
+// every fetch. The running frame and its segment are cached
+// in a cursor_t and the offset is only written back to the
+// frame when the loop calls, returns or imports.
+//
+// Segments are verified when they're loaded (see verify.c),
+// so neither the fetches nor the jumps are bounds checked.
+//
+// Dispatch is threaded through a table of label addresses
+// when the compiler supports it (GCC and Clang). Defining
+// NJ_SWITCH_DISPATCH forces the portable switch.
+//
+
+#if defined(__GNUC__) && !defined(NJ_SWITCH_DISPATCH)
+#define NJ_THREADED_DISPATCH
+#endif
+
+typedef struct {
+	nj_frame_t *frame;
+	uint32_t segment;
+	uint32_t offset;
+	char *code;
+	char *data;
+	nj_symbol_t **symbols;
+	nj_inline_cache_t **sites;
+} cursor_t;
+
+static inline void cursor_load(nj_state_t *state, cursor_t *cur);
+static inline void cursor_save(cursor_t *cur);
+
+static inline void fetch_u32(cursor_t *cur, uint32_t *value);
+static inline void fetch_i64(cursor_t *cur, int64_t *value);
+static inline void fetch_f64(cursor_t *cur, double *value);
+static inline void fetch_string(cursor_t *cur, char **value);
+static inline void fetch_symbol(cursor_t *cur, nj_symbol_t **value);
+static inline nj_inline_cache_t *site_cache(cursor_t *cur);
+
+//
+// Collections only happen at safepoints: backward jumps and
+// calls, where no handler is holding object references.
+//
+
+#define SAFEPOINT()									\
+	do {											\
+		if(nj_should_collect(state))				\
+			if(!nj_collect(state)) {				\
+				nj_fail(state, "Out of heap");		\
+				return 0;							\
+			}										\
+	} while(0)
+
+//
+// Before running the code of a segment, the evaluation stack
+// is grown to fit the deepest frame of the segment, which the
+// verifier computed when it was loaded. Pushes and pops don't
+// need to check for space.
+//
+
+#define PUSH(object) (*state->stack_top++ = (object))
+#define POP()        (*--state->stack_top)
+#define TOP()        (state->stack_top[-1])
+
+#ifdef NJ_COUNT_DISPATCH
+#define COUNT_DISPATCH() (state->dispatched++)
+#else
+#define COUNT_DISPATCH()
+#endif
+
+//
+// Counts the pairs of consecutive opcodes, to tell which
+// sequences are worth a superinstruction. The previous
+// opcode is kept in the state so that pairs that span a
+// call are counted too.
+//
+
+#ifdef NJ_COUNT_PAIRS
+#define COUNT_PAIR(opcode)														\
+	do {																		\
+		if(state->opcode_pairs && state->previous_opcode < OPCODE_COUNT)		\
+			state->opcode_pairs[state->previous_opcode * OPCODE_COUNT + (opcode)]++; \
+		state->previous_opcode = (opcode);										\
+	} while(0)
+#else
+#define COUNT_PAIR(opcode)
+#endif
+
+#ifdef NJ_THREADED_DISPATCH
+
+#define CASE(opcode) label_##opcode
+
+#define NEXT											\
+	do {												\
+		uint32_t opcode;								\
+		COUNT_DISPATCH();								\
+		fetch_u32(&cur, &opcode);						\
+		COUNT_PAIR(opcode);								\
+		goto *dispatch_table[opcode];					\
+	} while(0)
+
+#else
+
+#define CASE(opcode) case opcode
+#define NEXT break
+
+#endif
+
+//
+// A comparison followed by JUMP_IF_FALSE_AND_POP. Small
+// ints are compared in place, which is what the int type
+// would do, without making the int it would return.
+//
+
+#define COMPARE_AND_JUMP(compare, op, name)						\
+	{															\
+		uint32_t dest;											\
+		int holds;												\
+																\
+		fetch_u32(&cur, &dest);									\
+																\
+		nj_object_t *right = POP();								\
+		nj_object_t *left  = POP();								\
+																\
+		if(nj_is_small_int(left) && nj_is_small_int(right))		\
+			holds = nj_small_int_value(left) op nj_small_int_value(right); \
+		else {													\
+			nj_object_t *result = compare(state, left, right);	\
+																\
+			if(result == 0) {									\
+				/* #ERROR */									\
+				nj_fail(state, "Failed to execute " name);		\
+				return 0;										\
+			}													\
+																\
+			holds = nj_object_test(state, result);				\
+		}														\
+																\
+		if(!holds)												\
+			cur.offset = dest;									\
+		NEXT;													\
+	}
+
+static inline nj_object_t *add_int(nj_state_t *state, nj_object_t *left, int64_t value);
 
-int nj_step(nj_state_t *state)
+//
+// Runs the code of the frame on top of the frame stack
+// until its QUIT instruction. Returns 0 on failure.
+//
+int nj_execute(nj_state_t *state)
 {
-	
-	if(nj_should_collect(state))
-		if(!nj_collect(state)) {
+	cursor_t cur;
 
-			nj_fail(state, "Out of heap");
-			return 0;
-		}
-	
-	uint32_t opcode;
+	uint32_t frames_at_entry = state->frames_used;
+
+	cursor_load(state, &cur);
 
-	fetch_u32(state, &opcode);
+	if(!nj_stack_reserve(state, state->segments[cur.segment].max_depth)) {
 
-	if(nj_failed(state)) return 0;
+		// #ERROR
+		nj_fail(state, "Out of memory. Failed to grow evaluation stack");
+		return 0;
+	}
+
+	SAFEPOINT();
+
+#ifdef NJ_THREADED_DISPATCH
+
+	static void *dispatch_table[OPCODE_COUNT] = {
+		[OPCODE_NOPE] = &&label_OPCODE_NOPE,
+		[OPCODE_QUIT] = &&label_OPCODE_QUIT,
+		[OPCODE_OFFSET] = &&label_OPCODE_OFFSET,
+		[OPCODE_PUSH_NULL] = &&label_OPCODE_PUSH_NULL,
+		[OPCODE_PUSH_TRUE] = &&label_OPCODE_PUSH_TRUE,
+		[OPCODE_PUSH_FALSE] = &&label_OPCODE_PUSH_FALSE,
+		[OPCODE_PUSH_INT] = &&label_OPCODE_PUSH_INT,
+		[OPCODE_PUSH_FLOAT] = &&label_OPCODE_PUSH_FLOAT,
+		[OPCODE_PUSH_STRING] = &&label_OPCODE_PUSH_STRING,
+		[OPCODE_PUSH_FUNCTION] = &&label_OPCODE_PUSH_FUNCTION,
+		[OPCODE_PUSH_VARIABLE] = &&label_OPCODE_PUSH_VARIABLE,
+		[OPCODE_PUSH_GLOBAL] = &&label_OPCODE_PUSH_GLOBAL,
+		[OPCODE_SELECT_ATTRIBUTE_AND_REPUSH] = &&label_OPCODE_SELECT_ATTRIBUTE_AND_REPUSH,
+		[OPCODE_BUILD_ARRAY] = &&label_OPCODE_BUILD_ARRAY,
+		[OPCODE_BUILD_DICT] = &&label_OPCODE_BUILD_DICT,
+		[OPCODE_POP] = &&label_OPCODE_POP,
+		[OPCODE_IMPORT] = &&label_OPCODE_IMPORT,
+		[OPCODE_IMPORT_AS] = &&label_OPCODE_IMPORT_AS,
+		[OPCODE_ASSIGN] = &&label_OPCODE_ASSIGN,
+		[OPCODE_SELECT] = &&label_OPCODE_SELECT,
+		[OPCODE_INSERT] = &&label_OPCODE_INSERT,
+		[OPCODE_SELECT_ATTRIBUTE] = &&label_OPCODE_SELECT_ATTRIBUTE,
+		[OPCODE_INSERT_ATTRIBUTE] = &&label_OPCODE_INSERT_ATTRIBUTE,
+		[OPCODE_VARIABLE_MAP_PUSH] = &&label_OPCODE_VARIABLE_MAP_PUSH,
+		[OPCODE_VARIABLE_MAP_POP] = &&label_OPCODE_VARIABLE_MAP_POP,
+		[OPCODE_LOCALS_PUSH] = &&label_OPCODE_LOCALS_PUSH,
+		[OPCODE_LOCALS_POP] = &&label_OPCODE_LOCALS_POP,
+		[OPCODE_LOAD_LOCAL] = &&label_OPCODE_LOAD_LOCAL,
+		[OPCODE_STORE_LOCAL] = &&label_OPCODE_STORE_LOCAL,
+		[OPCODE_CALL] = &&label_OPCODE_CALL,
+		[OPCODE_EXPECT] = &&label_OPCODE_EXPECT,
+		[OPCODE_RETURN] = &&label_OPCODE_RETURN,
+		[OPCODE_JUMP_ABSOLUTE] = &&label_OPCODE_JUMP_ABSOLUTE,
+		[OPCODE_JUMP_IF_FALSE_AND_POP] = &&label_OPCODE_JUMP_IF_FALSE_AND_POP,
+		[OPCODE_ADD] = &&label_OPCODE_ADD,
+		[OPCODE_SUB] = &&label_OPCODE_SUB,
+		[OPCODE_MUL] = &&label_OPCODE_MUL,
+		[OPCODE_DIV] = &&label_OPCODE_DIV,
+		[OPCODE_MOD] = &&label_OPCODE_MOD,
+		[OPCODE_POW] = &&label_OPCODE_POW,
+		[OPCODE_NEG] = &&label_OPCODE_NEG,
+		[OPCODE_LSS] = &&label_OPCODE_LSS,
+		[OPCODE_GRT] = &&label_OPCODE_GRT,
+		[OPCODE_LEQ] = &&label_OPCODE_LEQ,
+		[OPCODE_GEQ] = &&label_OPCODE_GEQ,
+		[OPCODE_EQL] = &&label_OPCODE_EQL,
+		[OPCODE_NQL] = &&label_OPCODE_NQL,
+		[OPCODE_AND] = &&label_OPCODE_AND,
+		[OPCODE_OR] = &&label_OPCODE_OR,
+		[OPCODE_NOT] = &&label_OPCODE_NOT,
+		[OPCODE_SHL] = &&label_OPCODE_SHL,
+		[OPCODE_SHR] = &&label_OPCODE_SHR,
+		[OPCODE_BITWISE_AND] = &&label_OPCODE_BITWISE_AND,
+		[OPCODE_BITWISE_OR] = &&label_OPCODE_BITWISE_OR,
+		[OPCODE_BITWISE_XOR] = &&label_OPCODE_BITWISE_XOR,
+		[OPCODE_BITWISE_NOT] = &&label_OPCODE_BITWISE_NOT,
+		[OPCODE_ASSIGN_AND_POP] = &&label_OPCODE_ASSIGN_AND_POP,
+		[OPCODE_STORE_LOCAL_AND_POP] = &&label_OPCODE_STORE_LOCAL_AND_POP,
+		[OPCODE_INC_VARIABLE] = &&label_OPCODE_INC_VARIABLE,
+		[OPCODE_INC_LOCAL] = &&label_OPCODE_INC_LOCAL,
+		[OPCODE_PUSH_VARIABLE_SELECT_ATTRIBUTE] = &&label_OPCODE_PUSH_VARIABLE_SELECT_ATTRIBUTE,
+		[OPCODE_LSS_JUMP_IF_FALSE] = &&label_OPCODE_LSS_JUMP_IF_FALSE,
+		[OPCODE_GRT_JUMP_IF_FALSE] = &&label_OPCODE_GRT_JUMP_IF_FALSE,
+		[OPCODE_LEQ_JUMP_IF_FALSE] = &&label_OPCODE_LEQ_JUMP_IF_FALSE,
+		[OPCODE_GEQ_JUMP_IF_FALSE] = &&label_OPCODE_GEQ_JUMP_IF_FALSE,
+		[OPCODE_EQL_JUMP_IF_FALSE] = &&label_OPCODE_EQL_JUMP_IF_FALSE,
+		[OPCODE_NQL_JUMP_IF_FALSE] = &&label_OPCODE_NQL_JUMP_IF_FALSE,
+	};
+
+	NEXT;
+
+	{
+#else
+
+	while(1) {
+
+		uint32_t opcode;
+
+		COUNT_DISPATCH();
+		fetch_u32(&cur, &opcode);
+		COUNT_PAIR(opcode);
+
+		switch(opcode) {
+#endif
+
+		CASE(OPCODE_NOPE):NEXT;
+		CASE(OPCODE_QUIT):
+		if(state->frames_used != frames_at_entry) {
 
-	switch(opcode) {
+			// #ERROR
+			nj_fail(state, "QUIT inside a function");
+			return 0;
+		}
 
-		case OPCODE_NOPE:break;
-		case OPCODE_QUIT:return 0;
+		cursor_save(&cur);
+		return 1;
 
-		case OPCODE_OFFSET:
+		CASE(OPCODE_OFFSET):
 		{
 			uint32_t offset;
 
-			fetch_u32(state, &offset);
-
-			if(nj_failed(state))
-				return 0;
+			fetch_u32(&cur, &offset);
 
 			state->offset = offset;
-			break;
+			NEXT;
 		}
 		
-		case OPCODE_IMPORT: 
+		CASE(OPCODE_IMPORT): 
+		cursor_save(&cur);
 		if(!nj_import(state))
 			return 0;
-		break;
+		cursor_load(state, &cur);
+		NEXT;
 
-		case OPCODE_IMPORT_AS: 
+		CASE(OPCODE_IMPORT_AS): 
 		{
-			char *name;
+			nj_symbol_t *name;
 
-			fetch_string(state, &name);
+			fetch_symbol(&cur, &name);
 
-			if(nj_failed(state))
-				return 0;
+			cursor_save(&cur);
 
 			if(!nj_import_as(state, name))
 				return 0;
-			break;
+
+			cursor_load(state, &cur);
+			NEXT;
 		}
 
-		case OPCODE_PUSH_NULL:
+		CASE(OPCODE_PUSH_NULL):
 
-		if(!object_push(&state->eval_stack, (nj_object_t*) &state->null_object)) {
-			
-			// #ERROR
-			nj_fail(state, "Out of memory. Couldn't grow the evaluation stack");
-			return 0;
-		}
+		PUSH((nj_object_t*) &state->null_object);
 
-		break;
+		NEXT;
 		
-		case OPCODE_PUSH_TRUE:
+		CASE(OPCODE_PUSH_TRUE):
 
-		if(!object_push(&state->eval_stack, (nj_object_t*) &state->true_object)) {
-			
-			// #ERROR
-			nj_fail(state, "Out of memory. Couldn't grow the evaluation stack");
-			return 0;
-		}
+		PUSH((nj_object_t*) &state->true_object);
 
-		break;
+		NEXT;
 
-		case OPCODE_PUSH_FALSE:
+		CASE(OPCODE_PUSH_FALSE):
 
-		if(!object_push(&state->eval_stack, (nj_object_t*) &state->false_object)) {
-			
-			// #ERROR
-			nj_fail(state, "Out of memory. Couldn't grow the evaluation stack");
-			return 0;
-		}
+		PUSH((nj_object_t*) &state->false_object);
 
-		break;
+		NEXT;
 		
 		
-		case OPCODE_PUSH_INT:
+		CASE(OPCODE_PUSH_INT):
 		{
 
 			int64_t value;
 
-			fetch_i64(state, &value);
-			
-			if(nj_failed(state)) 
-				return 0;
+			fetch_i64(&cur, &value);
 
 			nj_object_t *object = nj_object_from_c_int(state, value);
 
@@ -117,23 +337,15 @@ int nj_step(nj_state_t *state)
 				return 0;
 			}
 
-			if(!object_push(&state->eval_stack, object)) {
-			
-				// #ERROR
-				nj_fail(state, "Out of memory. Couldn't grow the evaluation stack");
-				return 0;
-			}
-			break;
+			PUSH(object);
+			NEXT;
 		}
 
-		case OPCODE_PUSH_FLOAT:
+		CASE(OPCODE_PUSH_FLOAT):
 		{
 			double value;
 
-			fetch_f64(state, &value);
-
-			if(nj_failed(state)) 
-				return 0;
+			fetch_f64(&cur, &value);
 
 			nj_object_t *object = nj_object_from_c_float(state, value);
 
@@ -144,31 +356,16 @@ int nj_step(nj_state_t *state)
 				return 0;
 			}
 
-			if(!object_push(&state->eval_stack, object)) {
-			
-				// #ERROR
-				nj_fail(state, "Out of memory. Couldn't grow the evaluation stack");
-				return 0;
-			}
-			break;
+			PUSH(object);
+			NEXT;
 		}
 
-		case OPCODE_BUILD_ARRAY:
+		CASE(OPCODE_BUILD_ARRAY):
 		{
 
 			int64_t count;
 
-			fetch_i64(state, &count);
-
-			if(nj_failed(state))
-				return 0;
-
-			if(object_stack_size(&state->eval_stack) < count) {
-
-				// #ERROR
-				nj_fail(state, "BUILD_ARRAY with more items than the stack size");
-				return 0;
-			}
+			fetch_i64(&cur, &count);
 
 			nj_object_t *object = nj_object_istanciate(state, (nj_object_t*) &state->type_object_array);
 
@@ -181,45 +378,23 @@ int nj_step(nj_state_t *state)
 			}
 
 			for(int i = 0; i < count; i++)
-				if(!nj_array_insert(state, object, i, object_pop(&state->eval_stack))) {
+				if(!nj_array_insert(state, object, i, POP())) {
 
 					// #ERROR
 					nj_fail(state, "Failed to insert item into array while building it");
 					return 0;
 				}
 
-			if(!object_push(&state->eval_stack, object)) {
-
-				// #ERROR
-				nj_fail(state, "Out of memory. Failed to grow evaluation stack");
-				return 0;
-			}
-
-			if(!object_push(&state->eval_stack, object)) {
-			
-				// #ERROR
-				nj_fail(state, "Out of memory. Couldn't grow the evaluation stack");
-				return 0;
-			}
-			break;
+			PUSH(object);
+			NEXT;
 		}
 
-		case OPCODE_BUILD_DICT:
+		CASE(OPCODE_BUILD_DICT):
 		{
 
 			int64_t count;
 
-			fetch_i64(state, &count);
-
-			if(nj_failed(state))
-				return 0;
-
-			if(object_stack_size(&state->eval_stack) < count * 2) {
-
-				// #ERROR
-				nj_fail(state, "BUILD_DICT with more items than the stack size");
-				return 0;
-			}
+			fetch_i64(&cur, &count);
 
 			nj_object_t *object = nj_object_istanciate(state, (nj_object_t*) &state->type_object_dict);
 
@@ -235,8 +410,8 @@ int nj_step(nj_state_t *state)
 
 				nj_object_t *key, *value;
 
-				value = object_pop(&state->eval_stack);
-				key   = object_pop(&state->eval_stack);
+				value = POP();
+				key   = POP();
 
 				if(!nj_object_insert(state, object, key, value)) {
 
@@ -246,24 +421,16 @@ int nj_step(nj_state_t *state)
 				}
 			}
 
-			if(!object_push(&state->eval_stack, object)) {
-					
-					// #ERROR
-					nj_fail(state, "Out of memory. Failed to grow evaluation stack");
-					return 0;
-			}
-			break;
+			PUSH(object);
+			NEXT;
 		}
 
-		case OPCODE_PUSH_STRING:
+		CASE(OPCODE_PUSH_STRING):
 		{
 
 			char *value;
 
-			fetch_string(state, &value);
-
-			if(nj_failed(state)) 
-				return 0;
+			fetch_string(&cur, &value);
 
 			nj_object_t *object = nj_object_from_c_string_ref(state, value, strlen(value));
 
@@ -275,99 +442,156 @@ int nj_step(nj_state_t *state)
 				return 0;
 			}
 
-			if(!object_push(&state->eval_stack, object)) {
-					
-					// #ERROR
-					nj_fail(state, "Out of memory. Failed to grow evaluation stack");
-					return 0;
-			}
-			break;
+			PUSH(object);
+			NEXT;
 		}
 		
-		case OPCODE_PUSH_FUNCTION:
+		CASE(OPCODE_PUSH_FUNCTION):
 		{
 		
 			uint32_t dest;
 
-			fetch_u32(state, &dest);
+			fetch_u32(&cur, &dest);
 
-			if(nj_failed(state)) 
-				return 0;
 
-			uint32_t current_segment = u32_top(&state->segment_stack);
+			nj_object_t *object = nj_object_from_segment_and_offset(state, cur.segment, dest);
 
-			if(dest >= state->segments[current_segment].code_size) {
+			if(object == 0) {
 
 				// #ERROR
-				// PUSH_FUNCTION refers to an address outside of the code segment
-				nj_fail(state, "PUSH_FUNCTION refers to an address outside of the code segment");
+				// Failed to create object
+				nj_fail(state, "Failed to create PUSH_FUNCTION's value");
 				return 0;
 			}
 
-			nj_object_t *object = nj_object_from_segment_and_offset(state, current_segment, dest);
+			PUSH(object);
+			NEXT;
+		}
+
+		CASE(OPCODE_PUSH_VARIABLE):
+		{
+			nj_inline_cache_t *cache = site_cache(&cur);
+			nj_symbol_t *variable_name;
+
+			fetch_symbol(&cur, &variable_name);
+
+			nj_object_t *locals = 0;
+
+			if(object_stack_size(&state->vars_stack) > 0)
+				locals = object_top(&state->vars_stack);
+
+			nj_object_t *object = nj_cached_select_variable(state, cache, locals, state->segments[cur.segment].global_variables_map, variable_name);
 
 			if(object == 0) {
 
 				// #ERROR
-				// Failed to create object
-				nj_fail(state, "Failed to create PUSH_FUNCTION's value");
+				// Undefined variable was referenced
+				nj_fail(state, "Undefined variable [${zero-terminated-string}] was referenced", variable_name->text);
 				return 0;
 			}
 
-			if(!object_push(&state->eval_stack, object)) {
-					
-					// #ERROR
-					nj_fail(state, "Out of memory. Failed to grow evaluation stack");
-					return 0;
-			}
-			break;
+			PUSH(object);
+			NEXT;
 		}
 
-		case OPCODE_PUSH_VARIABLE:
+		CASE(OPCODE_PUSH_GLOBAL):
 		{
-			char *variable_name;
+			nj_inline_cache_t *cache = site_cache(&cur);
+			nj_symbol_t *variable_name;
+
+			fetch_symbol(&cur, &variable_name);
 
-			fetch_string(state, &variable_name);
+			nj_object_t *object = nj_cached_select_variable(state, cache, 0, state->segments[cur.segment].global_variables_map, variable_name);
 
-			if(nj_failed(state)) 
+			if(object == 0) {
+
+				// #ERROR
+				// Undefined variable was referenced
+				nj_fail(state, "Undefined variable [${zero-terminated-string}] was referenced", variable_name->text);
 				return 0;
+			}
 
-			nj_object_t *object = 0;
+			PUSH(object);
+			NEXT;
+		}
 
-			if(object_stack_size(&state->vars_stack) > 0)
-				object = nj_dictionary_select(state, object_top(&state->vars_stack), variable_name);
+		CASE(OPCODE_LOAD_LOCAL):
+		{
+			uint32_t slot;
 
-			if(object == 0)
-				object = nj_dictionary_select(state, state->segments[u32_top(&state->segment_stack)].global_variables_map, variable_name);
+			fetch_u32(&cur, &slot);
 
-			if(object == 0)
-				object = nj_dictionary_select(state, state->builtins_map, variable_name);
+			nj_object_t *object = state->locals[cur.frame->locals_base + slot];
 
 			if(object == 0) {
 
 				// #ERROR
-				// Undefined variable was referenced
-				nj_fail(state, "Undefined variable [${zero-terminated-string}] was referenced", variable_name);
+				nj_fail(state, "Local variable was referenced before being assigned");
 				return 0;
 			}
 
-			if(!object_push(&state->eval_stack, object)) {
-					
+			PUSH(object);
+			NEXT;
+		}
+
+		CASE(OPCODE_STORE_LOCAL):
+		{
+			uint32_t slot;
+
+			fetch_u32(&cur, &slot);
+
+			state->locals[cur.frame->locals_base + slot] = TOP();
+			NEXT;
+		}
+
+		CASE(OPCODE_LOCALS_PUSH):
+		{
+			uint32_t count;
+
+			fetch_u32(&cur, &count);
+
+			if(state->locals_used + count > state->locals_size) {
+
+				uint32_t new_size = state->locals_size ? state->locals_size * 2 : 256;
+
+				while(new_size < state->locals_used + count)
+					new_size *= 2;
+
+				nj_object_t **locals = realloc(state->locals, sizeof(nj_object_t*) * new_size);
+
+				if(locals == 0) {
+
 					// #ERROR
-					nj_fail(state, "Out of memory. Failed to grow evaluation stack");
+					nj_fail(state, "Out of memory. Failed to grow the frame slots");
 					return 0;
+				}
+
+				state->locals = locals;
+				state->locals_size = new_size;
 			}
-			break;
+
+			// Functions with no names push no slots, and locals
+			// may still be NULL then
+
+			if(count > 0)
+				memset(state->locals + state->locals_used, 0, sizeof(nj_object_t*) * count);
+
+			cur.frame->locals_base = state->locals_used;
+			state->locals_used += count;
+			NEXT;
 		}
 
-		case OPCODE_POP:
+		CASE(OPCODE_LOCALS_POP):
+		{
+			state->locals_used = cur.frame->locals_base;
+			NEXT;
+		}
+
+		CASE(OPCODE_POP):
 		{
 			int64_t count;
 			
-			fetch_i64(state, &count);
-
-			if(nj_failed(state)) 
-				return 0;
+			fetch_i64(&cur, &count);
 
 			if(count < 0) {
 
@@ -377,42 +601,22 @@ int nj_step(nj_state_t *state)
 				return 0;	
 			}
 
-			if(count > object_stack_size(&state->eval_stack)) {
-
-				// #ERROR
-				// POP's operand is negative
-				nj_fail(state, "POPping more item than there are on the stack");
-				return 0;	
-			}
-
-			for(int i = 0; i < count; i++)
-				object_pop(&state->eval_stack);
+			state->stack_top -= count;
 
-			break;
+			NEXT;
 		}
 
-		case OPCODE_ASSIGN:
+		CASE(OPCODE_ASSIGN):
 		{
-			char *variable_name;
+			nj_symbol_t *variable_name;
 
-			fetch_string(state, &variable_name);
-
-			if(nj_failed(state)) 
-				return 0;
-
-			if(object_stack_size(&state->eval_stack) == 0) {
-
-				// #ERROR
-				// ASSIGN while the stack is empty
-				nj_fail(state, "ASSIGN while the stack is empty");
-				return 0;
-			}
+			fetch_symbol(&cur, &variable_name);
 
 			nj_object_t *dest;
 
 			if(object_stack_size(&state->vars_stack) == 0) {
 
-				dest = state->segments[u32_top(&state->segment_stack)].global_variables_map;
+				dest = state->segments[cur.segment].global_variables_map;
 
 			} else {
 
@@ -420,7 +624,7 @@ int nj_step(nj_state_t *state)
 
 			}
 
-			if(!nj_dictionary_insert(state, dest, variable_name, object_top(&state->eval_stack))) {
+			if(!nj_dictionary_insert_symbol(state, dest, variable_name, TOP())) {
 
 				// #ERROR
 				// Failed to create the variable
@@ -428,27 +632,18 @@ int nj_step(nj_state_t *state)
 				return 0;
 			}
 
-			break;
+			NEXT;
 		}
 
-		case OPCODE_SELECT_ATTRIBUTE_AND_REPUSH: 
+		CASE(OPCODE_SELECT_ATTRIBUTE_AND_REPUSH): 
 		{
-			char *attribute_name;
+			nj_inline_cache_t *cache = site_cache(&cur);
+			nj_symbol_t *attribute_name;
 
-			fetch_string(state, &attribute_name);
+			fetch_symbol(&cur, &attribute_name);
 
-			if(nj_failed(state)) 
-				return 0;
-
-			if(object_stack_size(&state->eval_stack) == 0) {
-
-				// #ERROR
-				nj_fail(state, "SELECT_ATTRIBUTE_AND_REPUSH on an empty stack");
-				return 0;
-			}
-
-			nj_object_t *container = object_pop(&state->eval_stack);
-			nj_object_t *selected  = nj_object_select_attribute(state, container, attribute_name);
+			nj_object_t *container = POP();
+			nj_object_t *selected  = nj_cached_select_attribute(state, cache, container, attribute_name);
 
 			if(selected == 0) {
 
@@ -457,28 +652,17 @@ int nj_step(nj_state_t *state)
 				return 0;
 			}
 
-			if(!object_push(&state->eval_stack, selected) || !object_push(&state->eval_stack, container)) {
-					
-					// #ERROR
-					nj_fail(state, "Out of memory. Failed to grow evaluation stack");
-					return 0;
-			}
-			break;
+			PUSH(selected);
+			PUSH(container);
+			NEXT;
 		}
 
-		case OPCODE_SELECT: 
+		CASE(OPCODE_SELECT): 
 		{
-			if(object_stack_size(&state->eval_stack) < 2) {
-
-				// #ERROR
-				nj_fail(state, "SELECT on a stack with less than 2 items");
-				return 0;
-			}
-
 			nj_object_t *container, *key, *item;
 
-			key 	  = object_pop(&state->eval_stack);
-			container = object_top(&state->eval_stack);
+			key 	  = POP();
+			container = TOP();
 
 			item = nj_object_select(state, container, key);
 
@@ -489,25 +673,18 @@ int nj_step(nj_state_t *state)
 				return 0;
 			}
 
-			*object_top_ref(&state->eval_stack) = item;
+			TOP() = item;
 
-			break;
+			NEXT;
 		}
 
-		case OPCODE_INSERT: 
+		CASE(OPCODE_INSERT): 
 		{
-			if(object_stack_size(&state->eval_stack) < 3) {
-
-				// #ERROR
-				nj_fail(state, "INSERT on a stack with less than 3 items");
-				return 0;
-			}
-
 			nj_object_t *container, *key, *item;
 
-			item   	  = object_pop(&state->eval_stack);
-			key 	  = object_pop(&state->eval_stack);
-			container = object_top(&state->eval_stack);
+			item   	  = POP();
+			key 	  = POP();
+			container = TOP();
 
 			if(!nj_object_insert(state, container, key, item)) {
 
@@ -516,29 +693,20 @@ int nj_step(nj_state_t *state)
 				return 0;
 			}
 
-			*object_top_ref(&state->eval_stack) = item;
-			break;
+			TOP() = item;
+			NEXT;
 		}
 
-		case OPCODE_SELECT_ATTRIBUTE: 
+		CASE(OPCODE_SELECT_ATTRIBUTE): 
 		{
-			char *attribute_name;
-
-			fetch_string(state, &attribute_name);
-
-			if(nj_failed(state)) 
-				return 0;
-
-			if(object_stack_size(&state->eval_stack) == 0) {
+			nj_inline_cache_t *cache = site_cache(&cur);
+			nj_symbol_t *attribute_name;
 
-				// #ERROR
-				nj_fail(state, "SELECT_ATTRIBUTE on an empty stack");
-				return 0;
-			}
+			fetch_symbol(&cur, &attribute_name);
 
-			nj_object_t *container = object_top(&state->eval_stack);
+			nj_object_t *container = TOP();
 	
-			nj_object_t *selected = nj_object_select_attribute(state, container, attribute_name);
+			nj_object_t *selected = nj_cached_select_attribute(state, cache, container, attribute_name);
 
 			if(selected == 0) {
 
@@ -547,44 +715,34 @@ int nj_step(nj_state_t *state)
 				return 0;
 			}
 
-			*object_top_ref(&state->eval_stack) = selected;
-			break;
+			TOP() = selected;
+			NEXT;
 		}
 
 		
-		case OPCODE_INSERT_ATTRIBUTE: 
+		CASE(OPCODE_INSERT_ATTRIBUTE): 
 		{
-			char *attribute_name;
-
-			fetch_string(state, &attribute_name);
-
-			if(nj_failed(state)) 
-				return 0;
+			nj_symbol_t *attribute_name;
 
-			if(object_stack_size(&state->eval_stack) < 2) {
-
-				// #ERROR
-				nj_fail(state, "INSERT_ATTRIBUTE on a stack with less than 2 items");
-				return 0;
-			}
+			fetch_symbol(&cur, &attribute_name);
 
 			nj_object_t *container, *item;
 
-			item      = object_pop(&state->eval_stack);
-			container = object_top(&state->eval_stack);
+			item      = POP();
+			container = TOP();
 
-			if(!nj_object_insert_attribute(state, container, attribute_name, item)) {
+			if(!nj_object_insert_attribute_symbol(state, container, attribute_name, item)) {
 
 				// #ERROR
 				nj_fail(state, "Failed to insert attribute");
 				return 0;
 			}
 
-			*object_top_ref(&state->eval_stack) = item;
-			break;
+			TOP() = item;
+			NEXT;
 		}
 
-		case OPCODE_VARIABLE_MAP_PUSH:
+		CASE(OPCODE_VARIABLE_MAP_PUSH):
 		{
 			nj_object_t *dict = nj_object_istanciate(state, (nj_object_t*) &state->type_object_dict);
 
@@ -602,10 +760,10 @@ int nj_step(nj_state_t *state)
 				nj_fail(state, "Out of memory. Failed to grow variable map stack");
 				return 0;
 			}
-			break;
+			NEXT;
 		}
 
-		case OPCODE_VARIABLE_MAP_POP:
+		CASE(OPCODE_VARIABLE_MAP_POP):
 		{
 			if(object_stack_size(&state->vars_stack) == 0) {
 
@@ -615,84 +773,78 @@ int nj_step(nj_state_t *state)
 			}
 
 			object_pop(&state->vars_stack);
-			break;
+			NEXT;
 		}
 
-		case OPCODE_CALL: 
+		CASE(OPCODE_CALL): 
 		{
-			int64_t argc;
-
-			fetch_i64(state, &argc);
-
-			if(nj_failed(state)) 
-				return 0;
+			SAFEPOINT();
 
-			if(object_stack_size(&state->eval_stack) < argc + 1) {
+			int64_t argc;
 
-				// #ERROR
-				// CALL on a stack with not enough items
-				nj_fail(state, "CALL on a stack with not enough items");
-				return 0;
-			}
+			fetch_i64(&cur, &argc);
 
-			nj_object_t *callable = object_nth_from_top(&state->eval_stack, argc + 1);
+			nj_object_t *callable = state->stack_top[-(argc + 1)];
 
-			if(callable->type == (nj_object_t*) &state->type_object_cfunction) {
+			if(nj_object_type_of(state, callable) == (nj_object_t*) &state->type_object_cfunction) {
 
 				//
-				// Handle the call to a C function
+				// Handle the call to a C function. The arguments
+				// are passed in place and stay on the stack, where
+				// the collector sees them, until it returns.
 				//
 
-				nj_object_t **argv = malloc(sizeof(nj_object_t*) * argc);
-
-				for(int i = 0; i < argc; i++)
-					argv[argc-i-1] = object_pop(&state->eval_stack); // Pop the arguments
-				object_pop(&state->eval_stack); // Pop the called object
+				nj_object_t **argv = state->stack_top - argc;
 
 				nj_object_t *result = ((nj_object_cfunction_t*) callable)->routine(state, argc, argv);
 
-				free(argv);
+				if(result == 0) {
 
-				if(result == 0 && !nj_failed(state)) {
-
-					nj_fail(state, "C function returned NULL but didn't raise an error!");
+					if(!nj_failed(state))
+						nj_fail(state, "C function returned NULL but didn't raise an error!");
 					return 0;
 				}
 
-				if(!object_push(&state->eval_stack, result)) {
+				state->stack_top -= argc + 1; // Pop the arguments and the called object
 
-					// #ERROR
-					nj_fail(state, "Out of memory. Failed to grow evaluation stack");
-					return 0;
-				}
+				PUSH(result);
 
-			} else if(callable->type == (nj_object_t*) &state->type_object_function) {
+			} else if(nj_object_type_of(state, callable) == (nj_object_t*) &state->type_object_function) {
 
 				//
 				// Handle the call to a noja function
 				//
 
-				state->argc = argc;
-
 				uint32_t dest_segment, dest_offset;
 
 				dest_segment = ((nj_object_function_t*) callable)->segment;
 				dest_offset  = ((nj_object_function_t*) callable)->offset;
 
-				if(!u32_push(&state->segment_stack, dest_segment)) {
+				if(!nj_stack_reserve(state, state->segments[dest_segment].max_depth)) {
 
 					// #ERROR
-					nj_fail(state, "Out of memory. Failed to grow segment stack");
+					nj_fail(state, "Out of memory. Failed to grow evaluation stack");
 					return 0;
 				}
 
-				if(!u32_push(&state->offset_stack, dest_offset)) {
+				cursor_save(&cur);
+
+				nj_frame_t *frame = nj_push_frame(state, dest_segment, dest_offset);
+
+				if(frame == 0) {
 
 					// #ERROR
-					nj_fail(state, "Out of memory. Failed to grow segment stack");
+					nj_fail(state, "Out of memory. Failed to grow the frame stack");
 					return 0;
 				}
 
+				// The frame starts at the called object
+
+				frame->stack_base -= argc + 1;
+				frame->argc = argc;
+
+				cursor_load(state, &cur);
+
 			} else {
 
 				nj_fail(state, "CALL on something that is not callable");
@@ -700,115 +852,92 @@ int nj_step(nj_state_t *state)
 			}
 
 			
-			break;		
+			NEXT;		
 		}
 
-		case OPCODE_EXPECT:
+		CASE(OPCODE_EXPECT):
 		{
 			int64_t argc;
 
-			fetch_i64(state, &argc);
-
-			if(nj_failed(state)) 
-				return 0;
+			fetch_i64(&cur, &argc);
 		
-			if(state->argc < 0) {
+			if(cur.frame->argc < 0) {
 
 				// #ERROR
 				nj_fail(state, "EXPECT but the argc wasn't previously set by a CALL instruction");
 				return 0;
 			}
 
-			if(argc != state->argc) {
+			if(argc != cur.frame->argc) {
 
 				// #ERROR
 				nj_fail(state, "Function call didn't provide the required number of arguments");
 				return 0;
 			}
 
-			state->argc = -1;
-			break;
+			NEXT;
 		}
 
-		case OPCODE_RETURN:
+		CASE(OPCODE_RETURN):
 		{
-			if(u32_stack_size(&state->segment_stack) == 0 || u32_stack_size(&state->offset_stack) == 0) {
+			if(state->frames_used == frames_at_entry) {
 
 				// #ERROR
 				nj_fail(state, "RETURN but the call depth is 0");
 				return 0;
 			}
 
-			u32_pop(&state->segment_stack);
-			u32_pop(&state->offset_stack);
-			break;
+			// Leave the return value in place of the
+			// called object
+
+			nj_object_t *result = TOP();
+
+			state->stack_top = state->stack + cur.frame->stack_base;
+
+			PUSH(result);
+
+			state->frames_used--;
+
+			cursor_load(state, &cur);
+			NEXT;
 		}
 
-		case OPCODE_JUMP_ABSOLUTE: 
+		CASE(OPCODE_JUMP_ABSOLUTE): 
 		{
 		
 			uint32_t dest;
 
-			fetch_u32(state, &dest);
+			fetch_u32(&cur, &dest);
 
-			if(nj_failed(state)) 
-				return 0;
 
-			if(dest >= state->segments[u32_top(&state->segment_stack)].code_size) {
+			if(dest < cur.offset)
+				SAFEPOINT();
 
-				// #ERROR
-				nj_fail(state, "JUMP_ABSOLUTE refers to an address outside of the code segment");
-				return 0;
-			}
-
-			*u32_top_ref(&state->offset_stack) = dest;
-			break;
+			cur.offset = dest;
+			NEXT;
 		}
 		
-		case OPCODE_JUMP_IF_FALSE_AND_POP:
+		CASE(OPCODE_JUMP_IF_FALSE_AND_POP):
 		{
 			uint32_t dest;
 
-			fetch_u32(state, &dest);
+			fetch_u32(&cur, &dest);
 
-			if(nj_failed(state)) 
-				return 0;
 
-			if(dest >= state->segments[u32_top(&state->segment_stack)].code_size) {
+			if(!nj_object_test(state, POP())) {
 
-				// #ERROR
-				nj_fail(state, "JUMP_IF_FALSE_AND_POP refers to an address outside of the code segment");
-				return 0;
-			}
-
-			if(object_stack_size(&state->eval_stack) == 0) {
-
-				// #ERROR
-				nj_fail(state, "JUMP_IF_FALSE_AND_POP on an empty stack");
-				return 0;
-			}
-
-			if(!nj_object_test(state, object_pop(&state->eval_stack))) {
-
-				*u32_top_ref(&state->offset_stack) = dest;
+				cur.offset = dest;
 			}
 		
-			break;
+			NEXT;
 		}
 		
-		case OPCODE_ADD:
+		CASE(OPCODE_ADD):
 		{
-			if(object_stack_size(&state->eval_stack) < 2) {
-
-				// #ERROR
-				nj_fail(state, "ADD while the stack has less than 2 items");
-				return 0;
-			}
-
 			nj_object_t *left, *right, *result;
 
-			right = object_pop(&state->eval_stack);
-			left  = object_pop(&state->eval_stack);
+			right = POP();
+			left  = POP();
 			
 			result = nj_object_add(state, left, right);
 
@@ -820,31 +949,18 @@ int nj_step(nj_state_t *state)
 				return 0;
 			}
 
-			if(!object_push(&state->eval_stack, result)) {
-
-				// #ERROR
-				nj_fail(state, "Out of memory. Failed to grow evaluation stack");
-				return 0;
-			}
-			break;
+			PUSH(result);
+			NEXT;
 		}
 
 		#warning "Implement unary operation instructions"
 		
-		case OPCODE_SUB: 
+		CASE(OPCODE_SUB): 
 		{
-			if(object_stack_size(&state->eval_stack) < 2) {
-
-				// #ERROR
-				// SUB operation on a stack with less than 2 elements
-				nj_fail(state, "SUB while the stack has less than 2 items");
-				return 0;
-			}
-
 			nj_object_t *left, *right, *result;
 
-			right = object_pop(&state->eval_stack);
-			left  = object_pop(&state->eval_stack);
+			right = POP();
+			left  = POP();
 			
 			result = nj_object_sub(state, left, right);
 
@@ -856,29 +972,16 @@ int nj_step(nj_state_t *state)
 				return 0;
 			}
 
-			if(!object_push(&state->eval_stack, result)) {
-
-				// #ERROR
-				nj_fail(state, "Out of memory. Failed to grow evaluation stack");
-				return 0;
-			}
-			break;
+			PUSH(result);
+			NEXT;
 		}
 
-		case OPCODE_MUL:
+		CASE(OPCODE_MUL):
 		{
-			if(object_stack_size(&state->eval_stack) < 2) {
-
-				// #ERROR
-				// MUL operation on a stack with less than 2 elements
-				nj_fail(state, "MUL while the stack has less than 2 items");
-				return 0;
-			}
-
 			nj_object_t *left, *right, *result;
 
-			right = object_pop(&state->eval_stack);
-			left  = object_pop(&state->eval_stack);
+			right = POP();
+			left  = POP();
 			
 			result = nj_object_mul(state, left, right);
 
@@ -890,29 +993,16 @@ int nj_step(nj_state_t *state)
 				return 0;
 			}
 
-			if(!object_push(&state->eval_stack, result)) {
-
-				// #ERROR
-				nj_fail(state, "Out of memory. Failed to grow evaluation stack");
-				return 0;
-			}
-			break;
+			PUSH(result);
+			NEXT;
 		}
 
-		case OPCODE_DIV:
+		CASE(OPCODE_DIV):
 		{
-			if(object_stack_size(&state->eval_stack) < 2) {
-
-				// #ERROR
-				// DIV operation on a stack with less than 2 elements
-				nj_fail(state, "DIV while the stack has less than 2 items");
-				return 0;
-			}
-
 			nj_object_t *left, *right, *result;
 
-			right = object_pop(&state->eval_stack);
-			left  = object_pop(&state->eval_stack);
+			right = POP();
+			left  = POP();
 			
 			result = nj_object_div(state, left, right);
 
@@ -924,29 +1014,16 @@ int nj_step(nj_state_t *state)
 				return 0;
 			}
 
-			if(!object_push(&state->eval_stack, result)) {
-
-				// #ERROR
-				nj_fail(state, "Out of memory. Failed to grow evaluation stack");
-				return 0;
-			}
-			break;
+			PUSH(result);
+			NEXT;
 		}
 
-		case OPCODE_MOD:
+		CASE(OPCODE_MOD):
 		{
-			if(object_stack_size(&state->eval_stack) < 2) {
-
-				// #ERROR
-				// MOD operation on a stack with less than 2 elements
-				nj_fail(state, "MOD while the stack has less than 2 items");
-				return 0;
-			}
-
 			nj_object_t *left, *right, *result;
 
-			right = object_pop(&state->eval_stack);
-			left  = object_pop(&state->eval_stack);
+			right = POP();
+			left  = POP();
 			
 			result = nj_object_mod(state, left, right);
 
@@ -958,29 +1035,16 @@ int nj_step(nj_state_t *state)
 				return 0;
 			}
 
-			if(!object_push(&state->eval_stack, result)) {
-
-				// #ERROR
-				nj_fail(state, "Out of memory. Failed to grow evaluation stack");
-				return 0;
-			}
-			break;
+			PUSH(result);
+			NEXT;
 		}
 
-		case OPCODE_POW:
+		CASE(OPCODE_POW):
 		{
-			if(object_stack_size(&state->eval_stack) < 2) {
-
-				// #ERROR
-				// POW operation on a stack with less than 2 elements
-				nj_fail(state, "POW while the stack has less than 2 items");
-				return 0;
-			}
-
 			nj_object_t *left, *right, *result;
 
-			right = object_pop(&state->eval_stack);
-			left  = object_pop(&state->eval_stack);
+			right = POP();
+			left  = POP();
 			
 			result = nj_object_pow(state, left, right);
 
@@ -992,31 +1056,18 @@ int nj_step(nj_state_t *state)
 				return 0;
 			}
 
-			if(!object_push(&state->eval_stack, result)) {
-
-				// #ERROR
-				nj_fail(state, "Out of memory. Failed to grow evaluation stack");
-				return 0;
-			}
-			break;
+			PUSH(result);
+			NEXT;
 		}
 
-		case OPCODE_NEG: assert(0); break;
+		CASE(OPCODE_NEG): assert(0); NEXT;
 
-		case OPCODE_LSS:
+		CASE(OPCODE_LSS):
 		{
-			if(object_stack_size(&state->eval_stack) < 2) {
-
-				// #ERROR
-				// LSS operation on a stack with less than 2 elements
-				nj_fail(state, "LSS while the stack has less than 2 items");
-				return 0;
-			}
-
 			nj_object_t *left, *right, *result;
 
-			right = object_pop(&state->eval_stack);
-			left  = object_pop(&state->eval_stack);
+			right = POP();
+			left  = POP();
 			
 			result = nj_object_lss(state, left, right);
 
@@ -1028,29 +1079,16 @@ int nj_step(nj_state_t *state)
 				return 0;
 			}
 
-			if(!object_push(&state->eval_stack, result)) {
-
-				// #ERROR
-				nj_fail(state, "Out of memory. Failed to grow evaluation stack");
-				return 0;
-			}
-			break;
+			PUSH(result);
+			NEXT;
 		}
 
-		case OPCODE_GRT: 
+		CASE(OPCODE_GRT): 
 		{
-			if(object_stack_size(&state->eval_stack) < 2) {
-
-				// #ERROR
-				// GRT operation on a stack with less than 2 elements
-				nj_fail(state, "GRT while the stack has less than 2 items");
-				return 0;
-			}
-
 			nj_object_t *left, *right, *result;
 
-			right = object_pop(&state->eval_stack);
-			left  = object_pop(&state->eval_stack);
+			right = POP();
+			left  = POP();
 			
 			result = nj_object_grt(state, left, right);
 
@@ -1062,29 +1100,16 @@ int nj_step(nj_state_t *state)
 				return 0;
 			}
 
-			if(!object_push(&state->eval_stack, result)) {
-
-				// #ERROR
-				nj_fail(state, "Out of memory. Failed to grow evaluation stack");
-				return 0;
-			}
-			break;
+			PUSH(result);
+			NEXT;
 		}
 
-		case OPCODE_LEQ:
+		CASE(OPCODE_LEQ):
 		{
-			if(object_stack_size(&state->eval_stack) < 2) {
-
-				// #ERROR
-				// LEQ operation on a stack with less than 2 elements
-				nj_fail(state, "LEQ while the stack has less than 2 items");
-				return 0;
-			}
-
 			nj_object_t *left, *right, *result;
 
-			right = object_pop(&state->eval_stack);
-			left  = object_pop(&state->eval_stack);
+			right = POP();
+			left  = POP();
 			
 			result = nj_object_leq(state, left, right);
 
@@ -1096,29 +1121,16 @@ int nj_step(nj_state_t *state)
 				return 0;
 			}
 
-			if(!object_push(&state->eval_stack, result)) {
-
-				// #ERROR
-				nj_fail(state, "Out of memory. Failed to grow evaluation stack");
-				return 0;
-			}
-			break;
+			PUSH(result);
+			NEXT;
 		}
 
-		case OPCODE_GEQ:
+		CASE(OPCODE_GEQ):
 		{
-			if(object_stack_size(&state->eval_stack) < 2) {
-
-				// #ERROR
-				// GEQ operation on a stack with less than 2 elements
-				nj_fail(state, "GEQ while the stack has less than 2 items");
-				return 0;
-			}
-
 			nj_object_t *left, *right, *result;
 
-			right = object_pop(&state->eval_stack);
-			left  = object_pop(&state->eval_stack);
+			right = POP();
+			left  = POP();
 			
 			result = nj_object_geq(state, left, right);
 
@@ -1130,29 +1142,16 @@ int nj_step(nj_state_t *state)
 				return 0;
 			}
 
-			if(!object_push(&state->eval_stack, result)) {
-
-				// #ERROR
-				nj_fail(state, "Out of memory. Failed to grow evaluation stack");
-				return 0;
-			}
-			break;
+			PUSH(result);
+			NEXT;
 		}
 
-		case OPCODE_EQL:
+		CASE(OPCODE_EQL):
 		{
-			if(object_stack_size(&state->eval_stack) < 2) {
-
-				// #ERROR
-				// EQL operation on a stack with less than 2 elements
-				nj_fail(state, "EQL while the stack has less than 2 items");
-				return 0;
-			}
-
 			nj_object_t *left, *right, *result;
 
-			right = object_pop(&state->eval_stack);
-			left  = object_pop(&state->eval_stack);
+			right = POP();
+			left  = POP();
 			
 			result = nj_object_eql(state, left, right);
 
@@ -1164,29 +1163,16 @@ int nj_step(nj_state_t *state)
 				return 0;
 			}
 
-			if(!object_push(&state->eval_stack, result)) {
-
-				// #ERROR
-				nj_fail(state, "Out of memory. Failed to grow evaluation stack");
-				return 0;
-			}
-			break;
+			PUSH(result);
+			NEXT;
 		}
 
-		case OPCODE_NQL:
+		CASE(OPCODE_NQL):
 		{
-			if(object_stack_size(&state->eval_stack) < 2) {
-
-				// #ERROR
-				// NQL operation on a stack with less than 2 elements
-				nj_fail(state, "NQL while the stack has less than 2 items");
-				return 0;
-			}
-
 			nj_object_t *left, *right, *result;
 
-			right = object_pop(&state->eval_stack);
-			left  = object_pop(&state->eval_stack);
+			right = POP();
+			left  = POP();
 			
 			result = nj_object_nql(state, left, right);
 
@@ -1198,29 +1184,16 @@ int nj_step(nj_state_t *state)
 				return 0;
 			}
 
-			if(!object_push(&state->eval_stack, result)) {
-
-				// #ERROR
-				nj_fail(state, "Out of memory. Failed to grow evaluation stack");
-				return 0;
-			}
-			break;
+			PUSH(result);
+			NEXT;
 		}
 
-		case OPCODE_AND:
+		CASE(OPCODE_AND):
 		{
-			if(object_stack_size(&state->eval_stack) < 2) {
-
-				// #ERROR
-				// AND operation on a stack with less than 2 elements
-				nj_fail(state, "AND while the stack has less than 2 items");
-				return 0;
-			}
-
 			nj_object_t *left, *right, *result;
 
-			right = object_pop(&state->eval_stack);
-			left  = object_pop(&state->eval_stack);
+			right = POP();
+			left  = POP();
 			
 			result = nj_object_and(state, left, right);
 
@@ -1232,29 +1205,16 @@ int nj_step(nj_state_t *state)
 				return 0;
 			}
 
-			if(!object_push(&state->eval_stack, result)) {
-
-				// #ERROR
-				nj_fail(state, "Out of memory. Failed to grow evaluation stack");
-				return 0;
-			}
-			break;
+			PUSH(result);
+			NEXT;
 		}
 
-		case OPCODE_OR: 
+		CASE(OPCODE_OR): 
 		{
-			if(object_stack_size(&state->eval_stack) < 2) {
-
-				// #ERROR
-				// OR operation on a stack with less than 2 elements
-				nj_fail(state, "OR while the stack has less than 2 items");
-				return 0;
-			}
-
 			nj_object_t *left, *right, *result;
 
-			right = object_pop(&state->eval_stack);
-			left  = object_pop(&state->eval_stack);
+			right = POP();
+			left  = POP();
 			
 			result = nj_object_or(state, left, right);
 
@@ -1266,31 +1226,18 @@ int nj_step(nj_state_t *state)
 				return 0;
 			}
 
-			if(!object_push(&state->eval_stack, result)) {
-
-				// #ERROR
-				nj_fail(state, "Out of memory. Failed to grow evaluation stack");
-				return 0;
-			}
-			break;
+			PUSH(result);
+			NEXT;
 		}
 
-		case OPCODE_NOT: assert(0); break;
+		CASE(OPCODE_NOT): assert(0); NEXT;
 
-		case OPCODE_SHL:
+		CASE(OPCODE_SHL):
 		{
-			if(object_stack_size(&state->eval_stack) < 2) {
-
-				// #ERROR
-				// SHL operation on a stack with less than 2 elements
-				nj_fail(state, "SHL while the stack has less than 2 items");
-				return 0;
-			}
-
 			nj_object_t *left, *right, *result;
 
-			right = object_pop(&state->eval_stack);
-			left  = object_pop(&state->eval_stack);
+			right = POP();
+			left  = POP();
 			
 			result = nj_object_shl(state, left, right);
 
@@ -1302,29 +1249,16 @@ int nj_step(nj_state_t *state)
 				return 0;
 			}
 
-			if(!object_push(&state->eval_stack, result)) {
-
-				// #ERROR
-				nj_fail(state, "Out of memory. Failed to grow evaluation stack");
-				return 0;
-			}
-			break;
+			PUSH(result);
+			NEXT;
 		}
 
-		case OPCODE_SHR:
+		CASE(OPCODE_SHR):
 		{
-			if(object_stack_size(&state->eval_stack) < 2) {
-
-				// #ERROR
-				// SHR operation on a stack with less than 2 elements
-				nj_fail(state, "SHR while the stack has less than 2 items");
-				return 0;
-			}
-
 			nj_object_t *left, *right, *result;
 
-			right = object_pop(&state->eval_stack);
-			left  = object_pop(&state->eval_stack);
+			right = POP();
+			left  = POP();
 			
 			result = nj_object_shr(state, left, right);
 
@@ -1336,191 +1270,330 @@ int nj_step(nj_state_t *state)
 				return 0;
 			}
 
-			if(!object_push(&state->eval_stack, result)) {
+			PUSH(result);
+			NEXT;
+		}
+
+		CASE(OPCODE_BITWISE_AND): 
+		{
+			nj_object_t *left, *right, *result;
+
+			right = POP();
+			left  = POP();
+			
+			result = nj_object_bitwise_and(state, left, right);
+
+			if(result == 0) {
 
 				// #ERROR
-				nj_fail(state, "Out of memory. Failed to grow evaluation stack");
+				// Failed to execute BITWISE_AND operation
+				nj_fail(state, "Failed to execute BITWISE_AND");
 				return 0;
 			}
-			break;
+
+			PUSH(result);
+			NEXT;
 		}
 
-		case OPCODE_BITWISE_AND: 
+		CASE(OPCODE_BITWISE_OR):  
 		{
-			if(object_stack_size(&state->eval_stack) < 2) {
+			nj_object_t *left, *right, *result;
+
+			right = POP();
+			left  = POP();
+			
+			result = nj_object_bitwise_or(state, left, right);
+
+			if(result == 0) {
 
 				// #ERROR
-				// BITWISE_AND operation on a stack with less than 2 elements
-				nj_fail(state, "BITWISE_AND while the stack has less than 2 items");
+				// Failed to execute BITWISE_OR operation
+				nj_fail(state, "Failed to execute BITWISE_OR");
 				return 0;
 			}
 
+			PUSH(result);
+			NEXT;
+		}
+
+		CASE(OPCODE_BITWISE_XOR): 
+		{
 			nj_object_t *left, *right, *result;
 
-			right = object_pop(&state->eval_stack);
-			left  = object_pop(&state->eval_stack);
+			right = POP();
+			left  = POP();
 			
-			result = nj_object_bitwise_and(state, left, right);
+			result = nj_object_bitwise_xor(state, left, right);
 
 			if(result == 0) {
 
 				// #ERROR
-				// Failed to execute BITWISE_AND operation
-				nj_fail(state, "Failed to execute BITWISE_AND");
+				// Failed to execute BITWISE_XOR operation
+				nj_fail(state, "Failed to execute BITWISE_XOR");
 				return 0;
 			}
 
-			if(!object_push(&state->eval_stack, result)) {
+			PUSH(result);
+			NEXT;
+		}
+
+
+		CASE(OPCODE_BITWISE_NOT): assert(0); NEXT;
+
+		CASE(OPCODE_ASSIGN_AND_POP):
+		{
+			nj_symbol_t *variable_name;
+
+			fetch_symbol(&cur, &variable_name);
+
+			nj_object_t *dest;
+
+			if(object_stack_size(&state->vars_stack) == 0)
+				dest = state->segments[cur.segment].global_variables_map;
+			else
+				dest = object_top(&state->vars_stack);
+
+			if(!nj_dictionary_insert_symbol(state, dest, variable_name, POP())) {
 
 				// #ERROR
-				nj_fail(state, "Out of memory. Failed to grow evaluation stack");
+				nj_fail(state, "Failed to execute ASSIGN instrucion. Couldn't insert into the variable map");
 				return 0;
 			}
-			break;
+
+			NEXT;
 		}
 
-		case OPCODE_BITWISE_OR:  
+		CASE(OPCODE_STORE_LOCAL_AND_POP):
+		{
+			uint32_t slot;
+
+			fetch_u32(&cur, &slot);
+
+			state->locals[cur.frame->locals_base + slot] = POP();
+			NEXT;
+		}
+
+		//
+		// INC_VARIABLE and INC_LOCAL add an int to a variable.
+		// The sequence they replace sets the source offset
+		// after reading the variable, so they do too.
+		//
+
+		CASE(OPCODE_INC_VARIABLE):
 		{
-			if(object_stack_size(&state->eval_stack) < 2) {
+			nj_inline_cache_t *cache = site_cache(&cur);
+			nj_symbol_t *variable_name;
+			int64_t value;
+			uint32_t offset;
+
+			fetch_symbol(&cur, &variable_name);
+			fetch_i64(&cur, &value);
+			fetch_u32(&cur, &offset);
+
+			nj_object_t *locals = 0;
+
+			if(object_stack_size(&state->vars_stack) > 0)
+				locals = object_top(&state->vars_stack);
+
+			nj_object_t *object = nj_cached_select_variable(state, cache, locals, state->segments[cur.segment].global_variables_map, variable_name);
+
+			if(object == 0) {
 
 				// #ERROR
-				// BITWISE_OR operation on a stack with less than 2 elements
-				nj_fail(state, "BITWISE_OR while the stack has less than 2 items");
+				nj_fail(state, "Undefined variable [${zero-terminated-string}] was referenced", variable_name->text);
 				return 0;
 			}
 
-			nj_object_t *left, *right, *result;
+			state->offset = offset;
 
-			right = object_pop(&state->eval_stack);
-			left  = object_pop(&state->eval_stack);
-			
-			result = nj_object_bitwise_or(state, left, right);
+			nj_object_t *result = add_int(state, object, value);
 
 			if(result == 0) {
 
 				// #ERROR
-				// Failed to execute BITWISE_OR operation
-				nj_fail(state, "Failed to execute BITWISE_OR");
+				nj_fail(state, "Failed to execute ADD");
 				return 0;
 			}
 
-			if(!object_push(&state->eval_stack, result)) {
+			nj_object_t *dest = locals ? locals : state->segments[cur.segment].global_variables_map;
+
+			if(!nj_dictionary_insert_symbol(state, dest, variable_name, result)) {
 
 				// #ERROR
-				nj_fail(state, "Out of memory. Failed to grow evaluation stack");
+				nj_fail(state, "Failed to execute ASSIGN instrucion. Couldn't insert into the variable map");
 				return 0;
 			}
-			break;
+
+			NEXT;
 		}
 
-		case OPCODE_BITWISE_XOR: 
+		CASE(OPCODE_INC_LOCAL):
 		{
-			if(object_stack_size(&state->eval_stack) < 2) {
+			uint32_t slot, offset;
+			int64_t value;
+
+			fetch_u32(&cur, &slot);
+			fetch_i64(&cur, &value);
+			fetch_u32(&cur, &offset);
+
+			nj_object_t **local = &state->locals[cur.frame->locals_base + slot];
+
+			if(*local == 0) {
 
 				// #ERROR
-				// BITWISE_XOR operation on a stack with less than 2 elements
-				nj_fail(state, "BITWISE_XOR while the stack has less than 2 items");
+				nj_fail(state, "Local variable was referenced before being assigned");
 				return 0;
 			}
 
-			nj_object_t *left, *right, *result;
+			state->offset = offset;
 
-			right = object_pop(&state->eval_stack);
-			left  = object_pop(&state->eval_stack);
-			
-			result = nj_object_bitwise_xor(state, left, right);
+			nj_object_t *result = add_int(state, *local, value);
 
 			if(result == 0) {
 
 				// #ERROR
-				// Failed to execute BITWISE_XOR operation
-				nj_fail(state, "Failed to execute BITWISE_XOR");
+				nj_fail(state, "Failed to execute ADD");
 				return 0;
 			}
 
-			if(!object_push(&state->eval_stack, result)) {
+			*local = result;
+			NEXT;
+		}
+
+		CASE(OPCODE_PUSH_VARIABLE_SELECT_ATTRIBUTE):
+		{
+			nj_inline_cache_t *variable_cache = site_cache(&cur);
+			nj_symbol_t *variable_name;
+
+			fetch_symbol(&cur, &variable_name);
+
+			nj_inline_cache_t *attribute_cache = site_cache(&cur);
+			nj_symbol_t *attribute_name;
+
+			fetch_symbol(&cur, &attribute_name);
+
+			nj_object_t *locals = 0;
+
+			if(object_stack_size(&state->vars_stack) > 0)
+				locals = object_top(&state->vars_stack);
+
+			nj_object_t *container = nj_cached_select_variable(state, variable_cache, locals, state->segments[cur.segment].global_variables_map, variable_name);
+
+			if(container == 0) {
 
 				// #ERROR
-				nj_fail(state, "Out of memory. Failed to grow evaluation stack");
+				nj_fail(state, "Undefined variable [${zero-terminated-string}] was referenced", variable_name->text);
 				return 0;
 			}
-			break;
-		}
 
+			nj_object_t *selected = nj_cached_select_attribute(state, attribute_cache, container, attribute_name);
+
+			if(selected == 0) {
+
+				// #ERROR
+				nj_fail(state, "Failed to select attribute");
+				return 0;
+			}
 
-		case OPCODE_BITWISE_NOT: assert(0); break;
+			PUSH(selected);
+			NEXT;
+		}
+
+		CASE(OPCODE_LSS_JUMP_IF_FALSE): COMPARE_AND_JUMP(nj_object_lss, <,  "LSS")
+		CASE(OPCODE_GRT_JUMP_IF_FALSE): COMPARE_AND_JUMP(nj_object_grt, >,  "GRT")
+		CASE(OPCODE_LEQ_JUMP_IF_FALSE): COMPARE_AND_JUMP(nj_object_leq, <=, "LEQ")
+		CASE(OPCODE_GEQ_JUMP_IF_FALSE): COMPARE_AND_JUMP(nj_object_geq, >=, "GEQ")
+		CASE(OPCODE_EQL_JUMP_IF_FALSE): COMPARE_AND_JUMP(nj_object_eql, ==, "EQL")
+		CASE(OPCODE_NQL_JUMP_IF_FALSE): COMPARE_AND_JUMP(nj_object_nql, !=, "NQL")
 
+#ifndef NJ_THREADED_DISPATCH
 		default:
 		// #ERROR
 		// Unexpected opcode
 		nj_fail(state, "Unknown opcode");
 		return 0;
-
+		}
+#endif
 	}
-
-	return 1;
 }
 
-static void fetch_u32(nj_state_t *state, uint32_t *value)
+static inline void cursor_load(nj_state_t *state, cursor_t *cur)
 {
-	if(u32_top(&state->offset_stack) + sizeof(uint32_t) > state->segments[u32_top(&state->segment_stack)].code_size) {
+	segment_t *segment;
 
-		nj_fail(state, "Unexpected end of the code segment while fetching an u32");
-		return;
-	}
+	cur->frame   = state->frames + state->frames_used - 1;
+	cur->segment = cur->frame->segment;
+	cur->offset  = cur->frame->offset;
 
-	if(value)
-		*value = *(uint32_t*) (state->segments[u32_top(&state->segment_stack)].code + u32_top(&state->offset_stack));
+	segment = state->segments + cur->segment;
 
-	*u32_top_ref(&state->offset_stack) += sizeof(uint32_t);
+	assert(segment->flags & SEGMENT_IS_TRUSTED);
+
+	cur->code = segment->code;
+	cur->data = segment->data;
+	cur->symbols = segment->symbols;
+	cur->sites = segment->sites;
 }
 
-static void fetch_i64(nj_state_t *state, int64_t *value)
+static inline void cursor_save(cursor_t *cur)
 {
-	if(u32_top(&state->offset_stack) + sizeof(int64_t) > state->segments[u32_top(&state->segment_stack)].code_size) {
-
-		nj_fail(state, "Unexpected end of the code segment while fetching an i64");
-		return;
-	}
-
-	if(value)
-		*value = *(int64_t*) (state->segments[u32_top(&state->segment_stack)].code + u32_top(&state->offset_stack));
-
-	*u32_top_ref(&state->offset_stack) += sizeof(int64_t);
+	cur->frame->offset = cur->offset;
 }
 
-static void fetch_f64(nj_state_t *state, double *value)
+static inline void fetch_u32(cursor_t *cur, uint32_t *value)
 {
-	if(u32_top(&state->offset_stack) + sizeof(double) > state->segments[u32_top(&state->segment_stack)].code_size) {
+	*value = *(uint32_t*) (cur->code + cur->offset);
+	cur->offset += sizeof(uint32_t);
+}
 
-		nj_fail(state, "Unexpected end of the code segment while fetching an f64");
-		return;
-	}
+static inline void fetch_i64(cursor_t *cur, int64_t *value)
+{
+	*value = *(int64_t*) (cur->code + cur->offset);
+	cur->offset += sizeof(int64_t);
+}
 
-	if(value)
-		*value = *(double*) (state->segments[u32_top(&state->segment_stack)].code + u32_top(&state->offset_stack));
+static inline void fetch_f64(cursor_t *cur, double *value)
+{
+	*value = *(double*) (cur->code + cur->offset);
+	cur->offset += sizeof(double);
+}
 
-	*u32_top_ref(&state->offset_stack) += sizeof(double);
+static inline void fetch_string(cursor_t *cur, char **value)
+{
+	*value = cur->data + *(uint32_t*) (cur->code + cur->offset);
+	cur->offset += sizeof(uint32_t);
 }
 
-static void fetch_string(nj_state_t *state, char **value)
+static inline void fetch_symbol(cursor_t *cur, nj_symbol_t **value)
 {
-	if(u32_top(&state->offset_stack) + sizeof(uint32_t) > state->segments[u32_top(&state->segment_stack)].code_size) {
+	*value = cur->symbols[*(uint32_t*) (cur->code + cur->offset)];
+	cur->offset += sizeof(uint32_t);
+}
 
-		nj_fail(state, "Unexpected end of the code segment while fetching an u32");
-		return;
-	}
+//
+// Same as ADD with an int of [value] on the right.
+//
+static inline nj_object_t *add_int(nj_state_t *state, nj_object_t *left, int64_t value)
+{
+	int64_t sum;
 
-	uint32_t offset = *(uint32_t*) (state->segments[u32_top(&state->segment_stack)].code + u32_top(&state->offset_stack));
+	if(nj_is_small_int(left) && !__builtin_add_overflow(nj_small_int_value(left), value, &sum) && nj_small_int_fits(sum))
+		return nj_small_int_make(sum);
 
-	if(offset >= state->segments[u32_top(&state->segment_stack)].data_size) {
+	nj_object_t *right = nj_object_from_c_int(state, value);
 
-		nj_fail(state, "Fetched data offset points outside of the data segment");
-		return;
-	}
+	if(right == 0)
+		return 0;
 
-	if(value)
-		*value = state->segments[u32_top(&state->segment_stack)].data + offset;
+	return nj_object_add(state, left, right);
+}
 
-	*u32_top_ref(&state->offset_stack) += sizeof(uint32_t);
-}
\ No newline at end of file
+//
+// The inline cache of the word that was just fetched. That's
+// the opcode for most sites, PUSH_VARIABLE_SELECT_ATTRIBUTE
+// also has one for its first operand.
+//
+static inline nj_inline_cache_t *site_cache(cursor_t *cur)
+{
+	return cur->sites[cur->offset / sizeof(uint32_t) - 1];
+}
@@ -0,0 +1,230 @@
+#include <stdlib.h>
+#include <string.h>
+#include "noja.h"
+#include "utils/hash.h"
+
+//
+// The symbol table interns every name the interpreter
+// deals with (variable names, attribute names and dict
+// keys). Two equal names always map to the same symbol,
+// so once a name is interned it can be compared by
+// pointer and its hash never needs to be recomputed.
+//
+// Dict keys are interned at run time, so the table is weak:
+// major collections free the symbols nothing refers to (see
+// nj_symbol_table_sweep). Interning a name that was freed
+// makes a new symbol, which is fine since no dict had it.
+//
+
+int nj_symbol_table_init(nj_symbol_table_t *table)
+{
+	table->slots = calloc(64, sizeof(nj_symbol_t*));
+	table->size = 64;
+	table->used = 0;
+	table->epoch = 0;
+
+	if(table->slots == 0)
+		return 0;
+
+	return 1;
+}
+
+void nj_symbol_table_deinit(nj_symbol_table_t *table)
+{
+	for(uint32_t i = 0; i < table->size; i++)
+		free(table->slots[i]);
+
+	free(table->slots);
+}
+
+static uint32_t find_slot(nj_symbol_t **slots, uint32_t size, const char *text, size_t length, uint64_t hash)
+{
+	uint32_t mask = size - 1;
+	uint32_t i = hash & mask;
+
+	while(slots[i]) {
+
+		nj_symbol_t *symbol = slots[i];
+
+		if(symbol->hash == hash && symbol->length == length && !memcmp(symbol->text, text, length))
+			break;
+
+		i = (i + 1) & mask;
+	}
+
+	return i;
+}
+
+static int grow(nj_symbol_table_t *table)
+{
+	uint32_t new_size = table->size * 2;
+
+	nj_symbol_t **new_slots = calloc(new_size, sizeof(nj_symbol_t*));
+
+	if(new_slots == 0)
+		return 0;
+
+	for(uint32_t i = 0; i < table->size; i++) {
+
+		nj_symbol_t *symbol = table->slots[i];
+
+		if(symbol)
+			new_slots[find_slot(new_slots, new_size, symbol->text, symbol->length, symbol->hash)] = symbol;
+	}
+
+	free(table->slots);
+
+	table->slots = new_slots;
+	table->size = new_size;
+	return 1;
+}
+
+nj_symbol_t *nj_symbol_lookup(nj_state_t *state, const char *text, size_t length)
+{
+	nj_symbol_table_t *table = &state->symbols;
+
+	uint64_t hash = hash_bytes(text, length, state->hash_seed);
+
+	return table->slots[find_slot(table->slots, table->size, text, length, hash)];
+}
+
+nj_symbol_t *nj_symbol_intern(nj_state_t *state, const char *text, size_t length)
+{
+	nj_symbol_table_t *table = &state->symbols;
+
+	uint64_t hash = hash_bytes(text, length, state->hash_seed);
+
+	uint32_t i = find_slot(table->slots, table->size, text, length, hash);
+
+	if(table->slots[i])
+		return table->slots[i];
+
+	if((table->used + 1) * 3 > table->size * 2) {
+
+		if(!grow(table))
+			return 0;
+
+		i = find_slot(table->slots, table->size, text, length, hash);
+	}
+
+	nj_symbol_t *symbol = malloc(sizeof(nj_symbol_t) + length + 1);
+
+	if(symbol == 0)
+		return 0;
+
+	symbol->hash = hash;
+	symbol->length = length;
+	symbol->epoch = table->epoch;
+	memcpy(symbol->text, text, length);
+	symbol->text[length] = '\0';
+
+	table->slots[i] = symbol;
+	table->used++;
+
+	return symbol;
+}
+
+//
+// Tells the collection in progress that [symbol] is in use.
+// Symbols are marked when a dict that holds them is traced
+// and when they're inserted in a dict, so that a dict that
+// was traced before getting the key still keeps it.
+//
+void nj_symbol_mark(nj_state_t *state, nj_symbol_t *symbol)
+{
+	symbol->epoch = state->symbols.epoch;
+}
+
+//
+// Frees the symbols that weren't marked since the current
+// major collection started, which bumped the epoch. The
+// names of the code segments and the keys of the shapes,
+// which live as long as the state, are marked here. Keys
+// of dicts in dictionary mode were marked by tracing them.
+//
+void nj_symbol_table_sweep(nj_state_t *state)
+{
+	nj_symbol_table_t *table = &state->symbols;
+
+	for(int i = 0; i < state->segments_used; i++)
+		for(uint32_t j = 0; j < state->segments[i].symbols_count; j++)
+			nj_symbol_mark(state, state->segments[i].symbols[j]);
+
+	for(uint32_t i = 0; i < state->shapes.size; i++)
+		if(state->shapes.transitions[i])
+			nj_symbol_mark(state, state->shapes.transitions[i]->key);
+
+	// Probing can't skip holes, so the survivors are
+	// moved to a new array. Without one, nothing is freed.
+
+	nj_symbol_t **slots = calloc(table->size, sizeof(nj_symbol_t*));
+
+	if(slots == 0)
+		return;
+
+	for(uint32_t i = 0; i < table->size; i++) {
+
+		nj_symbol_t *symbol = table->slots[i];
+
+		if(symbol == 0)
+			continue;
+
+		if(symbol->epoch != table->epoch) {
+
+			free(symbol);
+			table->used--;
+			continue;
+		}
+
+		slots[find_slot(slots, table->size, symbol->text, symbol->length, symbol->hash)] = symbol;
+	}
+
+	free(table->slots);
+
+	table->slots = slots;
+}
+
+//
+// Maps from symbols to indices into an array of keys, used
+// by shapes and by dicts in dictionary mode. Slots hold -1
+// when empty and the size is a power of two.
+//
+
+void nj_symbol_map_insert(int *map, int map_size, nj_symbol_t *key, int index)
+{
+	uint64_t p = key->hash;
+
+	int mask = map_size - 1;
+	int i = key->hash & mask;
+
+	while(map[i] != -1) {
+
+		p >>= 5;
+		i = (i*5 + p + 1) & mask;
+	}
+
+	map[i] = index;
+}
+
+//
+// Returns the index associated to [key], or -1 if there's
+// none. Symbols are interned so they're compared by address.
+//
+int nj_symbol_map_find(int *map, int map_size, nj_symbol_t **keys, nj_symbol_t *key)
+{
+	uint64_t p = key->hash;
+
+	int mask = map_size - 1;
+	int i = key->hash & mask;
+
+	while(1) {
+
+		int j = map[i];
+
+		if(j == -1 || keys[j] == key)
+			return j;
+
+		p >>= 5;
+		i = (i*5 + p + 1) & mask;
+	}
+}
@@ -0,0 +1,90 @@
+#include <string.h>
+#include <time.h>
+#include "hash.h"
+
+//
+// A small wyhash-style keyed hash. Input is consumed in
+// 16 byte blocks, each folded into the state through a
+// 64x64->128 bit multiplication whose halves are xored
+// together. It's not cryptographic, but the seed makes
+// the bucket layout unpredictable from outside.
+//
+
+#define P0 0xa0761d6478bd642fULL
+#define P1 0xe7037ed1a0b428dbULL
+#define P2 0x8ebc6af09c88c6e3ULL
+
+static inline uint64_t mix(uint64_t a, uint64_t b)
+{
+	__uint128_t r = (__uint128_t) a * b;
+
+	return (uint64_t) r ^ (uint64_t) (r >> 64);
+}
+
+static inline uint64_t read_u64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t read_u32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+uint64_t hash_bytes(const char *bytes, size_t length, uint64_t seed)
+{
+	const uint8_t *p = (const uint8_t*) bytes;
+
+	uint64_t a, b;
+
+	seed ^= mix(seed ^ P0, P1);
+
+	if(length <= 16) {
+
+		if(length >= 4) {
+
+			a = (read_u32(p) << 32) | read_u32(p + ((length >> 3) << 2));
+			b = (read_u32(p + length - 4) << 32) | read_u32(p + length - 4 - ((length >> 3) << 2));
+
+		} else if(length > 0) {
+
+			a = ((uint64_t) p[0] << 16) | ((uint64_t) p[length >> 1] << 8) | p[length - 1];
+			b = 0;
+
+		} else {
+
+			a = b = 0;
+		}
+
+	} else {
+
+		size_t i = length;
+
+		while(i > 16) {
+
+			seed = mix(read_u64(p) ^ P1, read_u64(p + 8) ^ seed);
+
+			p += 16;
+			i -= 16;
+		}
+
+		a = read_u64(p + i - 16);
+		b = read_u64(p + i - 8);
+	}
+
+	return mix(P1 ^ length, mix(a ^ P1, b ^ seed));
+}
+
+uint64_t hash_string(const char *string, uint64_t seed)
+{
+	return hash_bytes(string, strlen(string), seed);
+}
+
+uint64_t hash_make_seed(const void *entropy)
+{
+	return mix((uint64_t) time(NULL) ^ P2, (uint64_t) (uintptr_t) entropy ^ P0);
+}
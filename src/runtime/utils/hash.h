@@ -0,0 +1,11 @@
+#ifndef _HASH_
+#define _HASH_
+
+#include <stdint.h>
+#include <stddef.h>
+
+uint64_t hash_bytes(const char *bytes, size_t length, uint64_t seed);
+uint64_t hash_string(const char *string, uint64_t seed);
+uint64_t hash_make_seed(const void *entropy);
+
+#endif
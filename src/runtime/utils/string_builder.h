@@ -1,4 +1,7 @@
 
+#ifndef _STRING_BUILDER_
+#define _STRING_BUILDER_
+
 #include <stdarg.h>
 #include <stdio.h>
 
@@ -24,3 +27,5 @@ int   string_builder_append_p(string_builder_t *builder, const char *fmt, va_lis
 int   string_builder_append_byte(string_builder_t *builder, char c);
 void  string_builder_serialize_to_buffer(string_builder_t *builder, char *dest);
 void  string_builder_serialize_to_stream(string_builder_t *builder, FILE *fp);
+
+#endif
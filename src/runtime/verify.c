@@ -0,0 +1,729 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "noja.h"
+#include "bytecode.h"
+
+//
+// The verifier runs once when a segment is loaded and
+// checks everything the execution loop would otherwise
+// check at every fetch:
+//
+//   - Every instruction has a known opcode and all of its
+//     operands are inside the code segment;
+//   - Data offsets and symbol indices are in range;
+//   - Jump targets and function addresses point to the
+//     start of an instruction;
+//   - No path falls off the end of the code;
+//   - Every instruction has the same stack depth on every
+//     path that reaches it and never pops more than what
+//     was pushed since the start of its function;
+//   - Every instruction has the same local slots on every
+//     path that reaches it, and the ones that read or write
+//     a slot are below the count of the LOCALS_PUSH before
+//     them. LOCALS_PUSH and LOCALS_POP come in pairs.
+//
+// Depths are relative to the start of the top-level code
+// or of the function. A function starts with EXPECT n,
+// which accounts for the n arguments and the callee that
+// the caller left on the stack.
+//
+// Register segments (SEGMENT_IS_REGISTER) have no stack to
+// track. They're made of regions, the top-level code and
+// one for each function, that start with ENTER. Instead of
+// the depths, the verifier checks that register operands
+// are below the count of their region's ENTER and that
+// control never leaves a region other than by calling or
+// returning.
+//
+// Segments that pass are marked as SEGMENT_IS_TRUSTED.
+//
+
+typedef struct {
+	nj_state_t *state;
+	const char *code;
+	uint32_t code_size;
+	uint8_t *starts;
+	int32_t *depths;
+	int32_t *locals; // Slot count, or -1 before LOCALS_PUSH
+	uint32_t *worklist;
+	uint32_t worklist_used;
+	uint32_t max_depth;
+	int is_register;
+} verifier_t;
+
+//
+// Upper limit on the number of registers of a region.
+//
+#define MAX_REGISTERS 65536
+
+//
+// Upper limit on the number of local slots of a function.
+//
+#define MAX_LOCALS 65536
+
+static uint32_t read_u32(const char *code, uint32_t offset)
+{
+	uint32_t value;
+	memcpy(&value, code + offset, sizeof(value));
+	return value;
+}
+
+static int64_t read_i64(const char *code, uint32_t offset)
+{
+	int64_t value;
+	memcpy(&value, code + offset, sizeof(value));
+	return value;
+}
+
+//
+// Returns the number of bytes taken by the operands of the
+// instruction at [offset] or -1 if they're not valid.
+//
+static int64_t check_operands(verifier_t *v, uint32_t offset, uint32_t data_size, uint32_t symbols_count)
+{
+	uint32_t opcode = read_u32(v->code, offset);
+
+	const char *operands = v->is_register ? nj_get_ropcode_operands(opcode) : nj_get_opcode_operands(opcode);
+
+	if(operands == 0) {
+
+		// #ERROR
+		nj_fail(v->state, "Invalid bytecode: unknown opcode ${integer} at ${integer}", opcode, offset);
+		return -1;
+	}
+
+	uint32_t i = offset + sizeof(uint32_t);
+
+	for(int j = 0; operands[j]; j++) {
+
+		uint32_t size = (operands[j] == 'i' || operands[j] == 'f') ? 8 : 4;
+
+		if(i + size > v->code_size) {
+
+			// #ERROR
+			nj_fail(v->state, "Invalid bytecode: truncated instruction at ${integer}", offset);
+			return -1;
+		}
+
+		switch(operands[j]) {
+
+			case 'i':
+			if(!v->is_register && opcode != OPCODE_PUSH_INT && opcode != OPCODE_INC_VARIABLE && opcode != OPCODE_INC_LOCAL && (read_i64(v->code, i) < 0 || read_i64(v->code, i) > INT32_MAX)) {
+
+				// #ERROR
+				nj_fail(v->state, "Invalid bytecode: count out of range at ${integer}", offset);
+				return -1;
+			}
+			break;
+
+			case 's':
+			if(read_u32(v->code, i) >= data_size) {
+
+				// #ERROR
+				nj_fail(v->state, "Invalid bytecode: data offset out of range at ${integer}", offset);
+				return -1;
+			}
+			break;
+
+			case 'y':
+			if(read_u32(v->code, i) >= symbols_count) {
+
+				// #ERROR
+				nj_fail(v->state, "Invalid bytecode: symbol index out of range at ${integer}", offset);
+				return -1;
+			}
+			break;
+
+			case 'a':
+			if(read_u32(v->code, i) >= v->code_size) {
+
+				// #ERROR
+				nj_fail(v->state, "Invalid bytecode: address out of range at ${integer}", offset);
+				return -1;
+			}
+			break;
+		}
+
+		i += size;
+	}
+
+	return i - offset - sizeof(uint32_t);
+}
+
+//
+// Stack effect of an instruction: how many items it needs
+// on the stack and how much it changes the depth.
+//
+static void stack_effect(const char *code, uint32_t offset, int64_t *need, int64_t *delta)
+{
+	uint32_t opcode = read_u32(code, offset);
+	int64_t n = 0;
+
+	if(opcode == OPCODE_BUILD_ARRAY || opcode == OPCODE_BUILD_DICT || opcode == OPCODE_POP
+	|| opcode == OPCODE_CALL || opcode == OPCODE_EXPECT)
+		n = read_i64(code, offset + sizeof(uint32_t));
+
+	*need = 0;
+	*delta = 0;
+
+	switch(opcode) {
+
+		case OPCODE_PUSH_NULL:
+		case OPCODE_PUSH_TRUE:
+		case OPCODE_PUSH_FALSE:
+		case OPCODE_PUSH_INT:
+		case OPCODE_PUSH_FLOAT:
+		case OPCODE_PUSH_STRING:
+		case OPCODE_PUSH_FUNCTION:
+		case OPCODE_PUSH_VARIABLE:
+		case OPCODE_PUSH_GLOBAL:
+		case OPCODE_LOAD_LOCAL:
+		*delta = 1;
+		break;
+
+		case OPCODE_PUSH_VARIABLE_SELECT_ATTRIBUTE:
+		*delta = 1;
+		break;
+
+		case OPCODE_SELECT_ATTRIBUTE_AND_REPUSH: *need = 1; *delta = 1; break;
+
+		case OPCODE_BUILD_ARRAY: *need = n; *delta = 1 - n; break;
+		case OPCODE_BUILD_DICT:  *need = 2 * n; *delta = 1 - 2 * n; break;
+		case OPCODE_POP:         *need = n; *delta = -n; break;
+		case OPCODE_CALL:        *need = n + 1; *delta = -n; break;
+		case OPCODE_EXPECT:      *delta = n + 1; break;
+
+		case OPCODE_IMPORT:
+		case OPCODE_IMPORT_AS:
+		case OPCODE_JUMP_IF_FALSE_AND_POP:
+		case OPCODE_ASSIGN_AND_POP:
+		case OPCODE_STORE_LOCAL_AND_POP:
+		*need = 1;
+		*delta = -1;
+		break;
+
+		case OPCODE_LSS_JUMP_IF_FALSE:
+		case OPCODE_GRT_JUMP_IF_FALSE:
+		case OPCODE_LEQ_JUMP_IF_FALSE:
+		case OPCODE_GEQ_JUMP_IF_FALSE:
+		case OPCODE_EQL_JUMP_IF_FALSE:
+		case OPCODE_NQL_JUMP_IF_FALSE:
+		*need = 2;
+		*delta = -2;
+		break;
+
+		case OPCODE_ASSIGN:
+		case OPCODE_STORE_LOCAL:
+		case OPCODE_SELECT_ATTRIBUTE:
+		case OPCODE_RETURN:
+		case OPCODE_NEG:
+		case OPCODE_NOT:
+		case OPCODE_BITWISE_NOT:
+		*need = 1;
+		break;
+
+		case OPCODE_SELECT:
+		case OPCODE_INSERT_ATTRIBUTE:
+		case OPCODE_ADD:
+		case OPCODE_SUB:
+		case OPCODE_MUL:
+		case OPCODE_DIV:
+		case OPCODE_MOD:
+		case OPCODE_POW:
+		case OPCODE_LSS:
+		case OPCODE_GRT:
+		case OPCODE_LEQ:
+		case OPCODE_GEQ:
+		case OPCODE_EQL:
+		case OPCODE_NQL:
+		case OPCODE_AND:
+		case OPCODE_OR:
+		case OPCODE_SHL:
+		case OPCODE_SHR:
+		case OPCODE_BITWISE_AND:
+		case OPCODE_BITWISE_OR:
+		case OPCODE_BITWISE_XOR:
+		*need = 2;
+		*delta = -1;
+		break;
+
+		case OPCODE_INSERT: *need = 3; *delta = -2; break;
+	}
+}
+
+static int reach(verifier_t *v, uint32_t offset, int64_t depth, int64_t locals, uint32_t from)
+{
+	if(offset >= v->code_size) {
+
+		// #ERROR
+		nj_fail(v->state, "Invalid bytecode: execution falls off the end of the code after ${integer}", from);
+		return 0;
+	}
+
+	if(v->depths[offset] < 0) {
+
+		v->depths[offset] = depth;
+		v->locals[offset] = locals;
+		v->worklist[v->worklist_used++] = offset;
+		return 1;
+	}
+
+	if(v->depths[offset] != depth) {
+
+		// #ERROR
+		nj_fail(v->state, "Invalid bytecode: inconsistent stack depth at ${integer}", offset);
+		return 0;
+	}
+
+	if(v->locals[offset] != locals) {
+
+		// #ERROR
+		nj_fail(v->state, "Invalid bytecode: inconsistent local slots at ${integer}", offset);
+		return 0;
+	}
+
+	return 1;
+}
+
+//
+// Applies the instruction at [offset] to the slot count of
+// its function, [locals], checking the slots it refers to.
+//
+static int check_locals(verifier_t *v, uint32_t offset, int64_t *locals)
+{
+	uint32_t opcode = read_u32(v->code, offset);
+
+	// Counts and slots are the first operand. Instructions
+	// with no operands may end the code, so they read none.
+
+	const char *operands = nj_get_opcode_operands(opcode);
+
+	uint32_t operand = operands[0] ? read_u32(v->code, offset + sizeof(uint32_t)) : 0;
+
+	switch(opcode) {
+
+		case OPCODE_LOCALS_PUSH:
+		if(*locals >= 0 || operand > MAX_LOCALS) {
+
+			// #ERROR
+			nj_fail(v->state, "Invalid bytecode: invalid LOCALS_PUSH at ${integer}", offset);
+			return 0;
+		}
+
+		*locals = operand;
+		break;
+
+		case OPCODE_LOCALS_POP:
+		if(*locals < 0) {
+
+			// #ERROR
+			nj_fail(v->state, "Invalid bytecode: LOCALS_POP without LOCALS_PUSH at ${integer}", offset);
+			return 0;
+		}
+
+		*locals = -1;
+		break;
+
+		case OPCODE_LOAD_LOCAL:
+		case OPCODE_STORE_LOCAL:
+		case OPCODE_STORE_LOCAL_AND_POP:
+		case OPCODE_INC_LOCAL:
+		if((int64_t) operand >= *locals) {
+
+			// #ERROR
+			nj_fail(v->state, "Invalid bytecode: local slot out of range at ${integer}", offset);
+			return 0;
+		}
+		break;
+	}
+
+	return 1;
+}
+
+static int check_depths(verifier_t *v)
+{
+	while(v->worklist_used > 0) {
+
+		uint32_t offset = v->worklist[--v->worklist_used];
+		uint32_t opcode = read_u32(v->code, offset);
+		int64_t  depth  = v->depths[offset];
+		int64_t  locals = v->locals[offset];
+
+		int64_t need, delta;
+
+		stack_effect(v->code, offset, &need, &delta);
+
+		if(depth < need) {
+
+			// #ERROR
+			nj_fail(v->state, "Invalid bytecode: stack underflow at ${integer}", offset);
+			return 0;
+		}
+
+		depth += delta;
+
+		if(depth > INT32_MAX) {
+
+			// #ERROR
+			nj_fail(v->state, "Invalid bytecode: stack overflow at ${integer}", offset);
+			return 0;
+		}
+
+		if(depth > v->max_depth)
+			v->max_depth = depth;
+
+		if(!check_locals(v, offset, &locals))
+			return 0;
+
+		uint32_t next = offset + sizeof(uint32_t);
+
+		const char *operands = nj_get_opcode_operands(opcode);
+
+		for(int j = 0; operands[j]; j++)
+			next += (operands[j] == 'i' || operands[j] == 'f') ? 8 : 4;
+
+		switch(opcode) {
+
+			case OPCODE_QUIT:
+			case OPCODE_RETURN:
+			break;
+
+			case OPCODE_JUMP_ABSOLUTE:
+			if(!reach(v, read_u32(v->code, offset + sizeof(uint32_t)), depth, locals, offset))
+				return 0;
+			break;
+
+			case OPCODE_JUMP_IF_FALSE_AND_POP:
+			case OPCODE_LSS_JUMP_IF_FALSE:
+			case OPCODE_GRT_JUMP_IF_FALSE:
+			case OPCODE_LEQ_JUMP_IF_FALSE:
+			case OPCODE_GEQ_JUMP_IF_FALSE:
+			case OPCODE_EQL_JUMP_IF_FALSE:
+			case OPCODE_NQL_JUMP_IF_FALSE:
+			if(!reach(v, read_u32(v->code, offset + sizeof(uint32_t)), depth, locals, offset))
+				return 0;
+			if(!reach(v, next, depth, locals, offset))
+				return 0;
+			break;
+
+			case OPCODE_PUSH_FUNCTION:
+			{
+				// The function body starts a new frame
+
+				uint32_t entry = read_u32(v->code, offset + sizeof(uint32_t));
+
+				if(!reach(v, entry, 0, -1, offset))
+					return 0;
+
+				if(!reach(v, next, depth, locals, offset))
+					return 0;
+				break;
+			}
+
+			default:
+			if(!reach(v, next, depth, locals, offset))
+				return 0;
+			break;
+		}
+	}
+
+	return 1;
+}
+
+static uint32_t instruction_size(verifier_t *v, uint32_t offset)
+{
+	uint32_t opcode = read_u32(v->code, offset);
+
+	const char *operands = v->is_register ? nj_get_ropcode_operands(opcode) : nj_get_opcode_operands(opcode);
+
+	uint32_t size = sizeof(uint32_t);
+
+	for(int j = 0; operands[j]; j++)
+		size += (operands[j] == 'i' || operands[j] == 'f') ? 8 : 4;
+
+	return size;
+}
+
+//
+// Checks the register operands of the instruction at [offset]
+// against the register count of its region.
+//
+static int check_registers(verifier_t *v, uint32_t offset, uint32_t count)
+{
+	uint32_t opcode = read_u32(v->code, offset);
+
+	const char *operands = nj_get_ropcode_operands(opcode);
+
+	uint32_t i = offset + sizeof(uint32_t);
+
+	for(int j = 0; operands[j]; j++) {
+
+		if(operands[j] == 'r' && read_u32(v->code, i) >= count) {
+
+			// #ERROR
+			nj_fail(v->state, "Invalid bytecode: register out of range at ${integer}", offset);
+			return 0;
+		}
+
+		i += (operands[j] == 'i' || operands[j] == 'f') ? 8 : 4;
+	}
+
+	// Instructions that use a sequence of registers
+
+	uint64_t first = 0, end = 0;
+
+	switch(opcode) {
+
+		case ROPCODE_BUILD_ARRAY:
+		case ROPCODE_BUILD_DICT:
+		first = read_u32(v->code, offset + 8);
+		end = first + (uint64_t) read_u32(v->code, offset + 12) * (opcode == ROPCODE_BUILD_DICT ? 2 : 1);
+		break;
+
+		case ROPCODE_CALL:
+		first = read_u32(v->code, offset + 8);
+		end = first + 1 + (uint64_t) read_u32(v->code, offset + 12);
+		break;
+	}
+
+	if(end > count) {
+
+		// #ERROR
+		nj_fail(v->state, "Invalid bytecode: register sequence out of range at ${integer}", offset);
+		return 0;
+	}
+
+	return 1;
+}
+
+static int is_terminator(uint32_t opcode)
+{
+	return opcode == ROPCODE_QUIT || opcode == ROPCODE_RETURN || opcode == ROPCODE_JUMP;
+}
+
+//
+// Splits a register segment in regions and checks that
+// registers and addresses stay inside their region.
+//
+static int check_regions(verifier_t *v)
+{
+	uint32_t *regions = v->worklist;
+
+	uint32_t region = 0, count = 0, last = 0;
+
+	if(read_u32(v->code, 0) != ROPCODE_ENTER || read_u32(v->code, 8) != 0) {
+
+		// #ERROR
+		nj_fail(v->state, "Invalid bytecode: the code doesn't start with ENTER");
+		return 0;
+	}
+
+	for(uint32_t i = 0; i < v->code_size; i += instruction_size(v, i)) {
+
+		uint32_t opcode = read_u32(v->code, i);
+
+		if(opcode == ROPCODE_ENTER) {
+
+			if(i > 0 && !is_terminator(read_u32(v->code, last))) {
+
+				// #ERROR
+				nj_fail(v->state, "Invalid bytecode: execution falls into the function at ${integer}", i);
+				return 0;
+			}
+
+			count = read_u32(v->code, i + 4);
+
+			if(count > MAX_REGISTERS || read_u32(v->code, i + 8) > count) {
+
+				// #ERROR
+				nj_fail(v->state, "Invalid bytecode: register count out of range at ${integer}", i);
+				return 0;
+			}
+
+			region = i;
+		}
+
+		if(opcode == ROPCODE_QUIT && region != 0) {
+
+			// #ERROR
+			nj_fail(v->state, "Invalid bytecode: QUIT inside a function at ${integer}", i);
+			return 0;
+		}
+
+		if(!check_registers(v, i, count))
+			return 0;
+
+		regions[i] = region;
+		last = i;
+	}
+
+	if(!is_terminator(read_u32(v->code, last))) {
+
+		// #ERROR
+		nj_fail(v->state, "Invalid bytecode: execution falls off the end of the code after ${integer}", last);
+		return 0;
+	}
+
+	for(uint32_t i = 0; i < v->code_size; i += instruction_size(v, i)) {
+
+		uint32_t opcode = read_u32(v->code, i);
+		uint32_t dest;
+
+		switch(opcode) {
+
+			case ROPCODE_JUMP:
+			case ROPCODE_JUMP_IF_FALSE:
+			dest = read_u32(v->code, i + (opcode == ROPCODE_JUMP ? 4 : 8));
+
+			if(!v->starts[dest] || regions[dest] != regions[i] || read_u32(v->code, dest) == ROPCODE_ENTER) {
+
+				// #ERROR
+				nj_fail(v->state, "Invalid bytecode: jump at ${integer} leaves its function", i);
+				return 0;
+			}
+			break;
+
+			case ROPCODE_LOAD_FUNCTION:
+			dest = read_u32(v->code, i + 8);
+
+			if(dest == 0 || !v->starts[dest] || read_u32(v->code, dest) != ROPCODE_ENTER) {
+
+				// #ERROR
+				nj_fail(v->state, "Invalid bytecode: address at ${integer} doesn't point to a function", i);
+				return 0;
+			}
+			break;
+		}
+	}
+
+	return 1;
+}
+
+int nj_verify_segment(nj_state_t *state, segment_t *segment)
+{
+	if(segment->code_size == 0) {
+
+		// #ERROR
+		nj_fail(state, "Invalid bytecode: the code segment is empty");
+		return 0;
+	}
+
+	if(segment->data_size > 0 && segment->data[segment->data_size - 1] != '\0') {
+
+		// #ERROR
+		nj_fail(state, "Invalid bytecode: the data segment isn't zero-terminated");
+		return 0;
+	}
+
+	verifier_t v = {
+		.state = state,
+		.code = segment->code,
+		.code_size = segment->code_size,
+		.worklist_used = 0,
+		.max_depth = 0,
+		.is_register = !!(segment->flags & SEGMENT_IS_REGISTER),
+	};
+
+	v.starts    = calloc(segment->code_size + 1, sizeof(uint8_t));
+	v.depths   = malloc(sizeof(int32_t)  * (segment->code_size + 1));
+	v.locals   = malloc(sizeof(int32_t)  * (segment->code_size + 1));
+	v.worklist = malloc(sizeof(uint32_t) * (segment->code_size + 1));
+
+	if(v.starts == 0 || v.depths == 0 || v.locals == 0 || v.worklist == 0) {
+
+		free(v.starts);
+		free(v.depths);
+		free(v.locals);
+		free(v.worklist);
+
+		// #ERROR
+		nj_fail(state, "Out of memory. Couldn't verify the segment");
+		return 0;
+	}
+
+	for(uint32_t i = 0; i < segment->code_size; i++)
+		v.depths[i] = -1;
+
+	int ok = 1;
+
+	// Find the instruction boundaries
+
+	uint32_t i = 0;
+
+	while(ok && i < segment->code_size) {
+
+		if(i + sizeof(uint32_t) > segment->code_size) {
+
+			// #ERROR
+			nj_fail(state, "Invalid bytecode: truncated instruction at ${integer}", i);
+			ok = 0;
+			break;
+		}
+
+		int64_t operands_size = check_operands(&v, i, segment->data_size, segment->symbols_count);
+
+		if(operands_size < 0) {
+
+			ok = 0;
+			break;
+		}
+
+		v.starts[i] = 1;
+
+		i += sizeof(uint32_t) + operands_size;
+	}
+
+	if(ok && v.is_register)
+		ok = check_regions(&v);
+
+	// Check that addresses point to instructions
+
+	i = 0;
+
+	while(ok && !v.is_register && i < segment->code_size) {
+
+		uint32_t opcode = read_u32(v.code, i);
+
+		const char *operands = nj_get_opcode_operands(opcode);
+
+		// Every address is the only operand of its instruction
+
+		if(operands[0] == 'a') {
+
+			uint32_t dest = read_u32(v.code, i + sizeof(uint32_t));
+
+			if(!v.starts[dest]) {
+
+				// #ERROR
+				nj_fail(state, "Invalid bytecode: address at ${integer} doesn't point to an instruction", i);
+				ok = 0;
+				break;
+			}
+		}
+
+		i += sizeof(uint32_t);
+
+		for(int j = 0; operands[j]; j++)
+			i += (operands[j] == 'i' || operands[j] == 'f') ? 8 : 4;
+	}
+
+	// Walk every path from the entry point and from
+	// the start of every function
+
+	if(ok && !v.is_register)
+		ok = reach(&v, 0, 0, -1, 0) && check_depths(&v);
+
+	free(v.starts);
+	free(v.depths);
+	free(v.locals);
+	free(v.worklist);
+
+	if(ok) {
+
+		segment->flags |= SEGMENT_IS_TRUSTED;
+		segment->max_depth = v.max_depth;
+	}
+
+	return ok;
+}